@@ -26,18 +26,19 @@
 #include <scsi/scsi_netlink.h>
 #include <scsi/scsi_netlink_fc.h>
 #include "fpin_els.h"
+#include "fpin_log.h"
+#include "fpin_feed.h"
 
-#ifdef FPIN_DEBUG
-#define FPIN_DLOG(fmt...) syslog(LOG_DEBUG, fmt);
-#define FPIN_ILOG(fmt...) syslog(LOG_INFO, fmt);
-#define FPIN_ELOG(fmt...) syslog(LOG_ERR, fmt);
-#define FPIN_CLOG(fmt...) syslog(LOG_CRIT, fmt);
-#else
-#define FPIN_DLOG(fmt...)
-#define FPIN_ILOG(fmt...)
-#define FPIN_ELOG(fmt...)
-#define FPIN_CLOG(fmt...)
-#endif
+#define FPIN_DLOG(fmt...) FPIN_LOG(LOG_DEBUG, fmt)
+#define FPIN_ILOG(fmt...) FPIN_LOG(LOG_INFO, fmt)
+#define FPIN_ELOG(fmt...) FPIN_LOG(LOG_ERR, fmt)
+#define FPIN_CLOG(fmt...) FPIN_LOG(LOG_CRIT, fmt)
+
+/*
+ * Per-event trace records and statistics are always compiled in, independent
+ * of FPIN_DEBUG, and bypass the level, subsystem mask and rate limit
+ */
+#define FPIN_TLOG(fmt...) fpin_log_trace(FPIN_LOG_SUBSYS, fmt)
 
 
 
@@ -53,81 +54,529 @@
 #define UUID_LEN		128
 #define FILE_PATH_LEN	576		// SYS_PATH_LEN + Filename
 #define DEV_STATUS_LEN	64
+#define NVME_ADDR_LEN	256
 #define FCH_EVT_LINKUP 0x2
+#define FCH_EVT_LINKDOWN 0x3
 #define FCH_EVT_LINK_FPIN 0x501
 #define FCH_EVT_RSCN 0x5
 
-struct impacted_devs
+#define FPIN_ARENA_CHUNK_SIZE	16384
+#define FPIN_INTERN_BUCKETS		64
+
+struct fpin_arena_chunk
 {
-	char dev_node[DEV_NAME_LEN];
-	char dev_name[DEV_NAME_LEN];
-	char dev_serial_id[UUID_LEN];
-	char p_wwn[WWN_LEN];
-	struct list_head dev_list_head;
+	struct fpin_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[];
+};
+
+/*
+ * Per-event bump arena. All the WWN, target and device nodes of an event
+ * and the strings they point to live here, and are released together with
+ * fpin_arena_reset() once the event completes.
+ */
+struct fpin_arena
+{
+	struct fpin_arena_chunk *head;
+	struct fpin_intern_str *intern[FPIN_INTERN_BUCKETS];
+	uint64_t chunk_allocs;		/* Allocator calls made for chunks */
+	size_t used;				/* Bytes handed out since the last reset */
+	size_t high_water;
 };
 
+/*
+ * The string members below are interned in the event arena, see
+ * fpin_arena_intern(). Port WWNs are kept as 64 bit integers throughout,
+ * they are only converted from text where sysfs is read.
+ */
 struct dm_devs
 {
-	char dm_name[DEV_NAME_LEN];
-	char dm_uuid[UUID_LEN];
+	const char *dm_node;		/* dm-* */
+	const char *dm_name;
+	const char *dm_uuid;
 	struct list_head dm_list_head;
 };
 
+struct impacted_devs
+{
+	const char *dev_node;
+	const char *dev_name;
+	const char *dev_serial_id;
+	uint64_t p_wwn;
+	struct dm_devs *dm;			/* Multipath map holding the device */
+	struct list_head dev_list_head;
+};
+
 struct targets
 {
-	char target[TGT_NAME_LEN];
-	char p_wwn[WWN_LEN];
+	const char *target;
+	uint64_t p_wwn;
 	struct list_head target_head;
 };
 
-/* Structure to store WWNs of HBA port and affected PWWNs */
+/* Link Integrity policy actions, see fpin_policy.c */
+enum fpin_policy_action {
+	FPIN_ACT_IGNORE = 0,
+	FPIN_ACT_COUNT,				/* Accounted in the policy statistics only */
+	FPIN_ACT_MARGINAL,
+	FPIN_ACT_FAIL,
+	FPIN_ACT_MAX
+};
+
+#define FPIN_POLICY_ANY			0xffffffff
+#define FPIN_POLICY_NR_TYPES	9	/* Named LI event types and "other" */
+#define FPIN_DEF_POLICY_FILE	"/etc/fctxpd.conf"
+
+struct fpin_policy;
+
+/* Location of a Link Integrity fault, see fpin_corr.c */
+enum fpin_fault_class {
+	FPIN_FAULT_HOST_LINK = 0,
+	FPIN_FAULT_TARGET_LINK,
+	FPIN_FAULT_INTER_SWITCH,
+	FPIN_FAULT_MAX
+};
+
+/* Host side evidence a policy action waits for, see fpin_ioerr.c */
+struct fpin_confirm
+{
+	uint32_t window_s;			/* 0 acts right away */
+	uint32_t errors;			/* I/O errors and timeouts that confirm */
+};
+
+/* Affected PWWN with the policy action for it */
 struct impacted_port_wwns
 {
-	char impacted_port_wwn[WWN_LEN];
-	struct list_head impacted_port_wwn_head;
+	uint64_t wwn;
+	enum fpin_policy_action action;
+	struct fpin_confirm confirm;
 };
 
 /* For 1 hba_wwn, we will have a list of impacted
- * port WWNs.
+ * port WWNs, kept sorted by WWN for binary search.
  */
 struct wwn_list
 {
 	uint32_t host_num;
-	struct list_head impacted_ports_wwn_head;
+	uint32_t event_num;			/* FC transport event number of the FPIN */
+	struct fpin_arena *arena;	/* Arena of the event the list belongs to */
+	struct impacted_port_wwns *ports;
+	uint32_t nr_ports;
+	uint32_t max_ports;
+};
+/* Kind of path a marginal device entry refers to */
+enum fpin_dev_type {
+	FPIN_DEV_SCSI = 0,		/* sd* path, managed through multipathd */
+	FPIN_DEV_NVME,			/* nvme-fc controller, native NVMe multipath */
 };
+
 /* Structure to store the marginal devices info */
 struct marginal_dev_list
 {
 	char dev_name[DEV_NAME_LEN];
+	uint64_t p_wwn;
 	uint32_t host_num;
+	enum fpin_dev_type dev_type;
+	int applied;				/* multipathd took the setmarginal */
 	struct list_head marginal_dev_list_head;
 };
 
+/* Remote port as read from fc_remote_ports */
+struct fpin_rport
+{
+	uint64_t port_name;
+	uint32_t port_id;
+};
+
+#define FPIN_MAX_RPORTS		256
+
+/*
+ * Fixed size object pool, see fpin_rt.c. Until objects are reserved, i.e.
+ * outside of real-time mode, get and put go to the heap.
+ */
+struct fpin_pool
+{
+	const char *name;
+	size_t obj_size;
+	pthread_mutex_t mutex;
+	char *base;					/* Reserved objects, NULL if none */
+	size_t stride;
+	uint32_t nr;
+	uint32_t in_use;
+	uint32_t max_in_use;
+	uint64_t exhausted;			/* Gets served from the heap */
+	void *free_list;
+};
+
+#define FPIN_POOL_INITIALIZER(pool_name, type) \
+	{ .name = (pool_name), .obj_size = sizeof(type), \
+	  .mutex = PTHREAD_MUTEX_INITIALIZER }
+
+/* Real-time failover mode (-R), pool sizes reserved at startup */
+#define FPIN_RT_TRACES			256
+#define FPIN_RT_MARGINAL		4096
+#define FPIN_RT_DAMP			4096
+#define FPIN_RT_RECOVERY		64
+#define FPIN_RT_IOERR			1024
+#define FPIN_RT_ARENA_SIZE		(1024 * 1024)
+#define FPIN_RT_STACK_PREFAULT	(256 * 1024)
+
+enum fpin_rt_role {
+	FPIN_RT_RECEIVER = 0,
+	FPIN_RT_CONSUMER,
+	FPIN_RT_WORKER
+};
+
+/* Batched sysfs attribute I/O, see fpin_sio.c */
+#define FPIN_SIO_BATCH			64		/* Requests in flight at a time */
+#define FPIN_SIO_CACHE_SLOTS	256		/* Open attributes per thread, power of 2 */
+
+enum fpin_sio_backend {
+	FPIN_SIO_PSYNC = 0,
+	FPIN_SIO_IO_URING,
+	FPIN_SIO_MAX
+};
+
+struct fpin_sio_req
+{
+	const char *path;			/* Full path of the attribute */
+	char *buf;					/* Value read, or value to write */
+	size_t len;					/* Size of buf for a read */
+	int write;
+	int once;					/* Not cached, e.g. read by a scan */
+	int ret;					/* Length read, 0 written, or -errno */
+};
+
+/* Called per entry with its attribute requests, nonzero stops the scan */
+typedef int (*fpin_sysfs_scan_fn)(const char *name, struct fpin_sio_req *reqs,
+			void *arg);
+
+/*
+ * Address format of an RSCN affected port ID page (FC-LS), in bits 25:24 of
+ * the RSCN event data. The port ID is in bits 23:0.
+ */
+#define FPIN_RSCN_ADDR_PORT		0x0
+#define FPIN_RSCN_ADDR_AREA		0x1
+#define FPIN_RSCN_ADDR_DOMAIN	0x2
+#define FPIN_RSCN_ADDR_FABRIC	0x3
+
+/* Port IDs affected by an RSCN, port_id & mask == port_id */
+struct fpin_rscn_range
+{
+	uint32_t port_id;
+	uint32_t mask;
+};
+
+/* Path actions, executed by the actuation workers, see fpin_act.c */
+enum fpin_job_type {
+	FPIN_JOB_MARGINAL = 0,		/* multipathd setmarginal and rport Marginal */
+	FPIN_JOB_FAIL,				/* multipathd fail path */
+	FPIN_JOB_NVME_MARGINAL,		/* rport Marginal behind an nvme-fc controller */
+	FPIN_JOB_UNSET,				/* Marginal SCSI path or controller to normal */
+	FPIN_JOB_MAX
+};
+
+struct fpin_event_trace;
+
+struct fpin_act_job
+{
+	enum fpin_job_type type;
+	enum fpin_dev_type dev_type;
+	uint32_t host_num;
+	uint32_t event_num;			/* 0 for a recovery */
+	uint64_t p_wwn;
+	char dev_name[DEV_NAME_LEN];
+	struct fpin_event_trace *trace;	/* Referenced, NULL for a recovery */
+	struct list_head job_list;
+};
+
+/* Corroboration of SCSI paths by their I/O error counters */
+#define FPIN_IOERR_INTERVAL_MS	1000
+
+/* fc_host link statistics, see fpin_link.c */
+#define FPIN_LINK_DEF_INTERVAL	0		/* seconds, -T, off */
+#define FPIN_LINK_MAX_HOSTS		64
+
+#define FPIN_DEF_ACT_WORKERS	4
+#define FPIN_MAX_ACT_WORKERS	16
+#define FPIN_DEF_ACT_QUEUE		256	/* Jobs per worker */
+#define FPIN_MAX_ACT_QUEUE		65536
+
+/* Flap damping of marginal paths, see fpin_damp.c */
+#define FPIN_DAMP_PENALTY			1000
+#define FPIN_DAMP_DEF_HALF_LIFE		300		/* seconds */
+#define FPIN_DAMP_DEF_SUPPRESS		2000
+#define FPIN_DAMP_DEF_REUSE			750
+#define FPIN_DAMP_MAX_HALF_LIVES	4
+
+struct fpin_damp_config
+{
+	uint32_t half_life_s;
+	uint32_t suppress;
+	uint32_t reuse;
+};
+
+/* Health of the remote ports of every host, see fpin_health.c */
+#define FPIN_HEALTH_SLOTS			1024
+#define FPIN_HEALTH_PROBE			8
+#define FPIN_HEALTH_HALF_LIFE		300		/* seconds */
+#define FPIN_HEALTH_SLOPE_ALPHA		0.3
+#define FPIN_HEALTH_DUMP_MAX		64
+#define FPIN_HEALTH_LINK_MAX_RATIO	5
+
+enum fpin_health_source {
+	FPIN_HEALTH_LI = 0,			/* FPIN Link Integrity event */
+	FPIN_HEALTH_CN,				/* FPIN peer congestion event */
+	FPIN_HEALTH_IOERR,			/* I/O errors of the SCSI paths */
+	FPIN_HEALTH_LINK,			/* fc_host link error counters */
+	FPIN_HEALTH_NR_SOURCES
+};
+
+struct fpin_health_config
+{
+	uint32_t early_score;		/* 0 disables early marginalization */
+	uint32_t early_slope;		/* Score points per minute */
+};
+
+/* Stages of the FPIN handling path, used for latency accounting */
+enum fpin_stage {
+	FPIN_STAGE_QUEUE = 0,		/* Kernel receive -> consumer dequeue */
+	FPIN_STAGE_RESOLVE,			/* WWN -> target -> sd/dm resolution */
+	FPIN_STAGE_SETMARGINAL,		/* multipathd setmarginal round trips */
+	FPIN_STAGE_RPORT,			/* rport port_state writes */
+	FPIN_STAGE_MAX
+};
+
+/*
+ * Per-event latency trace, carried from the netlink receive to the last action.
+ * The actions of an event complete on the actuation workers, each holds a
+ * reference and the trace is recorded when the last one is dropped.
+ */
+struct fpin_event_trace
+{
+	pthread_mutex_t lock;		/* Serializes the stage updates */
+	int refs;
+	uint32_t host_num;
+	uint32_t event_num;
+	struct timespec rx_ts;		/* Kernel receive time (SO_TIMESTAMPNS) */
+	struct timespec done_ts;	/* Completion of the last action */
+	struct timespec first_action_ts;	/* First path actioned, 0 if none */
+	struct timespec last_action_ts;
+	uint64_t stage_ns[FPIN_STAGE_MAX];
+	int paths_marginal;
+};
+
+#define FPIN_DEF_SLO_MS		1000
+
 /* ELS frame Handling functions */
-int fpin_fetch_dm_lun_data(struct wwn_list *list,
-			struct list_head *dm_list_head,
-			struct list_head *impacted_dev_list_head, struct udev *udev);
-void fpin_dm_marginal_path(uint32_t host_num, struct list_head *dm_list_head,
-				struct list_head *impacted_dev_list_head);
+int fpin_dm_stream_ports(struct wwn_list *list, struct udev *udev,
+			struct fpin_event_trace *trace);
+void fpin_dm_marginal_path(struct wwn_list *list, struct list_head *dm_list_head,
+				struct list_head *impacted_dev_list_head,
+				struct fpin_event_trace *trace);
 
 int fpin_populate_dm_lun(struct list_head *dm_list_head,
 			struct list_head *impacted_dev_list_head,
-			struct udev *udev, struct list_head *target_head);
+			struct udev *udev, struct list_head *target_head,
+			struct fpin_arena *arena);
 
 /* Target Related Functions */
-int fpin_dm_insert_target(struct list_head *tgt_head, const char *target, const char *port_wwn);
-int fpin_dm_find_target(struct list_head *tgt_head, const char *target, char *port_wwn);
+int fpin_dm_insert_target(struct list_head *tgt_head, const char *target,
+			uint64_t port_wwn, struct fpin_arena *arena);
+int fpin_dm_find_target(struct list_head *tgt_head, const char *target,
+			uint64_t *port_wwn);
 void fpin_dm_display_target(struct list_head *tgt_head);
-void fpin_dm_free_target(struct list_head *tgt_head);
 int fpin_dm_populate_target(struct wwn_list *list,
 		 struct list_head *tgt_list, struct udev *udev);
-void fpin_dm_free_dev(struct  list_head *sd_head);
-void fpin_free_dm(struct list_head *dm_head);
 
 /* WWN Related Functions */
-int fpin_els_wwn_exists(struct wwn_list *list, const char *port_wwn_buf);
-void fpin_els_free_wwn_list(struct wwn_list *list);
-void fpin_unset_marginal_dev(uint32_t host_num, struct list_head *tgt_head);
+uint32_t fpin_els_wwn_index(struct wwn_list *list, uint64_t wwn);
+int fpin_els_wwn_exists(struct wwn_list *list, uint64_t wwn);
+enum fpin_policy_action fpin_els_wwn_action(struct wwn_list *list,
+			uint64_t wwn);
+const struct fpin_confirm *fpin_els_wwn_confirm(struct wwn_list *list,
+			uint64_t wwn);
+int fpin_els_decode_frame(uint16_t host_num, char *fc_payload, uint32_t len,
+			struct wwn_list *list, struct fpin_policy *policy);
+int fpin_unset_marginal_dev(uint32_t host_num, struct list_head *tgt_head,
+			const struct fpin_rscn_range *range, int *skipped);
+void fpin_rscn_parse_range(uint32_t event_data, struct fpin_rscn_range *range);
+void fpin_add_marginal_dev_info(uint32_t host_num, const char *devname,
+			enum fpin_dev_type dev_type, uint64_t p_wwn);
+void fpin_del_marginal_dev_info(uint32_t host_num, const char *devname);
+void fpin_marginal_dev_applied(uint32_t host_num, const char *devname);
+int fpin_marginal_dev_reconcile(const char *devname,
+			enum fpin_dev_type dev_type, int applied_only);
+int fpin_marginal_dev_prune(int (*gone)(const struct marginal_dev_list *));
+int fpin_marginal_dev_nr_applied(void);
+int fpin_dm_plan_path(enum fpin_job_type type, uint32_t host_num,
+			uint32_t event_num, const char *dev_name, uint64_t p_wwn,
+			struct fpin_event_trace *trace);
+int fpin_dm_actuate(struct fpin_act_job *job);
+int send_packet(int fd, const char *buf);
+int recv_packet(int fd, char **buf, unsigned int timeout);
+
+/* I/O error corroboration */
+int fpin_ioerr_watch(enum fpin_job_type type, uint32_t host_num,
+			uint32_t event_num, const char *dev_name, uint64_t p_wwn,
+			const struct fpin_confirm *confirm);
+void *fpin_ioerr_sampler();
+void fpin_ioerr_dump_stats(void);
+
+/* NVMe over FC */
+int fpin_nvme_marginal_path(struct wwn_list *list,
+			struct fpin_event_trace *trace);
+int fpin_nvme_unset_marginal(uint32_t host_num, const char *ctrl,
+			uint64_t p_wwn);
+int fpin_nvme_actuate(struct fpin_act_job *job);
+
+/* Actuation stage */
+int fpin_act_init(void);
+int fpin_act_parse_config(const char *arg);
+int fpin_act_submit(enum fpin_job_type type, enum fpin_dev_type dev_type,
+			uint32_t host_num, uint32_t event_num, const char *dev_name,
+			uint64_t p_wwn, struct fpin_event_trace *trace);
+void fpin_act_dump_stats(void);
+
+/* Plain sysfs accessors, relative to fpin_sysfs_root */
+#define FPIN_DEF_SYSFS_ROOT	"/sys"
+int fpin_sysfs_path(char *buf, size_t len, const char *fmt, ...)
+			__attribute__((format(printf, 3, 4)));
+int fpin_sysfs_read_attr(const char *path, char *buf, size_t len);
+int fpin_sysfs_write_attr(const char *path, const char *value);
+int fpin_sysfs_read_rports(uint32_t host_num, struct fpin_rport *rports,
+			int max);
+int fpin_sysfs_parse_wwn(const char *str, size_t len, uint64_t *wwn);
+int fpin_sysfs_read_wwn(const char *path, uint64_t *wwn);
+int fpin_sysfs_strip(char *buf, ssize_t len);
+int fpin_sysfs_scan_attrs(const char *dir_name, const char *prefix,
+			const char *const *attrs, int nr_attrs, int once,
+			fpin_sysfs_scan_fn fn, void *arg);
+int fpin_sysfs_set_rport_state(uint32_t host_num, uint32_t event_num,
+			uint64_t p_wwn, const char *state);
+int fpin_sio_parse_backend(const char *name);
+void fpin_sio_batch(struct fpin_sio_req *reqs, int nr);
+int fpin_sio_read_attr(const char *path, char *buf, size_t len);
+int fpin_sio_write_attr(const char *path, const char *value);
+void fpin_sio_dump_stats(void);
+void fpin_sio_thread_init(void);
+
+/* Real-time mode */
+void *fpin_pool_get(struct fpin_pool *pool);
+void fpin_pool_put(struct fpin_pool *pool, void *obj);
+int fpin_rt_parse_cpus(const char *arg);
+int fpin_rt_init(void);
+void fpin_rt_thread(enum fpin_rt_role role);
+void fpin_rt_dump_stats(void);
+
+/* Flap damping */
+void fpin_damp_penalize(uint32_t host_num, const char *dev_name);
+int fpin_damp_hold(uint32_t host_num, const char *dev_name);
+int fpin_damp_reusable(uint32_t host_num, const char *dev_name);
+void fpin_damp_expire(void);
+int fpin_damp_parse_config(const char *arg);
+void fpin_damp_dump_stats(void);
+
+/* Port health scoring */
+int fpin_health_li_event(uint32_t host_num, uint64_t wwn, uint16_t event_type);
+int fpin_health_cn_event(uint32_t host_num, uint64_t wwn, uint16_t event_type);
+int fpin_health_signal(uint32_t host_num, uint64_t wwn,
+			enum fpin_health_source source, double weight);
+void fpin_health_link_event(uint32_t host_num, uint16_t event_type,
+			uint64_t delta, uint32_t threshold);
+int fpin_health_parse_config(const char *arg);
+void fpin_health_dump_stats(void);
+
+/* Marginal device list reconciliation */
+void *fpin_recon_monitor();
+void fpin_recon_dump_stats(void);
+
+/* fc_host link statistics */
+void *fpin_link_sampler();
+void fpin_link_sample(void);
+void fpin_link_event(uint32_t host_num, uint32_t event_code);
+void fpin_link_dump_stats(void);
+int fpin_rx_host_wanted(uint32_t host_num);
+
+/* Link Integrity policy */
+int fpin_policy_load(const char *path);
+struct fpin_policy *fpin_policy_get(void);
+void fpin_policy_put(struct fpin_policy *policy);
+enum fpin_policy_action fpin_policy_lookup(struct fpin_policy *policy,
+			uint32_t event_type, uint32_t host_num, uint64_t wwn,
+			struct fpin_confirm *confirm);
+const char *fpin_policy_action_name(enum fpin_policy_action action);
+void fpin_policy_dump_stats(void);
+
+/* Fault localization */
+enum fpin_fault_class fpin_corr_classify(uint32_t host_num,
+			fpin_link_integrity_notification_t *li, uint64_t *target_wwn);
+const char *fpin_corr_fault_name(enum fpin_fault_class fault);
+void fpin_corr_dump_stats(void);
+
+/* Shared memory event feed, see fpin_feed.h */
+int fpin_feed_init(void);
+void fpin_feed_publish(struct fpin_feed_rec *rec);
+void fpin_feed_li_event(uint32_t host_num, uint32_t event_num,
+			fpin_link_integrity_notification_t *li,
+			enum fpin_fault_class fault);
+void fpin_feed_cn_event(uint32_t host_num, uint32_t event_num,
+			fpin_congestion_notification_t *cn);
+void fpin_feed_path_action(uint16_t type, uint32_t host_num,
+			uint32_t event_num, const char *dev_name, uint64_t p_wwn);
+
+/* Link Integrity history, see fpin_hist.c */
+#define FPIN_DEF_HIST_FILE	"/var/lib/fctxpd/li_history"
+int fpin_hist_init(void);
+void fpin_hist_record(uint32_t host_num, uint64_t wwn, uint16_t event_type);
+int fpin_hist_query(const char *query);
+void fpin_hist_dump_stats(void);
+
+/* Per-event arena */
+void fpin_arena_init(struct fpin_arena *arena);
+void *fpin_arena_alloc(struct fpin_arena *arena, size_t size);
+const char *fpin_arena_intern(struct fpin_arena *arena, const char *str);
+void fpin_arena_reset(struct fpin_arena *arena);
+int fpin_arena_reserve(struct fpin_arena *arena, size_t size);
+void fpin_arena_destroy(struct fpin_arena *arena);
+
+/* Latency SLO tracking */
+void fpin_trace_now(struct timespec *ts);
+uint64_t fpin_trace_elapsed_ns(const struct timespec *from,
+			const struct timespec *to);
+void fpin_trace_stage(struct fpin_event_trace *trace, enum fpin_stage stage,
+			struct timespec *start);
+void fpin_trace_action(struct fpin_event_trace *trace);
+struct fpin_event_trace *fpin_trace_new(uint32_t host_num, uint32_t event_num,
+			const struct timespec *rx_ts);
+void fpin_trace_get(struct fpin_event_trace *trace);
+void fpin_trace_put(struct fpin_event_trace *trace);
+void fpin_slo_record(struct fpin_event_trace *trace);
+void fpin_slo_dump_stats(void);
+void fpin_shadow_record(uint32_t host_num, uint32_t event_num,
+			const char *fmt, ...) __attribute__((format(printf, 3, 4)));
 
 extern struct list_head fpin_li_marginal_dev_list_head;
+extern uint32_t fpin_slo_budget_ms;
+extern int fpin_shadow_mode;
+extern int fpin_act_workers;
+extern uint32_t fpin_act_queue_capacity;
+extern const char *fpin_sysfs_root;
+extern int fpin_sio_backend;
+extern int fpin_rt_prio;
+extern struct fpin_pool fpin_frame_pool;
+extern uint32_t fpin_li_queue_capacity;
+extern struct fpin_pool fpin_recovery_pool;
+extern struct fpin_pool fpin_trace_pool;
+extern struct fpin_pool fpin_job_pool;
+extern struct fpin_pool fpin_marginal_pool;
+extern struct fpin_pool fpin_damp_pool;
+extern struct fpin_pool fpin_ioerr_pool;
+extern struct fpin_damp_config fpin_damp_cfg;
+extern struct fpin_health_config fpin_health_cfg;
+extern uint32_t fpin_link_interval;
+extern const char *fpin_policy_file;
+extern const char *fpin_feed_name;
+extern const char *fpin_hist_file;
 #endif
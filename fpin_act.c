@@ -0,0 +1,298 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_DM
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * Actuation stage.
+ *
+ * An FPIN-LI event goes through three stages: the netlink receiver decodes
+ * and queues the frame, the LI consumer resolves the impacted paths and
+ * plans an action per path, and the actuation workers below carry out the
+ * actions, i.e. the multipathd round trips and rport port_state writes.
+ * The consumer resolves the next event while the workers still wait on
+ * multipathd for the current one.
+ *
+ * A path is always handled by the same worker, chosen by hashing the host
+ * number and device name, and every worker runs its jobs in submission
+ * order. Recoveries are submitted to the same workers, so the set and
+ * unset actions of a path are carried out in the order they were planned.
+ *
+ * Every stage has its own limit: the receiver queues at most -L frames for
+ * the consumer, the consumer at most -w workers:queue jobs per worker, and
+ * -w workers carry them out concurrently.
+ *
+ * The job queue of a worker is bounded. An action whose path already has
+ * the same action as its last pending one is coalesced into it, and a
+ * planned action that finds the queue full waits for the worker, so with
+ * multipathd hung the consumer stops and the LI queue applies its overflow
+ * policies. Unsets never wait: the recoveries queue them with the marginal
+ * device list locked, which the workers take too. They are bounded by the
+ * list instead.
+ */
+
+struct fpin_act_queue
+{
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t space;		/* Signalled when a job is taken */
+	struct list_head job_list_head;
+	uint32_t depth;
+	uint32_t max_depth;
+	uint64_t completed;
+	uint64_t failed;
+	uint64_t coalesced;
+	uint64_t waited;			/* Submissions that found the queue full */
+	pthread_t thread_id;
+};
+
+int fpin_act_workers = FPIN_DEF_ACT_WORKERS;
+uint32_t fpin_act_queue_capacity = FPIN_DEF_ACT_QUEUE;
+struct fpin_pool fpin_job_pool =
+	FPIN_POOL_INITIALIZER("job", struct fpin_act_job);
+
+static struct fpin_act_queue fpin_act_queues[FPIN_MAX_ACT_WORKERS];
+static uint64_t fpin_act_submitted[FPIN_JOB_MAX];
+
+static const char *fpin_job_names[FPIN_JOB_MAX] = {
+	[FPIN_JOB_MARGINAL]			= "marginal",
+	[FPIN_JOB_FAIL]				= "fail",
+	[FPIN_JOB_NVME_MARGINAL]	= "nvme-marginal",
+	[FPIN_JOB_UNSET]			= "unset",
+};
+
+/* Picks the worker of a path, FNV-1a over host number and device name */
+static struct fpin_act_queue *
+fpin_act_queue_of(uint32_t host_num, const char *dev_name) {
+	uint32_t hash = 2166136261U ^ host_num;
+
+	while (*dev_name != '\0') {
+		hash ^= (unsigned char)*dev_name++;
+		hash *= 16777619U;
+	}
+	return &fpin_act_queues[hash % fpin_act_workers];
+}
+
+static void *
+fpin_act_worker(void *arg) {
+	struct fpin_act_queue *queue = arg;
+	struct fpin_act_job *job = NULL;
+	int ret = 0;
+
+	fpin_rt_thread(FPIN_RT_WORKER);
+	for ( ; ; ) {
+		pthread_mutex_lock(&queue->mutex);
+		while (list_empty(&queue->job_list_head))
+			pthread_cond_wait(&queue->cond, &queue->mutex);
+		job = list_first_entry(&queue->job_list_head, struct fpin_act_job,
+					job_list);
+		list_del(&job->job_list);
+		queue->depth--;
+		pthread_mutex_unlock(&queue->mutex);
+		pthread_cond_signal(&queue->space);
+
+		if (job->type == FPIN_JOB_NVME_MARGINAL)
+			ret = fpin_nvme_actuate(job);
+		else
+			ret = fpin_dm_actuate(job);
+		if (job->trace != NULL)
+			fpin_trace_put(job->trace);
+
+		pthread_mutex_lock(&queue->mutex);
+		queue->completed++;
+		if (ret < 0)
+			queue->failed++;
+		pthread_mutex_unlock(&queue->mutex);
+		fpin_pool_put(&fpin_job_pool, job);
+	}
+	return NULL;
+}
+
+/* Starts fpin_act_workers workers. Returns 0 or a pthread error. */
+int
+fpin_act_init(void) {
+	struct fpin_act_queue *queue = NULL;
+	int i = 0, ret = 0;
+
+	if (fpin_act_workers < 1)
+		fpin_act_workers = 1;
+	if (fpin_act_workers > FPIN_MAX_ACT_WORKERS)
+		fpin_act_workers = FPIN_MAX_ACT_WORKERS;
+
+	for (i = 0; i < fpin_act_workers; i++) {
+		queue = &fpin_act_queues[i];
+		pthread_mutex_init(&queue->mutex, NULL);
+		pthread_cond_init(&queue->cond, NULL);
+		pthread_cond_init(&queue->space, NULL);
+		INIT_LIST_HEAD(&queue->job_list_head);
+		ret = pthread_create(&queue->thread_id, NULL, fpin_act_worker, queue);
+		if (ret != 0) {
+			FPIN_CLOG("pthread_create failed for actuation worker %d,"
+				" err %d\n", i, ret);
+			return ret;
+		}
+	}
+	return 0;
+}
+
+/* Parses -w workers[:queue], the worker count and jobs queued per worker */
+int
+fpin_act_parse_config(const char *arg) {
+	unsigned long workers = 0, capacity = fpin_act_queue_capacity;
+	char *end = NULL;
+
+	workers = strtoul(arg, &end, 0);
+	if ((end == arg) || (workers < 1) || (workers > FPIN_MAX_ACT_WORKERS))
+		return -EINVAL;
+	if (*end == ':') {
+		arg = end + 1;
+		capacity = strtoul(arg, &end, 0);
+		if ((end == arg) || (capacity < 1) ||
+			(capacity > FPIN_MAX_ACT_QUEUE))
+			return -EINVAL;
+	}
+	if (*end != '\0')
+		return -EINVAL;
+
+	fpin_act_workers = workers;
+	fpin_act_queue_capacity = capacity;
+	return 0;
+}
+
+/*
+ * Returns the last pending job of the path if it is of the given type,
+ * i.e. the new one would repeat it. Called with the queue mutex held.
+ */
+static struct fpin_act_job *
+fpin_act_pending(struct fpin_act_queue *queue, enum fpin_job_type type,
+			uint32_t host_num, const char *dev_name) {
+	struct fpin_act_job *job = NULL, *last = NULL;
+
+	list_for_each_entry(job, &queue->job_list_head, job_list) {
+		if ((job->host_num == host_num) &&
+			(strcmp(job->dev_name, dev_name) == 0))
+			last = job;
+	}
+	return ((last != NULL) && (last->type == type)) ? last : NULL;
+}
+
+/*
+ * Function:
+ *	fpin_act_submit
+ *
+ * Inputs:
+ *	1. The action.
+ *	2. SCSI path or nvme-fc controller.
+ *	3. Host number of the path.
+ *	4. Event number the action is planned for, 0 for a recovery.
+ *	5. sd* or nvme controller name.
+ *	6. Port WWN of the remote port of the path.
+ *	7. Trace of the event, NULL for a recovery. The job holds a reference
+ *	   until it completes.
+ *
+ * Description:
+ *	Queues the action to the worker of the path, unless the last action
+ *	pending for the path is the same one. A planned action waits while
+ *	the queue is full, an unset does not. Returns 0 or -ENOMEM.
+ */
+int
+fpin_act_submit(enum fpin_job_type type, enum fpin_dev_type dev_type,
+			uint32_t host_num, uint32_t event_num, const char *dev_name,
+			uint64_t p_wwn, struct fpin_event_trace *trace) {
+	struct fpin_act_queue *queue = fpin_act_queue_of(host_num, dev_name);
+	struct fpin_act_job *job = NULL;
+	int waited = 0;
+
+	pthread_mutex_lock(&queue->mutex);
+	for ( ; ; ) {
+		if (fpin_act_pending(queue, type, host_num, dev_name) != NULL) {
+			queue->coalesced++;
+			pthread_mutex_unlock(&queue->mutex);
+			FPIN_DLOG("%s of %s host_num %u already pending\n",
+				fpin_job_names[type], dev_name, host_num);
+			return 0;
+		}
+		if ((type == FPIN_JOB_UNSET) ||
+			(queue->depth < fpin_act_queue_capacity))
+			break;
+		if (!waited) {
+			queue->waited++;
+			waited = 1;
+		}
+		pthread_cond_wait(&queue->space, &queue->mutex);
+	}
+
+	job = fpin_pool_get(&fpin_job_pool);
+	if (job == NULL) {
+		pthread_mutex_unlock(&queue->mutex);
+		FPIN_CLOG("No memory to %s %s host_num %u\n", fpin_job_names[type],
+				dev_name, host_num);
+		return -ENOMEM;
+	}
+	job->type = type;
+	job->dev_type = dev_type;
+	job->host_num = host_num;
+	job->event_num = event_num;
+	job->p_wwn = p_wwn;
+	strncpy(job->dev_name, dev_name, DEV_NAME_LEN - 1);
+	job->trace = trace;
+	if (trace != NULL)
+		fpin_trace_get(trace);
+
+	list_add_tail(&job->job_list, &queue->job_list_head);
+	if (++queue->depth > queue->max_depth)
+		queue->max_depth = queue->depth;
+	pthread_mutex_unlock(&queue->mutex);
+	pthread_cond_signal(&queue->cond);
+
+	__atomic_add_fetch(&fpin_act_submitted[type], 1, __ATOMIC_RELAXED);
+	return 0;
+}
+
+void
+fpin_act_dump_stats(void) {
+	struct fpin_act_queue *queue = NULL;
+	uint32_t depth = 0, max_depth = 0;
+	uint64_t completed = 0, failed = 0, coalesced = 0, waited = 0;
+	int i = 0;
+
+	FPIN_TLOG("act: workers %d queue capacity %u\n", fpin_act_workers,
+		fpin_act_queue_capacity);
+	FPIN_TLOG("act: workers %d submitted marginal %llu fail %llu"
+		" nvme-marginal %llu unset %llu\n", fpin_act_workers,
+		(unsigned long long)fpin_act_submitted[FPIN_JOB_MARGINAL],
+		(unsigned long long)fpin_act_submitted[FPIN_JOB_FAIL],
+		(unsigned long long)fpin_act_submitted[FPIN_JOB_NVME_MARGINAL],
+		(unsigned long long)fpin_act_submitted[FPIN_JOB_UNSET]);
+	for (i = 0; i < fpin_act_workers; i++) {
+		queue = &fpin_act_queues[i];
+		pthread_mutex_lock(&queue->mutex);
+		depth = queue->depth;
+		max_depth = queue->max_depth;
+		completed = queue->completed;
+		failed = queue->failed;
+		coalesced = queue->coalesced;
+		waited = queue->waited;
+		pthread_mutex_unlock(&queue->mutex);
+		FPIN_TLOG("act: worker %d depth %u max depth %u completed %llu"
+			" failed %llu\n", i, depth, max_depth,
+			(unsigned long long)completed, (unsigned long long)failed);
+		FPIN_TLOG("act: worker %d coalesced %llu waited %llu\n", i,
+			(unsigned long long)coalesced, (unsigned long long)waited);
+	}
+}
@@ -0,0 +1,196 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <stdlib.h>
+#include "fpin.h"
+
+#define FPIN_ARENA_ALIGN	16
+
+/* Interned string, stored inline in the arena */
+struct fpin_intern_str {
+	struct fpin_intern_str *next;
+	uint32_t hash;
+	uint32_t len;
+	char str[];
+};
+
+static struct fpin_arena_chunk *
+fpin_arena_new_chunk(struct fpin_arena *arena, size_t size) {
+	struct fpin_arena_chunk *chunk = NULL;
+
+	if (size < FPIN_ARENA_CHUNK_SIZE)
+		size = FPIN_ARENA_CHUNK_SIZE;
+	chunk = malloc(sizeof(struct fpin_arena_chunk) + size);
+	if (chunk == NULL)
+		return NULL;
+	chunk->size = size;
+	chunk->used = 0;
+	chunk->next = arena->head;
+	arena->head = chunk;
+	arena->chunk_allocs++;
+	return chunk;
+}
+
+void
+fpin_arena_init(struct fpin_arena *arena) {
+	memset(arena, 0, sizeof(*arena));
+}
+
+/*
+ * Function:
+ *	fpin_arena_alloc
+ *
+ * Inputs:
+ *	1. The arena of the event being processed.
+ *	2. Number of bytes required.
+ *
+ * Description:
+ *	Bump allocates from the current chunk of the arena, adding a chunk when
+ *	it is exhausted. The memory is only given back by fpin_arena_reset() or
+ *	fpin_arena_destroy(), there is no per object free.
+ */
+void *
+fpin_arena_alloc(struct fpin_arena *arena, size_t size) {
+	struct fpin_arena_chunk *chunk = arena->head;
+	uintptr_t base = 0, ptr = 0;
+
+	if (chunk != NULL) {
+		base = (uintptr_t)chunk->data;
+		ptr = (base + chunk->used + FPIN_ARENA_ALIGN - 1) &
+			~((uintptr_t)FPIN_ARENA_ALIGN - 1);
+	}
+	if ((chunk == NULL) || (ptr + size > base + chunk->size)) {
+		chunk = fpin_arena_new_chunk(arena, size + FPIN_ARENA_ALIGN);
+		if (chunk == NULL) {
+			FPIN_CLOG("No memory to grow event arena by %zu\n", size);
+			return NULL;
+		}
+		base = (uintptr_t)chunk->data;
+		ptr = (base + FPIN_ARENA_ALIGN - 1) &
+			~((uintptr_t)FPIN_ARENA_ALIGN - 1);
+	}
+
+	chunk->used = ptr + size - base;
+	arena->used += size;
+	if (arena->used > arena->high_water)
+		arena->high_water = arena->used;
+	return (void *)ptr;
+}
+
+/*
+ * Function:
+ *	fpin_arena_intern
+ *
+ * Inputs:
+ *	1. The arena of the event being processed.
+ *	2. NULL terminated string to intern.
+ *
+ * Description:
+ *	Returns a copy of the string owned by the arena. Equal strings within
+ *	an event share one copy, so WWNs and device names referenced from the
+ *	WWN, target and device lists are stored only once.
+ */
+const char *
+fpin_arena_intern(struct fpin_arena *arena, const char *str) {
+	struct fpin_intern_str *entry = NULL;
+	uint32_t hash = 2166136261U, len = 0;
+	const char *p = NULL;
+
+	if (str == NULL)
+		return NULL;
+
+	/* FNV-1a */
+	for (p = str; *p; p++) {
+		hash ^= (unsigned char)*p;
+		hash *= 16777619U;
+	}
+	len = p - str;
+
+	for (entry = arena->intern[hash % FPIN_INTERN_BUCKETS]; entry != NULL;
+			entry = entry->next) {
+		if ((entry->hash == hash) && (entry->len == len) &&
+			(memcmp(entry->str, str, len) == 0))
+			return entry->str;
+	}
+
+	entry = fpin_arena_alloc(arena, sizeof(struct fpin_intern_str) + len + 1);
+	if (entry == NULL)
+		return NULL;
+	entry->hash = hash;
+	entry->len = len;
+	memcpy(entry->str, str, len + 1);
+	entry->next = arena->intern[hash % FPIN_INTERN_BUCKETS];
+	arena->intern[hash % FPIN_INTERN_BUCKETS] = entry;
+	return entry->str;
+}
+
+/*
+ * Gives an empty arena a chunk of size bytes up front, touched so it is
+ * resident. Returns 0 or -ENOMEM.
+ */
+int
+fpin_arena_reserve(struct fpin_arena *arena, size_t size) {
+	struct fpin_arena_chunk *chunk = NULL;
+
+	if (arena->head != NULL)
+		return 0;
+	chunk = fpin_arena_new_chunk(arena, size);
+	if (chunk == NULL)
+		return -ENOMEM;
+	memset(chunk->data, 0, chunk->size);
+	return 0;
+}
+
+/*
+ * Releases everything allocated for the event in one operation. One chunk
+ * is kept, so steady state events do not call the allocator at all. If the
+ * event needed several chunks, they are replaced by a single chunk big
+ * enough for it.
+ */
+void
+fpin_arena_reset(struct fpin_arena *arena) {
+	struct fpin_arena_chunk *chunk = NULL, *next = NULL;
+	size_t total = 0;
+
+	if (arena->head == NULL)
+		return;
+
+	memset(arena->intern, 0, sizeof(arena->intern));
+	arena->used = 0;
+	if (arena->head->next == NULL) {
+		arena->head->used = 0;
+		return;
+	}
+
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		total += chunk->size;
+		free(chunk);
+	}
+	arena->head = NULL;
+	fpin_arena_new_chunk(arena, total);
+}
+
+void
+fpin_arena_destroy(struct fpin_arena *arena) {
+	struct fpin_arena_chunk *chunk = NULL, *next = NULL;
+
+	for (chunk = arena->head; chunk != NULL; chunk = next) {
+		next = chunk->next;
+		free(chunk);
+	}
+	fpin_arena_init(arena);
+}
@@ -0,0 +1,209 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_ELS
+#include "fpin.h"
+
+/*
+ * Fault localization of Link Integrity events.
+ *
+ * The LI descriptor names the port that detected the errors and the port
+ * attached to it, i.e. the two ends of the faulty link, besides the list of
+ * N_Ports whose traffic crosses it. Comparing the link ends with the local
+ * HBA port and the listed ports places the fault:
+ *
+ *	host-link	One end is the HBA port the FPIN was received on. Every
+ *			listed port is reached over the faulty link.
+ *	target-link	One end is a listed remote port. Only the paths to that
+ *			port cross the faulty link, the other listed ports are
+ *			left alone.
+ *	inter-switch	Neither end is an N_Port, the link is an ISL or a switch
+ *			internal port, every listed port is reached over it.
+ *
+ * Events are aggregated per link into incidents, which are reported with
+ * the daemon statistics.
+ */
+
+#define FPIN_CORR_MAX_INCIDENTS	64
+#define FPIN_CORR_WINDOW		3600	/* seconds an incident stays reported */
+
+static const char *fpin_fault_names[FPIN_FAULT_MAX] = {
+	[FPIN_FAULT_HOST_LINK]		= "host-link",
+	[FPIN_FAULT_TARGET_LINK]	= "target-link",
+	[FPIN_FAULT_INTER_SWITCH]	= "inter-switch",
+};
+
+/* LI events seen on one link, identified by its two ends */
+struct fpin_incident {
+	uint64_t detecting_wwn;
+	uint64_t attached_wwn;
+	uint32_t host_num;
+	enum fpin_fault_class fault;
+	uint64_t events;
+	uint64_t wwns_listed;
+	uint64_t wwns_pruned;
+	time_t first;
+	time_t last;
+};
+
+static struct fpin_incident fpin_incidents[FPIN_CORR_MAX_INCIDENTS];
+static int fpin_nr_incidents;
+static pthread_mutex_t fpin_corr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t fpin_corr_faults[FPIN_FAULT_MAX];
+
+const char *
+fpin_corr_fault_name(enum fpin_fault_class fault) {
+	return fpin_fault_names[fault];
+}
+
+/* Reads the port name of the local HBA port as a 64 bit WWN */
+static uint64_t
+fpin_corr_host_wwn(uint32_t host_num) {
+	char path[FILE_PATH_LEN];
+	uint64_t wwn = 0;
+
+	fpin_sysfs_path(path, sizeof(path), "class/fc_host/host%u/port_name",
+			host_num);
+	if (fpin_sysfs_read_wwn(path, &wwn) < 0)
+		return 0;
+	return wwn;
+}
+
+/*
+ * Finds the incident of a link, or takes the slot of the incident seen
+ * least recently. Called with fpin_corr_mutex held.
+ */
+static struct fpin_incident *
+fpin_corr_incident(uint32_t host_num, uint64_t detecting_wwn,
+			uint64_t attached_wwn, time_t now) {
+	struct fpin_incident *incident = NULL, *oldest = NULL;
+	int i = 0;
+
+	for (i = 0; i < fpin_nr_incidents; i++) {
+		incident = &fpin_incidents[i];
+		if ((incident->host_num == host_num) &&
+			(incident->detecting_wwn == detecting_wwn) &&
+			(incident->attached_wwn == attached_wwn))
+			return incident;
+		if ((oldest == NULL) || (incident->last < oldest->last))
+			oldest = incident;
+	}
+
+	if (fpin_nr_incidents < FPIN_CORR_MAX_INCIDENTS)
+		incident = &fpin_incidents[fpin_nr_incidents++];
+	else
+		incident = oldest;
+	memset(incident, 0, sizeof(*incident));
+	incident->host_num = host_num;
+	incident->detecting_wwn = detecting_wwn;
+	incident->attached_wwn = attached_wwn;
+	incident->first = now;
+	return incident;
+}
+
+/*
+ * Function:
+ *	fpin_corr_classify
+ *
+ * Inputs:
+ *	1. Host number the FPIN was received on.
+ *	2. The Link Integrity descriptor.
+ *	3. Returns the WWN of the remote port on the faulty link, for a
+ *	   target-link fault.
+ *
+ * Description:
+ *	Places the fault of the event and accounts it to the incident of the
+ *	link. Returns the fault class. For a target-link fault only the paths
+ *	to target_wwn are to be acted on.
+ */
+enum fpin_fault_class
+fpin_corr_classify(uint32_t host_num, fpin_link_integrity_notification_t *li,
+			uint64_t *target_wwn) {
+	uint64_t detecting_wwn = fpin_wwn_to_u64(&li->detecting_port_wwn);
+	uint64_t attached_wwn = fpin_wwn_to_u64(&li->attached_port_wwn);
+	uint64_t host_wwn = fpin_corr_host_wwn(host_num), wwn = 0;
+	uint32_t wwn_count = ntohl(li->port_list.count), iter = 0;
+	enum fpin_fault_class fault = FPIN_FAULT_INTER_SWITCH;
+	struct fpin_incident *incident = NULL;
+	time_t now = time(NULL);
+	int is_new = 0;
+
+	*target_wwn = 0;
+	if ((host_wwn != 0) &&
+		((detecting_wwn == host_wwn) || (attached_wwn == host_wwn))) {
+		fault = FPIN_FAULT_HOST_LINK;
+	} else {
+		for (iter = 0; iter < wwn_count; iter++) {
+			wwn = fpin_wwn_to_u64(&li->port_list.port_name_list[iter]);
+			if ((wwn != 0) &&
+				((wwn == detecting_wwn) || (wwn == attached_wwn))) {
+				fault = FPIN_FAULT_TARGET_LINK;
+				*target_wwn = wwn;
+				break;
+			}
+		}
+	}
+
+	pthread_mutex_lock(&fpin_corr_mutex);
+	incident = fpin_corr_incident(host_num, detecting_wwn, attached_wwn, now);
+	is_new = (incident->events == 0) || (incident->fault != fault);
+	incident->fault = fault;
+	incident->events++;
+	incident->last = now;
+	incident->wwns_listed += wwn_count;
+	if (fault == FPIN_FAULT_TARGET_LINK)
+		incident->wwns_pruned += wwn_count - 1;
+	fpin_corr_faults[fault]++;
+	pthread_mutex_unlock(&fpin_corr_mutex);
+
+	if (is_new) {
+		FPIN_ILOG("fault: %s between 0x%016llx and 0x%016llx on host%u,"
+			" %u ports listed\n", fpin_fault_names[fault],
+			(unsigned long long)detecting_wwn,
+			(unsigned long long)attached_wwn, host_num, wwn_count);
+	}
+	return fault;
+}
+
+/* Reports the fault counts and the incidents of the last FPIN_CORR_WINDOW */
+void
+fpin_corr_dump_stats(void) {
+	struct fpin_incident *incident = NULL;
+	time_t now = time(NULL);
+	int i = 0;
+
+	pthread_mutex_lock(&fpin_corr_mutex);
+	FPIN_TLOG("fault: host-link %llu target-link %llu inter-switch %llu\n",
+		(unsigned long long)fpin_corr_faults[FPIN_FAULT_HOST_LINK],
+		(unsigned long long)fpin_corr_faults[FPIN_FAULT_TARGET_LINK],
+		(unsigned long long)fpin_corr_faults[FPIN_FAULT_INTER_SWITCH]);
+	for (i = 0; i < fpin_nr_incidents; i++) {
+		incident = &fpin_incidents[i];
+		if (now - incident->last > FPIN_CORR_WINDOW)
+			continue;
+		FPIN_TLOG("fault: %s host%u detecting 0x%016llx attached 0x%016llx"
+			" events %llu ports listed %llu pruned %llu first %lds ago"
+			" last %lds ago\n", fpin_fault_names[incident->fault],
+			incident->host_num,
+			(unsigned long long)incident->detecting_wwn,
+			(unsigned long long)incident->attached_wwn,
+			(unsigned long long)incident->events,
+			(unsigned long long)incident->wwns_listed,
+			(unsigned long long)incident->wwns_pruned,
+			(long)(now - incident->first), (long)(now - incident->last));
+	}
+	pthread_mutex_unlock(&fpin_corr_mutex);
+}
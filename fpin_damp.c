@@ -0,0 +1,292 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_DM
+#include <stdlib.h>
+#include <math.h>
+#include "fpin.h"
+
+/*
+ * Flap damping of marginal paths, modelled on BGP route flap dampening
+ * (RFC 2439). Every time a path is newly set marginal its penalty grows by
+ * FPIN_DAMP_PENALTY, and the penalty decays exponentially with the
+ * configured half life. A path whose penalty crosses the suppress threshold
+ * is held marginal through LINKUP/RSCN, until the penalty has decayed below
+ * the reuse threshold. The marginal checker thread then recovers the held
+ * paths which had a recovery event while they were suppressed.
+ */
+
+struct fpin_damp_config fpin_damp_cfg = {
+	.half_life_s	= FPIN_DAMP_DEF_HALF_LIFE,
+	.suppress		= FPIN_DAMP_DEF_SUPPRESS,
+	.reuse			= FPIN_DAMP_DEF_REUSE,
+};
+
+/* Damping state of one path, kept across its marginal/normal cycles */
+struct fpin_damp_entry {
+	char dev_name[DEV_NAME_LEN];
+	uint32_t host_num;
+	double penalty;
+	double updated;				/* CLOCK_MONOTONIC seconds of the last decay */
+	int suppressed;
+	int recovery_pending;		/* A recovery was held back while suppressed */
+	uint64_t flaps;
+	struct list_head damp_list;
+};
+
+static struct list_head fpin_damp_list_head = LIST_HEAD_INIT(fpin_damp_list_head);
+static pthread_mutex_t fpin_damp_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct fpin_pool fpin_damp_pool =
+	FPIN_POOL_INITIALIZER("damp", struct fpin_damp_entry);
+static struct fpin_damp_stats {
+	uint64_t penalized;
+	uint64_t suppressed;
+	uint64_t reused;
+	uint64_t held;
+	uint32_t entries;
+} fpin_damp_stats;
+
+static double
+fpin_damp_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The penalty is capped, so a path that keeps flapping is suppressed for at
+ * most FPIN_DAMP_MAX_HALF_LIVES half lives after its last flap.
+ */
+static double
+fpin_damp_ceiling(void) {
+	return fpin_damp_cfg.reuse * exp2(FPIN_DAMP_MAX_HALF_LIVES);
+}
+
+static void
+fpin_damp_decay(struct fpin_damp_entry *entry, double now) {
+	entry->penalty *= exp2(-(now - entry->updated) / fpin_damp_cfg.half_life_s);
+	entry->updated = now;
+}
+
+/* Called with fpin_damp_mutex held */
+static struct fpin_damp_entry *
+fpin_damp_find(uint32_t host_num, const char *dev_name) {
+	struct fpin_damp_entry *entry = NULL;
+
+	list_for_each_entry(entry, &fpin_damp_list_head, damp_list) {
+		if ((entry->host_num == host_num) &&
+			(strcmp(entry->dev_name, dev_name) == 0))
+			return entry;
+	}
+	return NULL;
+}
+
+/* Ends the suppression of an entry whose penalty is below reuse */
+static void
+fpin_damp_reuse(struct fpin_damp_entry *entry) {
+	entry->suppressed = 0;
+	entry->recovery_pending = 0;
+	fpin_damp_stats.reused++;
+	FPIN_ILOG("damping: host%u %s reused, penalty %.0f\n", entry->host_num,
+		entry->dev_name, entry->penalty);
+}
+
+/*
+ * Function:
+ *	fpin_damp_penalize
+ *
+ * Inputs:
+ *	1. Host number of the path.
+ *	2. Device name of the path, sd* or nvme controller.
+ *
+ * Description:
+ *	Charges a flap to a path that was just set marginal, and suppresses it
+ *	when its penalty crosses the suppress threshold.
+ */
+void
+fpin_damp_penalize(uint32_t host_num, const char *dev_name) {
+	struct fpin_damp_entry *entry = NULL;
+	double now = fpin_damp_now();
+
+	if (fpin_damp_cfg.half_life_s == 0)
+		return;
+
+	pthread_mutex_lock(&fpin_damp_mutex);
+	entry = fpin_damp_find(host_num, dev_name);
+	if (entry == NULL) {
+		entry = fpin_pool_get(&fpin_damp_pool);
+		if (entry == NULL) {
+			pthread_mutex_unlock(&fpin_damp_mutex);
+			FPIN_CLOG("No memory for damping state of %s\n", dev_name);
+			return;
+		}
+		entry->host_num = host_num;
+		strncpy(entry->dev_name, dev_name, DEV_NAME_LEN - 1);
+		entry->updated = now;
+		list_add_tail(&entry->damp_list, &fpin_damp_list_head);
+		fpin_damp_stats.entries++;
+	}
+
+	fpin_damp_decay(entry, now);
+	entry->penalty += FPIN_DAMP_PENALTY;
+	if (entry->penalty > fpin_damp_ceiling())
+		entry->penalty = fpin_damp_ceiling();
+	entry->flaps++;
+	fpin_damp_stats.penalized++;
+	if (!entry->suppressed && (entry->penalty >= fpin_damp_cfg.suppress)) {
+		entry->suppressed = 1;
+		fpin_damp_stats.suppressed++;
+		FPIN_ILOG("damping: host%u %s suppressed after %llu flaps,"
+			" penalty %.0f\n", host_num, dev_name,
+			(unsigned long long)entry->flaps, entry->penalty);
+	}
+	pthread_mutex_unlock(&fpin_damp_mutex);
+}
+
+/*
+ * Function:
+ *	fpin_damp_hold
+ *
+ * Inputs:
+ *	1. Host number of the path.
+ *	2. Device name of the path.
+ *
+ * Description:
+ *	Called on LINKUP/RSCN recovery of a marginal path. Returns 1 if the path
+ *	is suppressed and must stay marginal, the recovery is then remembered
+ *	for the marginal checker. Returns 0 if the path may be recovered.
+ */
+int
+fpin_damp_hold(uint32_t host_num, const char *dev_name) {
+	struct fpin_damp_entry *entry = NULL;
+	int hold = 0;
+
+	pthread_mutex_lock(&fpin_damp_mutex);
+	entry = fpin_damp_find(host_num, dev_name);
+	if ((entry != NULL) && entry->suppressed) {
+		fpin_damp_decay(entry, fpin_damp_now());
+		if (entry->penalty >= fpin_damp_cfg.reuse) {
+			entry->recovery_pending = 1;
+			fpin_damp_stats.held++;
+			hold = 1;
+		} else {
+			fpin_damp_reuse(entry);
+		}
+	}
+	pthread_mutex_unlock(&fpin_damp_mutex);
+
+	return hold;
+}
+
+/*
+ * Function:
+ *	fpin_damp_reusable
+ *
+ * Inputs:
+ *	1. Host number of the path.
+ *	2. Device name of the path.
+ *
+ * Description:
+ *	Called by the marginal checker for every marginal path. Returns 1 if a
+ *	recovery of the path was held back and its penalty has since decayed
+ *	below the reuse threshold, i.e. the path is to be recovered now.
+ */
+int
+fpin_damp_reusable(uint32_t host_num, const char *dev_name) {
+	struct fpin_damp_entry *entry = NULL;
+	int reusable = 0;
+
+	pthread_mutex_lock(&fpin_damp_mutex);
+	entry = fpin_damp_find(host_num, dev_name);
+	if ((entry != NULL) && entry->suppressed) {
+		fpin_damp_decay(entry, fpin_damp_now());
+		if (entry->penalty < fpin_damp_cfg.reuse) {
+			reusable = entry->recovery_pending;
+			fpin_damp_reuse(entry);
+		}
+	}
+	pthread_mutex_unlock(&fpin_damp_mutex);
+
+	return reusable;
+}
+
+/* Drops the state of paths whose penalty has decayed away */
+void
+fpin_damp_expire(void) {
+	struct fpin_damp_entry *entry = NULL, *next = NULL;
+	double now = fpin_damp_now();
+
+	pthread_mutex_lock(&fpin_damp_mutex);
+	list_for_each_entry_safe(entry, next, &fpin_damp_list_head, damp_list) {
+		fpin_damp_decay(entry, now);
+		if (entry->suppressed || (entry->penalty >= 1.0))
+			continue;
+		list_del(&entry->damp_list);
+		fpin_pool_put(&fpin_damp_pool, entry);
+		fpin_damp_stats.entries--;
+	}
+	pthread_mutex_unlock(&fpin_damp_mutex);
+}
+
+/* Parses -d half_life[,suppress,reuse], a half life of 0 disables damping */
+int
+fpin_damp_parse_config(const char *arg) {
+	struct fpin_damp_config cfg = fpin_damp_cfg;
+	char *end = NULL;
+
+	cfg.half_life_s = strtoul(arg, &end, 0);
+	if (*end == ',') {
+		cfg.suppress = strtoul(end + 1, &end, 0);
+		if (*end != ',')
+			return -EINVAL;
+		cfg.reuse = strtoul(end + 1, &end, 0);
+	}
+	if ((end == arg) || (*end != '\0'))
+		return -EINVAL;
+	if ((cfg.half_life_s != 0) &&
+		((cfg.reuse == 0) || (cfg.reuse >= cfg.suppress)))
+		return -EINVAL;
+
+	fpin_damp_cfg = cfg;
+	return 0;
+}
+
+void
+fpin_damp_dump_stats(void) {
+	struct fpin_damp_entry *entry = NULL;
+	double now = fpin_damp_now();
+
+	pthread_mutex_lock(&fpin_damp_mutex);
+	FPIN_TLOG("damping: half life %us suppress %u reuse %u paths %u"
+		" penalized %llu suppressed %llu reused %llu held %llu\n",
+		fpin_damp_cfg.half_life_s, fpin_damp_cfg.suppress,
+		fpin_damp_cfg.reuse, fpin_damp_stats.entries,
+		(unsigned long long)fpin_damp_stats.penalized,
+		(unsigned long long)fpin_damp_stats.suppressed,
+		(unsigned long long)fpin_damp_stats.reused,
+		(unsigned long long)fpin_damp_stats.held);
+	list_for_each_entry(entry, &fpin_damp_list_head, damp_list) {
+		if (!entry->suppressed)
+			continue;
+		fpin_damp_decay(entry, now);
+		FPIN_TLOG("damping: host%u %s suppressed penalty %.0f flaps %llu%s\n",
+			entry->host_num, entry->dev_name, entry->penalty,
+			(unsigned long long)entry->flaps,
+			entry->recovery_pending ? " recovery pending" : "");
+	}
+	pthread_mutex_unlock(&fpin_damp_mutex);
+}
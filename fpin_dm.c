@@ -18,194 +18,81 @@
  *      Muneendra Kumar <muneendra.kumar@broadcom.com>
  */
 
+#define FPIN_LOG_SUBSYS	FPIN_LOG_DM
+#include <stdlib.h>
 #include "fpin.h"
 
 
 pthread_cond_t fpin_li_marginal_dev_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t fpin_li_marginal_dev_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct fpin_pool fpin_marginal_pool =
+	FPIN_POOL_INITIALIZER("marginal", struct marginal_dev_list);
 
-static int fpin_set_rport_marginal(int host_no, char *p_wwn)
-{
-	struct udev *udev = NULL;
-	struct udev_enumerate *enumerate = NULL;
-	struct udev_list_entry *devices = NULL, *dev_list_entry = NULL;
-	struct udev_device *dev = NULL;
-	int i = 0, ret = 0;
-	char rport_host_buf[DEV_NODE_LEN];
-
-	udev = udev_new();
-	if (!udev) {
-		FPIN_ELOG("Can't create udev\n");
-		return(-1);
-	}
-	/* Create a list of the devices in the 'fc_remote_ports' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	if (enumerate == NULL) {
-		FPIN_ELOG("Could not enumerate udev for fc_trans\n");
-		udev_unref(udev);
-		return (-EBADF);
-	}
-
-	ret = udev_enumerate_add_match_subsystem(enumerate, "fc_remote_ports");
-	if (ret < 0) {
-		FPIN_ELOG("Could not enumerate fc_tx sub with ret %d\n", ret);
-		goto error;
-	}
-
-	ret = udev_enumerate_scan_devices(enumerate);
-	if (ret < 0) {
-		FPIN_ELOG("Could not scan block subsystem with ret %d\n", ret);
-		goto error;
-	}
-
-	devices = udev_enumerate_get_list_entry(enumerate);
-	if (devices == NULL) {
-		FPIN_ELOG("NO devices found under block subsystem\n");
-		ret = -ENODEV;
-		goto error;
-	}
-
-	/* For each item enumerated, find if the target matches.
-	 * fetch port_name and compare it with the PWWN in ELS.
-	 * If it matches set the rport port_state to marginal
-	 */
-	snprintf(rport_host_buf, DEV_NODE_LEN, "%s%d", "rport-", host_no);
-
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		const char *dir_path_buf, *target_buf, *port_wwn_buf, *port_state;
-		char rport_name[DEV_NODE_LEN], *temp;
-		int len;
-
-		dir_path_buf = udev_list_entry_get_name(dev_list_entry);
-		if (dir_path_buf == NULL) {
-			FPIN_ELOG("Failed to get syspath for targets\n");
-			continue;
-		}
-
-		dev = udev_device_new_from_syspath(udev, dir_path_buf);
-		if (dev == NULL) {
-			FPIN_ELOG("Failed to get device struct from path %s, err %d\n",
-					dir_path_buf, errno);
-			continue;
-		}
-		target_buf = udev_device_get_sysname(dev);
-		if (target_buf == NULL) {
-			FPIN_ELOG("Unable to get tgt sysname from host %s\n",
-					rport_host_buf);
-			udev_device_unref(dev);
-			continue;
-		}
-		/* As the target_buf o/p is like rport-2:0-6 i.e
-		 * rport-<hostno>:<channel>-<busno> and we need to get the
-		 * rport-<hostnumber> info so we are extracting the rport-<hostno>
-		 * from the target_buf and compare it with rport_host_buf
-		 */
-		temp = strchr(target_buf, ':');
-		len = temp - target_buf;
-		memset(rport_name, '\0', DEV_NODE_LEN);
-		strncpy(rport_name, target_buf, len);
-
-		FPIN_DLOG("Got Port Target_buf as %s :%s %d len %d\n",
-			target_buf, rport_host_buf, sizeof(rport_host_buf), len);
-		if (strcmp(rport_name, rport_host_buf) == 0) {
-			port_wwn_buf = udev_device_get_sysattr_value(dev, "port_name");
-			if (port_wwn_buf == NULL) {
-				FPIN_ELOG("Could not get tgt WWN for %s\n", rport_host_buf);
-				udev_device_unref(dev);
-				continue;
-			}
-			port_state = udev_device_get_sysattr_value(dev, "port_state");
-			if (port_state == NULL) {
-				FPIN_ELOG("Could not get tgt WWN for %s\n", rport_host_buf);
-				udev_device_unref(dev);
-				continue;
-			}
-			if (!strcmp(port_wwn_buf, p_wwn)) {
-				FPIN_DLOG("Got tgt WWN as %s ::: portstate: %s\n",
-						port_wwn_buf, port_state);
-				ret = udev_device_set_sysattr_value(dev, "port_state", "Marginal");
-				if (ret >= 0) {
-					FPIN_ILOG("set rport port state to marginal succeded\n");
-				} else {
-					FPIN_ILOG("set rport port state to marginal failed %d \n", ret);
-					udev_device_unref(dev);
-					goto error;
-				}
-
-			}
-		}
-		udev_device_unref(dev);
-	}
-error:
-	/* Free the enumerator object */
-	udev_enumerate_unref(enumerate);
-	udev_unref(udev);
-	return ret;
-
-}
+static int fpin_marginal_dev_insert(uint32_t host_num, const char *devname,
+			enum fpin_dev_type dev_type, uint64_t p_wwn);
 
 /*
  * Function:
- * 	fpin_insert_dm(struct list_head *dm_list_head, char *dm_name,
- * 			char *uid_name)
+ * 	fpin_insert_dm(struct list_head *dm_list_head, const char *dm_node,
+ * 			const char *dm_name, const char *uid_name,
+ * 			struct fpin_arena *arena)
  *
  * Inputs:
- * 	1. Pointer to the Linked list head containing dm name and node.
- * 	2. The dm name which id of form mpath* (mpatha/mpathb etc)
- * 	3. The DM node name in /dev
+ * 	1. Pointer to the Linked list head caching the dms of the event.
+ * 	2. The dm node name which is of the form dm-*
+ * 	3. The dm name which id of form mpath* (mpatha/mpathb etc)
+ * 	4. The dm UUID, of the form mpath-<wwid>
+ * 	5. The arena of the event, the node and strings are allocated from it.
+ *
+ * Returns:
+ * 	The inserted node, NULL on failure.
  *
  * Description:
- * 	This function inserts the dm name (which is in form of sd*) and
- * 	device Mapper Name (dm-*) into the Linked list which is later used to
- * 	fail the path using multipath daemon.
+ * 	This function inserts the dm node (dm-*) and device Mapper Name
+ * 	(mpath*) into the per-event dm cache which is later used to fail the
+ * 	path using multipath daemon.
  */
-int
-fpin_insert_dm(struct list_head *dm_list_head, const char *dm_name,
-			const char *uid_name) {
+static struct dm_devs *
+fpin_insert_dm(struct list_head *dm_list_head, const char *dm_node,
+			const char *dm_name, const char *uid_name,
+			struct fpin_arena *arena) {
 	struct dm_devs *new_node = NULL;
 	char *uid_ptr = NULL;
-	int dm_name_len = 0, uid_name_len = 0;
-
-	dm_name_len = strlen(dm_name);
-	uid_name_len = strlen(uid_name);
 
-	if ((dm_name_len > (DEV_NAME_LEN - 1)) ||
-		(uid_name_len > (UUID_LEN -1 ))) {
-		FPIN_ELOG("Failed to add %s, params exceed buffer length "
-		"dm_name %d, uid_name %d\n", dm_name,
-			dm_name_len, uid_name_len);
-		return (-EINVAL);
+	/*
+	 * Checking with only a '-' as this function is onvoked only
+	 * if uid_name has mpath- string in it.
+	 */
+	uid_ptr = strchr(uid_name, '-');
+	if (uid_ptr == NULL) {
+		FPIN_ELOG("Failed to fetch dm_uuid for %s\n", dm_name);
+		return NULL;
 	}
+	uid_ptr++;
 
 	/* Create a node */
-	new_node = (struct dm_devs *) malloc(sizeof(struct dm_devs));
+	new_node = fpin_arena_alloc(arena, sizeof(struct dm_devs));
 	if (new_node != NULL) {
 		/* Set values in new node */
-		strncpy(new_node->dm_name, dm_name, DEV_NAME_LEN);
-		/*
-		 * Checking with only a '-' as this function is onvoked only
-		 * if uid_name has mpath- string in it.
-		 */
-		uid_ptr = strchr(uid_name, '-');
-		if (uid_ptr != NULL) {
-			uid_ptr++;
-			/* No need to NULL check as UUID name cannot be blank */
-			strncpy(new_node->dm_uuid, uid_ptr, UUID_LEN);
-		} else {
-			FPIN_ELOG("Failed to fetch dm_uuid for %s\n", dm_name);
-			free(new_node);
-			return (-EBADF);
+		new_node->dm_node = fpin_arena_intern(arena, dm_node);
+		new_node->dm_name = fpin_arena_intern(arena, dm_name);
+		/* No need to NULL check as UUID name cannot be blank */
+		new_node->dm_uuid = fpin_arena_intern(arena, uid_ptr);
+		if ((new_node->dm_node == NULL) || (new_node->dm_name == NULL) ||
+			(new_node->dm_uuid == NULL)) {
+			FPIN_ELOG("Failed to add %s, OOM\n", dm_name);
+			return NULL;
 		}
 
-		FPIN_ILOG("Inserted %s : %s into dm list\n",
+		FPIN_DLOG("Inserted %s : %s : %s into dm list\n", new_node->dm_node,
 			new_node->dm_name, new_node->dm_uuid);
 		list_add_tail(&(new_node->dm_list_head), dm_list_head);
 	} else {
 		FPIN_ELOG("Failed to add %s, OOM\n", dm_name);
-		return -ENOMEM;
+		return NULL;
 	}
 
-	return (0);
+	return (new_node);
 }
 
 /*
@@ -217,6 +104,10 @@ fpin_insert_dm(struct list_head *dm_list_head, const char *dm_name,
  * 	1. Pointer to the Linked list head containing dev name and node.
  * 	2. The dev name which is of form sd* (mpatha/mpathb etc)
  * 	3. The DM node name which is of the form MAJOR:MINOR
+ * 	4. The serial ID of the device.
+ * 	5. The port WWN of the target the device is reached through.
+ * 	6. The multipath map holding the device.
+ * 	7. The arena of the event, the node and strings are allocated from it.
  *
  * Description:
  * 	This function inserts the dev name (which is in form of sd*) and
@@ -225,36 +116,29 @@ fpin_insert_dm(struct list_head *dm_list_head, const char *dm_name,
  */
 static int
 fpin_insert_sd(struct list_head *impacted_dev_list_head, const char *dev_name,
-			char *sd_node, const char *serial_id, char *port_wwn)
+			const char *sd_node, const char *serial_id, uint64_t port_wwn,
+			struct dm_devs *dm, struct fpin_arena *arena)
 {
 	struct impacted_devs *new_node = NULL;
-	int dev_name_len = 0, sd_node_len = 0, serial_id_len = 0, sd_path_len = 0;
-
-	dev_name_len = strlen(dev_name);
-	sd_node_len = strlen(sd_node);
-	serial_id_len = strlen(serial_id);
-
-	if ((dev_name_len > (DEV_NAME_LEN - 1)) ||
-		(sd_node_len > (DEV_NAME_LEN - 1)) ||
-		(serial_id_len > (UUID_LEN - 1))) {
-		FPIN_ELOG("Failed to add %s : %s, params exceed buffer length "
-			"dev_name_len %d, node_len %d, serial_id_len %d\n",
-			dev_name, sd_node, dev_name_len, sd_node_len, serial_id_len);
-		return (-EINVAL);
-	}
 
 	/* Create a node */
-	new_node = (struct impacted_devs*)
-				malloc(sizeof(struct impacted_devs));
+	new_node = fpin_arena_alloc(arena, sizeof(struct impacted_devs));
 	if (new_node != NULL) {
 		/* Set values in new node */
-		strncpy(new_node->dev_name, dev_name, DEV_NAME_LEN);
-		strncpy(new_node->dev_node, sd_node, DEV_NAME_LEN);
-		strncpy(new_node->dev_serial_id, serial_id, UUID_LEN);
-		strncpy(new_node->p_wwn, port_wwn, WWN_LEN);
-		FPIN_ILOG("Inserted %s : %s : %s : p_wwn %s :into sd list\n",
+		new_node->dev_name = fpin_arena_intern(arena, dev_name);
+		new_node->dev_node = fpin_arena_intern(arena, sd_node);
+		new_node->dev_serial_id = fpin_arena_intern(arena,
+						serial_id ? serial_id : "");
+		new_node->p_wwn = port_wwn;
+		new_node->dm = dm;
+		if ((new_node->dev_name == NULL) || (new_node->dev_node == NULL) ||
+			(new_node->dev_serial_id == NULL)) {
+			FPIN_ELOG("Failed to add %s : %s, OOM\n", dev_name, sd_node);
+			return -ENOMEM;
+		}
+		FPIN_DLOG("Inserted %s : %s : %s : p_wwn 0x%016llx :into sd list\n",
 			new_node->dev_name, new_node->dev_node,
-			new_node->dev_serial_id, new_node->p_wwn);
+			new_node->dev_serial_id, (unsigned long long)new_node->p_wwn);
 		list_add_tail(&(new_node->dev_list_head), impacted_dev_list_head);
 	} else {
 		FPIN_ELOG("Failed to add %s : %s, OOM\n",
@@ -272,33 +156,30 @@ fpin_insert_sd(struct list_head *impacted_dev_list_head, const char *dev_name,
  * Inputs:
  * 	1. Pointer to the Linked list which contains list of targets impacted.
  * 	2. The target id to be inserted to the above list.
+ * 	3. The port WWN of the target.
+ * 	4. The arena of the event, the node and strings are allocated from it.
  *
  * Description:
  * 	This function inserts the target name to a list of impacted targets.
  */
 int
 fpin_dm_insert_target(struct list_head *tgt_list_head, const char *target,
-			const char *port_wwn) {
+			uint64_t port_wwn, struct fpin_arena *arena) {
 
 	struct targets *new_node = NULL;
-	int tgt_name_len = 0;
-
-	tgt_name_len = strlen(target);
-
-	if (tgt_name_len > (TGT_NAME_LEN - 1)) {
-		FPIN_ELOG("Failed to insert tgt %s, buffer length exceeded "
-			"tgt_name_len %d\n", target, tgt_name_len);
-		return (-EINVAL);
-	}
 
 	/* Create a node */
-	new_node = (struct targets *) malloc(sizeof(struct targets));
+	new_node = fpin_arena_alloc(arena, sizeof(struct targets));
 	if (new_node != NULL) {
 		/* Set values in new node */
-		strncpy(new_node->target, target, TGT_NAME_LEN);
-		strncpy(new_node->p_wwn, port_wwn, WWN_LEN);
-		FPIN_ILOG("Inserted target %s and p_wwn into target list\n",
-			new_node->target, new_node->p_wwn);
+		new_node->target = fpin_arena_intern(arena, target);
+		new_node->p_wwn = port_wwn;
+		if (new_node->target == NULL) {
+			FPIN_CLOG("Failed to insert target %s, OOM\n", target);
+			return -ENOMEM;
+		}
+		FPIN_DLOG("Inserted target %s and p_wwn 0x%016llx into target list\n",
+			new_node->target, (unsigned long long)new_node->p_wwn);
 		list_add_tail(&(new_node->target_head), tgt_list_head);
 	} else {
 		FPIN_CLOG("Failed to insert target %s, OOM\n", target);
@@ -315,7 +196,8 @@ fpin_display_dm_list(struct list_head *list_head) {
 		FPIN_DLOG("DM list is empty, not failing any sd\n");
 	} else {
 		list_for_each_entry(temp, list_head, dm_list_head) {
-			FPIN_DLOG("Contains: dm_name: %s\n", temp->dm_name);
+			FPIN_DLOG("Contains: dm_node: %s dm_name: %s\n", temp->dm_node,
+				temp->dm_name);
 		}
 	}
 }
@@ -333,46 +215,6 @@ fpin_display_impacted_dev_list(struct list_head *list_head) {
 	}
 }
 
-/*
- * Function:
- * 	fpin_fetch_dm_for_sd
- *
- * Inputs:
- * 	1. List of all multipath DMs in the host.
- * 	2. The serial ID of the device to be mapped with UUID of DM.
- * 	3. Pointer to the memory where the impacted DM name (mpath*) will be stored.
- *
- * Returns:
- * 	1: If the corresponding holder of device is found., -1 Otherwise.
- *
- * Description:
- * 	This function gets the DM name in (mpath*) format, for the device whose
- * serial ID is passed. The DM name is stored in impacted_dm parameter, which
- * will be passed to dm_get_status of device mapper to get the number of active
- * paths for the DM.
- */
-int
-fpin_fetch_dm_for_sd(struct list_head *dm_head,
-				char *dev_serial_id, char **impacted_dm) {
-	struct dm_devs *dm = NULL;
-
-	if (list_empty(dm_head)) {
-		FPIN_ELOG("DM list is empty, returning -1\n");
-		return (-1);
-	} else {
-		list_for_each_entry(dm, dm_head, dm_list_head) {
-			if (strncmp(dev_serial_id, dm->dm_uuid, UUID_LEN) == 0) {
-				*impacted_dm = dm->dm_name;
-				FPIN_DLOG("Found impacted dm %s\n", *impacted_dm);
-				return (1);
-				break;
-			}
-		}
-	}
-
-	return (0);
-}
-
 int dm_get_status(const char *name, char *outstatus)
 {
         int r = 1;
@@ -433,15 +275,24 @@ int recv_packet(int fd, char **buf, unsigned int timeout)
  * 	fpin_set_marginal_state
  *
  * Inputs:
+ * 	host_num:Host number of the path.
+ * 	event_num:Event the command is sent for, 0 for a recovery.
  * 	Cmd:cmd that needs to be passed to dm
  * Description:
- * 	This will set/unset marginal state of a device
+ * 	This will set/unset marginal state of a device. In shadow mode the
+ * 	command is only recorded.
  */
 
-static int  fpin_set_marginal_state(char* cmd){
+static int  fpin_set_marginal_state(uint32_t host_num, uint32_t event_num,
+			char* cmd){
 	int ret = -1, fd = -1;
 	char *reply = NULL;
 
+	if (fpin_shadow_mode) {
+		fpin_shadow_record(host_num, event_num, "multipathd %s", cmd);
+		return 0;
+	}
+
 	fd = mpath_connect();
 	if (fd < 0) {
 		FPIN_CLOG("Not any devices, mpath_connect failed with %d\n", fd);
@@ -483,23 +334,127 @@ static int  fpin_set_marginal_state(char* cmd){
 
 }
 
+/*
+ * Function:
+ * 	fpin_rscn_parse_range
+ *
+ * Inputs:
+ * 	event_data:Event data of an FCH_EVT_RSCN event, the affected port ID
+ * 				page of the RSCN in host byte order.
+ * 	range:Affected port ID range.
+ * Description:
+ * 	Converts the address format of the page into a port ID mask. A fabric
+ * 	address format affects every port and yields a mask of 0.
+ */
+void
+fpin_rscn_parse_range(uint32_t event_data, struct fpin_rscn_range *range) {
+	switch ((event_data >> 24) & 0x3) {
+	case FPIN_RSCN_ADDR_PORT:
+		range->mask = 0xffffff;
+		break;
+	case FPIN_RSCN_ADDR_AREA:
+		range->mask = 0xffff00;
+		break;
+	case FPIN_RSCN_ADDR_DOMAIN:
+		range->mask = 0xff0000;
+		break;
+	default:
+		range->mask = 0;
+		break;
+	}
+	range->port_id = event_data & range->mask;
+}
+
+/* Returns 1 if the remote port p_wwn is in the RSCN range */
+static int
+fpin_rscn_port_affected(const struct fpin_rscn_range *range,
+			const struct fpin_rport *rports, int nr_rports,
+			uint64_t p_wwn) {
+	int i = 0;
+
+	for (i = 0; i < nr_rports; i++) {
+		if (rports[i].port_name == p_wwn)
+			return ((rports[i].port_id & range->mask) == range->port_id);
+	}
+	/* The rport is gone, nothing to recover behind it */
+	return 0;
+}
+
+/*
+ * Queues the unset of one marginal device list entry to the worker of the
+ * path, behind any action still pending for it. The caller removes the
+ * entry, a failed unset puts it back.
+ */
+static int
+fpin_unset_marginal_entry(struct marginal_dev_list *tmp_marg) {
+	return fpin_act_submit(FPIN_JOB_UNSET, tmp_marg->dev_type,
+			tmp_marg->host_num, 0, tmp_marg->dev_name, tmp_marg->p_wwn,
+			NULL);
+}
+
+/* Unsets the marginal state of a path, on its actuation worker */
+static int
+fpin_unset_marginal_path(struct fpin_act_job *job) {
+	char cmd[CMD_LEN];
+	int ret = 0;
+
+	if (job->dev_type == FPIN_DEV_NVME) {
+		ret = fpin_nvme_unset_marginal(job->host_num, job->dev_name,
+					job->p_wwn);
+	} else {
+		snprintf(cmd, CMD_LEN, "path %s unsetmarginal", job->dev_name);
+		ret = fpin_set_marginal_state(job->host_num, 0, cmd);
+	}
+	if (ret < 0) {
+		/* Still marginal, retried on the next LINKUP/RSCN */
+		fpin_marginal_dev_insert(job->host_num, job->dev_name,
+				job->dev_type, job->p_wwn);
+		if ((job->dev_type == FPIN_DEV_SCSI) && !fpin_shadow_mode)
+			fpin_marginal_dev_applied(job->host_num, job->dev_name);
+		return ret;
+	}
+	fpin_feed_path_action(FPIN_FEED_RECOVERED, job->host_num, 0,
+			job->dev_name, job->p_wwn);
+	return ret;
+}
+
 /*
  * Function:
  * 	fpin_unset_marginal_dev
  *
  * Inputs:
  * 	host_num:Host number
- * 	dev_name:device name.
+ * 	tgt_head:List of marginal devices.
+ * 	range:Port IDs affected by an RSCN, NULL to recover the whole host.
+ * 	skipped:Returns the number of marginal devices left alone because
+ * 			they are behind a port outside of range.
  * Description:
- * 	Adds the marginal devices into the list
+ * 	Unsets the marginal state of the devices of the host, limited to the
+ * 	remote ports in range, and removes them from the list. Devices
+ * 	suppressed by flap damping stay marginal. The unsets are queued to the
+ * 	actuation workers. Returns the number of devices queued for recovery.
  */
-void
-fpin_unset_marginal_dev(uint32_t host_num, struct list_head *tgt_head) {
+int
+fpin_unset_marginal_dev(uint32_t host_num, struct list_head *tgt_head,
+			const struct fpin_rscn_range *range, int *skipped) {
+	struct fpin_rport rports[FPIN_MAX_RPORTS];
 	struct marginal_dev_list *tmp_marg = NULL;
 	struct list_head *current_node = NULL;
 	struct list_head *temp = NULL;
-	char cmd[CMD_LEN];
-	int ret = 0;
+	int ret = 0, nr_rports = 0, recovered = 0;
+
+	*skipped = 0;
+	if ((range != NULL) && (range->mask != 0)) {
+		/* Port IDs are read once, outside of the marginal list lock */
+		nr_rports = fpin_sysfs_read_rports(host_num, rports, FPIN_MAX_RPORTS);
+		if (nr_rports < 0) {
+			FPIN_ELOG("Unable to read rports of host %u, err %d,"
+				" recovering all paths\n", host_num, nr_rports);
+			range = NULL;
+		}
+	} else {
+		range = NULL;
+	}
 
 	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
 	if (list_empty(tgt_head)) {
@@ -513,16 +468,67 @@ fpin_unset_marginal_dev(uint32_t host_num, struct list_head *tgt_head) {
 			FPIN_DLOG(" marginal dev: is %s %d\n", tmp_marg->dev_name, tmp_marg->host_num);
 			if (tmp_marg->host_num != host_num)
 				continue;
-			snprintf(cmd, CMD_LEN, "path %s unsetmarginal", tmp_marg->dev_name);
-			ret = fpin_set_marginal_state(cmd);
+			if ((range != NULL) && !fpin_rscn_port_affected(range, rports,
+						nr_rports, tmp_marg->p_wwn)) {
+				(*skipped)++;
+				continue;
+			}
+			if (fpin_damp_hold(host_num, tmp_marg->dev_name)) {
+				FPIN_ILOG("%s is flapping, held marginal\n",
+						tmp_marg->dev_name);
+				continue;
+			}
+			ret = fpin_unset_marginal_entry(tmp_marg);
 			if (ret <0)
 				continue;
 			list_del(current_node);
-			free(tmp_marg);
+			fpin_pool_put(&fpin_marginal_pool, tmp_marg);
+			recovered++;
 		}
 	}
 	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
 
+	return recovered;
+}
+
+/*
+ * Adds a device to the marginal device list unless it is in it already.
+ * Returns 1 if it was added, 0 if it was in the list, -ENOMEM.
+ */
+static int
+fpin_marginal_dev_insert(uint32_t host_num, const char *devname,
+			enum fpin_dev_type dev_type, uint64_t p_wwn) {
+	struct marginal_dev_list *newdev = NULL, *tmp_marg = NULL;
+
+	newdev = fpin_pool_get(&fpin_marginal_pool);
+	if (newdev == NULL) {
+		FPIN_CLOG("\n Mem alloc failed.Failed to add marginal dev info"
+			" Unset the marginal state manually after recovery"
+			" for  hostno %d devname %s \n",
+				host_num, devname);
+		return -ENOMEM;
+	}
+
+	newdev->host_num = host_num;
+	newdev->dev_type = dev_type;
+	strncpy(newdev->dev_name, devname, (DEV_NAME_LEN - 1));
+	newdev->p_wwn = p_wwn;
+	FPIN_DLOG("\n%s hostno %d devname %s\n",__func__,
+				host_num, newdev->dev_name);
+	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+	list_for_each_entry(tmp_marg, &fpin_li_marginal_dev_list_head,
+				marginal_dev_list_head) {
+		if ((tmp_marg->host_num == host_num) &&
+			(strcmp(tmp_marg->dev_name, newdev->dev_name) == 0)) {
+			pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+			fpin_pool_put(&fpin_marginal_pool, newdev);
+			return 0;
+		}
+	}
+	list_add_tail(&(newdev->marginal_dev_list_head),
+				&fpin_li_marginal_dev_list_head);
+	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+	return 1;
 }
 
 /*
@@ -532,30 +538,167 @@ fpin_unset_marginal_dev(uint32_t host_num, struct list_head *tgt_head) {
  * Inputs:
  * 	host_num:Host number
  * 	dev_name:device name.
+ * 	dev_type:SCSI path (sd*) or nvme-fc controller.
+ * 	p_wwn:Port WWN of the remote port the device is reached through.
  * Description:
- * 	Adds the marginal devices into the list
+ * 	Adds the marginal devices into the list, unless the device is already
+ * 	in it. Called when the setmarginal is planned, so a LINKUP/RSCN seen
+ * 	before the worker sets the device marginal queues the unset behind it.
  */
-static void
-fpin_add_marginal_dev_info(uint32_t host_num, char *devname) {
-	struct marginal_dev_list *newdev = NULL;
-
-	newdev = (struct marginal_dev_list *) calloc(1,
-					sizeof(struct marginal_dev_list));
-	if (newdev != NULL) {
-		newdev->host_num = host_num;
-		strncpy(newdev->dev_name, devname, (DEV_NAME_LEN - 1));
-		FPIN_DLOG("\n%s hostno %d devname %s\n",__func__,
-					host_num, newdev->dev_name);
-		pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
-		list_add_tail(&(newdev->marginal_dev_list_head),
-					&fpin_li_marginal_dev_list_head);
-		pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
-	} else {
-		FPIN_CLOG("\n Mem alloc failed.Failed to add marginal dev info"
-			" Unset the marginal state manually after recovery"
-			" for  hostno %d devname %s \n",
-				host_num, devname);
+void
+fpin_add_marginal_dev_info(uint32_t host_num, const char *devname,
+			enum fpin_dev_type dev_type, uint64_t p_wwn) {
+	/* The path went from normal to marginal, which counts as a flap */
+	if (fpin_marginal_dev_insert(host_num, devname, dev_type, p_wwn) == 1)
+		fpin_damp_penalize(host_num, devname);
+}
+
+/* Removes a device whose setmarginal failed from the marginal device list */
+void
+fpin_del_marginal_dev_info(uint32_t host_num, const char *devname) {
+	struct marginal_dev_list *tmp_marg = NULL, *next = NULL;
+
+	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+	list_for_each_entry_safe(tmp_marg, next, &fpin_li_marginal_dev_list_head,
+				marginal_dev_list_head) {
+		if ((tmp_marg->host_num == host_num) &&
+			(strcmp(tmp_marg->dev_name, devname) == 0)) {
+			list_del(&tmp_marg->marginal_dev_list_head);
+			fpin_pool_put(&fpin_marginal_pool, tmp_marg);
+			break;
+		}
 	}
+	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+}
+
+/*
+ * Marks a device of the marginal device list as set marginal by multipathd,
+ * from then on multipathd saying otherwise is a divergence, see fpin_recon.c.
+ */
+void
+fpin_marginal_dev_applied(uint32_t host_num, const char *devname) {
+	struct marginal_dev_list *tmp_marg = NULL;
+
+	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+	list_for_each_entry(tmp_marg, &fpin_li_marginal_dev_list_head,
+				marginal_dev_list_head) {
+		if ((tmp_marg->host_num == host_num) &&
+			(strcmp(tmp_marg->dev_name, devname) == 0)) {
+			tmp_marg->applied = 1;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+}
+
+/*
+ * Function:
+ * 	fpin_marginal_dev_reconcile
+ *
+ * Inputs:
+ * 	devname:		sd* or nvme controller name.
+ * 	dev_type:		Kind of the device.
+ * 	applied_only:	Leave alone the entries whose setmarginal is still
+ * 					pending on an actuation worker.
+ * Description:
+ * 	Removes the device from the marginal device list, whatever host it is
+ * 	on, as it is gone or no longer marginal. Returns the number of entries
+ * 	removed.
+ */
+int
+fpin_marginal_dev_reconcile(const char *devname, enum fpin_dev_type dev_type,
+			int applied_only) {
+	struct marginal_dev_list *tmp_marg = NULL, *next = NULL;
+	int removed = 0;
+
+	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+	list_for_each_entry_safe(tmp_marg, next, &fpin_li_marginal_dev_list_head,
+				marginal_dev_list_head) {
+		if ((tmp_marg->dev_type != dev_type) ||
+			(strcmp(tmp_marg->dev_name, devname) != 0) ||
+			(applied_only && !tmp_marg->applied))
+			continue;
+		list_del(&tmp_marg->marginal_dev_list_head);
+		fpin_pool_put(&fpin_marginal_pool, tmp_marg);
+		removed++;
+	}
+	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+	return removed;
+}
+
+/*
+ * Removes the devices the callback finds gone from the marginal device
+ * list. The callback runs with the list locked. Returns the number removed.
+ */
+int
+fpin_marginal_dev_prune(int (*gone)(const struct marginal_dev_list *)) {
+	struct marginal_dev_list *tmp_marg = NULL, *next = NULL;
+	int removed = 0;
+
+	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+	list_for_each_entry_safe(tmp_marg, next, &fpin_li_marginal_dev_list_head,
+				marginal_dev_list_head) {
+		if (!gone(tmp_marg))
+			continue;
+		FPIN_ILOG("%s host_num %u is gone, dropped from the marginal list\n",
+				tmp_marg->dev_name, tmp_marg->host_num);
+		list_del(&tmp_marg->marginal_dev_list_head);
+		fpin_pool_put(&fpin_marginal_pool, tmp_marg);
+		removed++;
+	}
+	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+	return removed;
+}
+
+/* Returns the number of SCSI paths multipathd took the setmarginal of */
+int
+fpin_marginal_dev_nr_applied(void) {
+	struct marginal_dev_list *tmp_marg = NULL;
+	int nr = 0;
+
+	pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+	list_for_each_entry(tmp_marg, &fpin_li_marginal_dev_list_head,
+				marginal_dev_list_head) {
+		if ((tmp_marg->dev_type == FPIN_DEV_SCSI) && tmp_marg->applied)
+			nr++;
+	}
+	pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+	return nr;
+}
+
+/*
+ * Function:
+ * 	fpin_dm_plan_path
+ *
+ * Inputs:
+ * 	type:		FPIN_JOB_MARGINAL or FPIN_JOB_FAIL.
+ * 	host_num:	Host number of the path.
+ * 	event_num:	Event number the action is planned for.
+ * 	dev_name:	sd* name of the path.
+ * 	p_wwn:		Port WWN of the remote port of the path.
+ * 	trace:		Latency trace of the event, NULL once the event is over.
+ *
+ * Description:
+ * 	Queues the action of a SCSI path to its actuation worker. A path set
+ * 	marginal is added to the marginal device list first, see
+ * 	fpin_add_marginal_dev_info. Returns 0 or -ENOMEM.
+ */
+int
+fpin_dm_plan_path(enum fpin_job_type type, uint32_t host_num,
+			uint32_t event_num, const char *dev_name, uint64_t p_wwn,
+			struct fpin_event_trace *trace) {
+	int ret = 0;
+
+	if (type == FPIN_JOB_FAIL)
+		return fpin_act_submit(FPIN_JOB_FAIL, FPIN_DEV_SCSI, host_num,
+				event_num, dev_name, p_wwn, trace);
+
+	fpin_add_marginal_dev_info(host_num, dev_name, FPIN_DEV_SCSI, p_wwn);
+	ret = fpin_act_submit(FPIN_JOB_MARGINAL, FPIN_DEV_SCSI, host_num,
+			event_num, dev_name, p_wwn, trace);
+	if (ret < 0)
+		fpin_del_marginal_dev_info(host_num, dev_name);
+	return ret;
 }
 
 /*
@@ -563,23 +706,33 @@ fpin_add_marginal_dev_info(uint32_t host_num, char *devname) {
  * 	fpin_dm_marginal_path
  *
  * Inputs:
+ * 	list:					Impacted WWNs of the event with their policy action.
  * 	dm_list_head:			List of all DMs in the host.
  * 	impacted_dev_list_head: List of all impacted devices, whose WWN was sent
  * 							as part of FPIN ELS frame.
+ * 	trace:					Latency trace of the event being processed.
  *
  * Description:
  * 	Uses Multipath daemon help to fail a path permanently unless manually
  * 	reinstated. Maps the impacted Devices to their corresponding holders/dms',
- * 	and fails the path only if there is at least one other active path present.
+ * 	and plans the action of every path whose map is active. Paths whose
+ * 	policy action is fail are failed right away instead of being set
+ * 	marginal, multipathd reinstates them once the path checker passes. The
+ * 	actions are carried out by the actuation workers, see fpin_dm_actuate.
+ * 	The action of a path whose policy rule wants corroboration is held
+ * 	until the host sees I/O errors on it, see fpin_ioerr_watch.
  */
 void
-fpin_dm_marginal_path(uint32_t host_num, struct list_head *dm_list_head,
-			struct list_head *impacted_dev_list_head) {
+fpin_dm_marginal_path(struct wwn_list *list, struct list_head *dm_list_head,
+			struct list_head *impacted_dev_list_head,
+			struct fpin_event_trace *trace) {
+	uint32_t host_num = list->host_num;
+	const struct fpin_confirm *confirm = NULL;
 	struct impacted_devs *temp = NULL;
-	char *reply = NULL;
-	char *impacted_dm = NULL;
-	char cmd[CMD_LEN], dm_status[DM_PARAMS_SIZE];
-	int ret = -1, fd = -1;
+	enum fpin_job_type type;
+	const char *impacted_dm = NULL;
+	char dm_status[DM_PARAMS_SIZE];
+	int ret = -1;
 
 	if (list_empty(dm_list_head)) {
 		FPIN_ELOG("DM list is empty, not failing any sd\n");
@@ -591,38 +744,100 @@ fpin_dm_marginal_path(uint32_t host_num, struct list_head *dm_list_head,
 		return;
 	}
 	list_for_each_entry(temp, impacted_dev_list_head, dev_list_head) {
-		ret = fpin_fetch_dm_for_sd(dm_list_head,
-				temp->dev_serial_id, &impacted_dm);
-		if (ret <= 0) {
-			FPIN_ELOG("Failed to fetch DM for sd %s\n", temp->dev_name);
-			continue;
-		}
+		/* Resolved from the holders of the sd, see fpin_dm_resolve_holder */
+		impacted_dm = temp->dm->dm_name;
 
 		FPIN_CLOG("DM to fail is %s\n", impacted_dm);
 		memset(dm_status, '\0', DM_PARAMS_SIZE);
 		ret = dm_get_status(impacted_dm, dm_status);
-		if (!ret) {
+		if (ret)
+			continue;
+		if (fpin_els_wwn_action(list, temp->p_wwn) == FPIN_ACT_FAIL) {
+			type = FPIN_JOB_FAIL;
+			FPIN_ILOG("failing %s:%s p_wwn 0x%016llx host_num %d by policy\n",
+					temp->dev_node, temp->dev_name,
+					(unsigned long long)temp->p_wwn, host_num);
+		} else {
 			/*
 			 * set  the impacted Path in DM to marginal
 			 */
-			FPIN_ILOG("setting marginal state %s:%s %s p_wwn%s host_num %d\n",
-					temp->dev_node, temp->dev_name, temp->dev_serial_id,
-					temp->p_wwn, host_num);
-			snprintf(cmd, CMD_LEN, "path %s setmarginal", temp->dev_name);
-			ret = fpin_set_marginal_state(cmd);
-			if (ret < 0)
-				continue;
-			else {
-				ret = fpin_set_rport_marginal(host_num, temp->p_wwn);
-				if (ret < 0)
-					FPIN_ELOG("failed to set the rport state :%s\n", temp->p_wwn);
+			type = FPIN_JOB_MARGINAL;
+			FPIN_ILOG("setting marginal state %s:%s %s p_wwn 0x%016llx"
+					" host_num %d\n", temp->dev_node, temp->dev_name,
+					temp->dev_serial_id, (unsigned long long)temp->p_wwn,
+					host_num);
+		}
 
-				fpin_add_marginal_dev_info(host_num, temp->dev_name);
+		confirm = fpin_els_wwn_confirm(list, temp->p_wwn);
+		if ((confirm != NULL) &&
+			(fpin_ioerr_watch(type, host_num, list->event_num,
+				temp->dev_name, temp->p_wwn, confirm) == 0))
+			continue;
+		fpin_dm_plan_path(type, host_num, list->event_num, temp->dev_name,
+				temp->p_wwn, trace);
+	}
+}
 
-			}
+/*
+ * Function:
+ * 	fpin_dm_actuate
+ *
+ * Inputs:
+ * 	job:The planned action of a SCSI path, or the unset of a SCSI path or
+ * 		nvme-fc controller.
+ *
+ * Description:
+ * 	Carries out the action on the actuation worker of the path, and charges
+ * 	the multipathd and rport times to the trace of the event. Returns 0 or
+ * 	the error of the action.
+ */
+int
+fpin_dm_actuate(struct fpin_act_job *job) {
+	struct fpin_event_trace *trace = job->trace;
+	struct timespec stage_start;
+	char cmd[CMD_LEN];
+	int ret = 0;
 
+	switch (job->type) {
+	case FPIN_JOB_FAIL:
+		snprintf(cmd, CMD_LEN, "fail path %s", job->dev_name);
+		fpin_trace_now(&stage_start);
+		ret = fpin_set_marginal_state(job->host_num, job->event_num, cmd);
+		fpin_trace_stage(trace, FPIN_STAGE_SETMARGINAL, &stage_start);
+		if (ret == 0) {
+			fpin_trace_action(trace);
+			fpin_feed_path_action(FPIN_FEED_FAIL, job->host_num,
+					job->event_num, job->dev_name, job->p_wwn);
 		}
+		break;
+	case FPIN_JOB_MARGINAL:
+		snprintf(cmd, CMD_LEN, "path %s setmarginal", job->dev_name);
+		fpin_trace_now(&stage_start);
+		ret = fpin_set_marginal_state(job->host_num, job->event_num, cmd);
+		fpin_trace_stage(trace, FPIN_STAGE_SETMARGINAL, &stage_start);
+		if (ret < 0) {
+			fpin_del_marginal_dev_info(job->host_num, job->dev_name);
+			break;
+		}
+		if (!fpin_shadow_mode)
+			fpin_marginal_dev_applied(job->host_num, job->dev_name);
+		fpin_trace_action(trace);
+		fpin_feed_path_action(FPIN_FEED_MARGINAL, job->host_num,
+				job->event_num, job->dev_name, job->p_wwn);
+		if (fpin_sysfs_set_rport_state(job->host_num, job->event_num,
+					job->p_wwn, "Marginal") < 0)
+			FPIN_ELOG("failed to set the rport state :0x%016llx\n",
+					(unsigned long long)job->p_wwn);
+		fpin_trace_stage(trace, FPIN_STAGE_RPORT, &stage_start);
+		break;
+	case FPIN_JOB_UNSET:
+		ret = fpin_unset_marginal_path(job);
+		break;
+	default:
+		ret = -EINVAL;
+		break;
 	}
+	return ret;
 }
 
 void
@@ -633,13 +848,14 @@ fpin_dm_display_target(struct list_head *tgt_head) {
 		FPIN_DLOG("Target List is empty\n");
 	} else {
 		list_for_each_entry(temp, tgt_head, target_head)
-			FPIN_DLOG("Target is %s : p_wwn is %s:\n", temp->target, temp->p_wwn);
+			FPIN_DLOG("Target is %s : p_wwn is 0x%016llx:\n", temp->target,
+					(unsigned long long)temp->p_wwn);
 	}
 }
 
 int
 fpin_dm_find_target(struct list_head *tgt_head, const char *target,
-			char *port_wwn) {
+			uint64_t *port_wwn) {
 	struct targets *temp = NULL;
 
 	if (list_empty(tgt_head)) {
@@ -655,7 +871,7 @@ fpin_dm_find_target(struct list_head *tgt_head, const char *target,
 			 */
 			if (strcmp(temp->target, target) == 0) {
 				FPIN_DLOG("Found Target %s\n", target);
-				strncpy(port_wwn, temp->p_wwn, WWN_LEN);
+				*port_wwn = temp->p_wwn;
 				return (1);
 			}
 		}
@@ -664,105 +880,36 @@ fpin_dm_find_target(struct list_head *tgt_head, const char *target,
 	return (0);
 }
 
-void
-fpin_free_dm(struct list_head *dm_head) {
-	struct list_head *current_node = NULL;
-	struct list_head *temp = NULL;
-	struct dm_devs *tmp_dm = NULL;
-	if (list_empty(dm_head)) {
-		FPIN_DLOG("List is empty, nothing to delete..\n");
-		return;
-	} else {
-		list_for_each_safe(current_node, temp, dm_head) {
-			tmp_dm = list_entry(current_node, struct dm_devs, dm_list_head);
-			FPIN_DLOG("Free dm %s\n", tmp_dm->dm_name);
-			list_del(current_node);
-			free(tmp_dm);
-		}
-	}
-}
-
-void
-fpin_dm_free_target(struct list_head *tgt_head) {
-	struct list_head *current_node = NULL;
-	struct list_head *temp = NULL;
-	struct targets *tmp_tgt = NULL;
-	if (list_empty(tgt_head)) {
-		FPIN_DLOG("List is empty, nothing to delete..\n");
-		return;
-	} else {
-		list_for_each_safe(current_node, temp, tgt_head) {
-			tmp_tgt = list_entry(current_node, struct targets, target_head);
-			FPIN_DLOG("Free target %s\n", tmp_tgt->target);
-			list_del(current_node);
-			free(tmp_tgt);
-		}
-	}
-}
+struct fpin_dm_target_scan
+{
+	struct wwn_list *list;
+	struct list_head *tgt_list;
+	int count;
+};
 
-void
-fpin_dm_free_dev(struct  list_head *sd_head) {
-	struct list_head *current_node = NULL;
-	struct list_head *temp = NULL;
-	struct impacted_devs *tmp_sd = NULL;
-	if (list_empty(sd_head)) {
-		FPIN_DLOG("List is empty, nothing to delete..\n");
-		return;
-	} else {
-		list_for_each_safe(current_node, temp, sd_head) {
-			tmp_sd = list_entry(current_node, struct impacted_devs, dev_list_head);
-			FPIN_DLOG("Free sd %s\n", tmp_sd->dev_name);
-			list_del(current_node);
-			free(tmp_sd);
-		}
+/* Adds a target of the host whose port_name is one of the impacted WWNs */
+static int
+fpin_dm_target_cb(const char *target, struct fpin_sio_req *reqs, void *arg) {
+	struct fpin_dm_target_scan *scan = arg;
+	uint64_t port_wwn = 0;
+
+	if (reqs[0].ret <= 0) {
+		FPIN_ELOG("Could not get tgt WWN for %s, err %d\n", target,
+				reqs[0].ret);
+		return 0;
 	}
-}
-
-/*
- * Function:
- *	fpin_fetch_dm_lun_data
- *
- * Inputs:
- * 	1. Pointer to the Linked list which contains list of port WWNs impacted.
- * 	2. Pointer to the Linked list which will be populated with impacted sd
- * 	   and dms. These sd* will be failed using multipathd.
- *
- * Description:
- * 	This function takes in the list of impacted WWNs as input and translates
- * 	them into sd* and dm-* which will be failed by multipathd.
- */
-int
-fpin_fetch_dm_lun_data(struct wwn_list *list, struct list_head *dm_list_head,
-				struct list_head *impacted_dev_list_head, struct udev *udev) {
-	struct list_head impacted_tgt_list_head;
-	int ret = -1;
-
-	FPIN_DLOG("Get DM Lun Data\n");
-	INIT_LIST_HEAD(&impacted_tgt_list_head);
-	/* Get Targets linked to the port on whichthe ELS frame was recieved */
-	ret = fpin_dm_populate_target(list, &impacted_tgt_list_head, udev);
-	if (ret <= 0) {
-		FPIN_ELOG("No targets found, returning ret %d\n", ret);
-		return (ret);
+	FPIN_DLOG("Got tgt WWN as %s\n", reqs[0].buf);
+	if (fpin_sysfs_parse_wwn(reqs[0].buf, reqs[0].ret, &port_wwn) < 0) {
+		FPIN_ELOG("Invalid tgt WWN %s of %s\n", reqs[0].buf, target);
+		return 0;
 	}
-
-	FPIN_DLOG("Display target\n");
-	fpin_dm_display_target(&impacted_tgt_list_head);
-
-	/* Get sd to dm mapping for populated targets */
-	ret = fpin_populate_dm_lun(dm_list_head, impacted_dev_list_head, udev,
-				&impacted_tgt_list_head);
-	if (ret <= 0) {
-		FPIN_ELOG("No sd found to fail, returning ret %d\n", ret);
-		fpin_dm_free_target(&impacted_tgt_list_head);
-		return (ret);
+	if (fpin_els_wwn_exists(scan->list, port_wwn)) {
+		FPIN_DLOG("Found a target %s %s\n", target, reqs[0].buf);
+		if (fpin_dm_insert_target(scan->tgt_list, target, port_wwn,
+					scan->list->arena) == 0)
+			scan->count++;
 	}
-
-	fpin_display_dm_list(dm_list_head);
-	fpin_display_impacted_dev_list(impacted_dev_list_head);
-
-	fpin_dm_free_target(&impacted_tgt_list_head);
-	return (ret);
+	return 0;
 }
 
 /*
@@ -783,13 +930,14 @@ int
 fpin_dm_populate_target(struct wwn_list *list, struct list_head *tgt_list,
 			struct udev *udev) {
 
-	char host_buf[DEV_NODE_LEN];
+	static const char *const attrs[] = { "port_name" };
+	struct fpin_dm_target_scan scan = { list, tgt_list, 0 };
+	char host_buf[DEV_NODE_LEN], prefix[DEV_NODE_LEN];
 	char *host_name_ptr = NULL;
-	int target_count = 0, host_found = 0, wwn_exists = 0;
+	int target_count = 0, host_found = 0;
 	struct udev_enumerate *enumerate = NULL;
 	struct udev_list_entry *devices = NULL, *dev_list_entry = NULL;
-	struct udev_device *dev = NULL, *parent_dev = NULL;
-	int i = 0, ret = 0;
+	int ret = 0;
 
 	/* Create a list of the devices in the 'fc_host' subsystem. */
 	enumerate = udev_enumerate_new(udev);
@@ -856,98 +1004,97 @@ fpin_dm_populate_target(struct wwn_list *list, struct list_head *tgt_list,
 
 	FPIN_DLOG("Find targets visible to host %s\n", host_buf);
 
-	/* Create a list of the devices in the 'fc_transport' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	if (enumerate == NULL) {
-		FPIN_ELOG("Could not enumerate udev for fc_trans\n");
-		return (-EBADF);
-	}
-
-	ret = udev_enumerate_add_match_subsystem(enumerate, "fc_transport");
+	/*
+	 * Targets are named target<host>:<channel>:<id>, read the port_name
+	 * of all the targets of the host in batches and compare them with the
+	 * PWWNs in the ELS.
+	 */
+	snprintf(prefix, sizeof(prefix), "target%u:", list->host_num);
+	ret = fpin_sysfs_scan_attrs("class/fc_transport", prefix, attrs, 1, 1,
+			fpin_dm_target_cb, &scan);
 	if (ret < 0) {
-		FPIN_ELOG("Could not enumerate fc_tx sub with ret %d\n", ret);
-		udev_enumerate_unref(enumerate);
+		FPIN_ELOG("Could not read fc_transport targets of %s, err %d\n",
+				host_buf, ret);
 		return (ret);
 	}
+	target_count = scan.count;
 
-	ret = udev_enumerate_scan_devices(enumerate);
-	if (ret < 0) {
-		FPIN_ELOG("Could not scan block subsystem with ret %d\n", ret);
-		udev_enumerate_unref(enumerate);
-		return (ret);
-	}
+	return (target_count);
+}
 
-	devices = udev_enumerate_get_list_entry(enumerate);
-	if (devices == NULL) {
-		FPIN_ELOG("NO devices found under block subsystem\n");
-		udev_enumerate_unref(enumerate);
-		return(-ENODEV);
+/*
+ * Function:
+ *	fpin_dm_resolve_holder
+ *
+ * Inputs:
+ * 	1. Pointer to the udev structure used to parse sysfs classes.
+ * 	2. The sd device whose multipath map is looked up.
+ * 	3. Pointer to the per-event cache of resolved dms.
+ * 	4. The arena of the event.
+ *
+ * Returns:
+ * 	The multipath map holding the sd, NULL if the sd is not part of one.
+ *
+ * Description:
+ * 	Follows the holders/dm-* link of the sd and reads dm/name and dm/uuid
+ * 	of that dm directly, so the association does not depend on the serial
+ * 	of the sd matching the WWID of the map. Maps already resolved during the
+ * 	event are served from the cache.
+ */
+static struct dm_devs *
+fpin_dm_resolve_holder(struct udev *udev, struct udev_device *sd_dev,
+			struct list_head *dm_list_head, struct fpin_arena *arena) {
+	char holders_path[FILE_PATH_LEN];
+	struct udev_device *dm_dev = NULL;
+	struct dm_devs *dm = NULL;
+	const char *dm_name = NULL, *uid_buf = NULL;
+	struct dirent *entry = NULL;
+	DIR *dir = NULL;
+
+	snprintf(holders_path, FILE_PATH_LEN, "%s/holders",
+			udev_device_get_syspath(sd_dev));
+	dir = opendir(holders_path);
+	if (dir == NULL) {
+		FPIN_DLOG("No holders for %s, err %d\n",
+				udev_device_get_sysname(sd_dev), errno);
+		return NULL;
 	}
 
-	/* For each item enumerated, find if the target matches.
-	 * fetch port_name and compare it with the HBA PWWN in ELS.
-	 * Whichever matches, store the sys_name
-	 */
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		const char *dir_path_buf, *target_buf, *port_wwn_buf;
-		dir_path_buf = udev_list_entry_get_name(dev_list_entry);
-		if (dir_path_buf == NULL) {
-			FPIN_ELOG("Failed to get syspath for targets\n");
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp("dm-", entry->d_name, 3) != 0)
 			continue;
-		}
 
-		dev = udev_device_new_from_syspath(udev, dir_path_buf);
-		if (dev == NULL) {
-			FPIN_ELOG("Failed to get device struct from path %s, err %d\n",
-						dir_path_buf, errno);
-			continue;
-		}
-
-		parent_dev = udev_device_get_parent_with_subsystem_devtype(
-						dev, "scsi", "scsi_host");
-		if (!parent_dev) {
-			FPIN_ELOG("Unable to find parent device for %s\n",
-							udev_device_get_sysname(dev));
-			udev_device_unref(dev);
-			continue;
+		list_for_each_entry(dm, dm_list_head, dm_list_head) {
+			if (strcmp(dm->dm_node, entry->d_name) == 0) {
+				FPIN_DLOG("dm cache hit %s for %s\n", dm->dm_node,
+						udev_device_get_sysname(sd_dev));
+				closedir(dir);
+				return dm;
+			}
 		}
 
-		target_buf = udev_device_get_sysname(dev);
-		if (target_buf == NULL) {
-			FPIN_ELOG("Unable to get tgt sysname from host %s\n", host_buf);
-			udev_device_unref(dev);
+		dm_dev = udev_device_new_from_subsystem_sysname(udev, "block",
+						entry->d_name);
+		if (dm_dev == NULL) {
+			FPIN_ELOG("Failed to get device for holder %s, err %d\n",
+					entry->d_name, errno);
 			continue;
 		}
-
-		FPIN_DLOG("Got Port Target_buf as %s\n", target_buf);
-		/*
-		 * Intentionally using strcmp as both strings are confirmed
-		 * to be NULL terminated. We do not want to match host1 with host10.
-		 */
-		if (strcmp(host_buf, udev_device_get_sysname(parent_dev)) == 0) {
-			port_wwn_buf = udev_device_get_sysattr_value(dev, "port_name");
-			if (port_wwn_buf == NULL) {
-				FPIN_ELOG("Could not get tgt WWN for %s\n", host_buf);
-				udev_device_unref(dev);
-				continue;
-			}
-
-			FPIN_DLOG("Got tgt WWN as %s\n", port_wwn_buf);
-			wwn_exists = fpin_els_wwn_exists(list, port_wwn_buf);
-			if (wwn_exists) {
-				FPIN_DLOG("Found a target %s %s\n", target_buf, port_wwn_buf);
-				if ((fpin_dm_insert_target(tgt_list, target_buf, port_wwn_buf)) == 0)
-					target_count++;
-			}
+		uid_buf = udev_device_get_sysattr_value(dm_dev, "dm/uuid");
+		dm_name = udev_device_get_sysattr_value(dm_dev, "dm/name");
+		if ((uid_buf != NULL) && (dm_name != NULL) &&
+			(strncmp("mpath-", uid_buf, 6) == 0)) {
+			dm = fpin_insert_dm(dm_list_head, entry->d_name, dm_name,
+						uid_buf, arena);
+			udev_device_unref(dm_dev);
+			closedir(dir);
+			return dm;
 		}
-
-		udev_device_unref(dev);
+		udev_device_unref(dm_dev);
 	}
 
-	/* Free the enumerator object */
-	udev_enumerate_unref(enumerate);
-
-	return (target_count);
+	closedir(dir);
+	return NULL;
 }
 
 /*
@@ -955,131 +1102,269 @@ fpin_dm_populate_target(struct wwn_list *list, struct list_head *tgt_list,
  *	fpin_populate_dm_lun
  *
  * Inputs:
- * 	1. Pointer to the Linked list which contains list of port WWNs impacted.
+ * 	1. Pointer to the Linked list which caches the dms resolved for the event.
  * 	2. Pointer to the Linked list which will be populated with impacted sd
  * 	   and dms. These sd* will be failed using multipathd.
- *	3. Pointer to the list of impacted target IDs.
+ * 	3. Pointer to the udev structure used to parse sysfs classes.
+ *	4. Pointer to the list of impacted target IDs.
+ *	5. The arena of the event.
  *
  * Description:
- * 	This function takes in the list of impacted WWNs as input and translates
- * 	them into sd* and dm-* which will be failed by multipathd.
+ * 	This function translates the impacted targets into sd* and the dm-*
+ * 	holding them, which will be failed by multipathd. Only the block devices
+ * 	below the impacted targets are visited, and only the maps holding them
+ * 	are resolved.
  */
 int
 fpin_populate_dm_lun(struct list_head *dm_list_head,
 			struct list_head *impacted_dev_list_head,
-			struct udev *udev, struct list_head *target_head) {
+			struct udev *udev, struct list_head *target_head,
+			struct fpin_arena *arena) {
 	char lun_buf[DEV_NODE_LEN];
-	int wwn_exists = 0, dm_count = 0;
 	int sd_count = 0, ret = 0;
-	char port_wwn[WWN_LEN];
+	struct targets *tgt = NULL;
+	struct dm_devs *dm = NULL;
 	struct udev_enumerate *enumerate = NULL;
 	struct udev_list_entry *devices = NULL, *dev_list_entry = NULL;
-	struct udev_device *dev = NULL, *parent_dev = NULL;
-	int i = 0;
-
-	/* Create a list of the devices in the 'block' subsystem. */
-	enumerate = udev_enumerate_new(udev);
-	if (enumerate == NULL) {
-		FPIN_ELOG("Could not enumerate udev\n");
-		return (-EBADF);
-	}
-
-	ret = udev_enumerate_add_match_subsystem(enumerate, "block");
-	if (ret < 0) {
-		FPIN_ELOG("Could not enumerate block subsystem with ret %d\n", ret);
-		udev_enumerate_unref(enumerate);
-		return (ret);
-	}
-
-	ret = udev_enumerate_scan_devices(enumerate);
-	if (ret < 0) {
-		FPIN_ELOG("Could not scan block subsystem with ret %d\n", ret);
-		udev_enumerate_unref(enumerate);
-		return (ret);
-	}
+	struct udev_device *dev = NULL, *tgt_dev = NULL;
+
+	list_for_each_entry(tgt, target_head, target_head) {
+		tgt_dev = udev_device_new_from_subsystem_sysname(udev, "scsi",
+						tgt->target);
+		if (tgt_dev == NULL) {
+			FPIN_ELOG("Failed to get device for target %s, err %d\n",
+					tgt->target, errno);
+			continue;
+		}
 
-	devices = udev_enumerate_get_list_entry(enumerate);
-	if (devices == NULL) {
-		FPIN_ELOG("NO devices found under block subsystem\n");
-		udev_enumerate_unref(enumerate);
-		return(-ENODEV);
-	}
+		/* Create a list of the block devices below the target */
+		enumerate = udev_enumerate_new(udev);
+		if (enumerate == NULL) {
+			FPIN_ELOG("Could not enumerate udev\n");
+			udev_device_unref(tgt_dev);
+			return (-EBADF);
+		}
 
-	/* For each item enumerated, find if the target matches.
-	 * fetch port_name and compare it with the HBA PWWN in ELS.
-	 * Whichever matches, store the sys_name
-	 */
-	FPIN_DLOG("Looping over Block...\n");
-	udev_list_entry_foreach(dev_list_entry, devices) {
-		const char *dir_path_buf, *dm_buf, *dev_buf;
-		const char *target_buf, *uid_buf;
-		dir_path_buf = udev_list_entry_get_name(dev_list_entry);
-		dev = udev_device_new_from_syspath(udev, dir_path_buf);
-		if (dev == NULL) {
-			FPIN_ELOG("Failed to get device struct from path %s, err %d\n",
-				dir_path_buf, errno);
+		ret = udev_enumerate_add_match_subsystem(enumerate, "block");
+		if (ret >= 0)
+			ret = udev_enumerate_add_match_parent(enumerate, tgt_dev);
+		if (ret >= 0)
+			ret = udev_enumerate_scan_devices(enumerate);
+		if (ret < 0) {
+			FPIN_ELOG("Could not scan block devices of %s with ret %d\n",
+					tgt->target, ret);
+			udev_enumerate_unref(enumerate);
+			udev_device_unref(tgt_dev);
 			continue;
 		}
-		/* Handle DMs */
-		dev_buf = udev_device_get_sysname(dev);
-		FPIN_DLOG("Got dev_name as %s\n", dev_buf);
-		if (strncmp("dm-", dev_buf, 3) == 0) {
-			uid_buf = udev_device_get_property_value(dev, "DM_UUID");
-			if (strncmp("mpath-", uid_buf, 6) == 0) {
-				dm_buf = udev_device_get_property_value(dev, "DM_NAME");
-				ret = fpin_insert_dm(dm_list_head, dm_buf, uid_buf);
-				if (ret < 0) {
-					FPIN_ELOG("Failed to Insert %s : %s\n", dev_buf, dm_buf);
-				} else {
-					dm_count++;
-				}
+
+		devices = udev_enumerate_get_list_entry(enumerate);
+		FPIN_DLOG("Looping over Block of %s...\n", tgt->target);
+		udev_list_entry_foreach(dev_list_entry, devices) {
+			const char *dir_path_buf, *dev_buf, *uid_buf;
+			dir_path_buf = udev_list_entry_get_name(dev_list_entry);
+			dev = udev_device_new_from_syspath(udev, dir_path_buf);
+			if (dev == NULL) {
+				FPIN_ELOG("Failed to get device struct from path %s, err %d\n",
+					dir_path_buf, errno);
+				continue;
 			}
 
-		} else if (strncmp("sd", dev_buf, 2) == 0) {
-			/* Handle SDs */
-			FPIN_DLOG("####Got syspath as %s\n", dir_path_buf);
-			parent_dev = udev_device_get_parent_with_subsystem_devtype(
-				dev, "scsi", "scsi_target");
-			if (!parent_dev) {
-				FPIN_ELOG("Unable to find parent device for %s\n",
-					udev_device_get_sysname(dev));
+			dev_buf = udev_device_get_sysname(dev);
+			FPIN_DLOG("Got dev_name as %s\n", dev_buf);
+			if (strncmp("sd", dev_buf, 2) != 0) {
 				udev_device_unref(dev);
 				continue;
 			}
 
-			target_buf = udev_device_get_sysname(parent_dev);
-			FPIN_ILOG("###Got target_buf as %s\n", target_buf);
-
-			if (fpin_dm_find_target(target_head, target_buf, port_wwn) != 0) {
-				snprintf(lun_buf, sizeof(lun_buf), "%s:%s",
-					udev_device_get_property_value(dev, "MAJOR"),
-					udev_device_get_property_value(dev, "MINOR"));
-				uid_buf = udev_device_get_property_value(dev, "ID_SERIAL");
-				FPIN_ILOG("###Attempting %s, %s\n", lun_buf, uid_buf);
-				ret = fpin_insert_sd(impacted_dev_list_head, dev_buf,
-					lun_buf, uid_buf, port_wwn);
-				if (ret < 0) {
-					FPIN_ELOG("Failed to insert %s %s to sd list\n",
-							dev_buf, lun_buf);
-				} else {
-					sd_count++;
-				}
+			dm = fpin_dm_resolve_holder(udev, dev, dm_list_head, arena);
+			if (dm == NULL) {
+				FPIN_DLOG("%s is not part of a multipath map\n", dev_buf);
+				udev_device_unref(dev);
+				continue;
 			}
+
+			snprintf(lun_buf, sizeof(lun_buf), "%s:%s",
+				udev_device_get_property_value(dev, "MAJOR"),
+				udev_device_get_property_value(dev, "MINOR"));
+			uid_buf = udev_device_get_property_value(dev, "ID_SERIAL");
+			FPIN_DLOG("###Attempting %s, %s in %s\n", lun_buf, uid_buf,
+					dm->dm_name);
+			ret = fpin_insert_sd(impacted_dev_list_head, dev_buf,
+				lun_buf, uid_buf, tgt->p_wwn, dm, arena);
+			if (ret < 0) {
+				FPIN_ELOG("Failed to insert %s %s to sd list\n",
+						dev_buf, lun_buf);
+			} else {
+				sd_count++;
+			}
+
+			udev_device_unref(dev);
 		}
 
-		udev_device_unref(dev);
+		udev_enumerate_unref(enumerate);
+		udev_device_unref(tgt_dev);
 	}
 
-	udev_enumerate_unref(enumerate);
+	return (sd_count);
+}
+
+/* Impacted remote port with its targets, in the order ports are actioned */
+struct fpin_port_work
+{
+	uint64_t wwn;
+	int nr_luns;
+	struct list_head tgt_list_head;
+};
+
+static int
+fpin_dm_lun_state_cb(const char *lun, struct fpin_sio_req *reqs, void *arg) {
+	int *luns = arg;
+
+	if ((reqs[0].ret > 0) && (strcmp(reqs[0].buf, "running") == 0))
+		(*luns)++;
+	return 0;
+}
+
+/* Counts the LUNs of a SCSI target that are in the running state */
+static int
+fpin_dm_target_luns(const char *target) {
+	static const char *const attrs[] = { "state" };
+	char dir_name[FILE_PATH_LEN], prefix[DEV_NODE_LEN];
+	int luns = 0;
+
+	/* LUNs of target<host>:<channel>:<id> are <host>:<channel>:<id>:<lun> */
+	if (strncmp(target, "target", 6) != 0)
+		return 0;
+	snprintf(dir_name, sizeof(dir_name), "bus/scsi/devices/%s", target);
+	snprintf(prefix, sizeof(prefix), "%s:", target + 6);
+	fpin_sysfs_scan_attrs(dir_name, prefix, attrs, 1, 1,
+			fpin_dm_lun_state_cb, &luns);
+	return luns;
+}
+
+/* Orders ports by descending LUN count */
+static int
+fpin_dm_port_work_cmp(const void *a, const void *b) {
+	const struct fpin_port_work *wa = a, *wb = b;
+
+	return wb->nr_luns - wa->nr_luns;
+}
+
+/*
+ * Function:
+ *	fpin_dm_stream_ports
+ *
+ * Inputs:
+ * 	1. The impacted port WWNs of the event.
+ * 	2. Pointer to the udev structure used to parse sysfs classes.
+ * 	3. Latency trace of the event being processed.
+ *
+ * Description:
+ * 	Resolves the targets of all the impacted ports in one pass, then takes
+ * 	the ports one at a time, the one with the most running LUNs first, and
+ * 	sets the paths behind a port marginal as soon as they are resolved,
+ * 	before the next port is resolved. The paths carrying the most I/O are
+ * 	drained first, instead of after the last path of the event is
+ * 	resolved. Returns the number of sd* found.
+ */
+int
+fpin_dm_stream_ports(struct wwn_list *list, struct udev *udev,
+			struct fpin_event_trace *trace) {
+	struct list_head tgt_list_head, dm_list_head, dev_list_head;
+	struct fpin_port_work *work = NULL;
+	struct targets *tgt = NULL, *next = NULL;
+	struct timespec stage_start;
+	uint32_t index = 0;
+	int ret = 0, sd_count = 0;
+
+	INIT_LIST_HEAD(&tgt_list_head);
+	INIT_LIST_HEAD(&dm_list_head);
+	fpin_trace_now(&stage_start);
+
+	/* Get Targets linked to the port on whichthe ELS frame was recieved */
+	ret = fpin_dm_populate_target(list, &tgt_list_head, udev);
+	if (ret <= 0) {
+		FPIN_ELOG("No targets found, returning ret %d\n", ret);
+		fpin_trace_stage(trace, FPIN_STAGE_RESOLVE, &stage_start);
+		return (ret);
+	}
+	fpin_dm_display_target(&tgt_list_head);
 
-	if (dm_count <= 0) {
-		if (sd_count > 0) {
-			fpin_dm_free_dev(impacted_dev_list_head);
+	work = fpin_arena_alloc(list->arena, list->nr_ports * sizeof(*work));
+	if (work == NULL) {
+		FPIN_CLOG("No memory to order %u ports\n", list->nr_ports);
+		return -ENOMEM;
+	}
+	for (index = 0; index < list->nr_ports; index++) {
+		work[index].wwn = list->ports[index].wwn;
+		work[index].nr_luns = 0;
+		INIT_LIST_HEAD(&work[index].tgt_list_head);
+	}
+	/* Targets are only inserted for WWNs of the list */
+	list_for_each_entry_safe(tgt, next, &tgt_list_head, target_head) {
+		index = fpin_els_wwn_index(list, tgt->p_wwn);
+		work[index].nr_luns += fpin_dm_target_luns(tgt->target);
+		list_move_tail(&tgt->target_head, &work[index].tgt_list_head);
+	}
+	qsort(work, list->nr_ports, sizeof(*work), fpin_dm_port_work_cmp);
+	fpin_trace_stage(trace, FPIN_STAGE_RESOLVE, &stage_start);
+
+	for (index = 0; index < list->nr_ports; index++) {
+		if (list_empty(&work[index].tgt_list_head))
+			continue;
+		FPIN_DLOG("Resolving port 0x%016llx, %d LUNs\n",
+				(unsigned long long)work[index].wwn, work[index].nr_luns);
+
+		/* Get sd to dm mapping for the targets of the port */
+		INIT_LIST_HEAD(&dev_list_head);
+		ret = fpin_populate_dm_lun(&dm_list_head, &dev_list_head, udev,
+					&work[index].tgt_list_head, list->arena);
+		fpin_trace_stage(trace, FPIN_STAGE_RESOLVE, &stage_start);
+		if (ret <= 0) {
+			FPIN_DLOG("No sd behind port 0x%016llx, ret %d\n",
+					(unsigned long long)work[index].wwn, ret);
+			continue;
 		}
-		return(dm_count);
-	} else if (sd_count <= 0) {
-		fpin_free_dm(dm_list_head);
+		fpin_display_impacted_dev_list(&dev_list_head);
+		sd_count += ret;
+
+		/* Fail the paths using multipath daemon */
+		fpin_dm_marginal_path(list, &dm_list_head, &dev_list_head, trace);
+		fpin_trace_now(&stage_start);
 	}
 
+	fpin_display_dm_list(&dm_list_head);
 	return (sd_count);
 }
+
+/*
+ * This is the marginal checker thread. It wakes up every
+ * MARGINAL_CHECKER_WAIT_TIME seconds and recovers the marginal paths that
+ * were held back by flap damping on LINKUP/RSCN, once their penalty has
+ * decayed below the reuse threshold.
+ */
+void *fpin_li_marginal_checker() {
+	struct marginal_dev_list *tmp_marg = NULL, *next = NULL;
+
+	for ( ; ; ) {
+		sleep(MARGINAL_CHECKER_WAIT_TIME);
+
+		pthread_mutex_lock(&fpin_li_marginal_dev_mutex);
+		list_for_each_entry_safe(tmp_marg, next,
+				&fpin_li_marginal_dev_list_head, marginal_dev_list_head) {
+			if (!fpin_damp_reusable(tmp_marg->host_num, tmp_marg->dev_name))
+				continue;
+			FPIN_ILOG("Recovering damped path %s host_num %u\n",
+					tmp_marg->dev_name, tmp_marg->host_num);
+			if (fpin_unset_marginal_entry(tmp_marg) < 0)
+				continue;
+			list_del(&tmp_marg->marginal_dev_list_head);
+			fpin_pool_put(&fpin_marginal_pool, tmp_marg);
+		}
+		pthread_mutex_unlock(&fpin_li_marginal_dev_mutex);
+
+		fpin_damp_expire();
+	}
+	return NULL;
+}
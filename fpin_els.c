@@ -18,12 +18,279 @@
  *      Muneendra Kumar <muneendra.kumar@broadcom.com>
  */
 
+#define FPIN_LOG_SUBSYS	FPIN_LOG_ELS
+#include <stdlib.h>
 #include "fpin.h"
 
 
 pthread_cond_t fpin_li_cond = PTHREAD_COND_INITIALIZER;
 pthread_mutex_t fpin_li_mutex = PTHREAD_MUTEX_INITIALIZER;
 extern struct list_head    els_marginal_list_head;
+struct fpin_pool fpin_frame_pool =
+	FPIN_POOL_INITIALIZER("frame", struct els_marginal_list);
+
+/* LINKUP/RSCN recovery jobs, see fpin_els_recovery_consumer */
+static struct list_head fpin_recovery_list_head =
+			LIST_HEAD_INIT(fpin_recovery_list_head);
+static pthread_cond_t fpin_recovery_cond = PTHREAD_COND_INITIALIZER;
+static pthread_mutex_t fpin_recovery_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct fpin_pool fpin_recovery_pool =
+	FPIN_POOL_INITIALIZER("recovery", struct fpin_recovery_job);
+static struct fpin_recovery_stats {
+	uint64_t queued;
+	uint64_t coalesced;
+	uint64_t completed;
+	uint32_t depth;
+	uint32_t max_depth;
+	uint64_t max_run_ns;
+	uint64_t paths_recovered;
+	uint64_t rscn_paths_skipped;
+} fpin_recovery_stats;
+
+/*
+ * The LI queue is bounded, so a storm cannot grow the daemon. When it is
+ * full the receiver applies the -L overflow policies in order to make room
+ * for the new frame; a frame none of them has room for is dropped. All of
+ * it is under fpin_li_mutex.
+ */
+uint32_t fpin_li_queue_capacity = FPIN_DEF_LI_QUEUE;
+static enum fpin_li_overflow fpin_li_overflow_order[FPIN_LI_OVERFLOW_MAX] = {
+	FPIN_LI_COALESCE, FPIN_LI_DROP_OLDEST, FPIN_LI_DROP_LOW
+};
+static int fpin_li_nr_overflow = FPIN_LI_OVERFLOW_MAX;
+static const char *fpin_li_overflow_names[FPIN_LI_OVERFLOW_MAX] = {
+	[FPIN_LI_COALESCE]		= "coalesce",
+	[FPIN_LI_DROP_OLDEST]	= "drop-oldest",
+	[FPIN_LI_DROP_LOW]		= "drop-low",
+};
+static struct fpin_li_queue_stats {
+	uint32_t depth;
+	uint32_t max_depth;
+	uint64_t queued;
+	uint64_t coalesced;
+	uint64_t evicted_oldest;
+	uint64_t dropped_low;
+	uint64_t evicted_low;
+	uint64_t dropped_full;
+	int full;				/* Logged once until the queue drains */
+} fpin_li_queue_stats;
+
+/* Arena of the LI consumer, reset after every event */
+static struct fpin_arena fpin_li_arena;
+/* udev context of the LI consumer, kept for the life of the thread */
+static struct udev *fpin_li_udev;
+static uint64_t fpin_li_events;
+static uint64_t fpin_li_malformed;
+
+/*
+ * Fills in what the overflow policies match a received frame on. Link
+ * failure and loss of sync or signal take the link down, the error count,
+ * unknown and device specific events are low severity, and so is a frame
+ * without a Link Integrity descriptor. The policy file is not consulted,
+ * its after=N state belongs to the consumer.
+ */
+static void
+fpin_els_li_key(fpin_payload_t *fpin_payload, struct fpin_li_key *key) {
+	fpin_link_integrity_request_els_t *fpin_req = NULL;
+	fpin_link_integrity_notification_t *li = NULL;
+
+	memset(key, 0, sizeof(*key));
+	key->host_num = fpin_payload->host_num;
+	key->low = 1;
+	if (fpin_payload->length < sizeof(fpin_link_integrity_request_els_t))
+		return;
+	fpin_req = (fpin_link_integrity_request_els_t *)fpin_payload->payload;
+	if ((fpin_req->els_header.cmd != ELS_CMD_FPIN) ||
+		(ntohl(fpin_req->linkIntegrityDesc.header.tag) !=
+			eFPIN_NOTIFICATION_DESCRIPTOR_LINK_INTEGRITY_TAG))
+		return;
+
+	li = &fpin_req->linkIntegrityDesc;
+	key->is_li = 1;
+	key->event_type = ntohs(li->event_type);
+	key->attached_wwn = fpin_wwn_to_u64(&li->attached_port_wwn);
+	key->detecting_wwn = fpin_wwn_to_u64(&li->detecting_port_wwn);
+	switch (key->event_type) {
+	case FPIN_LINK_INTEGRITY_EVENT_TYPE_LINK_FAILURE:
+	case FPIN_LINK_INTEGRITY_EVENT_TYPE_LOSS_OF_SYNC:
+	case FPIN_LINK_INTEGRITY_EVENT_TYPE_LOSS_OF_SIGNAL:
+		key->low = 0;
+		break;
+	default:
+		break;
+	}
+}
+
+/* Number of WWNs of an LI frame, or -1 if it claims more than it carries */
+static int
+fpin_els_li_nr_ports(fpin_link_integrity_request_els_t *fpin_req,
+			uint16_t length) {
+	uint32_t count = ntohl(fpin_req->linkIntegrityDesc.port_list.count);
+
+	if (count > (length - sizeof(*fpin_req)) / sizeof(wwn_t))
+		return -1;
+	return count;
+}
+
+/*
+ * Function:
+ *	fpin_els_li_merge
+ *
+ * Inputs:
+ *	1. The queued frame of the same notification.
+ *	2. The frame received while the LI queue is full.
+ *
+ * Description:
+ *	Called with fpin_li_mutex held. The queued frame takes the event
+ *	fields of the new one, and its port list becomes the union of both, so
+ *	no impacted port of either frame is lost. Returns 0, or -ENOSPC if the
+ *	union does not fit in a frame and -EBADMSG if a port list is longer
+ *	than its frame, leaving the queued frame as it was.
+ */
+static int
+fpin_els_li_merge(struct els_marginal_list *same,
+			fpin_payload_t *fpin_payload) {
+	fpin_link_integrity_request_els_t *old_req =
+		(fpin_link_integrity_request_els_t *)same->payload;
+	fpin_link_integrity_request_els_t *new_req =
+		(fpin_link_integrity_request_els_t *)fpin_payload->payload;
+	wwn_t *old_ports = old_req->linkIntegrityDesc.port_list.port_name_list;
+	wwn_t *new_ports = new_req->linkIntegrityDesc.port_list.port_name_list;
+	wwn_t merged[(FC_PAYLOAD_MAXLEN - sizeof(*old_req)) / sizeof(wwn_t)];
+	int nr_old = 0, nr_new = 0, nr = 0, i = 0, j = 0;
+	uint32_t grown = 0;
+
+	nr_old = fpin_els_li_nr_ports(old_req, same->length);
+	nr_new = fpin_els_li_nr_ports(new_req, fpin_payload->length);
+	if ((nr_old < 0) || (nr_new < 0))
+		return -EBADMSG;
+
+	/* The new ports first, then the queued ones it does not list */
+	memcpy(merged, new_ports, nr_new * sizeof(wwn_t));
+	nr = nr_new;
+	for (i = 0; i < nr_old; i++) {
+		for (j = 0; j < nr_new; j++) {
+			if (memcmp(&old_ports[i], &new_ports[j], sizeof(wwn_t)) == 0)
+				break;
+		}
+		if (j < nr_new)
+			continue;
+		if (nr == (int)(sizeof(merged) / sizeof(merged[0])))
+			return -ENOSPC;
+		merged[nr++] = old_ports[i];
+	}
+
+	/* The ELS and descriptor lengths grow by the ports taken over */
+	grown = (nr - nr_new) * sizeof(wwn_t);
+	memcpy(same->payload, fpin_payload->payload, sizeof(*new_req));
+	old_req->els_header.length =
+		htonl(ntohl(old_req->els_header.length) + grown);
+	old_req->linkIntegrityDesc.header.length =
+		htonl(ntohl(old_req->linkIntegrityDesc.header.length) + grown);
+	old_req->linkIntegrityDesc.port_list.count = htonl(nr);
+	memcpy(old_ports, merged, nr * sizeof(wwn_t));
+	same->length = sizeof(*old_req) + nr * sizeof(wwn_t);
+	same->event_num = fpin_payload->event_num;
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_els_li_overflow
+ *
+ * Inputs:
+ *	1. The frame received while the LI queue is full.
+ *	2. Its key.
+ *	3. Set to the queued frame evicted to make room, if any.
+ *
+ * Description:
+ *	Called with fpin_li_mutex held. Applies the overflow policies in the
+ *	-L order until one of them handles the frame:
+ *		coalesce:    a queued frame of the same notification, i.e. host,
+ *		             event type, attached and detecting port, is merged
+ *		             with the new one, see fpin_els_li_merge. It keeps
+ *		             its place and receive time, so the latency includes
+ *		             the wait.
+ *		drop-oldest: the oldest queued frame of the same attached port,
+ *		             unless it is more severe than the new one, is evicted.
+ *		drop-low:    a low severity frame is dropped, otherwise the oldest
+ *		             queued low severity frame is evicted.
+ *	The evicted frame is reused for the new one, so the queue stays at its
+ *	capacity. Returns 0, or -ENOBUFS if no policy made room and the frame
+ *	is dropped.
+ */
+static int
+fpin_els_li_overflow(fpin_payload_t *fpin_payload, struct fpin_li_key *key,
+			struct els_marginal_list **evicted) {
+	struct els_marginal_list *els_mrg = NULL, *same = NULL, *port = NULL;
+	struct els_marginal_list *low = NULL;
+	uint32_t into = 0;
+	int i = 0;
+
+	if (!fpin_li_queue_stats.full) {
+		FPIN_ELOG("LI queue full at %u frames\n", fpin_li_queue_capacity);
+		fpin_li_queue_stats.full = 1;
+	}
+
+	list_for_each_entry(els_mrg, &els_marginal_list_head, els_frame) {
+		if (els_mrg->key.low && (low == NULL))
+			low = els_mrg;
+		if (!key->is_li || !els_mrg->key.is_li ||
+			(els_mrg->key.host_num != key->host_num) ||
+			(els_mrg->key.attached_wwn != key->attached_wwn))
+			continue;
+		if ((same == NULL) && (els_mrg->key.event_type == key->event_type) &&
+			(els_mrg->key.detecting_wwn == key->detecting_wwn))
+			same = els_mrg;
+		if ((port == NULL) && (els_mrg->key.low >= key->low))
+			port = els_mrg;
+	}
+
+	*evicted = NULL;
+	for (i = 0; i < fpin_li_nr_overflow; i++) {
+		switch (fpin_li_overflow_order[i]) {
+		case FPIN_LI_COALESCE:
+			if (same == NULL)
+				break;
+			into = same->event_num;
+			if (fpin_els_li_merge(same, fpin_payload) < 0)
+				break;
+			FPIN_DLOG("LI event %u coalesced into event %u\n",
+					fpin_payload->event_num, into);
+			fpin_li_queue_stats.coalesced++;
+			return 0;
+		case FPIN_LI_DROP_OLDEST:
+			if (port == NULL)
+				break;
+			*evicted = port;
+			fpin_li_queue_stats.evicted_oldest++;
+			break;
+		case FPIN_LI_DROP_LOW:
+			if (key->low) {
+				FPIN_DLOG("Low severity LI event %u dropped\n",
+						fpin_payload->event_num);
+				fpin_li_queue_stats.dropped_low++;
+				return 0;
+			}
+			if (low == NULL)
+				break;
+			*evicted = low;
+			fpin_li_queue_stats.evicted_low++;
+			break;
+		default:
+			break;
+		}
+		if (*evicted != NULL) {
+			FPIN_DLOG("LI event %u evicted for event %u\n",
+					(*evicted)->event_num, fpin_payload->event_num);
+			list_del(&(*evicted)->els_frame);
+			return 0;
+		}
+	}
+
+	fpin_li_queue_stats.dropped_full++;
+	return -ENOBUFS;
+}
 
 /*
  * Function:
@@ -35,59 +302,152 @@ extern struct list_head    els_marginal_list_head;
  * Description:
  * 	On Receiving the frame from HBA driver, insert the frame into link
  * 	integrity frame list which will be picked up later by consumer thread for
- * 	processing.
+ * 	processing. If the list is at its capacity, the overflow policies decide
+ * 	what happens to the frame, see fpin_els_li_overflow.
  */
 int
 fpin_els_add_li_frame(fpin_payload_t *fpin_payload) {
 	struct els_marginal_list *els_mrg = NULL;
-	els_mrg = malloc(sizeof(struct els_marginal_list));
-	if (els_mrg != NULL) {
-		els_mrg->host_num = fpin_payload->host_num;
-		memcpy(els_mrg->payload, fpin_payload->payload, FC_PAYLOAD_MAXLEN);
-		pthread_mutex_lock(&fpin_li_mutex);
-		list_add_tail(&els_mrg->els_frame, &els_marginal_list_head);
-		pthread_mutex_unlock(&fpin_li_mutex);
-		pthread_cond_signal(&fpin_li_cond);
+	struct fpin_li_key key;
+	int ret = 0;
+
+	fpin_els_li_key(fpin_payload, &key);
+	pthread_mutex_lock(&fpin_li_mutex);
+	if (fpin_li_queue_stats.depth >= fpin_li_queue_capacity) {
+		ret = fpin_els_li_overflow(fpin_payload, &key, &els_mrg);
+		if (els_mrg == NULL) {
+			pthread_mutex_unlock(&fpin_li_mutex);
+			return ret;
+		}
 	} else {
-		FPIN_CLOG("NO Memory to add frame payload\n");
-		return (-ENOMEM);
+		els_mrg = fpin_pool_get(&fpin_frame_pool);
+		if (els_mrg == NULL) {
+			pthread_mutex_unlock(&fpin_li_mutex);
+			FPIN_CLOG("NO Memory to add frame payload\n");
+			return (-ENOMEM);
+		}
+		if (++fpin_li_queue_stats.depth > fpin_li_queue_stats.max_depth)
+			fpin_li_queue_stats.max_depth = fpin_li_queue_stats.depth;
 	}
 
+	els_mrg->host_num = fpin_payload->host_num;
+	els_mrg->event_num = fpin_payload->event_num;
+	els_mrg->rx_ts = fpin_payload->rx_ts;
+	els_mrg->length = fpin_payload->length;
+	els_mrg->key = key;
+	memcpy(els_mrg->payload, fpin_payload->payload, els_mrg->length);
+	list_add_tail(&els_mrg->els_frame, &els_marginal_list_head);
+	fpin_li_queue_stats.queued++;
+	pthread_mutex_unlock(&fpin_li_mutex);
+	pthread_cond_signal(&fpin_li_cond);
+
 	return (0);
 }
 
+/* Parses -L capacity[:policy,...], none for no overflow policy */
+int
+fpin_els_parse_queue(const char *arg) {
+	enum fpin_li_overflow order[FPIN_LI_OVERFLOW_MAX];
+	unsigned long capacity = 0;
+	const char *name = NULL;
+	char *end = NULL;
+	size_t len = 0;
+	int nr = 0, i = 0, j = 0;
+
+	capacity = strtoul(arg, &end, 0);
+	if ((end == arg) || (capacity == 0) || (capacity > FPIN_MAX_LI_QUEUE))
+		return -EINVAL;
+	if (*end == '\0') {
+		fpin_li_queue_capacity = capacity;
+		return 0;
+	}
+	if (*end != ':')
+		return -EINVAL;
+
+	name = end + 1;
+	if (strcmp(name, "none") != 0) {
+		for ( ; ; ) {
+			len = strcspn(name, ",");
+			for (i = 0; i < FPIN_LI_OVERFLOW_MAX; i++) {
+				if ((strlen(fpin_li_overflow_names[i]) == len) &&
+					(strncmp(name, fpin_li_overflow_names[i], len) == 0))
+					break;
+			}
+			if (i == FPIN_LI_OVERFLOW_MAX)
+				return -EINVAL;
+			for (j = 0; j < nr; j++) {
+				if (order[j] == (enum fpin_li_overflow)i)
+					return -EINVAL;
+			}
+			order[nr++] = i;
+			if (name[len] == '\0')
+				break;
+			name += len + 1;
+		}
+	}
+
+	fpin_li_queue_capacity = capacity;
+	memcpy(fpin_li_overflow_order, order, nr * sizeof(order[0]));
+	fpin_li_nr_overflow = nr;
+	return 0;
+}
+
+/*
+ * Returns the index of the first impacted port whose WWN is not below wwn,
+ * nr_ports if there is none.
+ */
+uint32_t
+fpin_els_wwn_index(struct wwn_list *list, uint64_t wwn) {
+	uint32_t low = 0, high = list->nr_ports, mid = 0;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (list->ports[mid].wwn < wwn)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	return low;
+}
+
 /*
  * Function:
  * 	fpin_els_insert_port_wwn
  *
  * Input:
  * 	struct wwn_list *list	: List containing impacted WWNs.
- * 	port_wwn_buf			: The WWN to be inserted into above list.
+ * 	wwn						: The WWN to be inserted into above list.
+ * 	action					: The policy action for the WWN.
+ * 	confirm					: The corroboration the action waits for.
  *
  * Description:
  * 	This function inserts the Port WWN retrieved from FPIN ELS frame, recieved
  * 	from HBA driver. These WWNs are later used to find sd* and dm-* details.
+ * 	The list is kept sorted, a WWN listed twice is inserted once.
  */
 
 int
-fpin_els_insert_port_wwn(struct wwn_list *list, char *port_wwn_buf)
+fpin_els_insert_port_wwn(struct wwn_list *list, uint64_t wwn,
+			enum fpin_policy_action action, const struct fpin_confirm *confirm)
 {
-	struct impacted_port_wwns *new_wwn = NULL;
-	FPIN_ILOG("Inserting %s...\n", port_wwn_buf);
+	uint32_t index = 0;
 
-	 /* Create a node */
-	new_wwn = (struct impacted_port_wwns *)malloc(sizeof(struct impacted_port_wwns));
-	if (new_wwn == NULL) {
-		FPIN_CLOG("No memory to assign pwwn %s\n", port_wwn_buf);
+	FPIN_DLOG("Inserting 0x%016llx...\n", (unsigned long long)wwn);
+	index = fpin_els_wwn_index(list, wwn);
+	if ((index < list->nr_ports) && (list->ports[index].wwn == wwn))
+		return (0);
+	if (list->nr_ports == list->max_ports) {
+		FPIN_CLOG("No room to assign pwwn 0x%016llx\n",
+				(unsigned long long)wwn);
 		return -ENOMEM;
 	}
 
-	memset(new_wwn->impacted_port_wwn, '\0', sizeof(new_wwn->impacted_port_wwn));
-	snprintf(new_wwn->impacted_port_wwn, sizeof(new_wwn->impacted_port_wwn),
-				"%s", port_wwn_buf);
-	FPIN_ILOG(" Assigned  %s to new node\n", new_wwn->impacted_port_wwn);
-	list_add_tail(&(new_wwn->impacted_port_wwn_head),
-		&(list->impacted_ports_wwn_head));
+	memmove(&list->ports[index + 1], &list->ports[index],
+			(list->nr_ports - index) * sizeof(list->ports[0]));
+	list->ports[index].wwn = wwn;
+	list->ports[index].action = action;
+	list->ports[index].confirm = *confirm;
+	list->nr_ports++;
 
 	return (0);
 }
@@ -98,7 +458,7 @@ fpin_els_insert_port_wwn(struct wwn_list *list, char *port_wwn_buf)
  *
  * Input:
  * 	struct wwn_list *list	: List containing impacted WWNs.
- * 	port_wwn_buf			: The WWN to be searched in the above list.
+ * 	wwn						: The WWN to be searched in the above list.
  *
  * Description:
  * 	This function searches the impacted WWN list for the WWN passed in
@@ -106,61 +466,48 @@ fpin_els_insert_port_wwn(struct wwn_list *list, char *port_wwn_buf)
  */
 
 int
-fpin_els_wwn_exists(struct wwn_list *list, const char *port_wwn_buf) {
-	struct impacted_port_wwns *temp = NULL;
+fpin_els_wwn_exists(struct wwn_list *list, uint64_t wwn) {
+	uint32_t index = fpin_els_wwn_index(list, wwn);
 
-	if (list_empty(&(list->impacted_ports_wwn_head))) {
-        	FPIN_ELOG("List is empty, %s not found\n", port_wwn_buf);
-	} else {
-		list_for_each_entry(temp, &(list->impacted_ports_wwn_head),
-								impacted_port_wwn_head) {
-			FPIN_DLOG("Checking for %s and %s\n", temp->impacted_port_wwn,
-						port_wwn_buf);
-			if (strncmp(temp->impacted_port_wwn, port_wwn_buf,
-						strlen(port_wwn_buf)) == 0) {
-				FPIN_ILOG("breaking for %s %s\n", temp->impacted_port_wwn,
-						port_wwn_buf);
-				return (1);
-			}
-		}
-	}
+	return ((index < list->nr_ports) && (list->ports[index].wwn == wwn));
+}
 
-	return (0);
+/* Returns the policy action of an impacted WWN, FPIN_ACT_IGNORE if absent */
+enum fpin_policy_action
+fpin_els_wwn_action(struct wwn_list *list, uint64_t wwn) {
+	uint32_t index = fpin_els_wwn_index(list, wwn);
+
+	if ((index < list->nr_ports) && (list->ports[index].wwn == wwn))
+		return list->ports[index].action;
+
+	return FPIN_ACT_IGNORE;
 }
 
-void
-fpin_els_display_wwn(struct wwn_list *list) {
-	struct impacted_port_wwns *temp = NULL;
+/* Returns the corroboration the action of the WWN waits for, or NULL */
+const struct fpin_confirm *
+fpin_els_wwn_confirm(struct wwn_list *list, uint64_t wwn) {
+	uint32_t index = fpin_els_wwn_index(list, wwn);
 
-	if (list_empty(&(list->impacted_ports_wwn_head))) {
-		FPIN_ELOG("WWN List is empty\n");
-	} else {
-		list_for_each_entry(temp, &(list->impacted_ports_wwn_head),
-				impacted_port_wwn_head)
-			FPIN_ILOG("WWN Imapcted is %s\n", temp->impacted_port_wwn);
-	}
+	if ((index < list->nr_ports) && (list->ports[index].wwn == wwn) &&
+		(list->ports[index].confirm.window_s != 0))
+		return &list->ports[index].confirm;
 
-	FPIN_ILOG("Host num recvd is %d\n", list->host_num);
+	return NULL;
 }
 
 void
-fpin_els_free_wwn_list(struct wwn_list *list) {
-	struct list_head *current_node = NULL;
-	struct list_head *temp = NULL;
-	struct impacted_port_wwns *temp_node = NULL;
+fpin_els_display_wwn(struct wwn_list *list) {
+	uint32_t iter = 0;
 
-	if (list_empty(&(list->impacted_ports_wwn_head))) {
+	if (list->nr_ports == 0) {
 		FPIN_ELOG("WWN List is empty\n");
 	} else {
-		list_for_each_safe(current_node, temp,
-			&(list->impacted_ports_wwn_head)) {
-			temp_node = list_entry(current_node, struct impacted_port_wwns,
-							impacted_port_wwn_head);
-			FPIN_DLOG("Free WWN %s\n", temp_node->impacted_port_wwn);
-			list_del(current_node);
-			free(temp_node);
-		}
+		for (iter = 0; iter < list->nr_ports; iter++)
+			FPIN_DLOG("WWN Imapcted is 0x%016llx\n",
+				(unsigned long long)list->ports[iter].wwn);
 	}
+
+	FPIN_ILOG("Host num recvd is %d\n", list->host_num);
 }
 
 
@@ -172,83 +519,273 @@ fpin_els_free_wwn_list(struct wwn_list *list) {
  *	host_num: The Host# of HBA port, where the ELS was received.
  *	L.I Notification Struct	: The Link Integrity struct with impacted WWN list.
  * 	struct wwn_list *list	: The list to be populated with impacted WWN.
+ * 	policy					: The Link Integrity policy of the event.
  *
  * Description:
  * 	This function reads though the FPIN ELS recieved from HBA driver, to get and
  * 	populate the impacted WWN list. This list is used to find and fail the
- * 	impacted paths if an alternate path for the same device exists.
+ * 	impacted paths if an alternate path for the same device exists. WWNs
+ * 	the policy ignores or only counts are left out of the list, unless the
+ * 	health score of a counted WWN finds it degrading, as are the WWNs not
+ * 	behind the faulty link of a target-link fault.
  */
 
 int
 fpin_els_extract_wwn(uint16_t host_num, fpin_link_integrity_notification_t *li,
-						struct wwn_list *list) {
-	char  port_wwn_buf[WWN_LEN];
+						struct wwn_list *list, struct fpin_policy *policy) {
 	wwn_t *currentPortListOffset_p = NULL;
+	enum fpin_policy_action action;
+	enum fpin_fault_class fault;
+	struct fpin_confirm confirm;
 	uint32_t wwn_count = 0;
-	int iter = 0, count = 0;
+	uint16_t event_type = ntohs(li->event_type);
+	uint64_t wwn = 0, target_wwn = 0;
+	int iter = 0, degrading = 0;
 
 	/* Update the wwn to list */
 	wwn_count = ntohl(li->port_list.count);
 	FPIN_DLOG("Got wwn count as %d\n", wwn_count);
 	list->host_num = host_num;
 
+	fault = fpin_corr_classify(host_num, li, &target_wwn);
+	fpin_feed_li_event(host_num, list->event_num, li, fault);
+
+	/* The count is bounded by the frame, see fpin_els_decode_li */
+	list->ports = fpin_arena_alloc(list->arena,
+				wwn_count * sizeof(struct impacted_port_wwns));
+	if ((list->ports == NULL) && (wwn_count != 0)) {
+		FPIN_CLOG("No memory for %u impacted WWNs\n", wwn_count);
+		return -ENOMEM;
+	}
+	list->nr_ports = 0;
+	list->max_ports = wwn_count;
+
 	currentPortListOffset_p = (wwn_t *)&(li->port_list.port_name_list);
 	for (iter = 0; iter < wwn_count; iter++) {
-		memset(port_wwn_buf, '\0', WWN_LEN);
 		/*
 		 * This data is read from FC frame, which has a mixture of
 		 * both 32 and 64 bit data. Using wwn_t as 64-bit is causing
 		 * an offset of 32 bits when used with be64toh. Hence, using
 		 * wwn_t as two 32-bit words and using ntohl instead.
 		 */
-		snprintf(port_wwn_buf, WWN_LEN, "0x%08x%08x", 
-			ntohl(currentPortListOffset_p->words[0]),
-			ntohl(currentPortListOffset_p->words[1]));
-		if (fpin_els_insert_port_wwn(list, port_wwn_buf) < 0) {
+		wwn = fpin_wwn_to_u64(currentPortListOffset_p);
+		currentPortListOffset_p++;
+		fpin_hist_record(host_num, wwn, event_type);
+
+		/* Only the target on the faulty link is affected */
+		if ((fault == FPIN_FAULT_TARGET_LINK) && (wwn != target_wwn)) {
+			FPIN_DLOG("0x%016llx not on the faulty %s\n",
+					(unsigned long long)wwn, fpin_corr_fault_name(fault));
+			continue;
+		}
+
+		degrading = fpin_health_li_event(host_num, wwn, event_type);
+		action = fpin_policy_lookup(policy, event_type, host_num, wwn,
+					&confirm);
+		if (degrading && (action == FPIN_ACT_COUNT)) {
+			FPIN_ILOG("policy: count 0x%016llx, degrading, set marginal\n",
+					(unsigned long long)wwn);
+			action = FPIN_ACT_MARGINAL;
+			memset(&confirm, 0, sizeof(confirm));
+		}
+		if (action < FPIN_ACT_MARGINAL) {
+			FPIN_DLOG("policy: %s 0x%016llx\n",
+					fpin_policy_action_name(action), (unsigned long long)wwn);
+			continue;
+		}
+		if (fpin_els_insert_port_wwn(list, wwn, action, &confirm) < 0) {
 			/* 
 			 * No point in adding more as we are out of memory, return
 			 * the count of devices already added.
 			 */
-			return (count);
+			return (list->nr_ports);
 		}
-
-		currentPortListOffset_p++;
-		count++;
 	}
 
 	fpin_els_display_wwn(list);
-	return (count);
+	return (list->nr_ports);
 }
 
 /*
  * Function:
- *	fpin_process_els_frame
+ *	fpin_els_decode_li
  *
  * Inputs:
- * 	1. The WWN of the HBA on which the ELS frame was received.
- *	2. The ELS frame to be processed. Could be FPIN frame or any other ELS frame
- *	in the future.
+ *	1. The FPIN ELS frame.
+ *	2. Number of bytes of the frame received from the HBA driver.
  *
  * Description:
- *	This function process the ELS frame recieved from HBA driver,
- *	and fails the impacted paths if an alternate path exists. This function
- *	does the following:
- *		1. Extarct the impacted device WWNs from the FPIN ELS frame.
- *		2. Get the target IDs of the devices from the WWNs extracted.
- *		3. Translate the target IDs into corresponding sd* and dm-*.
- *		4. Fail the sd* using multipath daemon, provided alternate paths exist.
- *		5. Free the resources allocated.
+ *	Returns the Link Integrity descriptor of the frame, or NULL if the
+ *	frame is too short for it or for the port list it announces. The count
+ *	comes from the fabric, it must not make the decode read beyond the
+ *	received bytes.
+ */
+static fpin_link_integrity_notification_t *
+fpin_els_decode_li(char *fc_payload, uint32_t len) {
+	fpin_link_integrity_request_els_t *fpin_req = NULL;
+	uint32_t wwn_count = 0, max_count = 0;
+
+	if (len < sizeof(fpin_link_integrity_request_els_t)) {
+		FPIN_ELOG("LI frame too short, %u bytes\n", len);
+		return NULL;
+	}
+
+	fpin_req = (fpin_link_integrity_request_els_t *)fc_payload;
+	wwn_count = ntohl(fpin_req->linkIntegrityDesc.port_list.count);
+	max_count = (len - sizeof(fpin_link_integrity_request_els_t)) /
+			sizeof(wwn_t);
+	if (wwn_count > max_count) {
+		FPIN_ELOG("LI port list of %u WWNs exceeds the %u in the %u byte"
+			" frame\n", wwn_count, max_count, len);
+		return NULL;
+	}
+	return &(fpin_req->linkIntegrityDesc);
+}
+
+/*
+ * Function:
+ *	fpin_els_decode_cn
+ *
+ * Inputs:
+ *	1. The FPIN ELS frame.
+ *	2. Number of bytes of the frame received from the HBA driver.
+ *
+ * Description:
+ *	Returns the Peer Congestion descriptor of the frame, or NULL if the
+ *	frame is too short for it or for its port list, see fpin_els_decode_li.
+ */
+static fpin_congestion_notification_t *
+fpin_els_decode_cn(char *fc_payload, uint32_t len) {
+	fpin_congestion_request_els_t *fpin_req = NULL;
+	uint32_t wwn_count = 0, max_count = 0;
+
+	if (len < sizeof(fpin_congestion_request_els_t)) {
+		FPIN_ELOG("Congestion frame too short, %u bytes\n", len);
+		return NULL;
+	}
+
+	fpin_req = (fpin_congestion_request_els_t *)fc_payload;
+	wwn_count = ntohl(fpin_req->congestionDesc.port_list.count);
+	max_count = (len - sizeof(fpin_congestion_request_els_t)) /
+			sizeof(wwn_t);
+	if (wwn_count > max_count) {
+		FPIN_ELOG("Congestion port list of %u WWNs exceeds the %u in the %u"
+			" byte frame\n", wwn_count, max_count, len);
+		return NULL;
+	}
+	return &(fpin_req->congestionDesc);
+}
+
+/*
+ * Function:
+ *	fpin_els_extract_cn_wwn
+ *
+ * Inputs:
+ *	1. Host number the frame was received on.
+ *	2. The Peer Congestion descriptor.
+ *	3. The list to be populated with the impacted WWNs.
+ *
+ * Description:
+ *	Congestion is not a reason to leave a path by itself, the policy only
+ *	covers LI events. Every impacted port is scored, and only the ports the
+ *	score finds degrading are added to the list, to be set marginal.
+ *	Returns the number of WWNs added, or -ENOMEM.
+ */
+static int
+fpin_els_extract_cn_wwn(uint16_t host_num, fpin_congestion_notification_t *cn,
+			struct wwn_list *list) {
+	wwn_t *port_name = (wwn_t *)&(cn->port_list.port_name_list);
+	struct fpin_confirm confirm;
+	uint32_t wwn_count = ntohl(cn->port_list.count), iter = 0;
+	uint16_t event_type = ntohs(cn->event_type);
+	uint64_t wwn = 0;
+
+	memset(&confirm, 0, sizeof(confirm));
+	list->host_num = host_num;
+	fpin_feed_cn_event(host_num, list->event_num, cn);
+
+	list->ports = fpin_arena_alloc(list->arena,
+				wwn_count * sizeof(struct impacted_port_wwns));
+	if ((list->ports == NULL) && (wwn_count != 0)) {
+		FPIN_CLOG("No memory for %u impacted WWNs\n", wwn_count);
+		return -ENOMEM;
+	}
+	list->nr_ports = 0;
+	list->max_ports = wwn_count;
+
+	for (iter = 0; iter < wwn_count; iter++, port_name++) {
+		wwn = fpin_wwn_to_u64(port_name);
+		if (!fpin_health_cn_event(host_num, wwn, event_type))
+			continue;
+		if (fpin_els_insert_port_wwn(list, wwn, FPIN_ACT_MARGINAL,
+				&confirm) < 0)
+			break;
+	}
+	return (list->nr_ports);
+}
+
+/*
+ * Resolves the paths to the impacted ports of the list and plans their
+ * actions. Returns the number of paths acted on, or <= 0 if none.
+ */
+static int
+fpin_els_act_ports(struct wwn_list *list, struct fpin_event_trace *trace,
+			struct timespec *stage_start) {
+	int count = 0, nvme_count = 0;
+
+	fpin_trace_stage(trace, FPIN_STAGE_RESOLVE, stage_start);
+
+	/* NVMe/FC controllers behind the impacted ports */
+	nvme_count = fpin_nvme_marginal_path(list, trace);
+
+	/* Resolve and set marginal the paths port by port */
+	if (fpin_li_udev == NULL)
+		fpin_li_udev = udev_new();
+	if (!fpin_li_udev) {
+		FPIN_ELOG("Can't create udev\n");
+		return(nvme_count ? nvme_count : -1);
+	}
+	count = fpin_dm_stream_ports(list, fpin_li_udev, trace);
+	if (count <= 0) {
+		FPIN_ELOG("Could not find any sd to fail =%d\n", count);
+		return(nvme_count ? nvme_count : count);
+	}
+	return (count + nvme_count);
+}
+
+/*
+ * Function:
+ *	fpin_els_decode_frame
+ *
+ * Inputs:
+ *	1. Host number the frame was received on.
+ *	2. The ELS frame as received from the HBA driver.
+ *	3. Number of valid bytes in the frame.
+ *	4. The list to be populated with the impacted WWNs. The caller sets its
+ *	   arena and event number.
+ *	5. The Link Integrity policy the event is handled with.
+ *
+ * Description:
+ *	Decodes the FPIN descriptor of the frame and fills the list with the
+ *	impacted WWNs to act on. Everything the fabric sent is checked against
+ *	the received length here, before the actuation stages see it. Returns
+ *	the number of WWNs in the list, 0 if there is nothing to act on, or
+ *	-EBADMSG for a malformed frame.
  */
 int
-fpin_process_els_frame(uint16_t host_num, char *fc_payload) {
-	struct list_head dm_list_head, impacted_dev_list_head;
-	struct udev *udev = NULL;
+fpin_els_decode_frame(uint16_t host_num, char *fc_payload, uint32_t len,
+			struct wwn_list *list, struct fpin_policy *policy) {
 	fpin_link_integrity_request_els_t *fpin_req = NULL;
 	fpin_link_integrity_notification_t *li = NULL;
+	fpin_congestion_notification_t *cn = NULL;
 	uint32_t els_cmd = 0;
-	struct wwn_list list_of_wwn;
-	int count = -1;
+	int count = 0;
 
+	if (len < sizeof(fpin_els_header_t) + sizeof(fpin_descriptor_header_t)) {
+		FPIN_ELOG("ELS frame too short, %u bytes\n", len);
+		fpin_li_malformed++;
+		return -EBADMSG;
+	}
 	els_cmd = *(uint32_t *)fc_payload;
 	FPIN_ILOG("Got CMD while processing as 0x%x\n", els_cmd);
 	switch(els_cmd) {
@@ -257,53 +794,30 @@ fpin_process_els_frame(uint16_t host_num, char *fc_payload) {
 		/*Check the type of fpin by checking the tag info*/
 		switch(ntohl(fpin_req->linkIntegrityDesc.header.tag)) {
 		case eFPIN_NOTIFICATION_DESCRIPTOR_LINK_INTEGRITY_TAG:
-			INIT_LIST_HEAD(&list_of_wwn.impacted_ports_wwn_head);
+			li = fpin_els_decode_li(fc_payload, len);
+			if (li == NULL) {
+				fpin_li_malformed++;
+				return -EBADMSG;
+			}
+			FPIN_ILOG("LI event type 0x%x modifier 0x%x threshold %u"
+				" count %u\n", ntohs(li->event_type),
+				ntohs(li->event_modifier), ntohl(li->event_threshold),
+				ntohl(li->event_count));
 			/* Get the WWNs recieved from HBA firmware through
 			 * ELS frame
 			 */
-			count = fpin_els_extract_wwn(host_num,
-					&(fpin_req->linkIntegrityDesc),
-					&list_of_wwn);
-			if (count <= 0) {
-				FPIN_ELOG("Could not find any WWNs, ret = %d\n",
-							count);
-				return count;
-			}
-
-			/* Get the list of paths to be setmarginal from WWNs
-			 * aquired above
-			 */
-			INIT_LIST_HEAD(&dm_list_head);
-			INIT_LIST_HEAD(&impacted_dev_list_head);
-			udev = udev_new();
-			if (!udev) {
-				fpin_els_free_wwn_list(&list_of_wwn);
-				FPIN_ELOG("Can't create udev\n");
-				return(-1);
-			}
-			FPIN_DLOG("Got new udev Resource\n");
-			count = fpin_fetch_dm_lun_data(&list_of_wwn,
-					&dm_list_head, &impacted_dev_list_head,
-					udev);
-
-			udev_unref(udev);
-			if (count <= 0) {
-				FPIN_ELOG("Could not find any sd to fail =%d\n",
-							count);
-				fpin_els_free_wwn_list(&list_of_wwn);
-				return count;
-			}
-
-			/* Fail the paths using multipath daemon */
-			fpin_dm_marginal_path(host_num, &dm_list_head,
-						&impacted_dev_list_head);
-			/* Free the WWNs list extracted from ELS recieved */
-			fpin_dm_free_dev(&impacted_dev_list_head);
-			fpin_free_dm(&dm_list_head);
-			fpin_els_free_wwn_list(&list_of_wwn);
+			count = fpin_els_extract_wwn(host_num, li, list, policy);
 			break;
 		case eFPIN_NOTIFICATION_DESCRIPTOR_CONGESTION_TAG:
-			FPIN_ELOG("Rcvd FPIN: Congestion not supported:\n");
+			cn = fpin_els_decode_cn(fc_payload, len);
+			if (cn == NULL) {
+				fpin_li_malformed++;
+				return -EBADMSG;
+			}
+			FPIN_ILOG("Congestion event type 0x%x modifier 0x%x period"
+				" %u ms\n", ntohs(cn->event_type),
+				ntohs(cn->event_modifier), ntohl(cn->event_period));
+			count = fpin_els_extract_cn_wwn(host_num, cn, list);
 			break;
 		case eFPIN_NOTIFICATION_DESCRIPTOR_DELIVERY_TAG:
 			FPIN_ELOG("Rcvd FPIN: Delivery notification not supported\n");
@@ -324,6 +838,53 @@ fpin_process_els_frame(uint16_t host_num, char *fc_payload) {
 	return (count);
 }
 
+/*
+ * Function:
+ *	fpin_process_els_frame
+ *
+ * Inputs:
+ * 	1. The WWN of the HBA on which the ELS frame was received.
+ *	2. The ELS frame to be processed. Could be FPIN frame or any other ELS frame
+ *	in the future.
+ *	3. Number of valid bytes in the frame.
+ *	4. The latency trace of the event, filled in as the stages complete.
+ *	5. The arena all the per-event lists are allocated from. The caller
+ *	   resets it once the event completes.
+ *	6. The Link Integrity policy the event is handled with.
+ *
+ * Description:
+ *	This function process the ELS frame recieved from HBA driver,
+ *	and fails the impacted paths if an alternate path exists. This function
+ *	does the following:
+ *		1. Extarct the impacted device WWNs from the FPIN ELS frame, see
+ *		   fpin_els_decode_frame.
+ *		2. Get the target IDs of the devices from the WWNs extracted.
+ *		3. Port by port, highest LUN count first, translate the target IDs
+ *		   into corresponding sd* and dm-* and fail the sd* using multipath
+ *		   daemon, provided alternate paths exist.
+ *		4. Free the resources allocated.
+ */
+int
+fpin_process_els_frame(uint16_t host_num, char *fc_payload, uint32_t len,
+			struct fpin_event_trace *trace, struct fpin_arena *arena,
+			struct fpin_policy *policy) {
+	struct timespec stage_start;
+	struct wwn_list list_of_wwn;
+	int count = -1;
+
+	fpin_trace_now(&stage_start);
+	memset(&list_of_wwn, 0, sizeof(list_of_wwn));
+	list_of_wwn.arena = arena;
+	list_of_wwn.event_num = trace->event_num;
+	count = fpin_els_decode_frame(host_num, fc_payload, len, &list_of_wwn,
+				policy);
+	if (count <= 0) {
+		FPIN_ILOG("No WWNs to act on, ret = %d\n", count);
+		return count;
+	}
+	return fpin_els_act_ports(&list_of_wwn, trace, &stage_start);
+}
+
 /*
  * Function:
  *	fpin_handle_els_frame
@@ -360,6 +921,146 @@ fpin_handle_els_frame(fpin_payload_t *fpin_payload) {
 	return (ret);
 }
 
+/*
+ * Function:
+ *	fpin_els_add_recovery_job
+ *
+ * Inputs:
+ *	1. Host number the event was received on.
+ *	2. FC transport event code, FCH_EVT_LINKUP or FCH_EVT_RSCN.
+ *	3. Event data of the transport event.
+ *
+ * Description:
+ *	Called from the netlink receiver, which must not block on multipathd.
+ *	Queues the recovery for fpin_els_recovery_consumer. A job identical to
+ *	one still pending is coalesced with it, as the pending job will recover
+ *	the same paths.
+ */
+int
+fpin_els_add_recovery_job(uint32_t host_num, uint32_t event_code,
+			uint32_t event_data) {
+	struct fpin_recovery_job *job = NULL;
+
+	pthread_mutex_lock(&fpin_recovery_mutex);
+	list_for_each_entry(job, &fpin_recovery_list_head, job_list) {
+		if ((job->host_num == host_num) && (job->event_code == event_code) &&
+			(job->event_data == event_data)) {
+			fpin_recovery_stats.coalesced++;
+			pthread_mutex_unlock(&fpin_recovery_mutex);
+			return 0;
+		}
+	}
+	pthread_mutex_unlock(&fpin_recovery_mutex);
+
+	job = fpin_pool_get(&fpin_recovery_pool);
+	if (job == NULL) {
+		FPIN_CLOG("NO Memory to queue recovery for host %u\n", host_num);
+		return -ENOMEM;
+	}
+	job->host_num = host_num;
+	job->event_code = event_code;
+	job->event_data = event_data;
+
+	pthread_mutex_lock(&fpin_recovery_mutex);
+	list_add_tail(&job->job_list, &fpin_recovery_list_head);
+	fpin_recovery_stats.queued++;
+	if (++fpin_recovery_stats.depth > fpin_recovery_stats.max_depth)
+		fpin_recovery_stats.max_depth = fpin_recovery_stats.depth;
+	pthread_mutex_unlock(&fpin_recovery_mutex);
+	pthread_cond_signal(&fpin_recovery_cond);
+
+	return 0;
+}
+
+/*
+ * This is the recovery consumer thread. It sleeps on pthread cond variable
+ * unless notified by fpin_fabric_notification_receiver thread, and runs the
+ * multipathd/rport recovery of LINKUP and RSCN events, so the receiver keeps
+ * reading netlink while paths are being recovered.
+ */
+void *fpin_els_recovery_consumer() {
+	struct fpin_recovery_job *job = NULL;
+	struct fpin_rscn_range rscn_range, *range = NULL;
+	struct timespec start, end;
+	uint64_t run_ns = 0;
+	int recovered = 0, skipped = 0;
+
+	for ( ; ; ) {
+		pthread_mutex_lock(&fpin_recovery_mutex);
+		while (list_empty(&fpin_recovery_list_head))
+			pthread_cond_wait(&fpin_recovery_cond, &fpin_recovery_mutex);
+		job = list_first_entry(&fpin_recovery_list_head,
+					struct fpin_recovery_job, job_list);
+		list_del(&job->job_list);
+		fpin_recovery_stats.depth--;
+		pthread_mutex_unlock(&fpin_recovery_mutex);
+
+		/* LINKUP recovers the whole host, RSCN only the ports it names */
+		range = NULL;
+		if (job->event_code == FCH_EVT_RSCN) {
+			fpin_rscn_parse_range(job->event_data, &rscn_range);
+			range = &rscn_range;
+			FPIN_ILOG("Recovering host %u on RSCN port id 0x%06x mask 0x%06x\n",
+				job->host_num, rscn_range.port_id, rscn_range.mask);
+		} else {
+			FPIN_ILOG("Recovering host %u on event code 0x%x\n",
+				job->host_num, job->event_code);
+		}
+		fpin_trace_now(&start);
+		recovered = fpin_unset_marginal_dev(job->host_num,
+					&fpin_li_marginal_dev_list_head, range, &skipped);
+		fpin_trace_now(&end);
+		run_ns = fpin_trace_elapsed_ns(&start, &end);
+		if (skipped)
+			FPIN_ILOG("host %u: recovered %d paths, %d outside of the RSCN"
+				" range left marginal\n", job->host_num, recovered, skipped);
+		fpin_pool_put(&fpin_recovery_pool, job);
+
+		pthread_mutex_lock(&fpin_recovery_mutex);
+		fpin_recovery_stats.completed++;
+		fpin_recovery_stats.paths_recovered += recovered;
+		fpin_recovery_stats.rscn_paths_skipped += skipped;
+		if (run_ns > fpin_recovery_stats.max_run_ns)
+			fpin_recovery_stats.max_run_ns = run_ns;
+		pthread_mutex_unlock(&fpin_recovery_mutex);
+	}
+}
+
+void
+fpin_els_dump_stats(void) {
+	struct fpin_recovery_stats stats;
+	struct fpin_li_queue_stats queue;
+
+	pthread_mutex_lock(&fpin_recovery_mutex);
+	stats = fpin_recovery_stats;
+	pthread_mutex_unlock(&fpin_recovery_mutex);
+	pthread_mutex_lock(&fpin_li_mutex);
+	queue = fpin_li_queue_stats;
+	pthread_mutex_unlock(&fpin_li_mutex);
+
+	FPIN_TLOG("els: events %llu malformed %llu arena high water %zu bytes,"
+		" %llu chunk allocs\n", (unsigned long long)fpin_li_events,
+		(unsigned long long)fpin_li_malformed, fpin_li_arena.high_water,
+		(unsigned long long)fpin_li_arena.chunk_allocs);
+	FPIN_TLOG("els: LI queue depth %u max depth %u capacity %u queued %llu"
+		" coalesced %llu\n", queue.depth, queue.max_depth,
+		fpin_li_queue_capacity, (unsigned long long)queue.queued,
+		(unsigned long long)queue.coalesced);
+	FPIN_TLOG("els: LI queue evicted oldest %llu low %llu, dropped low %llu"
+		" full %llu\n", (unsigned long long)queue.evicted_oldest,
+		(unsigned long long)queue.evicted_low,
+		(unsigned long long)queue.dropped_low,
+		(unsigned long long)queue.dropped_full);
+	FPIN_TLOG("recovery: queued %llu coalesced %llu completed %llu depth %u "
+		"max depth %u max run %lluus\n",
+		(unsigned long long)stats.queued, (unsigned long long)stats.coalesced,
+		(unsigned long long)stats.completed, stats.depth, stats.max_depth,
+		(unsigned long long)(stats.max_run_ns / 1000));
+	FPIN_TLOG("recovery: paths recovered %llu, skipped outside of RSCN range"
+		" %llu\n", (unsigned long long)stats.paths_recovered,
+		(unsigned long long)stats.rscn_paths_skipped);
+}
+
 /*
  * This is the FPIN ELS consumer thread. The thread sleeps on pthread cond
  * variable unless notified by fpin_fabric_notification_receiver thread.
@@ -367,44 +1068,63 @@ fpin_handle_els_frame(fpin_payload_t *fpin_payload) {
  * list will be added if any more ELS frames types are to be supported.
  */
 void *fpin_els_li_consumer() {
-	struct list_head marginal_list_head;
 	char payload[FC_PAYLOAD_MAXLEN];
+	struct fpin_event_trace *trace = NULL;
 	int ret = 0;
-	uint16_t host_num;
+	uint16_t host_num, len;
 	struct els_marginal_list *els_marg;
+	struct fpin_policy *policy = NULL;
 
-	INIT_LIST_HEAD(&marginal_list_head);
+	fpin_rt_thread(FPIN_RT_CONSUMER);
+	if (fpin_rt_prio)
+		fpin_arena_reserve(&fpin_li_arena, FPIN_RT_ARENA_SIZE);
+	/* Created once, not per event, retried by the first event that needs it */
+	fpin_li_udev = udev_new();
 
 	for ( ; ; ) {
 		pthread_mutex_lock(&fpin_li_mutex);
-		if (list_empty(&els_marginal_list_head)) {
+		while (list_empty(&els_marginal_list_head)) {
 			pthread_cond_wait(&fpin_li_cond, &fpin_li_mutex);
 		}
 
-		if (!list_empty(&els_marginal_list_head)) {
-			FPIN_DLOG("Invoke List splice tail\n");
-			list_splice_tail_init(&els_marginal_list_head, &marginal_list_head);
-			pthread_mutex_unlock(&fpin_li_mutex);
-		} else {
-			FPIN_DLOG("Spurious/INTR wakeup, continue\n");
-			pthread_mutex_unlock(&fpin_li_mutex);
+		/*
+		 * One frame at a time, the frames still queued are the ones the
+		 * overflow policies of the receiver can coalesce or evict.
+		 */
+		els_marg  = list_first_entry(&els_marginal_list_head,
+						struct els_marginal_list, els_frame);
+		list_del(&els_marg->els_frame);
+		if (--fpin_li_queue_stats.depth == 0)
+			fpin_li_queue_stats.full = 0;
+		pthread_mutex_unlock(&fpin_li_mutex);
+
+		host_num = els_marg->host_num;
+		len = els_marg->length;
+		memcpy(payload, els_marg->payload, len);
+
+		trace = fpin_trace_new(host_num, els_marg->event_num,
+					&els_marg->rx_ts);
+		fpin_pool_put(&fpin_frame_pool, els_marg);
+		if (trace == NULL) {
+			FPIN_CLOG("No memory to trace event, dropped\n");
 			continue;
 		}
 
-		while (!list_empty(&marginal_list_head)) {
-			els_marg  = list_first_entry(&marginal_list_head,
-							struct els_marginal_list, els_frame);
-			host_num = els_marg->host_num;
-			memcpy(payload, els_marg->payload, FC_PAYLOAD_MAXLEN);
-			list_del(&els_marg->els_frame);
-			free(els_marg);
-
-			/* Now finally process FPIN LI ELS Frame */
-			FPIN_ILOG("Got a new Payload buffer, processing it\n");
-			ret = fpin_process_els_frame(host_num, payload);
-			if (ret <= 0 ) {
-				FPIN_ELOG("ELS frame processing failed with ret %d\n", ret);
-			}
+		/* Now finally process FPIN LI ELS Frame */
+		FPIN_ILOG("Got a new Payload buffer, processing it\n");
+		/* A reload during the event does not affect it */
+		policy = fpin_policy_get();
+		ret = fpin_process_els_frame(host_num, payload, len, trace,
+					&fpin_li_arena, policy);
+		fpin_policy_put(policy);
+		if (ret < 0 ) {
+			FPIN_ELOG("ELS frame processing failed with ret %d\n", ret);
 		}
+		/* Recorded once the last action of the event completes */
+		fpin_trace_put(trace);
+
+		/* Release every node of the event in one go */
+		fpin_arena_reset(&fpin_li_arena);
+		fpin_li_events++;
 	}
 }
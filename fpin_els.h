@@ -16,6 +16,18 @@
 
 #define MARGINAL_CHECKER_WAIT_TIME 30
 
+/* LI frame queue between the receiver and the consumer, see -L */
+#define FPIN_DEF_LI_QUEUE	256
+#define FPIN_MAX_LI_QUEUE	65536
+
+/* What the receiver may do to make room when the LI queue is full */
+enum fpin_li_overflow {
+	FPIN_LI_COALESCE = 0,	/* Update a queued frame of the same notification */
+	FPIN_LI_DROP_OLDEST,	/* Evict the oldest queued frame of the same port */
+	FPIN_LI_DROP_LOW,		/* Drop a low severity frame, new or queued */
+	FPIN_LI_OVERFLOW_MAX
+};
+
 /*
  * This data is read from FC frame, which has a mixture of
  * both 32 and 64 bit data. Using wwn_t as 64-bit is causing
@@ -26,13 +38,44 @@ typedef struct wwn {
 	uint32_t	words[2];
 } wwn_t;
 
+static inline uint64_t
+fpin_wwn_to_u64(const wwn_t *wwn) {
+	return ((uint64_t)ntohl(wwn->words[0]) << 32) | ntohl(wwn->words[1]);
+}
+
+static inline void
+fpin_u64_to_wwn(uint64_t value, wwn_t *wwn) {
+	wwn->words[0] = htonl(value >> 32);
+	wwn->words[1] = htonl((uint32_t)value);
+}
+
+/* What the overflow policies match queued LI frames on */
+struct fpin_li_key {
+	uint64_t attached_wwn;
+	uint64_t detecting_wwn;
+	uint16_t host_num;
+	uint16_t event_type;
+	uint8_t is_li;				/* Carries a Link Integrity descriptor */
+	uint8_t low;				/* Low severity, see fpin_els_li_key */
+};
+
 struct els_marginal_list {
 	uint16_t host_num;
 	uint16_t length;
+	uint32_t event_num;
+	struct timespec rx_ts;		/* Kernel receive time of the event */
+	struct fpin_li_key key;
 	char payload[FC_PAYLOAD_MAXLEN];
 	struct list_head els_frame;
 };
 
+/* LINKUP/RSCN recovery job, queued by the receiver for the recovery thread */
+struct fpin_recovery_job {
+	uint32_t host_num;
+	uint32_t event_code;
+	uint32_t event_data;
+	struct list_head job_list;
+};
 
 /* --- FPIN --- */
 
@@ -95,6 +138,17 @@ typedef struct fpin_link_integrity_notification {
 	fpin_notification_port_list_t       port_list;			/* Event data (Port List) */
 } fpin_link_integrity_notification_t;
 
+/* Peer Congestion Descriptor */
+typedef struct fpin_congestion_notification {
+	fpin_descriptor_header_t			header;
+	wwn_t                               detecting_port_wwn;	/* Detecting F/N_Port Name (Port WWN) */
+	wwn_t                               attached_port_wwn;	/* Attached F/N_Port Name (Port WWN) */
+	uint16_t							event_type;			/* eFPIN_CONGESTION_NOTIFICATION_EVENT_TYPE_* */
+	uint16_t							event_modifier;		/* Set to 0 normally */
+	uint32_t							event_period;		/* Period of the event, in ms */
+	fpin_notification_port_list_t       port_list;			/* Event data (Port List) */
+} fpin_congestion_notification_t;
+
 /* FPIN ELS Header */
 typedef struct fpin_els_header {
 	uint32_t	cmd;			/* ELS Command Code */
@@ -106,15 +160,27 @@ typedef struct fpin_link_integrity_request_els {
 	fpin_link_integrity_notification_t	linkIntegrityDesc;	/* Link Integrity Descriptor */
 } fpin_link_integrity_request_els_t;
 
+typedef struct fpin_congestion_request_els {
+	fpin_els_header_t					els_header;
+	fpin_congestion_notification_t		congestionDesc;	/* Peer Congestion Descriptor */
+} fpin_congestion_request_els_t;
+
 /* FPIN Payload received from HBA driver */
 typedef struct fpin_payload {
 	uint16_t host_num;
 	uint16_t length; //2048 for now
+	uint32_t event_num;
+	struct timespec rx_ts;		/* Kernel receive time of the event */
 	char payload[0];
 } fpin_payload_t;
 
 /* FPIN ELS Handler functions */
 void *fpin_els_li_consumer();
+void *fpin_els_recovery_consumer();
+int fpin_els_add_recovery_job(uint32_t host_num, uint32_t event_code,
+			uint32_t event_data);
 void *fpin_li_marginal_checker();
 int fpin_handle_els_frame(fpin_payload_t *fpin_payload);
+void fpin_els_dump_stats(void);
+int fpin_els_parse_queue(const char *arg);
 #endif
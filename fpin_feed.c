@@ -0,0 +1,203 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <sys/mman.h>
+#include "fpin.h"
+
+/*
+ * Writer side of the shared memory event feed, see fpin_feed.h. Records are
+ * published by the LI consumer, the recovery thread and the marginal
+ * checker, a mutex orders them. Readers never take it.
+ */
+
+const char *fpin_feed_name = FPIN_FEED_NAME;
+
+static struct fpin_feed_hdr *fpin_feed;
+static pthread_mutex_t fpin_feed_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Marks the feed of a previous instance closed before it is unlinked.
+ * Its readers keep the old mapping, they only see the change of the
+ * generation and reopen the new feed.
+ */
+static void
+fpin_feed_retire(void) {
+	struct fpin_feed_hdr *hdr = NULL;
+	struct stat st;
+	int fd = -1;
+
+	fd = shm_open(fpin_feed_name, O_RDWR | O_CLOEXEC, 0);
+	if (fd < 0)
+		return;
+	if ((fstat(fd, &st) == 0) &&
+		((size_t)st.st_size >= sizeof(struct fpin_feed_hdr))) {
+		hdr = mmap(NULL, sizeof(*hdr), PROT_READ | PROT_WRITE, MAP_SHARED,
+				fd, 0);
+		if (hdr != MAP_FAILED) {
+			__atomic_store_n(&hdr->generation, FPIN_FEED_CLOSED,
+					__ATOMIC_RELEASE);
+			munmap(hdr, sizeof(*hdr));
+		}
+	}
+	close(fd);
+}
+
+/*
+ * Creates the feed, replacing the one of a previous instance. Without a
+ * feed the daemon works as before, only nothing is published.
+ */
+int
+fpin_feed_init(void) {
+	size_t len = sizeof(struct fpin_feed_hdr) +
+			FPIN_FEED_RECORDS * sizeof(struct fpin_feed_slot);
+	struct fpin_feed_hdr *hdr = NULL;
+	struct timespec ts;
+	int fd = -1, ret = 0;
+
+	if (strcmp(fpin_feed_name, "none") == 0)
+		return 0;
+
+	fpin_feed_retire();
+	shm_unlink(fpin_feed_name);
+	fd = shm_open(fpin_feed_name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		ret = -errno;
+		FPIN_ELOG("Failed to create event feed %s, err %d\n",
+			fpin_feed_name, ret);
+		return ret;
+	}
+	if (ftruncate(fd, len) < 0) {
+		ret = -errno;
+		goto error;
+	}
+	hdr = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED) {
+		ret = -errno;
+		goto error;
+	}
+	close(fd);
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	hdr->version = FPIN_FEED_VERSION;
+	hdr->slot_size = sizeof(struct fpin_feed_slot);
+	hdr->nr_slots = FPIN_FEED_RECORDS;
+	hdr->generation = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+	/* Readers check the magic, so it is set last */
+	__atomic_store_n(&hdr->magic, FPIN_FEED_MAGIC, __ATOMIC_RELEASE);
+	pthread_mutex_lock(&fpin_feed_mutex);
+	if (fpin_feed != NULL)
+		munmap(fpin_feed, len);
+	fpin_feed = hdr;
+	pthread_mutex_unlock(&fpin_feed_mutex);
+	return 0;
+
+error:
+	FPIN_ELOG("Failed to set up event feed %s, err %d\n", fpin_feed_name, ret);
+	close(fd);
+	shm_unlink(fpin_feed_name);
+	return ret;
+}
+
+/*
+ * Function:
+ *	fpin_feed_publish
+ *
+ * Inputs:
+ *	The record to publish, index and ts_ns are filled in.
+ *
+ * Description:
+ *	Writes the record into the next slot under its sequence count and then
+ *	advances the head, so a reader either sees the complete record or
+ *	notices the slot changed under it.
+ */
+void
+fpin_feed_publish(struct fpin_feed_rec *rec) {
+	struct fpin_feed_slot *slot = NULL;
+	struct timespec ts;
+	uint64_t head = 0;
+	uint32_t seq = 0;
+
+	if (fpin_feed == NULL)
+		return;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	rec->ts_ns = (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+
+	pthread_mutex_lock(&fpin_feed_mutex);
+	head = fpin_feed->head;
+	rec->index = head;
+	slot = &fpin_feed->slots[head & (FPIN_FEED_RECORDS - 1)];
+	seq = slot->seq;
+	__atomic_store_n(&slot->seq, seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	memcpy(&slot->rec, rec, sizeof(*rec));
+	__atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+	__atomic_store_n(&fpin_feed->head, head + 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fpin_feed_mutex);
+}
+
+/* Publishes a decoded FPIN-LI notification */
+void
+fpin_feed_li_event(uint32_t host_num, uint32_t event_num,
+			fpin_link_integrity_notification_t *li,
+			enum fpin_fault_class fault) {
+	struct fpin_feed_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = FPIN_FEED_LI_EVENT;
+	rec.event_type = ntohs(li->event_type);
+	rec.host_num = host_num;
+	rec.event_num = event_num;
+	rec.fault = fault;
+	rec.detecting_wwn = fpin_wwn_to_u64(&li->detecting_port_wwn);
+	rec.attached_wwn = fpin_wwn_to_u64(&li->attached_port_wwn);
+	rec.count = ntohl(li->port_list.count);
+	rec.event_count = ntohl(li->event_count);
+	fpin_feed_publish(&rec);
+}
+
+/* Publishes a decoded Peer Congestion notification */
+void
+fpin_feed_cn_event(uint32_t host_num, uint32_t event_num,
+			fpin_congestion_notification_t *cn) {
+	struct fpin_feed_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = FPIN_FEED_CN_EVENT;
+	rec.event_type = ntohs(cn->event_type);
+	rec.host_num = host_num;
+	rec.event_num = event_num;
+	rec.detecting_wwn = fpin_wwn_to_u64(&cn->detecting_port_wwn);
+	rec.attached_wwn = fpin_wwn_to_u64(&cn->attached_port_wwn);
+	rec.count = ntohl(cn->port_list.count);
+	rec.event_count = ntohl(cn->event_period);
+	fpin_feed_publish(&rec);
+}
+
+/* Publishes a marginal, fail or recovery action on a path */
+void
+fpin_feed_path_action(uint16_t type, uint32_t host_num, uint32_t event_num,
+			const char *dev_name, uint64_t p_wwn) {
+	struct fpin_feed_rec rec;
+
+	memset(&rec, 0, sizeof(rec));
+	rec.type = type;
+	rec.host_num = host_num;
+	rec.event_num = event_num;
+	rec.wwn = p_wwn;
+	strncpy(rec.dev_name, dev_name, FPIN_FEED_DEV_LEN - 1);
+	fpin_feed_publish(&rec);
+}
@@ -0,0 +1,81 @@
+#ifndef __FPIN_FEED_H__
+#define __FPIN_FEED_H__
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Shared memory event feed.
+ *
+ * The daemon publishes every decoded FPIN event and every path action as a
+ * fixed size record into a ring in /dev/shm. Each slot is protected by a
+ * sequence count, odd while the daemon writes it, so readers copy records
+ * without locks or system calls. A reader that falls more than a ring
+ * behind loses the overwritten records and is told how many.
+ *
+ * This header and fpin_feed_reader.c form the reader library, they do not
+ * depend on the rest of the daemon.
+ */
+
+#define FPIN_FEED_NAME			"/fctxpd_feed"
+#define FPIN_FEED_MAGIC			0x4650494eU		/* "FPIN" */
+#define FPIN_FEED_VERSION		1
+#define FPIN_FEED_RECORDS		4096			/* power of 2 */
+#define FPIN_FEED_DEV_LEN		56
+#define FPIN_FEED_CLOSED		0	/* Generation of a replaced feed */
+
+/* Record types */
+#define FPIN_FEED_LI_EVENT		1	/* Decoded FPIN-LI notification */
+#define FPIN_FEED_MARGINAL		2	/* Path set marginal */
+#define FPIN_FEED_FAIL			3	/* Path failed by policy */
+#define FPIN_FEED_RECOVERED		4	/* Marginal path back to normal */
+#define FPIN_FEED_CN_EVENT		5	/* Decoded FPIN congestion notification */
+
+struct fpin_feed_rec {
+	uint64_t index;				/* Position in the feed, from 0 */
+	uint64_t ts_ns;				/* CLOCK_REALTIME */
+	uint16_t type;				/* FPIN_FEED_* */
+	uint16_t event_type;		/* LI or congestion event type */
+	uint32_t host_num;
+	uint32_t event_num;			/* FC transport event number, 0 if none */
+	uint32_t fault;				/* Fault class of FPIN_FEED_LI_EVENT */
+	uint64_t wwn;				/* Remote port WWN of path records */
+	uint64_t detecting_wwn;		/* Link ends of LI and congestion events */
+	uint64_t attached_wwn;
+	uint32_t count;				/* Listed port count of LI and congestion */
+	uint32_t event_count;		/* LI threshold count, congestion period ms */
+	char dev_name[FPIN_FEED_DEV_LEN];	/* sd* or nvme controller */
+};
+
+struct fpin_feed_slot {
+	uint32_t seq;				/* Odd while the record is written */
+	uint32_t pad;
+	struct fpin_feed_rec rec;
+};
+
+struct fpin_feed_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t slot_size;
+	uint32_t nr_slots;
+	uint32_t pad;
+	uint64_t generation;		/* FPIN_FEED_CLOSED once the feed is replaced */
+	uint64_t head;				/* Number of records ever published */
+	uint8_t reserved[32];
+	struct fpin_feed_slot slots[];
+};
+
+/* Reader side, see fpin_feed_reader.c */
+struct fpin_feed_reader {
+	int fd;
+	size_t map_len;
+	const struct fpin_feed_hdr *hdr;
+	uint64_t generation;
+	uint64_t next;				/* Index of the next record to read */
+	uint64_t lost;				/* Records overwritten before being read */
+};
+
+int fpin_feed_open(struct fpin_feed_reader *reader, const char *name);
+int fpin_feed_read(struct fpin_feed_reader *reader, struct fpin_feed_rec *rec);
+void fpin_feed_close(struct fpin_feed_reader *reader);
+#endif
@@ -0,0 +1,148 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "fpin_feed.h"
+
+/*
+ * Function:
+ *	fpin_feed_open
+ *
+ * Inputs:
+ *	1. The reader to initialize.
+ *	2. Name of the feed, NULL for FPIN_FEED_NAME.
+ *
+ * Description:
+ *	Maps the feed read only. The reader starts at the current head, i.e.
+ *	it sees the records published from now on. Returns 0 or -errno.
+ */
+int
+fpin_feed_open(struct fpin_feed_reader *reader, const char *name) {
+	const struct fpin_feed_hdr *hdr = NULL;
+	struct stat st;
+	void *map = NULL;
+	int fd = -1, ret = 0;
+
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = -1;
+	fd = shm_open(name ? name : FPIN_FEED_NAME, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+	if (fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto error;
+	}
+	if ((size_t)st.st_size < sizeof(struct fpin_feed_hdr)) {
+		ret = -EAGAIN;
+		goto error;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		goto error;
+	}
+	hdr = map;
+	if ((hdr->magic != FPIN_FEED_MAGIC) || (hdr->version != FPIN_FEED_VERSION) ||
+		(hdr->slot_size != sizeof(struct fpin_feed_slot)) ||
+		(hdr->nr_slots == 0) ||
+		(sizeof(struct fpin_feed_hdr) + (size_t)hdr->nr_slots *
+			sizeof(struct fpin_feed_slot) > (size_t)st.st_size)) {
+		munmap(map, st.st_size);
+		ret = -EPROTO;
+		goto error;
+	}
+
+	reader->fd = fd;
+	reader->map_len = st.st_size;
+	reader->hdr = hdr;
+	reader->generation = hdr->generation;
+	reader->next = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+	return 0;
+
+error:
+	close(fd);
+	return ret;
+}
+
+/*
+ * Function:
+ *	fpin_feed_read
+ *
+ * Inputs:
+ *	1. The reader.
+ *	2. Buffer for the record.
+ *
+ * Description:
+ *	Copies the next record. Returns 1 if a record was read, 0 if the reader
+ *	is at the head, -ESTALE if a restarted daemon replaced the feed and it
+ *	has to be reopened. Records overwritten before they could be read are skipped
+ *	and added to reader->lost. Never blocks and makes no system calls.
+ */
+int
+fpin_feed_read(struct fpin_feed_reader *reader, struct fpin_feed_rec *rec) {
+	const struct fpin_feed_hdr *hdr = reader->hdr;
+	const struct fpin_feed_slot *slot = NULL;
+	uint64_t head = 0;
+	uint32_t seq1 = 0, seq2 = 0;
+
+	for ( ; ; ) {
+		if (__atomic_load_n(&hdr->generation, __ATOMIC_ACQUIRE) !=
+			reader->generation)
+			return -ESTALE;
+		head = __atomic_load_n(&hdr->head, __ATOMIC_ACQUIRE);
+		if (reader->next == head)
+			return 0;
+		if (head - reader->next > hdr->nr_slots) {
+			reader->lost += head - reader->next - hdr->nr_slots;
+			reader->next = head - hdr->nr_slots;
+		}
+
+		slot = &hdr->slots[reader->next & (hdr->nr_slots - 1)];
+		seq1 = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq1 & 1)
+			continue;
+		memcpy(rec, &slot->rec, sizeof(*rec));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		seq2 = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+		if (seq1 != seq2)
+			continue;
+
+		/* The slot was reused for a later record, we were overrun */
+		if (rec->index != reader->next) {
+			reader->lost++;
+			reader->next++;
+			continue;
+		}
+		reader->next++;
+		return 1;
+	}
+}
+
+void
+fpin_feed_close(struct fpin_feed_reader *reader) {
+	if (reader->hdr != NULL)
+		munmap((void *)reader->hdr, reader->map_len);
+	if (reader->fd >= 0)
+		close(reader->fd);
+	memset(reader, 0, sizeof(*reader));
+	reader->fd = -1;
+}
@@ -0,0 +1,345 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_ELS
+#include <stdlib.h>
+#include <math.h>
+#include "fpin.h"
+
+/*
+ * Health scoring of the paths to a remote port, i.e. of every host and
+ * remote port WWN pair.
+ *
+ * Every signal about a port adds its weight to the score of the port, LI
+ * events by event type, peer congestion events by congestion type and the
+ * I/O errors seen by the corroboration sampler per error. The link error
+ * counters of the HBA port, read by the fc_host statistics sampler, are
+ * scored against a pseudo port of WWN 0 of the host, whose score adds to
+ * that of every remote port of the host, as the link is on all of their
+ * paths. The score decays
+ * with a half life of FPIN_HEALTH_HALF_LIFE, so it reads as recent trouble.
+ * The trend of the score is tracked as an EWMA of its change per minute
+ * between signals, decay included, so sparse events give a falling slope
+ * and a burst a rising one.
+ *
+ * With -E a port whose score and slope both cross the thresholds is
+ * degrading, and its paths are set marginal even if the policy would only
+ * count the event, or the event is a congestion notification. A port trips
+ * once, until its score has decayed below half the threshold.
+ *
+ * The ports live in a fixed table, open addressed over FPIN_HEALTH_PROBE
+ * slots; when they are all taken the healthiest port is forgotten. An
+ * update is O(1) and the table does not grow during a storm.
+ */
+
+struct fpin_health_config fpin_health_cfg;
+
+/* The HBA port link of a host, see fpin_health_link_event */
+#define FPIN_HEALTH_HOST_LINK	0
+
+struct fpin_health {
+	uint64_t wwn;
+	uint32_t host_num;
+	uint16_t used;
+	uint16_t early;				/* Tripped, until the score halves */
+	double score;
+	double slope;				/* EWMA of the score change per minute */
+	double updated;				/* CLOCK_MONOTONIC seconds of the last decay */
+	uint32_t events[FPIN_HEALTH_NR_SOURCES];
+};
+
+static struct fpin_health fpin_health_ports[FPIN_HEALTH_SLOTS];
+static pthread_mutex_t fpin_health_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fpin_health_stats {
+	uint64_t signals[FPIN_HEALTH_NR_SOURCES];
+	uint64_t tripped;
+	uint64_t evicted;
+	uint32_t ports;
+} fpin_health_stats;
+
+/* Score points per LI event, indexed by FPIN_LINK_INTEGRITY_EVENT_TYPE_* */
+static const double fpin_health_li_weights[] = {
+	10, 100, 60, 80, 20, 20, 30, 10,
+};
+
+/* Indexed by fpin_congestion_notification_event_type_e, a clear is free */
+static const double fpin_health_cn_weights[] = {
+	0, 20, 20, 10,
+};
+
+#define FPIN_HEALTH_NR_LI_WEIGHTS	\
+	(sizeof(fpin_health_li_weights) / sizeof(fpin_health_li_weights[0]))
+#define FPIN_HEALTH_NR_CN_WEIGHTS	\
+	(sizeof(fpin_health_cn_weights) / sizeof(fpin_health_cn_weights[0]))
+
+static const char *fpin_health_sources[FPIN_HEALTH_NR_SOURCES] = {
+	[FPIN_HEALTH_LI]	= "li",
+	[FPIN_HEALTH_CN]	= "cn",
+	[FPIN_HEALTH_IOERR]	= "ioerr",
+	[FPIN_HEALTH_LINK]	= "link",
+};
+
+static double
+fpin_health_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+fpin_health_decay(struct fpin_health *port, double now) {
+	port->score *= exp2(-(now - port->updated) / FPIN_HEALTH_HALF_LIFE);
+	port->updated = now;
+}
+
+/* First slot of the probe window of a port */
+static uint32_t
+fpin_health_hash(uint32_t host_num, uint64_t wwn) {
+	uint64_t hash = (wwn ^ ((uint64_t)host_num << 48)) * 0x9e3779b97f4a7c15ULL;
+
+	return (uint32_t)(hash >> 32);
+}
+
+/*
+ * Returns the slot of the port, taking a free one or the one of the
+ * healthiest port of the probe window for a new port, in which case fresh
+ * is set. Called with fpin_health_mutex held.
+ */
+static struct fpin_health *
+fpin_health_slot(uint32_t host_num, uint64_t wwn, double now, int *fresh) {
+	struct fpin_health *port = NULL, *victim = NULL;
+	uint32_t slot = fpin_health_hash(host_num, wwn);
+	int i = 0;
+
+	*fresh = 0;
+	for (i = 0; i < FPIN_HEALTH_PROBE; i++) {
+		port = &fpin_health_ports[(slot + i) % FPIN_HEALTH_SLOTS];
+		if (!port->used) {
+			victim = port;
+			fpin_health_stats.ports++;
+			break;
+		}
+		if ((port->host_num == host_num) && (port->wwn == wwn))
+			return port;
+		fpin_health_decay(port, now);
+		if ((victim == NULL) || (port->score < victim->score))
+			victim = port;
+	}
+	if (victim->used)
+		fpin_health_stats.evicted++;
+
+	*fresh = 1;
+	memset(victim, 0, sizeof(*victim));
+	victim->used = 1;
+	victim->host_num = host_num;
+	victim->wwn = wwn;
+	victim->updated = now;
+	return victim;
+}
+
+/*
+ * Returns the decayed score of the HBA port link of a host, 0 if it is not
+ * scored. Called with fpin_health_mutex held.
+ */
+static double
+fpin_health_link_score(uint32_t host_num, double now) {
+	struct fpin_health *port = NULL;
+	uint32_t slot = fpin_health_hash(host_num, FPIN_HEALTH_HOST_LINK);
+	int i = 0;
+
+	for (i = 0; i < FPIN_HEALTH_PROBE; i++) {
+		port = &fpin_health_ports[(slot + i) % FPIN_HEALTH_SLOTS];
+		if (!port->used)
+			return 0;
+		if ((port->host_num == host_num) &&
+			(port->wwn == FPIN_HEALTH_HOST_LINK)) {
+			fpin_health_decay(port, now);
+			return port->score;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_health_signal
+ *
+ * Inputs:
+ *	1. Host number the signal was seen on.
+ *	2. Remote port WWN the signal is about.
+ *	3. Where the signal comes from.
+ *	4. Score points of the signal.
+ *
+ * Description:
+ *	Adds the signal to the score of the port and updates its trend.
+ *	Returns 1 if the port just crossed the -E thresholds, i.e. its paths
+ *	are to be set marginal, 0 otherwise. The thresholds apply to the score
+ *	of the port plus the one of the HBA port link of the host, and never
+ *	to the link alone, which has no paths of its own.
+ */
+int
+fpin_health_signal(uint32_t host_num, uint64_t wwn,
+			enum fpin_health_source source, double weight) {
+	struct fpin_health *port = NULL;
+	double now = fpin_health_now(), before = 0, dt = 0;
+	double score = 0, slope = 0, link_score = 0;
+	int fresh = 0, tripped = 0;
+
+	pthread_mutex_lock(&fpin_health_mutex);
+	if (wwn != FPIN_HEALTH_HOST_LINK)
+		link_score = fpin_health_link_score(host_num, now);
+	port = fpin_health_slot(host_num, wwn, now, &fresh);
+	before = port->score;
+	dt = now - port->updated;
+	fpin_health_decay(port, now);
+	if (port->early &&
+		(port->score + link_score < fpin_health_cfg.early_score / 2.0))
+		port->early = 0;
+	port->score += weight;
+	/* Signals within a minute count as one minute, bursts are not noise */
+	if (!fresh)
+		port->slope += FPIN_HEALTH_SLOPE_ALPHA *
+			((port->score - before) * 60.0 / fmax(dt, 60.0) - port->slope);
+	port->events[source]++;
+	fpin_health_stats.signals[source]++;
+
+	if (fpin_health_cfg.early_score && !port->early &&
+		(wwn != FPIN_HEALTH_HOST_LINK) &&
+		(port->score + link_score >= fpin_health_cfg.early_score) &&
+		(port->slope >= fpin_health_cfg.early_slope)) {
+		port->early = 1;
+		tripped = 1;
+		fpin_health_stats.tripped++;
+	}
+	score = port->score + link_score;
+	slope = port->slope;
+	pthread_mutex_unlock(&fpin_health_mutex);
+
+	if (tripped)
+		FPIN_ILOG("health: host%u 0x%016llx degrading, score %.0f slope"
+			" %+.1f/min\n", host_num, (unsigned long long)wwn, score, slope);
+	return tripped;
+}
+
+/* Scores an LI event about an impacted port, see fpin_health_signal */
+int
+fpin_health_li_event(uint32_t host_num, uint64_t wwn, uint16_t event_type) {
+	double weight = fpin_health_li_weights[0];
+
+	if (event_type < FPIN_HEALTH_NR_LI_WEIGHTS)
+		weight = fpin_health_li_weights[event_type];
+	return fpin_health_signal(host_num, wwn, FPIN_HEALTH_LI, weight);
+}
+
+/* Scores a peer congestion event about an impacted port */
+int
+fpin_health_cn_event(uint32_t host_num, uint64_t wwn, uint16_t event_type) {
+	if ((event_type >= FPIN_HEALTH_NR_CN_WEIGHTS) ||
+		(fpin_health_cn_weights[event_type] == 0))
+		return 0;
+	return fpin_health_signal(host_num, wwn, FPIN_HEALTH_CN,
+			fpin_health_cn_weights[event_type]);
+}
+
+/*
+ * Function:
+ *	fpin_health_link_event
+ *
+ * Inputs:
+ *	1. Host number of the HBA port.
+ *	2. LI event type the link counter stands for.
+ *	3. Change of the counter over the sampling interval.
+ *	4. The change that stands in for an FPIN, see fpin_link.c.
+ *
+ * Description:
+ *	Scores the link errors of the HBA port itself. A change of the stand-in
+ *	threshold weighs as much as the LI event, more errors count up to
+ *	FPIN_HEALTH_LINK_MAX_RATIO times that.
+ */
+void
+fpin_health_link_event(uint32_t host_num, uint16_t event_type,
+			uint64_t delta, uint32_t threshold) {
+	double weight = fpin_health_li_weights[0];
+
+	if (event_type < FPIN_HEALTH_NR_LI_WEIGHTS)
+		weight = fpin_health_li_weights[event_type];
+	weight *= fmin((double)delta / threshold, FPIN_HEALTH_LINK_MAX_RATIO);
+	fpin_health_signal(host_num, FPIN_HEALTH_HOST_LINK, FPIN_HEALTH_LINK,
+			weight);
+}
+
+/* Parses -E score[,slope], a score of 0 disables early marginalization */
+int
+fpin_health_parse_config(const char *arg) {
+	struct fpin_health_config cfg = fpin_health_cfg;
+	char *end = NULL;
+
+	cfg.early_score = strtoul(arg, &end, 0);
+	if (*end == ',')
+		cfg.early_slope = strtoul(end + 1, &end, 0);
+	if ((end == arg) || (*end != '\0'))
+		return -EINVAL;
+
+	fpin_health_cfg = cfg;
+	return 0;
+}
+
+void
+fpin_health_dump_stats(void) {
+	struct fpin_health *port = NULL;
+	double now = fpin_health_now();
+	int i = 0, listed = 0;
+
+	pthread_mutex_lock(&fpin_health_mutex);
+	FPIN_TLOG("health: early score %u slope %u/min, ports %u evicted %llu"
+		" tripped %llu\n", fpin_health_cfg.early_score,
+		fpin_health_cfg.early_slope, fpin_health_stats.ports,
+		(unsigned long long)fpin_health_stats.evicted,
+		(unsigned long long)fpin_health_stats.tripped);
+	FPIN_TLOG("health: signals %s %llu %s %llu %s %llu %s %llu\n",
+		fpin_health_sources[FPIN_HEALTH_LI],
+		(unsigned long long)fpin_health_stats.signals[FPIN_HEALTH_LI],
+		fpin_health_sources[FPIN_HEALTH_CN],
+		(unsigned long long)fpin_health_stats.signals[FPIN_HEALTH_CN],
+		fpin_health_sources[FPIN_HEALTH_IOERR],
+		(unsigned long long)fpin_health_stats.signals[FPIN_HEALTH_IOERR],
+		fpin_health_sources[FPIN_HEALTH_LINK],
+		(unsigned long long)fpin_health_stats.signals[FPIN_HEALTH_LINK]);
+	for (i = 0; (i < FPIN_HEALTH_SLOTS) && (listed < FPIN_HEALTH_DUMP_MAX);
+			i++) {
+		port = &fpin_health_ports[i];
+		if (!port->used)
+			continue;
+		fpin_health_decay(port, now);
+		if (port->score < 1.0)
+			continue;
+		if (port->wwn == FPIN_HEALTH_HOST_LINK) {
+			FPIN_TLOG("health: host%u link score %.0f slope %+.1f/min"
+				" link %u\n", port->host_num, port->score, port->slope,
+				port->events[FPIN_HEALTH_LINK]);
+			listed++;
+			continue;
+		}
+		FPIN_TLOG("health: host%u 0x%016llx score %.0f slope %+.1f/min"
+			" li %u cn %u ioerr %u%s\n", port->host_num,
+			(unsigned long long)port->wwn, port->score, port->slope,
+			port->events[FPIN_HEALTH_LI], port->events[FPIN_HEALTH_CN],
+			port->events[FPIN_HEALTH_IOERR], port->early ? " degrading" : "");
+		listed++;
+	}
+	pthread_mutex_unlock(&fpin_health_mutex);
+}
@@ -0,0 +1,364 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_ELS
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "fpin.h"
+
+/*
+ * Link Integrity history.
+ *
+ * One series per (host, remote port WWN, LI event type) counts the events
+ * in minute buckets covering the last FPIN_HIST_MINUTES minutes and hour
+ * buckets covering the last FPIN_HIST_HOURS hours. The series live in a
+ * fixed size, memory mapped file, so the history survives restarts and its
+ * size does not depend on the fabric. Series are found by open addressing
+ * over a bounded probe window; when the window is full the series updated
+ * least recently in it is replaced.
+ *
+ * Only the LI consumer updates the file. A query from another process may
+ * observe a bucket mid-update, which is acceptable for counters.
+ */
+
+#define FPIN_HIST_MAGIC			0x46484953U		/* "FHIS" */
+#define FPIN_HIST_VERSION		1
+#define FPIN_HIST_SERIES		1024
+#define FPIN_HIST_MINUTES		120
+#define FPIN_HIST_HOURS			192				/* 8 days */
+#define FPIN_HIST_PROBE			16
+
+struct fpin_hist_series {
+	uint64_t wwn;
+	uint32_t host_num;
+	uint16_t event_type;
+	uint16_t in_use;
+	uint32_t last_minute;		/* Minutes since the epoch of the last event */
+	uint32_t last_hour;
+	uint64_t total;
+	uint32_t minutes[FPIN_HIST_MINUTES];
+	uint32_t hours[FPIN_HIST_HOURS];
+};
+
+struct fpin_hist_hdr {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t series_size;
+	uint32_t nr_series;
+	uint32_t in_use;
+	uint64_t evictions;
+	struct fpin_hist_series series[FPIN_HIST_SERIES];
+};
+
+const char *fpin_hist_file = FPIN_DEF_HIST_FILE;
+
+static struct fpin_hist_hdr *fpin_hist;
+
+/*
+ * Function:
+ *	fpin_hist_map
+ *
+ * Inputs:
+ *	1. Path of the history file.
+ *	2. Non zero to create the file and map it writable.
+ *
+ * Description:
+ *	Maps the history file. A file of another layout is reinitialized when
+ *	mapped writable and rejected otherwise.
+ */
+static struct fpin_hist_hdr *
+fpin_hist_map(const char *path, int writable) {
+	struct fpin_hist_hdr *hdr = NULL;
+	struct stat st;
+	int fd = -1;
+
+	fd = open(path, (writable ? O_RDWR | O_CREAT : O_RDONLY) | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return NULL;
+	if ((fstat(fd, &st) < 0) ||
+		((st.st_size != sizeof(struct fpin_hist_hdr)) &&
+		 (!writable || (ftruncate(fd, 0) < 0) ||
+		  (ftruncate(fd, sizeof(struct fpin_hist_hdr)) < 0)))) {
+		close(fd);
+		return NULL;
+	}
+
+	hdr = mmap(NULL, sizeof(struct fpin_hist_hdr),
+			writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (hdr == MAP_FAILED)
+		return NULL;
+
+	if ((hdr->magic != FPIN_HIST_MAGIC) || (hdr->version != FPIN_HIST_VERSION) ||
+		(hdr->series_size != sizeof(struct fpin_hist_series)) ||
+		(hdr->nr_series != FPIN_HIST_SERIES)) {
+		if (!writable) {
+			munmap(hdr, sizeof(struct fpin_hist_hdr));
+			return NULL;
+		}
+		memset(hdr, 0, sizeof(struct fpin_hist_hdr));
+		hdr->version = FPIN_HIST_VERSION;
+		hdr->series_size = sizeof(struct fpin_hist_series);
+		hdr->nr_series = FPIN_HIST_SERIES;
+		hdr->magic = FPIN_HIST_MAGIC;
+	}
+	return hdr;
+}
+
+int
+fpin_hist_init(void) {
+	char dir[FILE_PATH_LEN], *p = NULL;
+
+	if (strcmp(fpin_hist_file, "none") == 0)
+		return 0;
+
+	/* The state directory may not exist on the first start */
+	snprintf(dir, sizeof(dir), "%s", fpin_hist_file);
+	p = strrchr(dir, '/');
+	if ((p != NULL) && (p != dir)) {
+		*p = '\0';
+		mkdir(dir, 0755);
+	}
+
+	fpin_hist = fpin_hist_map(fpin_hist_file, 1);
+	if (fpin_hist == NULL) {
+		FPIN_ELOG("Failed to map LI history %s, err %d, history disabled\n",
+			fpin_hist_file, errno);
+		return -errno;
+	}
+	FPIN_ILOG("LI history %s, %u series in use\n", fpin_hist_file,
+		fpin_hist->in_use);
+	return 0;
+}
+
+static uint32_t
+fpin_hist_hash(uint32_t host_num, uint64_t wwn, uint16_t event_type) {
+	uint64_t h = wwn ^ ((uint64_t)host_num << 48) ^ ((uint64_t)event_type << 32);
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return h % FPIN_HIST_SERIES;
+}
+
+/* Finds the series of the key, or claims a free or the least recent slot */
+static struct fpin_hist_series *
+fpin_hist_lookup(struct fpin_hist_hdr *hdr, uint32_t host_num, uint64_t wwn,
+			uint16_t event_type, int create) {
+	struct fpin_hist_series *series = NULL, *victim = NULL, *free_slot = NULL;
+	uint32_t slot = fpin_hist_hash(host_num, wwn, event_type);
+	int i = 0;
+
+	for (i = 0; i < FPIN_HIST_PROBE; i++) {
+		series = &hdr->series[(slot + i) % FPIN_HIST_SERIES];
+		if (!series->in_use) {
+			if (free_slot == NULL)
+				free_slot = series;
+			continue;
+		}
+		if ((series->wwn == wwn) && (series->host_num == host_num) &&
+			(series->event_type == event_type))
+			return series;
+		if ((victim == NULL) || (series->last_minute < victim->last_minute))
+			victim = series;
+	}
+	if (!create)
+		return NULL;
+
+	if (free_slot != NULL) {
+		victim = free_slot;
+		hdr->in_use++;
+	} else {
+		hdr->evictions++;
+	}
+	memset(victim, 0, sizeof(*victim));
+	victim->wwn = wwn;
+	victim->host_num = host_num;
+	victim->event_type = event_type;
+	victim->in_use = 1;
+	return victim;
+}
+
+/*
+ * Clears the buckets between the last update and now, so stale counts of
+ * the previous lap of the ring are not summed. At most one lap is cleared.
+ */
+static void
+fpin_hist_advance(uint32_t *buckets, uint32_t nr, uint32_t last, uint32_t now) {
+	uint32_t t = 0;
+
+	if (now <= last)
+		return;
+	if (now - last >= nr) {
+		memset(buckets, 0, nr * sizeof(uint32_t));
+		return;
+	}
+	for (t = last + 1; t <= now; t++)
+		buckets[t % nr] = 0;
+}
+
+/*
+ * Function:
+ *	fpin_hist_record
+ *
+ * Inputs:
+ *	1. Host number the FPIN was received on.
+ *	2. The listed remote port WWN.
+ *	3. LI event type.
+ *
+ * Description:
+ *	Counts one event in the current minute and hour bucket of the series.
+ */
+void
+fpin_hist_record(uint32_t host_num, uint64_t wwn, uint16_t event_type) {
+	struct fpin_hist_series *series = NULL;
+	uint32_t minute = time(NULL) / 60, hour = minute / 60;
+
+	if (fpin_hist == NULL)
+		return;
+
+	series = fpin_hist_lookup(fpin_hist, host_num, wwn, event_type, 1);
+	if (series->total == 0) {
+		series->last_minute = minute;
+		series->last_hour = hour;
+	}
+	fpin_hist_advance(series->minutes, FPIN_HIST_MINUTES,
+			series->last_minute, minute);
+	fpin_hist_advance(series->hours, FPIN_HIST_HOURS, series->last_hour, hour);
+	series->minutes[minute % FPIN_HIST_MINUTES]++;
+	series->hours[hour % FPIN_HIST_HOURS]++;
+	if (minute > series->last_minute)
+		series->last_minute = minute;
+	if (hour > series->last_hour)
+		series->last_hour = hour;
+	series->total++;
+}
+
+/*
+ * Sums the buckets of the last n units up to now. Buckets not written since
+ * the last event are in the past of the ring and count as empty.
+ */
+static uint64_t
+fpin_hist_sum(const uint32_t *buckets, uint32_t nr, uint32_t last,
+			uint32_t now, uint32_t n) {
+	uint64_t sum = 0;
+	uint32_t t = 0;
+
+	if (n > nr)
+		n = nr;
+	for (t = now - n + 1; t <= now; t++) {
+		if ((t > last) || (last - t >= nr))
+			continue;
+		sum += buckets[t % nr];
+	}
+	return sum;
+}
+
+/*
+ * Function:
+ *	fpin_hist_count
+ *
+ * Inputs:
+ *	1. The series.
+ *	2. The window in seconds.
+ *
+ * Description:
+ *	Returns the number of events in the window. Windows up to
+ *	FPIN_HIST_MINUTES minutes are answered with minute resolution, longer
+ *	ones with hour resolution, up to FPIN_HIST_HOURS hours.
+ */
+static uint64_t
+fpin_hist_count(const struct fpin_hist_series *series, uint32_t window_s) {
+	uint32_t minute = time(NULL) / 60, hour = minute / 60;
+
+	if (window_s <= FPIN_HIST_MINUTES * 60)
+		return fpin_hist_sum(series->minutes, FPIN_HIST_MINUTES,
+				series->last_minute, minute, (window_s + 59) / 60);
+	return fpin_hist_sum(series->hours, FPIN_HIST_HOURS, series->last_hour,
+			hour, (window_s + 3599) / 3600);
+}
+
+/*
+ * Function:
+ *	fpin_hist_query
+ *
+ * Inputs:
+ *	The query, wwn[,window_s], wwn is a remote port WWN or * for all.
+ *
+ * Description:
+ *	Prints the event count and hourly rate over the window of every series
+ *	of the WWN, from the history file of a running or stopped daemon.
+ *	Windows longer than the history are clamped to it.
+ */
+int
+fpin_hist_query(const char *query) {
+	struct fpin_hist_hdr *hdr = NULL;
+	const struct fpin_hist_series *series = NULL;
+	uint32_t window_s = 3600, i = 0;
+	uint64_t wwn = 0, count = 0;
+	char *end = NULL;
+	int any = 0;
+
+	if (strncmp(query, "*", 1) == 0) {
+		any = 1;
+		end = (char *)query + 1;
+	} else {
+		wwn = strtoull(query, &end, 16);
+		if (end == query)
+			return -EINVAL;
+	}
+	if (*end == ',')
+		window_s = strtoul(end + 1, &end, 0);
+	if ((*end != '\0') || (window_s == 0))
+		return -EINVAL;
+	/* The ring can't answer beyond its span, nor rate over more than it */
+	if (window_s > FPIN_HIST_HOURS * 3600) {
+		window_s = FPIN_HIST_HOURS * 3600;
+		fprintf(stderr, "Window clamped to the %u seconds of history\n",
+			window_s);
+	}
+
+	hdr = fpin_hist_map(fpin_hist_file, 0);
+	if (hdr == NULL) {
+		fprintf(stderr, "No LI history in %s\n", fpin_hist_file);
+		return -ENOENT;
+	}
+
+	printf("%-6s %-18s %-6s %10s %12s %10s\n", "host", "wwn", "type",
+		"events", "per hour", "total");
+	for (i = 0; i < hdr->nr_series; i++) {
+		series = &hdr->series[i];
+		if (!series->in_use || (!any && (series->wwn != wwn)))
+			continue;
+		count = fpin_hist_count(series, window_s);
+		printf("%-6u 0x%016llx 0x%-4x %10llu %12.2f %10llu\n",
+			series->host_num, (unsigned long long)series->wwn,
+			series->event_type, (unsigned long long)count,
+			count * 3600.0 / window_s, (unsigned long long)series->total);
+	}
+
+	munmap(hdr, sizeof(struct fpin_hist_hdr));
+	return 0;
+}
+
+void
+fpin_hist_dump_stats(void) {
+	if (fpin_hist == NULL)
+		return;
+	FPIN_TLOG("history: %s series %u/%u evictions %llu\n", fpin_hist_file,
+		fpin_hist->in_use, fpin_hist->nr_series,
+		(unsigned long long)fpin_hist->evictions);
+}
@@ -0,0 +1,355 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_DM
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * I/O error corroboration.
+ *
+ * A policy rule with confirm=S does not act on the fabric's word alone.
+ * The SCSI paths of the impacted port are watched instead: the sampler
+ * thread reads the ioerr_cnt, iotmo_cnt and iodone_cnt counters of every
+ * watched sd every FPIN_IOERR_INTERVAL_MS, and plans the marginal or fail
+ * action of a path as soon as its errors and timeouts since the FPIN reach
+ * errors=N. A path that stays clean for S seconds is left alone, so a
+ * failover does not move its load onto the remaining paths for nothing.
+ *
+ * The counters are read through the fd cache of the sampler, see
+ * fpin_sio.c, so a watched attribute is opened once and then only reread.
+ * The LI consumer only queues the watches, it never waits for the reads.
+ */
+
+enum fpin_ioerr_counter {
+	FPIN_IOERR_ERR = 0,
+	FPIN_IOERR_TMO,
+	FPIN_IOERR_DONE,
+	FPIN_IOERR_NR_COUNTERS
+};
+
+struct fpin_ioerr_watch {
+	enum fpin_job_type type;
+	uint32_t host_num;
+	uint32_t event_num;
+	uint64_t p_wwn;
+	struct fpin_confirm confirm;
+	time_t start;				/* CLOCK_MONOTONIC seconds */
+	time_t deadline;
+	int sampled;				/* Baseline read, -1 if the device is gone */
+	uint32_t scored;			/* Errors already fed to the health score */
+	uint64_t base[FPIN_IOERR_NR_COUNTERS];
+	uint64_t cur[FPIN_IOERR_NR_COUNTERS];
+	char dev_name[DEV_NAME_LEN];
+	struct list_head watch_list;
+};
+
+struct fpin_pool fpin_ioerr_pool =
+	FPIN_POOL_INITIALIZER("ioerr", struct fpin_ioerr_watch);
+
+static const char *fpin_ioerr_attrs[FPIN_IOERR_NR_COUNTERS] = {
+	[FPIN_IOERR_ERR]	= "ioerr_cnt",
+	[FPIN_IOERR_TMO]	= "iotmo_cnt",
+	[FPIN_IOERR_DONE]	= "iodone_cnt",
+};
+
+/* Watches queued by the LI consumer, taken over by the sampler */
+static struct list_head fpin_ioerr_pending_head =
+			LIST_HEAD_INIT(fpin_ioerr_pending_head);
+static pthread_mutex_t fpin_ioerr_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t fpin_ioerr_cond = PTHREAD_COND_INITIALIZER;
+static struct fpin_ioerr_stats {
+	uint64_t watched;
+	uint64_t merged;
+	uint64_t corroborated;
+	uint64_t expired;
+	uint64_t gone;
+	uint64_t samples;
+	uint32_t active;
+	uint32_t max_active;
+} fpin_ioerr_stats;
+
+static time_t
+fpin_ioerr_now(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec;
+}
+
+/*
+ * Function:
+ *	fpin_ioerr_watch
+ *
+ * Inputs:
+ *	1. The action held until it is corroborated.
+ *	2. Host number of the path.
+ *	3. Event number the action is planned for.
+ *	4. sd* name of the path.
+ *	5. Port WWN of the remote port of the path.
+ *	6. The corroboration the policy rule wants.
+ *
+ * Description:
+ *	Called from the LI consumer instead of planning the action. Queues the
+ *	path to the sampler, which plans the action once the path shows the
+ *	errors. Returns 0, or -ENOMEM in which case the caller acts right away.
+ */
+int
+fpin_ioerr_watch(enum fpin_job_type type, uint32_t host_num,
+			uint32_t event_num, const char *dev_name, uint64_t p_wwn,
+			const struct fpin_confirm *confirm) {
+	struct fpin_ioerr_watch *watch = NULL;
+
+	watch = fpin_pool_get(&fpin_ioerr_pool);
+	if (watch == NULL) {
+		FPIN_CLOG("No memory to watch %s host_num %u, acting without"
+			" corroboration\n", dev_name, host_num);
+		return -ENOMEM;
+	}
+	watch->type = type;
+	watch->host_num = host_num;
+	watch->event_num = event_num;
+	watch->p_wwn = p_wwn;
+	watch->confirm = *confirm;
+	watch->start = fpin_ioerr_now();
+	watch->deadline = watch->start + confirm->window_s;
+	strncpy(watch->dev_name, dev_name, DEV_NAME_LEN - 1);
+
+	FPIN_ILOG("Holding %s of %s host_num %u until %u I/O errors within %us\n",
+		(type == FPIN_JOB_FAIL) ? "fail" : "setmarginal", dev_name, host_num,
+		confirm->errors, confirm->window_s);
+	pthread_mutex_lock(&fpin_ioerr_mutex);
+	list_add_tail(&watch->watch_list, &fpin_ioerr_pending_head);
+	fpin_ioerr_stats.watched++;
+	pthread_mutex_unlock(&fpin_ioerr_mutex);
+	pthread_cond_signal(&fpin_ioerr_cond);
+	return 0;
+}
+
+/*
+ * Moves the new watches to the active list of the sampler. A path already
+ * watched keeps its baseline and takes the later deadline, and a fail wins
+ * over a setmarginal.
+ */
+static void
+fpin_ioerr_merge(struct list_head *new_head, struct list_head *active_head) {
+	struct fpin_ioerr_watch *watch = NULL, *next = NULL, *cur = NULL;
+	int merged = 0, added = 0;
+
+	list_for_each_entry_safe(watch, next, new_head, watch_list) {
+		list_del(&watch->watch_list);
+		list_for_each_entry(cur, active_head, watch_list) {
+			if ((cur->host_num == watch->host_num) &&
+				(strcmp(cur->dev_name, watch->dev_name) == 0))
+				break;
+		}
+		if (&cur->watch_list == active_head) {
+			list_add_tail(&watch->watch_list, active_head);
+			added++;
+			continue;
+		}
+
+		if (watch->deadline > cur->deadline)
+			cur->deadline = watch->deadline;
+		if (watch->type == FPIN_JOB_FAIL)
+			cur->type = FPIN_JOB_FAIL;
+		cur->event_num = watch->event_num;
+		fpin_pool_put(&fpin_ioerr_pool, watch);
+		merged++;
+	}
+
+	pthread_mutex_lock(&fpin_ioerr_mutex);
+	fpin_ioerr_stats.merged += merged;
+	fpin_ioerr_stats.active += added;
+	if (fpin_ioerr_stats.active > fpin_ioerr_stats.max_active)
+		fpin_ioerr_stats.max_active = fpin_ioerr_stats.active;
+	pthread_mutex_unlock(&fpin_ioerr_mutex);
+}
+
+/*
+ * Reads the counters of the watches, FPIN_SIO_BATCH attributes per batch.
+ * A watch whose counters cannot be read, i.e. whose device is gone, is
+ * marked by a sampled of -1.
+ */
+static void
+fpin_ioerr_sample(struct list_head *active_head) {
+	static char paths[FPIN_SIO_BATCH][FILE_PATH_LEN];
+	static char values[FPIN_SIO_BATCH][32];
+	struct fpin_ioerr_watch *batch[FPIN_SIO_BATCH / FPIN_IOERR_NR_COUNTERS];
+	struct fpin_sio_req reqs[FPIN_SIO_BATCH];
+	struct fpin_ioerr_watch *watch = NULL;
+	int nr_watches = 0, nr = 0, i = 0, c = 0;
+
+	watch = list_first_entry(active_head, struct fpin_ioerr_watch,
+				watch_list);
+	while (&watch->watch_list != active_head) {
+		nr_watches = 0;
+		nr = 0;
+		while ((&watch->watch_list != active_head) &&
+			(nr_watches < FPIN_SIO_BATCH / FPIN_IOERR_NR_COUNTERS)) {
+			for (c = 0; c < FPIN_IOERR_NR_COUNTERS; c++, nr++) {
+				fpin_sysfs_path(paths[nr], FILE_PATH_LEN,
+						"block/%s/device/%s", watch->dev_name,
+						fpin_ioerr_attrs[c]);
+				memset(&reqs[nr], 0, sizeof(reqs[nr]));
+				reqs[nr].path = paths[nr];
+				reqs[nr].buf = values[nr];
+				reqs[nr].len = sizeof(values[nr]);
+			}
+			batch[nr_watches++] = watch;
+			watch = list_entry(watch->watch_list.next,
+						struct fpin_ioerr_watch, watch_list);
+		}
+
+		fpin_sio_batch(reqs, nr);
+		for (i = 0; i < nr_watches; i++) {
+			for (c = 0; c < FPIN_IOERR_NR_COUNTERS; c++) {
+				nr = i * FPIN_IOERR_NR_COUNTERS + c;
+				if (reqs[nr].ret <= 0) {
+					batch[i]->sampled = -1;
+					break;
+				}
+				/* The counters are printed in hex, e.g. 0x1f */
+				batch[i]->cur[c] = strtoull(values[nr], NULL, 0);
+			}
+		}
+	}
+}
+
+/*
+ * Plans the action of a watch whose errors reached the threshold and drops
+ * the watches that expired or whose device is gone. Returns 1 if the watch
+ * is done with.
+ */
+static int
+fpin_ioerr_check(struct fpin_ioerr_watch *watch, time_t now) {
+	uint32_t errors = 0, done = 0;
+
+	if (watch->sampled < 0) {
+		FPIN_ILOG("%s host_num %u is gone, dropping its watch\n",
+			watch->dev_name, watch->host_num);
+		fpin_ioerr_stats.gone++;
+		return 1;
+	}
+	if (!watch->sampled) {
+		memcpy(watch->base, watch->cur, sizeof(watch->base));
+		watch->sampled = 1;
+		return 0;
+	}
+
+	/* The counters are 32 bit in the kernel, iodone_cnt wraps */
+	errors = (uint32_t)(watch->cur[FPIN_IOERR_ERR] -
+			watch->base[FPIN_IOERR_ERR]);
+	errors += (uint32_t)(watch->cur[FPIN_IOERR_TMO] -
+			watch->base[FPIN_IOERR_TMO]);
+	done = (uint32_t)(watch->cur[FPIN_IOERR_DONE] -
+			watch->base[FPIN_IOERR_DONE]);
+	/* The watch decides on its path, the score only learns from it */
+	if (errors > watch->scored) {
+		fpin_health_signal(watch->host_num, watch->p_wwn, FPIN_HEALTH_IOERR,
+				5.0 * ((errors - watch->scored) < 10 ?
+					(errors - watch->scored) : 10));
+		watch->scored = errors;
+	}
+	if (errors >= watch->confirm.errors) {
+		FPIN_ILOG("%s host_num %u corroborated, %u I/O errors of %u"
+			" completions in %llds\n", watch->dev_name, watch->host_num,
+			errors, done, (long long)(now - watch->start));
+		fpin_dm_plan_path(watch->type, watch->host_num, watch->event_num,
+				watch->dev_name, watch->p_wwn, NULL);
+		fpin_ioerr_stats.corroborated++;
+		return 1;
+	}
+	if (now >= watch->deadline) {
+		FPIN_ILOG("%s host_num %u not corroborated, %u I/O errors of %u"
+			" completions in %llds, no action\n", watch->dev_name,
+			watch->host_num, errors, done, (long long)(now - watch->start));
+		fpin_ioerr_stats.expired++;
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * This is the I/O error sampler thread. It sleeps until a path is watched,
+ * then samples the watched paths every FPIN_IOERR_INTERVAL_MS, and right
+ * away when new paths are watched so their baseline is read early.
+ */
+void *fpin_ioerr_sampler() {
+	struct list_head active_head, new_head;
+	struct fpin_ioerr_watch *watch = NULL, *next = NULL;
+	struct timespec wake;
+	time_t now = 0;
+	int done = 0;
+
+	INIT_LIST_HEAD(&active_head);
+	INIT_LIST_HEAD(&new_head);
+	for ( ; ; ) {
+		pthread_mutex_lock(&fpin_ioerr_mutex);
+		if (list_empty(&fpin_ioerr_pending_head)) {
+			if (list_empty(&active_head)) {
+				pthread_cond_wait(&fpin_ioerr_cond, &fpin_ioerr_mutex);
+			} else {
+				fpin_trace_now(&wake);
+				wake.tv_nsec += FPIN_IOERR_INTERVAL_MS * 1000000L;
+				wake.tv_sec += wake.tv_nsec / 1000000000L;
+				wake.tv_nsec %= 1000000000L;
+				pthread_cond_timedwait(&fpin_ioerr_cond, &fpin_ioerr_mutex,
+						&wake);
+			}
+		}
+		list_splice_tail_init(&fpin_ioerr_pending_head, &new_head);
+		pthread_mutex_unlock(&fpin_ioerr_mutex);
+
+		fpin_ioerr_merge(&new_head, &active_head);
+		if (list_empty(&active_head))
+			continue;
+
+		fpin_ioerr_sample(&active_head);
+		now = fpin_ioerr_now();
+		done = 0;
+		list_for_each_entry_safe(watch, next, &active_head, watch_list) {
+			if (!fpin_ioerr_check(watch, now))
+				continue;
+			list_del(&watch->watch_list);
+			fpin_pool_put(&fpin_ioerr_pool, watch);
+			done++;
+		}
+
+		pthread_mutex_lock(&fpin_ioerr_mutex);
+		fpin_ioerr_stats.samples++;
+		fpin_ioerr_stats.active -= done;
+		pthread_mutex_unlock(&fpin_ioerr_mutex);
+	}
+	return NULL;
+}
+
+void
+fpin_ioerr_dump_stats(void) {
+	struct fpin_ioerr_stats stats;
+
+	pthread_mutex_lock(&fpin_ioerr_mutex);
+	stats = fpin_ioerr_stats;
+	pthread_mutex_unlock(&fpin_ioerr_mutex);
+
+	FPIN_TLOG("ioerr: watched %llu merged %llu corroborated %llu expired %llu"
+		" gone %llu\n", (unsigned long long)stats.watched,
+		(unsigned long long)stats.merged,
+		(unsigned long long)stats.corroborated,
+		(unsigned long long)stats.expired, (unsigned long long)stats.gone);
+	FPIN_TLOG("ioerr: active %u max active %u samples %llu\n", stats.active,
+		stats.max_active, (unsigned long long)stats.samples);
+}
@@ -0,0 +1,491 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_ELS
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * fc_host link statistics sampler.
+ *
+ * Not every HBA driver passes the FPIN ELS frames up as FCH_EVT_LINK_FPIN,
+ * and the fabric does not send an FPIN for the errors the HBA itself
+ * receives. The link error counters under
+ * /sys/class/fc_host/hostN/statistics are read every -T seconds instead,
+ * through the fd cache of the sampler (see fpin_sio.c), so every attribute
+ * is opened once and then only reread with pread. Only the change of every
+ * counter since the previous sample is kept per host, and logged.
+ *
+ * A counter whose change over an interval reaches its threshold stands in
+ * for the FPIN-LI the host did not get: an LI frame of the matching event
+ * type, detected by the HBA port and listing every remote port of the
+ * host, is queued to the LI consumer as if it had been received. It goes
+ * through the same policy, fault localization, health scoring and damping
+ * as a real one. The frame is held for one interval, and dropped if the
+ * fpin_li counter of the host moved meanwhile, i.e. the driver delivered
+ * the FPIN for the same errors itself.
+ *
+ * A link that goes down and up again, e.g. on a switch reboot or a cable
+ * reseat, bumps the link failure, loss of signal and loss of sync counters
+ * by itself, and often the CRC and transmission word counters while it
+ * comes back. The former never stand in for an FPIN, and no frame is held
+ * or sent for a host whose link went down or up since the previous
+ * sample: the LINKUP recovery would run before the frame and leave every
+ * path of the host marginal.
+ */
+
+enum fpin_link_counter {
+	FPIN_LINK_FAILURE = 0,
+	FPIN_LINK_LOSS_OF_SIGNAL,
+	FPIN_LINK_LOSS_OF_SYNC,
+	FPIN_LINK_PRIM_SEQ_ERR,
+	FPIN_LINK_INVALID_CRC,
+	FPIN_LINK_INVALID_TX_WORD,
+	FPIN_LINK_ERROR_FRAMES,
+	FPIN_LINK_FPIN_LI,
+	FPIN_LINK_FPIN_CN,
+	FPIN_LINK_NR_COUNTERS
+};
+
+/* The attributes of the counters under class/fc_host/hostN */
+static const char *const fpin_link_attrs[FPIN_LINK_NR_COUNTERS] = {
+	[FPIN_LINK_FAILURE]			= "statistics/link_failure_count",
+	[FPIN_LINK_LOSS_OF_SIGNAL]	= "statistics/loss_of_signal_count",
+	[FPIN_LINK_LOSS_OF_SYNC]	= "statistics/loss_of_sync_count",
+	[FPIN_LINK_PRIM_SEQ_ERR]	= "statistics/prim_seq_protocol_err_count",
+	[FPIN_LINK_INVALID_CRC]		= "statistics/invalid_crc_count",
+	[FPIN_LINK_INVALID_TX_WORD]	= "statistics/invalid_tx_word_count",
+	[FPIN_LINK_ERROR_FRAMES]	= "statistics/error_frames",
+	[FPIN_LINK_FPIN_LI]			= "statistics/fpin_li",
+	[FPIN_LINK_FPIN_CN]			= "statistics/fpin_cn",
+};
+
+/*
+ * The counters in the order of severity, with the LI event type they stand
+ * in for and the change per interval that makes one, 0 for none. Every
+ * link bounce moves the first three, they are only logged.
+ */
+static const struct {
+	const char *name;
+	uint16_t event_type;
+	uint32_t threshold;
+} fpin_link_counters[FPIN_LINK_NR_COUNTERS] = {
+	[FPIN_LINK_FAILURE]			= { "link_failure",
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_LINK_FAILURE, 0 },
+	[FPIN_LINK_LOSS_OF_SIGNAL]	= { "loss_of_signal",
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_LOSS_OF_SIGNAL, 0 },
+	[FPIN_LINK_LOSS_OF_SYNC]	= { "loss_of_sync",
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_LOSS_OF_SYNC, 0 },
+	[FPIN_LINK_PRIM_SEQ_ERR]	= { "prim_seq_err",
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_PRIMITIVE_ERROR, 5 },
+	[FPIN_LINK_INVALID_CRC]		= { "invalid_crc",
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC, 10 },
+	[FPIN_LINK_INVALID_TX_WORD]	= { "invalid_tx_word",
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_ITW, 100 },
+	[FPIN_LINK_ERROR_FRAMES]	= { "error_frames", 0, 0 },
+	[FPIN_LINK_FPIN_LI]			= { "fpin_li", 0, 0 },
+	[FPIN_LINK_FPIN_CN]			= { "fpin_cn", 0, 0 },
+};
+
+struct fpin_link_host {
+	uint32_t host_num;
+	uint16_t used;
+	uint16_t sampled;			/* Samples taken, 0 until last[] is valid */
+	uint16_t seen;				/* Read in the current sample */
+	uint32_t supported;			/* Bit per counter the driver reports */
+	uint16_t down;				/* LINKDOWN seen, no LINKUP yet */
+	uint16_t bounced;			/* LINKDOWN or LINKUP since the last sample */
+	int pending;				/* Counter of the held frame, -1 if none */
+	uint64_t pending_delta;
+	uint64_t last[FPIN_LINK_NR_COUNTERS];
+	uint64_t delta[FPIN_LINK_NR_COUNTERS];	/* Over the last interval */
+	uint64_t held[FPIN_LINK_NR_COUNTERS];	/* Scored at the next sample */
+	uint64_t total[FPIN_LINK_NR_COUNTERS];	/* Since the first sample */
+	uint64_t frames;			/* LI frames stood in for */
+};
+
+uint32_t fpin_link_interval = FPIN_LINK_DEF_INTERVAL;
+
+static struct fpin_link_host fpin_link_hosts[FPIN_LINK_MAX_HOSTS];
+static pthread_mutex_t fpin_link_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fpin_link_stats {
+	uint64_t samples;
+	uint64_t frames;
+	uint64_t superseded;
+	uint64_t bounced;
+	uint64_t no_rports;
+	uint64_t untracked;
+	uint32_t hosts;
+} fpin_link_stats;
+
+/* Formats the supported nonzero counters, e.g. "link_failure +1" */
+static void
+fpin_link_format(char *buf, size_t len, const uint64_t *values,
+			uint32_t supported, const char *sign) {
+	size_t off = 0;
+	int c = 0, n = 0;
+
+	buf[0] = '\0';
+	for (c = 0; (c < FPIN_LINK_NR_COUNTERS) && (off < len); c++) {
+		if (!(supported & (1U << c)) || (values[c] == 0))
+			continue;
+		n = snprintf(buf + off, len - off, "%s%s %s%llu", off ? " " : "",
+				fpin_link_counters[c].name, sign,
+				(unsigned long long)values[c]);
+		if (n < 0)
+			break;
+		off += n;
+	}
+}
+
+/* Returns the entry of a host, taking a free one for a new host */
+static struct fpin_link_host *
+fpin_link_host_of(uint32_t host_num) {
+	struct fpin_link_host *host = NULL, *free_host = NULL;
+	int i = 0;
+
+	for (i = 0; i < FPIN_LINK_MAX_HOSTS; i++) {
+		host = &fpin_link_hosts[i];
+		if (host->used && (host->host_num == host_num))
+			return host;
+		if (!host->used && (free_host == NULL))
+			free_host = host;
+	}
+	if (free_host == NULL)
+		return NULL;
+
+	free_host->used = 1;
+	free_host->host_num = host_num;
+	free_host->pending = -1;
+	fpin_link_stats.hosts++;
+	return free_host;
+}
+
+/*
+ * Takes the counters of a host read by fpin_sysfs_scan_attrs, in
+ * fpin_link_attrs order, and keeps their change since the last sample. A
+ * counter the driver does not keep reads as all ones, or not at all.
+ */
+static int
+fpin_link_host_cb(const char *name, struct fpin_sio_req *reqs, void *arg) {
+	struct fpin_link_host *host = NULL;
+	uint64_t value = 0;
+	uint32_t prev = 0;
+	unsigned long host_num = 0;
+	char *end = NULL;
+	int c = 0;
+
+	host_num = strtoul(name + strlen("host"), &end, 10);
+	if ((*end != '\0') || !fpin_rx_host_wanted(host_num))
+		return 0;
+
+	pthread_mutex_lock(&fpin_link_mutex);
+	host = fpin_link_host_of(host_num);
+	if (host == NULL) {
+		fpin_link_stats.untracked++;
+		pthread_mutex_unlock(&fpin_link_mutex);
+		return 0;
+	}
+	prev = host->supported;
+	host->supported = 0;
+	for (c = 0; c < FPIN_LINK_NR_COUNTERS; c++) {
+		host->delta[c] = 0;
+		if (reqs[c].ret <= 0)
+			continue;
+		value = strtoull(reqs[c].buf, NULL, 0);
+		if (value == UINT64_MAX)
+			continue;
+		host->supported |= 1U << c;
+		/* A reset_statistics write starts the counters over */
+		if (host->sampled && (prev & (1U << c)))
+			host->delta[c] = (value >= host->last[c]) ?
+					value - host->last[c] : value;
+		host->total[c] += host->delta[c];
+		host->last[c] = value;
+	}
+	if (host->sampled < UINT16_MAX)
+		host->sampled++;
+	host->seen = 1;
+	pthread_mutex_unlock(&fpin_link_mutex);
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_link_stand_in
+ *
+ * Inputs:
+ *	1. Host number of the HBA port whose counter crossed its threshold.
+ *	2. The counter.
+ *	3. Its change over the interval.
+ *
+ * Description:
+ *	Builds the FPIN-LI the fabric would have sent for the errors, detected
+ *	by the HBA port and listing every remote port of the host, and hands
+ *	it to the LI consumer like a received one. It has event number 0, as
+ *	it does not come from the transport. Returns 0 or -errno.
+ */
+static int
+fpin_link_stand_in(uint32_t host_num, int counter, uint64_t delta) {
+	static struct fpin_rport rports[FPIN_MAX_RPORTS];
+	static char frame[sizeof(fpin_payload_t) + FC_PAYLOAD_MAXLEN]
+			__attribute__((aligned(8)));
+	fpin_payload_t *fpin_payload = (fpin_payload_t *)frame;
+	fpin_link_integrity_request_els_t *fpin_req = NULL;
+	fpin_link_integrity_notification_t *li = NULL;
+	char path[FILE_PATH_LEN];
+	int max_ports = (FC_PAYLOAD_MAXLEN -
+			sizeof(fpin_link_integrity_request_els_t)) / sizeof(wwn_t);
+	uint64_t host_wwn = 0;
+	int nr_rports = 0, i = 0;
+
+	nr_rports = fpin_sysfs_read_rports(host_num, rports, FPIN_MAX_RPORTS);
+	if (nr_rports <= 0) {
+		FPIN_ILOG("link: host%u %s +%llu, but no remote ports to act on,"
+			" err %d\n", host_num, fpin_link_counters[counter].name,
+			(unsigned long long)delta, nr_rports);
+		pthread_mutex_lock(&fpin_link_mutex);
+		fpin_link_stats.no_rports++;
+		pthread_mutex_unlock(&fpin_link_mutex);
+		return nr_rports ? nr_rports : -ENODEV;
+	}
+	if (nr_rports > max_ports)
+		nr_rports = max_ports;
+	fpin_sysfs_path(path, sizeof(path), "class/fc_host/host%u/port_name",
+			host_num);
+	if (fpin_sysfs_read_wwn(path, &host_wwn) < 0)
+		host_wwn = 0;
+
+	memset(frame, 0, sizeof(frame));
+	fpin_req = (fpin_link_integrity_request_els_t *)fpin_payload->payload;
+	li = &fpin_req->linkIntegrityDesc;
+	fpin_req->els_header.cmd = ELS_CMD_FPIN;
+	li->header.tag = htonl(eFPIN_NOTIFICATION_DESCRIPTOR_LINK_INTEGRITY_TAG);
+	li->header.length = htonl(sizeof(*li) - sizeof(li->header) +
+				nr_rports * sizeof(wwn_t));
+	fpin_req->els_header.length = htonl(sizeof(*li) +
+				nr_rports * sizeof(wwn_t));
+	fpin_u64_to_wwn(host_wwn, &li->detecting_port_wwn);
+	li->event_type = htons(fpin_link_counters[counter].event_type);
+	li->event_threshold = htonl(fpin_link_interval * 1000);
+	li->event_count = htonl((delta > UINT32_MAX) ? UINT32_MAX : delta);
+	li->port_list.count = htonl(nr_rports);
+	for (i = 0; i < nr_rports; i++)
+		fpin_u64_to_wwn(rports[i].port_name,
+				&li->port_list.port_name_list[i]);
+
+	fpin_payload->host_num = host_num;
+	fpin_payload->length = sizeof(*fpin_req) + nr_rports * sizeof(wwn_t);
+	fpin_payload->event_num = 0;
+	fpin_trace_now(&fpin_payload->rx_ts);
+
+	FPIN_ILOG("link: host%u %s +%llu in %us, standing in for an FPIN-LI"
+		" to %d remote ports\n", host_num, fpin_link_counters[counter].name,
+		(unsigned long long)delta, fpin_link_interval, nr_rports);
+	return fpin_handle_els_frame(fpin_payload);
+}
+
+/*
+ * Decides on the counters of a host just sampled. A frame held since the
+ * previous sample is sent unless the driver delivered an FPIN or the link
+ * bounced meanwhile, and the most severe counter over its threshold holds
+ * a new one. Called with fpin_link_mutex held, returns the counter to
+ * stand in for or -1.
+ */
+static int
+fpin_link_decide(struct fpin_link_host *host, uint64_t *delta) {
+	int fpin_moved = (host->delta[FPIN_LINK_FPIN_LI] != 0);
+	int fire = -1, c = 0;
+
+	if (host->down || host->bounced) {
+		if (host->pending >= 0) {
+			FPIN_ILOG("link: host%u link bounced, dropping the held %s"
+				" frame\n", host->host_num,
+				fpin_link_counters[host->pending].name);
+			fpin_link_stats.bounced++;
+		}
+		host->pending = -1;
+		host->bounced = 0;
+		return -1;
+	}
+	if (host->pending >= 0) {
+		if (fpin_moved) {
+			FPIN_DLOG("link: host%u got the FPIN for its %s errors\n",
+				host->host_num, fpin_link_counters[host->pending].name);
+			fpin_link_stats.superseded++;
+		} else {
+			fire = host->pending;
+			*delta = host->pending_delta;
+		}
+		host->pending = -1;
+	}
+	if (fpin_moved || (fire >= 0))
+		return fire;
+
+	for (c = 0; c < FPIN_LINK_NR_COUNTERS; c++) {
+		if (!(host->supported & (1U << c)) ||
+			(fpin_link_counters[c].threshold == 0) ||
+			(host->delta[c] < fpin_link_counters[c].threshold))
+			continue;
+		host->pending = c;
+		host->pending_delta = host->delta[c];
+		break;
+	}
+	return -1;
+}
+
+/*
+ * Function:
+ *	fpin_link_event
+ *
+ * Inputs:
+ *	1. Host number the event was received on.
+ *	2. FCH_EVT_LINKDOWN or FCH_EVT_LINKUP.
+ *
+ * Description:
+ *	Called by the receiver. The counter changes of the host up to the next
+ *	sample are due to the link going down or up, so no frame is held or
+ *	sent for them, and none while the link is down.
+ */
+void
+fpin_link_event(uint32_t host_num, uint32_t event_code) {
+	struct fpin_link_host *host = NULL;
+
+	if (fpin_link_interval == 0)
+		return;
+
+	pthread_mutex_lock(&fpin_link_mutex);
+	host = fpin_link_host_of(host_num);
+	if (host != NULL) {
+		host->down = (event_code == FCH_EVT_LINKDOWN);
+		host->bounced = 1;
+	}
+	pthread_mutex_unlock(&fpin_link_mutex);
+}
+
+/*
+ * Reads the counters of every fc_host and acts on their changes. The
+ * errors of a stable link are also scored against every path of the host,
+ * see fpin_health_link_event, held for a sample like the frames.
+ */
+void
+fpin_link_sample(void) {
+	struct fpin_link_host *host = NULL;
+	uint64_t deltas[FPIN_LINK_NR_COUNTERS];
+	char changes[256];
+	uint64_t delta = 0;
+	int i = 0, c = 0, fire = -1, ret = 0;
+
+	ret = fpin_sysfs_scan_attrs("class/fc_host", "host", fpin_link_attrs,
+			FPIN_LINK_NR_COUNTERS, 0, fpin_link_host_cb, NULL);
+	if (ret < 0) {
+		FPIN_DLOG("link: could not read the fc_host statistics, err %d\n",
+			ret);
+		return;
+	}
+
+	for (i = 0; i < FPIN_LINK_MAX_HOSTS; i++) {
+		host = &fpin_link_hosts[i];
+		pthread_mutex_lock(&fpin_link_mutex);
+		if (!host->used || !host->seen) {
+			pthread_mutex_unlock(&fpin_link_mutex);
+			continue;
+		}
+		host->seen = 0;
+		fpin_link_format(changes, sizeof(changes), host->delta,
+				host->supported, "+");
+		if (host->down || host->bounced) {
+			memset(deltas, 0, sizeof(deltas));
+			memset(host->held, 0, sizeof(host->held));
+		} else {
+			memcpy(deltas, host->held, sizeof(deltas));
+			memcpy(host->held, host->delta, sizeof(host->held));
+		}
+		fire = fpin_link_decide(host, &delta);
+		pthread_mutex_unlock(&fpin_link_mutex);
+
+		if (changes[0] != '\0')
+			FPIN_ILOG("link: host%u %s\n", host->host_num, changes);
+		for (c = 0; c < FPIN_LINK_NR_COUNTERS; c++) {
+			if ((fpin_link_counters[c].threshold == 0) || (deltas[c] == 0))
+				continue;
+			fpin_health_link_event(host->host_num,
+					fpin_link_counters[c].event_type, deltas[c],
+					fpin_link_counters[c].threshold);
+		}
+		if ((fire < 0) || (fpin_link_stand_in(host->host_num, fire, delta) < 0))
+			continue;
+
+		pthread_mutex_lock(&fpin_link_mutex);
+		host->frames++;
+		fpin_link_stats.frames++;
+		pthread_mutex_unlock(&fpin_link_mutex);
+	}
+
+	pthread_mutex_lock(&fpin_link_mutex);
+	fpin_link_stats.samples++;
+	pthread_mutex_unlock(&fpin_link_mutex);
+}
+
+/*
+ * This is the link statistics sampler thread. It samples the fc_host
+ * counters every fpin_link_interval seconds, on an absolute schedule so
+ * the intervals do not drift by the time a sample takes. -T 0 disables it.
+ */
+void *fpin_link_sampler() {
+	struct timespec wake;
+
+	if (fpin_link_interval == 0)
+		return NULL;
+
+	clock_gettime(CLOCK_MONOTONIC, &wake);
+	for ( ; ; ) {
+		wake.tv_sec += fpin_link_interval;
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake,
+				NULL) == EINTR)
+			;
+		fpin_link_sample();
+	}
+	return NULL;
+}
+
+void
+fpin_link_dump_stats(void) {
+	struct fpin_link_host *host = NULL;
+	char totals[256];
+	int i = 0;
+
+	pthread_mutex_lock(&fpin_link_mutex);
+	FPIN_TLOG("link: interval %us hosts %u untracked %llu samples %llu"
+		" stood in %llu superseded %llu bounced %llu no rports %llu\n",
+		fpin_link_interval, fpin_link_stats.hosts,
+		(unsigned long long)fpin_link_stats.untracked,
+		(unsigned long long)fpin_link_stats.samples,
+		(unsigned long long)fpin_link_stats.frames,
+		(unsigned long long)fpin_link_stats.superseded,
+		(unsigned long long)fpin_link_stats.bounced,
+		(unsigned long long)fpin_link_stats.no_rports);
+	for (i = 0; i < FPIN_LINK_MAX_HOSTS; i++) {
+		host = &fpin_link_hosts[i];
+		if (!host->used)
+			continue;
+		fpin_link_format(totals, sizeof(totals), host->total,
+				host->supported, "");
+		FPIN_TLOG("link: host%u stood in %llu%s%s\n", host->host_num,
+			(unsigned long long)host->frames, totals[0] ? " " : "", totals);
+	}
+	pthread_mutex_unlock(&fpin_link_mutex);
+}
@@ -0,0 +1,329 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include "fpin.h"
+
+#define FPIN_LOG_FLUSH_INTERVAL_MS	100
+
+volatile int fpin_log_level = FPIN_LOG_DEF_LEVEL;
+volatile uint32_t fpin_log_subsys_mask = FPIN_LOG_SUBSYS_ALL;
+uint32_t fpin_log_rate = FPIN_LOG_DEF_RATE;
+
+static const char *fpin_log_subsys_names[FPIN_LOG_SUBSYS_MAX] = {
+	[FPIN_LOG_MAIN]	= "main",
+	[FPIN_LOG_ELS]	= "els",
+	[FPIN_LOG_DM]	= "dm",
+	[FPIN_LOG_SLO]	= "slo",
+	[FPIN_LOG_NVME]	= "nvme",
+};
+
+/* One log record, the message is formatted by the producer */
+struct fpin_log_rec {
+	uint64_t ts_ns;				/* CLOCK_MONOTONIC at the producer */
+	uint8_t level;
+	uint8_t subsys;
+	uint8_t trace;				/* Not rate limited */
+	uint16_t len;
+	char msg[FPIN_LOG_MSG_LEN];
+};
+
+/*
+ * Per-thread ring. head is only written by the owning thread and tail only
+ * by the flusher, so neither side needs a lock.
+ */
+struct fpin_log_ring {
+	uint32_t head;
+	uint32_t tail;
+	uint64_t dropped;
+	struct fpin_log_ring *next;
+	struct fpin_log_rec recs[FPIN_LOG_RING_SIZE];
+};
+
+static __thread struct fpin_log_ring *fpin_log_ring_self;
+static __thread int fpin_log_sync_self;
+static struct fpin_log_ring *fpin_log_rings;
+static pthread_mutex_t fpin_log_register_mutex = PTHREAD_MUTEX_INITIALIZER;
+/* Serializes the consumers, i.e. the flusher thread and exit time flush */
+static pthread_mutex_t fpin_log_flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int fpin_log_sync;
+static int fpin_log_prev_level = LOG_DEBUG;
+
+/* Token bucket per subsystem, only touched with fpin_log_flush_mutex held */
+static struct fpin_log_bucket {
+	uint64_t tokens;
+	uint64_t suppressed;
+	uint64_t suppressed_total;
+	uint64_t written;
+} fpin_log_buckets[FPIN_LOG_SUBSYS_MAX];
+static uint64_t fpin_log_last_refill_ns;
+
+static uint64_t
+fpin_log_now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct fpin_log_ring *
+fpin_log_get_ring(void) {
+	struct fpin_log_ring *ring = fpin_log_ring_self;
+
+	if (ring != NULL)
+		return ring;
+
+	ring = calloc(1, sizeof(struct fpin_log_ring));
+	if (ring == NULL)
+		return NULL;
+
+	pthread_mutex_lock(&fpin_log_register_mutex);
+	ring->next = fpin_log_rings;
+	__atomic_store_n(&fpin_log_rings, ring, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&fpin_log_register_mutex);
+	fpin_log_ring_self = ring;
+	return ring;
+}
+
+/* Sets up the ring of the calling thread ahead of its first record */
+void
+fpin_log_thread_init(void) {
+	fpin_log_get_ring();
+}
+
+/*
+ * The calling thread logs synchronously from now on, after flushing what
+ * it queued so far. For the signal thread, whose SIGUSR1 dump is longer
+ * than a ring; the thread must not hold fpin_log_flush_mutex when logging.
+ */
+void
+fpin_log_thread_sync(void) {
+	fpin_log_flush();
+	fpin_log_sync_self = 1;
+}
+
+static void
+fpin_log_vwrite(int level, int subsys, int trace, const char *fmt,
+			va_list ap) {
+	struct fpin_log_ring *ring = NULL;
+	struct fpin_log_rec *rec = NULL;
+	uint32_t head = 0, tail = 0;
+	int len = 0;
+
+	ring = (fpin_log_sync || fpin_log_sync_self) ? NULL : fpin_log_get_ring();
+	if (ring == NULL) {
+		vsyslog(level, fmt, ap);
+		return;
+	}
+
+	head = ring->head;
+	tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	if ((head - tail) >= FPIN_LOG_RING_SIZE) {
+		__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	rec = &ring->recs[head & (FPIN_LOG_RING_SIZE - 1)];
+	rec->ts_ns = fpin_log_now_ns();
+	rec->level = level;
+	rec->subsys = subsys;
+	rec->trace = trace;
+	len = vsnprintf(rec->msg, FPIN_LOG_MSG_LEN, fmt, ap);
+	if (len < 0)
+		len = 0;
+	rec->len = (len >= FPIN_LOG_MSG_LEN) ? (FPIN_LOG_MSG_LEN - 1) : len;
+	__atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Function:
+ *	fpin_log_write
+ *
+ * Inputs:
+ *	1. syslog level of the record.
+ *	2. Subsystem the record belongs to.
+ *	3. printf style format and arguments.
+ *
+ * Description:
+ *	Formats the record into the calling thread's ring. Never blocks, if the
+ *	ring is full the record is dropped and counted.
+ */
+void
+fpin_log_write(int level, int subsys, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	fpin_log_vwrite(level, subsys, 0, fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Writes a trace record at LOG_NOTICE, whatever the level and subsystem
+ * mask. The flusher does not rate limit it nor charge it to the subsystem.
+ */
+void
+fpin_log_trace(int subsys, const char *fmt, ...) {
+	va_list ap;
+
+	va_start(ap, fmt);
+	fpin_log_vwrite(LOG_NOTICE, subsys, 1, fmt, ap);
+	va_end(ap);
+}
+
+static void
+fpin_log_refill(void) {
+	uint64_t now = fpin_log_now_ns();
+	uint64_t add = 0;
+	int subsys = 0;
+
+	add = (now - fpin_log_last_refill_ns) * fpin_log_rate / 1000000000ULL;
+	if (add == 0)
+		return;
+	fpin_log_last_refill_ns = now;
+
+	for (subsys = 0; subsys < FPIN_LOG_SUBSYS_MAX; subsys++) {
+		struct fpin_log_bucket *b = &fpin_log_buckets[subsys];
+
+		b->tokens += add;
+		if (b->tokens > fpin_log_rate)
+			b->tokens = fpin_log_rate;
+		if (b->suppressed) {
+			syslog(LOG_NOTICE, "%llu %s log messages suppressed\n",
+				(unsigned long long)b->suppressed,
+				fpin_log_subsys_names[subsys]);
+			b->suppressed = 0;
+		}
+	}
+}
+
+/* Drains every registered ring. Called with fpin_log_flush_mutex held. */
+static void
+fpin_log_drain(void) {
+	struct fpin_log_ring *ring = NULL;
+	struct fpin_log_rec *rec = NULL;
+	struct fpin_log_bucket *b = NULL;
+	uint32_t head = 0, tail = 0;
+
+	fpin_log_refill();
+	for (ring = __atomic_load_n(&fpin_log_rings, __ATOMIC_ACQUIRE);
+			ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		for (tail = ring->tail; tail != head; tail++) {
+			rec = &ring->recs[tail & (FPIN_LOG_RING_SIZE - 1)];
+			b = &fpin_log_buckets[rec->subsys];
+			/* Critical and trace records are never rate limited */
+			if (rec->trace) {
+				syslog(rec->level, "%.*s", rec->len, rec->msg);
+				continue;
+			}
+			if ((rec->level > LOG_CRIT) && (b->tokens == 0)) {
+				b->suppressed++;
+				b->suppressed_total++;
+				continue;
+			}
+			if (b->tokens)
+				b->tokens--;
+			b->written++;
+			syslog(rec->level, "%.*s", rec->len, rec->msg);
+		}
+		__atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+	}
+}
+
+void
+fpin_log_flush(void) {
+	pthread_mutex_lock(&fpin_log_flush_mutex);
+	fpin_log_drain();
+	pthread_mutex_unlock(&fpin_log_flush_mutex);
+}
+
+static void *
+fpin_log_flusher(void *arg) {
+	struct timespec interval = {
+		.tv_sec = 0,
+		.tv_nsec = FPIN_LOG_FLUSH_INTERVAL_MS * 1000000L,
+	};
+
+	for ( ; ; ) {
+		nanosleep(&interval, NULL);
+		fpin_log_flush();
+	}
+	return NULL;
+}
+
+/*
+ * Starts the background flusher. Records written before this are kept in
+ * the rings and flushed on the first pass. If the thread can not be created,
+ * logging falls back to synchronous syslog.
+ */
+int
+fpin_log_init(void) {
+	pthread_t fpin_log_thread_id;
+	int subsys = 0, ret = 0;
+
+	fpin_log_last_refill_ns = fpin_log_now_ns();
+	for (subsys = 0; subsys < FPIN_LOG_SUBSYS_MAX; subsys++)
+		fpin_log_buckets[subsys].tokens = fpin_log_rate;
+
+	atexit(fpin_log_flush);
+	ret = pthread_create(&fpin_log_thread_id, NULL, fpin_log_flusher, NULL);
+	if (ret != 0) {
+		fpin_log_flush();
+		fpin_log_sync = 1;
+		syslog(LOG_ERR, "log flusher thread failed %d, logging synchronously\n",
+			ret);
+		return -ret;
+	}
+	return 0;
+}
+
+/* SIGUSR2 switches between the configured level and LOG_DEBUG */
+void
+fpin_log_toggle_debug(void) {
+	int level = fpin_log_level;
+
+	fpin_log_level = fpin_log_prev_level;
+	fpin_log_prev_level = level;
+	syslog(LOG_NOTICE, "log level set to %d\n", fpin_log_level);
+}
+
+void
+fpin_log_dump_stats(void) {
+	struct fpin_log_bucket buckets[FPIN_LOG_SUBSYS_MAX];
+	struct fpin_log_ring *ring = NULL;
+	uint64_t dropped = 0;
+	int subsys = 0;
+
+	for (ring = __atomic_load_n(&fpin_log_rings, __ATOMIC_ACQUIRE);
+			ring != NULL; ring = ring->next)
+		dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+
+	/* Copied out, a synchronous caller flushes with the mutex */
+	pthread_mutex_lock(&fpin_log_flush_mutex);
+	memcpy(buckets, fpin_log_buckets, sizeof(buckets));
+	pthread_mutex_unlock(&fpin_log_flush_mutex);
+
+	FPIN_TLOG("log: level %d mask 0x%x rate %u/s ring drops %llu\n",
+		fpin_log_level, fpin_log_subsys_mask, fpin_log_rate,
+		(unsigned long long)dropped);
+	for (subsys = 0; subsys < FPIN_LOG_SUBSYS_MAX; subsys++) {
+		FPIN_TLOG("log: subsys %s written %llu suppressed %llu\n",
+			fpin_log_subsys_names[subsys],
+			(unsigned long long)buckets[subsys].written,
+			(unsigned long long)buckets[subsys].suppressed_total);
+	}
+}
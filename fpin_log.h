@@ -0,0 +1,73 @@
+#ifndef __FPIN_LOG_H__
+#define __FPIN_LOG_H__
+
+#include <stdint.h>
+#include <syslog.h>
+
+/*
+ * Leveled, asynchronous logging.
+ *
+ * Records are formatted into a per-thread single producer/single consumer
+ * ring and written to syslog by a background thread, so the FPIN handling
+ * path never blocks on the syslog socket. A full ring drops the record and
+ * counts it instead of waiting.
+ *
+ * Levels above FPIN_LOG_MAX_LEVEL are compiled out. The remaining levels are
+ * filtered at run time against the current level and per-subsystem mask.
+ */
+
+/* Subsystems, each .c file sets FPIN_LOG_SUBSYS before including fpin.h */
+enum fpin_log_subsys {
+	FPIN_LOG_MAIN = 0,
+	FPIN_LOG_ELS,
+	FPIN_LOG_DM,
+	FPIN_LOG_SLO,
+	FPIN_LOG_NVME,
+	FPIN_LOG_SUBSYS_MAX
+};
+
+#define FPIN_LOG_SUBSYS_ALL		((1U << FPIN_LOG_SUBSYS_MAX) - 1)
+
+#ifndef FPIN_LOG_SUBSYS
+#define FPIN_LOG_SUBSYS			FPIN_LOG_MAIN
+#endif
+
+#ifndef FPIN_LOG_MAX_LEVEL
+#ifdef FPIN_DEBUG
+#define FPIN_LOG_MAX_LEVEL		LOG_DEBUG
+#else
+#define FPIN_LOG_MAX_LEVEL		LOG_NOTICE
+#endif
+#endif
+
+#define FPIN_LOG_DEF_LEVEL		LOG_INFO
+#define FPIN_LOG_DEF_RATE		1000	/* records/sec per subsystem */
+
+#define FPIN_LOG_RING_SIZE		256		/* records, power of 2 */
+#define FPIN_LOG_MSG_LEN		240
+
+/* Run time filter, adjusted with -l/-m and SIGUSR2 */
+extern volatile int fpin_log_level;
+extern volatile uint32_t fpin_log_subsys_mask;
+extern uint32_t fpin_log_rate;
+
+#define fpin_log_enabled(level, subsys) \
+	(((level) <= FPIN_LOG_MAX_LEVEL) && ((level) <= fpin_log_level) && \
+	 (fpin_log_subsys_mask & (1U << (subsys))))
+
+#define FPIN_LOG(level, fmt...) do { \
+	if (fpin_log_enabled(level, FPIN_LOG_SUBSYS)) \
+		fpin_log_write(level, FPIN_LOG_SUBSYS, fmt); \
+} while (0)
+
+void fpin_log_write(int level, int subsys, const char *fmt, ...)
+			__attribute__((format(printf, 3, 4)));
+void fpin_log_trace(int subsys, const char *fmt, ...)
+			__attribute__((format(printf, 2, 3)));
+void fpin_log_thread_sync(void);
+int fpin_log_init(void);
+void fpin_log_thread_init(void);
+void fpin_log_flush(void);
+void fpin_log_toggle_debug(void);
+void fpin_log_dump_stats(void);
+#endif
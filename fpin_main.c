@@ -23,6 +23,7 @@
 #include <fcntl.h>
 #include <pthread.h>
 #include <errno.h>
+#include <signal.h>
 #include "fpin.h"
 #include <linux/sockios.h>
 #include <linux/if.h>
@@ -31,12 +32,179 @@
 #include <linux/rtnetlink.h>
 #include <linux/ethtool.h>
 #include <linux/if_vlan.h>
+#include <linux/filter.h>
+#include <stddef.h>
 
 
 struct list_head els_marginal_list_head;
 struct list_head fpin_li_marginal_dev_list_head;
 static int fcm_fc_socket;
+
+/* Longest time the receive loop spent away from recvmsg() */
+static uint64_t fpin_rx_max_blocked_ns;
+static uint64_t fpin_rx_messages;
 #define DEF_RX_BUF_SIZE		4096
+#define DEF_RX_CMSG_SIZE	CMSG_SPACE(sizeof(struct timespec))
+
+/* FC transport events the daemon acts on, everything else is filtered */
+static const uint32_t fpin_rx_event_codes[] = {
+	FCH_EVT_LINK_FPIN,
+	FCH_EVT_LINKUP,
+	FCH_EVT_LINKDOWN,
+	FCH_EVT_RSCN,
+};
+#define FPIN_RX_NUM_EVENT_CODES	\
+	(sizeof(fpin_rx_event_codes) / sizeof(fpin_rx_event_codes[0]))
+
+/* Optional set of host_no to accept events from (-H), empty means all */
+#define FPIN_RX_MAX_HOSTS	32
+static uint16_t fpin_rx_hosts[FPIN_RX_MAX_HOSTS];
+static int fpin_rx_num_hosts;
+
+/*
+ * Receive counters. Every FC transport event carries a global event_num,
+ * so gaps between the accepted events count the events the socket filter
+ * dropped in the kernel. A socket overrun (ENOBUFS) drops messages too,
+ * the gap that follows it mixes both and is counted apart.
+ */
+static struct fpin_rx_stats {
+	uint64_t accepted;
+	uint64_t filtered;
+	uint64_t overruns;
+	uint64_t overrun_gap;		/* Lost or filtered across an overrun */
+	uint32_t last_event_num;
+	int have_event_num;
+	int overrun;				/* An overrun since the last event */
+} fpin_rx_stats;
+
+/*
+ * Longest filter program: the event code load, compares and reject, the
+ * host_no load, compares and reject, and the accept.
+ */
+#define FPIN_RX_FILTER_LEN	\
+	(5 + FPIN_RX_NUM_EVENT_CODES + FPIN_RX_MAX_HOSTS)
+
+/*
+ * Function:
+ *	fpin_attach_event_filter
+ *
+ * Inputs:
+ *	The NETLINK_SCSITRANSPORT socket.
+ *
+ * Description:
+ *	Attaches a classic BPF socket filter which admits only the event codes
+ *	in fpin_rx_event_codes and, if configured, only the hosts in
+ *	fpin_rx_hosts. The fields are in host byte order while BPF_ABS loads
+ *	convert from network order, hence the htonl/htons on the constants.
+ */
+static int
+fpin_attach_event_filter(int fd) {
+	struct sock_filter code[FPIN_RX_FILTER_LEN];
+	struct sock_fprog prog;
+	uint32_t code_off = NLMSG_HDRLEN + offsetof(struct fc_nl_event, event_code);
+	uint32_t host_off = NLMSG_HDRLEN + offsetof(struct fc_nl_event, host_no);
+	int n = 0, i = 0, ncodes = FPIN_RX_NUM_EVENT_CODES;
+
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_W | BPF_ABS,
+					code_off);
+	/* On a match jump past the remaining compares and the reject */
+	for (i = 0; i < ncodes; i++) {
+		code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+					htonl(fpin_rx_event_codes[i]), ncodes - i, 0);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+
+	if (fpin_rx_num_hosts > 0) {
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_LD | BPF_H | BPF_ABS,
+						host_off);
+		for (i = 0; i < fpin_rx_num_hosts; i++) {
+			code[n++] = (struct sock_filter)BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+						htons(fpin_rx_hosts[i]),
+						fpin_rx_num_hosts - i, 0);
+		}
+		code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0);
+	}
+	code[n++] = (struct sock_filter)BPF_STMT(BPF_RET | BPF_K, 0xffffffff);
+
+	if (n > (int)FPIN_RX_FILTER_LEN)
+		return -E2BIG;
+
+	prog.len = n;
+	prog.filter = code;
+	if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &prog, sizeof(prog)) < 0)
+		return -errno;
+	return 0;
+}
+
+/* Parses the -H list of host numbers, e.g. 3,4 */
+static int
+fpin_parse_hosts(const char *arg) {
+	char *end = NULL;
+	unsigned long host = 0;
+
+	while (*arg) {
+		if (fpin_rx_num_hosts >= FPIN_RX_MAX_HOSTS)
+			return -E2BIG;
+		host = strtoul(arg, &end, 0);
+		if ((end == arg) || (host > UINT16_MAX))
+			return -EINVAL;
+		fpin_rx_hosts[fpin_rx_num_hosts++] = host;
+		arg = (*end == ',') ? end + 1 : end;
+	}
+	return 0;
+}
+
+/* Whether the events of a host are handled, see -H */
+int
+fpin_rx_host_wanted(uint32_t host_num) {
+	int i = 0;
+
+	if (fpin_rx_num_hosts == 0)
+		return 1;
+	for (i = 0; i < fpin_rx_num_hosts; i++) {
+		if (fpin_rx_hosts[i] == host_num)
+			return 1;
+	}
+	return 0;
+}
+
+static void
+fpin_rx_account(const struct fc_nl_event *fc_event) {
+	uint32_t gap = 0;
+
+	fpin_rx_stats.accepted++;
+	if (fpin_rx_stats.have_event_num) {
+		gap = fc_event->event_num - fpin_rx_stats.last_event_num - 1;
+		if (fpin_rx_stats.overrun)
+			fpin_rx_stats.overrun_gap += gap;
+		else
+			fpin_rx_stats.filtered += gap;
+	}
+	fpin_rx_stats.last_event_num = fc_event->event_num;
+	fpin_rx_stats.have_event_num = 1;
+	fpin_rx_stats.overrun = 0;
+}
+
+/*
+ * Fetch the kernel receive time of the message from the SCM_TIMESTAMPNS
+ * control message. Falls back to the current time if the kernel did not
+ * attach one.
+ */
+static void
+fpin_get_rx_timestamp(struct msghdr *msg, struct timespec *rx_ts)
+{
+	struct cmsghdr *cmsg = NULL;
+
+	for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL;
+			cmsg = CMSG_NXTHDR(msg, cmsg)) {
+		if ((cmsg->cmsg_level == SOL_SOCKET) &&
+			(cmsg->cmsg_type == SCM_TIMESTAMPNS)) {
+			memcpy(rx_ts, CMSG_DATA(cmsg), sizeof(*rx_ts));
+			return;
+		}
+	}
+	fpin_trace_now(rx_ts);
+}
 
 /* 
  * Listen for ELS frames from driver. on receiving the frame payload,
@@ -55,9 +223,17 @@ void fpin_fabric_notification_receiver()
 	struct fc_nl_event *fc_event = NULL;
 	struct sockaddr_nl fc_local;
 	unsigned char buf[DEF_RX_BUF_SIZE];
-	size_t plen = 0;
+	size_t plen = 0, datalen = 0, len = 0;
+	struct nlmsghdr *nlh = (struct nlmsghdr *)buf;
 	int offset =0;
 	uint32_t els_cmd = 0;
+	int on = 1;
+	struct iovec iov;
+	struct msghdr msg;
+	unsigned char cmsg_buf[DEF_RX_CMSG_SIZE];
+	struct timespec busy_start, busy_end;
+	uint64_t blocked_ns = 0;
+	int busy = 0;
 
 	fd = socket(PF_NETLINK, SOCK_DGRAM, NETLINK_SCSITRANSPORT);
 	if (fd < 0) {
@@ -75,40 +251,223 @@ void fpin_fabric_notification_receiver()
 		exit(EX_NOINPUT);
 	}
 
+	rc = fpin_attach_event_filter(fd);
+	if (rc < 0) {
+		FPIN_ELOG("fc socket filter error %d, receiving all events\n", rc);
+	}
+
+	/* Kernel receive timestamps are the start of the latency trace */
+	rc = setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof(on));
+	if (rc == -1) {
+		FPIN_ELOG("fc socket SO_TIMESTAMPNS error %d, using receive time\n",
+				errno);
+	}
+
 	fpin_payload = calloc(1, fpin_payload_sz);
 	if (fpin_payload == NULL) {
 		FPIN_CLOG(" No Mem to alloc\n");
 		exit(EX_IOERR);
 	}
+	fpin_rt_thread(FPIN_RT_RECEIVER);
 
 	for ( ; ; ) {
+		if (busy) {
+			clock_gettime(CLOCK_MONOTONIC, &busy_end);
+			blocked_ns = fpin_trace_elapsed_ns(&busy_start, &busy_end);
+			if (blocked_ns > fpin_rx_max_blocked_ns)
+				fpin_rx_max_blocked_ns = blocked_ns;
+		}
 		FPIN_ILOG("Waiting for ELS...\n");
-		ret = read(fd, buf, DEF_RX_BUF_SIZE);
+		iov.iov_base = buf;
+		iov.iov_len = DEF_RX_BUF_SIZE;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cmsg_buf;
+		msg.msg_controllen = sizeof(cmsg_buf);
+		ret = recvmsg(fd, &msg, 0);
+		clock_gettime(CLOCK_MONOTONIC, &busy_start);
+		busy = 1;
+		fpin_rx_messages++;
+		if (ret < 0) {
+			if (errno == ENOBUFS) {
+				fpin_rx_stats.overruns++;
+				fpin_rx_stats.overrun = 1;
+			}
+			FPIN_ELOG("fc socket receive error %d\n", errno);
+			continue;
+		}
 		FPIN_DLOG("Got a new request\n");
+		fpin_get_rx_timestamp(&msg, &fpin_payload->rx_ts);
 
-		/* Push the frame to appropriate frame list */
-		plen = NLMSG_PAYLOAD((struct nlmsghdr *)buf, 0);
-		fc_event = (struct fc_nl_event *)NLMSG_DATA(buf);
-		if (plen < sizeof(*fc_event)) {
-			FPIN_ELOG("too short (%zu) to be an FC event", ret);
+		/*
+		 * Push the frame to appropriate frame list. Only the bytes actually
+		 * received count, neither nlmsg_len nor the frame length is trusted.
+		 */
+		len = ret;
+		if ((len >= NLMSG_HDRLEN) && (nlh->nlmsg_len < len))
+			len = nlh->nlmsg_len;
+		if (len < NLMSG_LENGTH(sizeof(*fc_event))) {
+			FPIN_ELOG("too short (%zu) to be an FC event", len);
 			continue;
 		}
-		memcpy(fpin_payload->payload, &(fc_event->event_data), fpin_payload_sz);
+		plen = len - NLMSG_LENGTH(0);
+		fc_event = (struct fc_nl_event *)NLMSG_DATA(buf);
+		fpin_rx_account(fc_event);
+		datalen = plen - offsetof(struct fc_nl_event, event_data);
+		if (fc_event->event_datalen < datalen)
+			datalen = fc_event->event_datalen;
+		if (datalen > FC_PAYLOAD_MAXLEN)
+			datalen = FC_PAYLOAD_MAXLEN;
+		memcpy(fpin_payload->payload, &(fc_event->event_data), datalen);
+		memset(fpin_payload->payload + datalen, 0,
+				FC_PAYLOAD_MAXLEN - datalen);
 		els_cmd = *(uint32_t *)fpin_payload->payload;
 		FPIN_ILOG("Got host no as %d, event 0x%x, len %d evntnum %d evntcode %d\n",
 				fc_event->host_no, els_cmd, fc_event->event_datalen,
 				fc_event->event_num, fc_event->event_code);
 		fpin_payload->host_num = fc_event->host_no;
-		fpin_payload->length = fc_event->event_datalen;
+		fpin_payload->length = datalen;
+		fpin_payload->event_num = fc_event->event_num;
+		if ((fc_event->event_code == FCH_EVT_LINKUP) ||
+			(fc_event->event_code == FCH_EVT_LINKDOWN))
+			fpin_link_event(fc_event->host_no, fc_event->event_code);
+		/* Recovery talks to multipathd, hand it off to the recovery thread */
 		if ((fc_event->event_code == FCH_EVT_LINKUP) ||
 			(fc_event->event_code == FCH_EVT_RSCN))
-			fpin_unset_marginal_dev(fc_event->host_no, &fpin_li_marginal_dev_list_head);
+			fpin_els_add_recovery_job(fc_event->host_no,
+					fc_event->event_code, fc_event->event_data);
 		if (fc_event->event_code != FCH_EVT_LINK_FPIN)
 			continue;
 		fpin_handle_els_frame(fpin_payload);
 	}
 }
 
+/*
+ * Signals are blocked in every thread and handled synchronously here.
+ * SIGUSR1 dumps the daemon statistics to syslog, SIGUSR2 toggles debug logs
+ * and SIGHUP reloads the Link Integrity policy.
+ */
+static void *
+fpin_signal_handler(void *arg)
+{
+	sigset_t *sigset = arg;
+	int sig = 0;
+
+	/* A SIGUSR1 dump is longer than a log ring, it goes straight out */
+	fpin_log_thread_sync();
+	for ( ; ; ) {
+		if (sigwait(sigset, &sig) != 0)
+			continue;
+		switch (sig) {
+		case SIGUSR1:
+			FPIN_TLOG("rx: messages %llu max blocked %lluus\n",
+				(unsigned long long)fpin_rx_messages,
+				(unsigned long long)(fpin_rx_max_blocked_ns / 1000));
+			FPIN_TLOG("rx: events accepted %llu filtered in kernel %llu "
+				"overruns %llu lost or filtered across overruns %llu\n",
+				(unsigned long long)fpin_rx_stats.accepted,
+				(unsigned long long)fpin_rx_stats.filtered,
+				(unsigned long long)fpin_rx_stats.overruns,
+				(unsigned long long)fpin_rx_stats.overrun_gap);
+			fpin_slo_dump_stats();
+			fpin_els_dump_stats();
+			fpin_act_dump_stats();
+			fpin_damp_dump_stats();
+			fpin_policy_dump_stats();
+			fpin_corr_dump_stats();
+			fpin_hist_dump_stats();
+			fpin_ioerr_dump_stats();
+			fpin_health_dump_stats();
+			fpin_link_dump_stats();
+			fpin_recon_dump_stats();
+			fpin_sio_dump_stats();
+			fpin_rt_dump_stats();
+			fpin_log_dump_stats();
+			break;
+		case SIGUSR2:
+			fpin_log_toggle_debug();
+			break;
+		case SIGHUP:
+			fpin_policy_load(fpin_policy_file);
+			break;
+		default:
+			break;
+		}
+	}
+	return NULL;
+}
+
+static void
+fpin_usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-s slo_ms] [-l level] [-m mask] [-r rate]"
+			" [-S sysfs_root] [-H host,...]\n"
+			"       [-d half_life[,suppress,reuse]] [-p policy_file]"
+			" [-f feed]\n"
+			"       [-y history_file] [-Q wwn[,window_s]]"
+			" [-w workers[:queue]]\n"
+			"       [-L queue[:policy,...]] [-E score[,slope]]"
+			" [-T interval] [-i backend]\n"
+			"       [-R priority [-A cpus]] [-n]\n", prog);
+	fprintf(stderr, "  -s slo_ms   end-to-end latency SLO per event"
+			" (default %d)\n", FPIN_DEF_SLO_MS);
+	fprintf(stderr, "  -l level    syslog level to log up to (default %d)\n",
+			FPIN_LOG_DEF_LEVEL);
+	fprintf(stderr, "  -m mask     bitmask of subsystems to log"
+			" (default 0x%x)\n", FPIN_LOG_SUBSYS_ALL);
+	fprintf(stderr, "  -r rate     log records per second per subsystem"
+			" (default %d)\n", FPIN_LOG_DEF_RATE);
+	fprintf(stderr, "  -S root     sysfs root for NVMe/FC resolution"
+			" (default %s)\n", FPIN_DEF_SYSFS_ROOT);
+	fprintf(stderr, "  -H hosts    only receive events of these host numbers"
+			" (default all)\n");
+	fprintf(stderr, "  -d damping  flap damping half life in seconds, suppress"
+			" and reuse penalties\n"
+			"              (default %d,%d,%d, 0 disables)\n",
+			FPIN_DAMP_DEF_HALF_LIFE, FPIN_DAMP_DEF_SUPPRESS,
+			FPIN_DAMP_DEF_REUSE);
+	fprintf(stderr, "  -p file     Link Integrity policy, reloaded on SIGHUP"
+			" (default %s)\n", FPIN_DEF_POLICY_FILE);
+	fprintf(stderr, "  -f feed     shared memory event feed, none disables"
+			" (default %s)\n", FPIN_FEED_NAME);
+	fprintf(stderr, "  -y file     LI history file, none disables"
+			" (default %s)\n", FPIN_DEF_HIST_FILE);
+	fprintf(stderr, "  -Q query    print the LI history of a remote port WWN"
+			" (* for all) over\n"
+			"              window_s seconds (default 3600) and exit\n");
+	fprintf(stderr, "  -w workers  actuation worker threads, 1 to %d"
+			" (default %d), and the\n"
+			"              actions queued per worker (default %d)\n",
+			FPIN_MAX_ACT_WORKERS, FPIN_DEF_ACT_WORKERS, FPIN_DEF_ACT_QUEUE);
+	fprintf(stderr, "  -L queue    LI frames queued at most (default %d), and"
+			" what to do when full:\n"
+			"              coalesce, drop-oldest, drop-low in order"
+			" (default all), or none\n", FPIN_DEF_LI_QUEUE);
+	fprintf(stderr, "  -E score    set marginal the paths to a remote port whose"
+			" health score and\n"
+			"              slope per minute reach score,slope (default 0,"
+			" off)\n");
+	fprintf(stderr, "  -T secs     fc_host link statistics sampling interval,"
+			" 0 disables (default %d, off)\n", FPIN_LINK_DEF_INTERVAL);
+#ifdef FPIN_HAVE_LIBURING
+	fprintf(stderr, "  -i backend  sysfs attribute I/O, io_uring or psync"
+			" (default io_uring)\n");
+#else
+	fprintf(stderr, "  -i backend  sysfs attribute I/O, psync only, built"
+			" without liburing\n");
+#endif
+	fprintf(stderr, "  -R prio     real-time mode, locked memory, reserved pools"
+			" and SCHED_FIFO\n"
+			"              prio 1-99 for the receiver, consumer and"
+			" workers\n");
+	fprintf(stderr, "  -A cpus     CPUs of the real-time threads, e.g."
+			" 2,3 or 4-7\n");
+	fprintf(stderr, "  -n          shadow mode, resolve and time every event"
+			" but only log the\n"
+			"              actions, feed and history default to none\n");
+}
+
 /*
  * FPIN daemon main(). Sleeps on read until an FPIn ELS frame is recieved from
  * HBA driver.
@@ -117,14 +476,161 @@ int
 main(int argc, char *argv[])
 {
 
-	int ret = -1;
-	pthread_t fpin_consumer_thread_id;
+	int ret = -1, opt = 0, feed_set = 0, hist_set = 0;
+	const char *query = NULL;
+	pthread_t fpin_consumer_thread_id, fpin_signal_thread_id;
+	pthread_t fpin_recovery_thread_id, fpin_checker_thread_id;
+	pthread_t fpin_ioerr_thread_id, fpin_link_thread_id;
+	pthread_t fpin_recon_thread_id;
+	static sigset_t sigset;
+
+	while ((opt = getopt(argc, argv, "s:l:m:r:S:H:d:p:f:y:Q:w:L:E:T:i:R:A:nh")) != -1) {
+		switch (opt) {
+		case 's':
+			fpin_slo_budget_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			fpin_log_level = strtol(optarg, NULL, 0);
+			break;
+		case 'm':
+			fpin_log_subsys_mask = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			fpin_log_rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'S':
+			fpin_sysfs_root = optarg;
+			break;
+		case 'H':
+			if (fpin_parse_hosts(optarg) < 0) {
+				fprintf(stderr, "Invalid host list %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'd':
+			if (fpin_damp_parse_config(optarg) < 0) {
+				fprintf(stderr, "Invalid damping parameters %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'p':
+			fpin_policy_file = optarg;
+			break;
+		case 'f':
+			fpin_feed_name = optarg;
+			feed_set = 1;
+			break;
+		case 'y':
+			fpin_hist_file = optarg;
+			hist_set = 1;
+			break;
+		case 'Q':
+			query = optarg;
+			break;
+		case 'w':
+			if (fpin_act_parse_config(optarg) < 0) {
+				fprintf(stderr, "Invalid actuation workers %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'L':
+			if (fpin_els_parse_queue(optarg) < 0) {
+				fprintf(stderr, "Invalid LI queue %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'E':
+			if (fpin_health_parse_config(optarg) < 0) {
+				fprintf(stderr, "Invalid health thresholds %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'T':
+			fpin_link_interval = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			if (fpin_sio_parse_backend(optarg) < 0) {
+				fprintf(stderr, "Invalid I/O backend %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'R':
+			fpin_rt_prio = strtol(optarg, NULL, 0);
+			if ((fpin_rt_prio < 1) || (fpin_rt_prio > 99)) {
+				fprintf(stderr, "Invalid real-time priority %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'A':
+			if (fpin_rt_parse_cpus(optarg) < 0) {
+				fprintf(stderr, "Invalid CPU list %s\n", optarg);
+				exit(EX_USAGE);
+			}
+			break;
+		case 'n':
+			fpin_shadow_mode = 1;
+			break;
+		case 'h':
+		default:
+			fpin_usage(argv[0]);
+			exit(opt == 'h' ? 0 : EX_USAGE);
+		}
+	}
 
-	setlogmask (LOG_UPTO (LOG_INFO));
+	if (query != NULL) {
+		ret = fpin_hist_query(query);
+		if (ret == -EINVAL)
+			fpin_usage(argv[0]);
+		exit(ret ? EX_USAGE : 0);
+	}
+
+	/*
+	 * A shadow daemon runs next to the production one, it must not replace
+	 * its feed or add to its history unless asked to.
+	 */
+	if (fpin_shadow_mode) {
+		if (!feed_set)
+			fpin_feed_name = "none";
+		if (!hist_set)
+			fpin_hist_file = "none";
+	}
+
+	/* Filtering is done by the daemon logger, see fpin_log.h */
+	setlogmask (LOG_UPTO (LOG_DEBUG));
 	openlog("FCTXPTD", LOG_PID, LOG_USER);
 	INIT_LIST_HEAD(&els_marginal_list_head);
 	INIT_LIST_HEAD(&fpin_li_marginal_dev_list_head);
 
+	/* Block the handled signals before any thread inherits the mask */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	sigaddset(&sigset, SIGUSR2);
+	sigaddset(&sigset, SIGHUP);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+	fpin_log_init();
+	if (fpin_shadow_mode)
+		FPIN_TLOG("Shadow mode, actions are logged as plan records only\n");
+	if (fpin_policy_load(fpin_policy_file) < 0) {
+		FPIN_CLOG("Invalid policy file %s\n", fpin_policy_file);
+		exit(EX_CONFIG);
+	}
+	fpin_feed_init();
+	fpin_hist_init();
+	/* Before the threads start, so their memory is locked as it is mapped */
+	ret = fpin_rt_init();
+	if (ret != 0)
+		exit (EX_OSERR);
+	ret = fpin_act_init();
+	if (ret != 0)
+		exit (ret);
+	ret = pthread_create(&fpin_signal_thread_id, NULL,
+				fpin_signal_handler, &sigset);
+	if (ret != 0) {
+		FPIN_CLOG("pthread_create failed for signal thread, err %d, %s\n",
+				ret, strerror(errno));
+		exit (ret);
+	}
+
 	/*
 	 *	A thread to process notifications from FC fabric.
 	 */
@@ -136,6 +642,63 @@ main(int argc, char *argv[])
 		exit (ret);
 	}
 
+	/*
+	 *	A thread to recover marginal paths on LINKUP/RSCN.
+	 */
+	ret = pthread_create(&fpin_recovery_thread_id, NULL,
+				fpin_els_recovery_consumer, NULL);
+	if (ret != 0) {
+		FPIN_CLOG("pthread_create failed for recovery thread, err %d, %s\n",
+				ret, strerror(errno));
+		exit (ret);
+	}
+
+	/*
+	 *	A thread to recover damped paths once their penalty has decayed.
+	 */
+	ret = pthread_create(&fpin_checker_thread_id, NULL,
+				fpin_li_marginal_checker, NULL);
+	if (ret != 0) {
+		FPIN_CLOG("pthread_create failed for checker thread, err %d, %s\n",
+				ret, strerror(errno));
+		exit (ret);
+	}
+
+	/*
+	 *	A thread to corroborate held actions with the I/O error counters.
+	 */
+	ret = pthread_create(&fpin_ioerr_thread_id, NULL,
+				fpin_ioerr_sampler, NULL);
+	if (ret != 0) {
+		FPIN_CLOG("pthread_create failed for I/O error sampler thread,"
+				" err %d, %s\n", ret, strerror(errno));
+		exit (ret);
+	}
+
+	/*
+	 *	A thread to sample the link statistics of the fc_hosts, standing in
+	 *	for the FPINs of the HBAs whose driver does not deliver them.
+	 */
+	ret = pthread_create(&fpin_link_thread_id, NULL,
+				fpin_link_sampler, NULL);
+	if (ret != 0) {
+		FPIN_CLOG("pthread_create failed for link statistics thread,"
+				" err %d, %s\n", ret, strerror(errno));
+		exit (ret);
+	}
+
+	/*
+	 *	A thread to keep the marginal device list in line with the devices
+	 *	and multipathd, see fpin_recon.c.
+	 */
+	ret = pthread_create(&fpin_recon_thread_id, NULL,
+				fpin_recon_monitor, NULL);
+	if (ret != 0) {
+		FPIN_CLOG("pthread_create failed for reconciliation thread,"
+				" err %d, %s\n", ret, strerror(errno));
+		exit (ret);
+	}
+
 	/*
 	 * Non returning function, waits on netlink socket to recieve FPIN frames 
 	 * from HBA. This function returning back implies there is some error in
@@ -0,0 +1,244 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_NVME
+#include "fpin.h"
+
+/*
+ * NVMe over FC paths are not managed by multipathd, native NVMe multipath
+ * picks the path in the kernel, from the ANA state the target reports. The
+ * host has no control to demote a path: the daemon writes Marginal to the
+ * port_state of the FC remote port behind the controller, as for the SCSI
+ * paths, and Online back on recovery. This is best effort. The rport
+ * port_state is a SCSI transport attribute, nvme-fc keeps remote ports of
+ * its own and mainline native multipath does not look at it, so on such a
+ * kernel NVMe I/O is not moved. I/O only moves on kernels whose nvme-fc
+ * marks the controllers of a marginal link themselves and has native
+ * multipath prefer their other paths. Either way the controllers are
+ * logged, published to the event feed and kept in the marginal list, so
+ * the rport is recovered and the action is visible to the operator.
+ *
+ * All accesses go through fpin_sysfs_root, so the resolution can be run
+ * against a synthetic sysfs tree.
+ */
+
+/*
+ * Function:
+ *	fpin_nvme_addr_pn
+ *
+ * Inputs:
+ *	1. The address attribute of an nvme-fc controller, of the form
+ *	   traddr=nn-0x<wwnn>:pn-0x<wwpn>,host_traddr=nn-0x<wwnn>:pn-0x<wwpn>
+ *	2. The field to look up, traddr or host_traddr.
+ *	3. Returns the port name as a 64 bit WWN.
+ *
+ * Description:
+ *	Extracts the port name (pn-) of the given field, which has the same
+ *	0x<hex> format as the port_name attributes of fc_host and
+ *	fc_remote_ports.
+ */
+static int
+fpin_nvme_addr_pn(const char *addr, const char *key, uint64_t *pn) {
+	const char *field = addr, *val = NULL, *end = NULL, *p = NULL;
+	size_t key_len = strlen(key);
+
+	while ((field != NULL) && (*field != '\0')) {
+		if ((strncmp(field, key, key_len) == 0) && (field[key_len] == '=')) {
+			val = field + key_len + 1;
+			end = strchr(val, ',');
+			if (end == NULL)
+				end = val + strlen(val);
+			p = strstr(val, "pn-");
+			if ((p == NULL) || (p >= end))
+				return -EINVAL;
+			p += 3;
+			return fpin_sysfs_parse_wwn(p, end - p, pn);
+		}
+		field = strchr(field, ',');
+		if (field != NULL)
+			field++;
+	}
+
+	return -ENOENT;
+}
+
+/* Logs the namespace paths behind a controller, part of the action plan */
+static int
+fpin_nvme_log_namespaces(const char *ctrl) {
+	char path[FILE_PATH_LEN];
+	struct dirent *entry = NULL;
+	DIR *dir = NULL;
+	int ns_count = 0;
+
+	if (fpin_sysfs_path(path, sizeof(path), "class/nvme/%s", ctrl) < 0)
+		return 0;
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
+
+	while ((entry = readdir(dir)) != NULL) {
+		/* nvme<subsys>c<ctrl>n<ns> with native multipath, nvme<ctrl>n<ns> without */
+		if ((strncmp(entry->d_name, "nvme", 4) != 0) ||
+			(strchr(entry->d_name, 'n') == strrchr(entry->d_name, 'n')))
+			continue;
+		FPIN_ILOG("%s namespace path %s\n", ctrl, entry->d_name);
+		ns_count++;
+	}
+
+	closedir(dir);
+	return ns_count;
+}
+
+/*
+ * Function:
+ *	fpin_nvme_marginal_path
+ *
+ * Inputs:
+ *	1. The list of impacted port WWNs of the event.
+ *	2. Latency trace of the event being processed.
+ *
+ * Description:
+ *	Maps the impacted remote port WWNs to the nvme-fc controllers reached
+ *	through the HBA port the FPIN was received on, and marks their remote
+ *	ports Marginal, best effort, see above. Every controller is added
+ *	to the marginal device list, so LINKUP/RSCN recovers it, and its rport
+ *	write is queued to the actuation workers. Returns the number of
+ *	controllers queued.
+ */
+int
+fpin_nvme_marginal_path(struct wwn_list *list, struct fpin_event_trace *trace) {
+	char path[FILE_PATH_LEN], value[NVME_ADDR_LEN];
+	uint64_t host_pn = 0, ctrl_host_pn = 0, tgt_pn = 0;
+	struct dirent *entry = NULL;
+	DIR *dir = NULL;
+	int ctrl_count = 0;
+
+	fpin_sysfs_path(path, sizeof(path), "class/fc_host/host%u/port_name",
+			list->host_num);
+	if (fpin_sysfs_read_wwn(path, &host_pn) < 0) {
+		FPIN_DLOG("No fc_host port_name for host%u\n", list->host_num);
+		return 0;
+	}
+
+	if (fpin_sysfs_path(path, sizeof(path), "class/nvme") < 0)
+		return 0;
+	dir = opendir(path);
+	if (dir == NULL) {
+		FPIN_DLOG("No nvme controllers, err %d\n", errno);
+		return 0;
+	}
+
+	while ((entry = readdir(dir)) != NULL) {
+		if (strncmp(entry->d_name, "nvme", 4) != 0)
+			continue;
+
+		fpin_sysfs_path(path, sizeof(path), "class/nvme/%s/transport",
+				entry->d_name);
+		if ((fpin_sysfs_read_attr(path, value, sizeof(value)) <= 0) ||
+			(strcmp(value, "fc") != 0))
+			continue;
+
+		fpin_sysfs_path(path, sizeof(path), "class/nvme/%s/address",
+				entry->d_name);
+		if (fpin_sysfs_read_attr(path, value, sizeof(value)) <= 0)
+			continue;
+		if ((fpin_nvme_addr_pn(value, "host_traddr", &ctrl_host_pn) < 0) ||
+			(fpin_nvme_addr_pn(value, "traddr", &tgt_pn) < 0)) {
+			FPIN_ELOG("Could not parse %s address %s\n", entry->d_name, value);
+			continue;
+		}
+
+		/* Only controllers reached through the port that got the FPIN */
+		if (ctrl_host_pn != host_pn)
+			continue;
+		if (!fpin_els_wwn_exists(list, tgt_pn))
+			continue;
+
+		FPIN_ILOG("setting marginal nvme ctrl %s p_wwn 0x%016llx"
+				" host_num %u\n", entry->d_name, (unsigned long long)tgt_pn,
+				list->host_num);
+		fpin_nvme_log_namespaces(entry->d_name);
+
+		fpin_add_marginal_dev_info(list->host_num, entry->d_name,
+				FPIN_DEV_NVME, tgt_pn);
+		if (fpin_act_submit(FPIN_JOB_NVME_MARGINAL, FPIN_DEV_NVME,
+				list->host_num, list->event_num, entry->d_name, tgt_pn,
+				trace) < 0) {
+			fpin_del_marginal_dev_info(list->host_num, entry->d_name);
+			continue;
+		}
+		ctrl_count++;
+	}
+
+	closedir(dir);
+	return ctrl_count;
+}
+
+/*
+ * Marks the remote port of an nvme-fc controller Marginal on its actuation
+ * worker, whether or not the kernel moves NVMe I/O for it. Returns 0 or
+ * the error of the rport write.
+ */
+int
+fpin_nvme_actuate(struct fpin_act_job *job) {
+	struct timespec stage_start;
+	int ret = 0;
+
+	fpin_trace_now(&stage_start);
+	ret = fpin_sysfs_set_rport_state(job->host_num, job->event_num,
+			job->p_wwn, "Marginal");
+	fpin_trace_stage(job->trace, FPIN_STAGE_RPORT, &stage_start);
+	if (ret < 0) {
+		FPIN_ELOG("failed to set the rport state :0x%016llx\n",
+				(unsigned long long)job->p_wwn);
+		fpin_del_marginal_dev_info(job->host_num, job->dev_name);
+		return ret;
+	}
+
+	fpin_trace_action(job->trace);
+	fpin_feed_path_action(FPIN_FEED_MARGINAL, job->host_num, job->event_num,
+			job->dev_name, job->p_wwn);
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_nvme_unset_marginal
+ *
+ * Inputs:
+ *	1. Host number of the HBA port.
+ *	2. The nvme controller that was marked marginal.
+ *	3. Port WWN of its remote port.
+ *
+ * Description:
+ *	Puts the remote port of the controller back Online.
+ */
+int
+fpin_nvme_unset_marginal(uint32_t host_num, const char *ctrl,
+			uint64_t p_wwn) {
+	int ret = 0;
+
+	ret = fpin_sysfs_set_rport_state(host_num, 0, p_wwn, "Online");
+	if (ret < 0) {
+		FPIN_ELOG("Unable to unset marginal nvme ctrl %s p_wwn 0x%016llx,"
+				" err %d\n", ctrl, (unsigned long long)p_wwn, ret);
+		return ret;
+	}
+
+	FPIN_ILOG("Unset marginal nvme ctrl %s p_wwn 0x%016llx host_num %u\n",
+			ctrl, (unsigned long long)p_wwn, host_num);
+	return 0;
+}
@@ -0,0 +1,508 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_ELS
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * Link Integrity policy.
+ *
+ * The policy file is a list of rules, one per line:
+ *
+ *	<event type> <host> <remote WWN prefix> <action> [after=N] [window=S]
+ *		[confirm=S [errors=N]]
+ *
+ * The first rule matching the event type, the host the FPIN was received on
+ * and the impacted port WWN decides the action for that WWN. '*' matches any
+ * event type, host or WWN. A rule with after=N only acts from the Nth
+ * matching event for the same host and WWN within window seconds, the events
+ * before that are only counted. A rule with confirm=S holds the action of
+ * the SCSI paths of the WWN until the host sees errors=N (default 1) I/O
+ * errors or timeouts on them within S seconds, see fpin_ioerr.c.
+ * "default <action>" sets the action when no rule matches, marginal unless
+ * configured.
+ *
+ * The rules are compiled into one rule index per event type, so a lookup
+ * only visits the rules that can match the event type. A compiled policy is
+ * immutable apart from its counters and is reference counted: a reload on
+ * SIGHUP builds a new one and swaps the pointer, events in flight finish
+ * with the policy they started with.
+ */
+
+#define FPIN_POLICY_LINE_LEN	256
+#define FPIN_POLICY_TRACK_SLOTS	64
+
+/* Per rule state of after=N rules, direct mapped on host and WWN */
+struct fpin_policy_track {
+	uint64_t wwn;
+	uint32_t host_num;
+	uint32_t count;
+	time_t first;
+};
+
+struct fpin_policy_rule {
+	uint32_t event_type;		/* FPIN_POLICY_ANY for '*' */
+	uint32_t host_num;			/* FPIN_POLICY_ANY for '*' */
+	uint64_t wwn_prefix;
+	uint64_t wwn_mask;			/* 0 for '*' */
+	enum fpin_policy_action action;
+	uint32_t after;
+	uint32_t window_s;
+	struct fpin_confirm confirm;
+	int line;
+	uint64_t hits;
+	struct fpin_policy_track *track;
+};
+
+struct fpin_policy {
+	int refcnt;
+	int nr_rules;
+	enum fpin_policy_action def_action;
+	struct fpin_policy_rule *rules;
+	/* Rule indexes per event type, in file order, terminated by -1 */
+	int *by_type[FPIN_POLICY_NR_TYPES];
+	uint64_t def_hits;
+	char path[FILE_PATH_LEN];
+};
+
+const char *fpin_policy_file = FPIN_DEF_POLICY_FILE;
+
+static struct fpin_policy *fpin_policy_cur;
+static pthread_mutex_t fpin_policy_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t fpin_policy_actions[FPIN_ACT_MAX];
+static uint64_t fpin_policy_reloads;
+
+static const char *fpin_policy_action_names[FPIN_ACT_MAX] = {
+	[FPIN_ACT_IGNORE]	= "ignore",
+	[FPIN_ACT_COUNT]	= "count",
+	[FPIN_ACT_MARGINAL]	= "marginal",
+	[FPIN_ACT_FAIL]		= "fail",
+};
+
+/* Indexed by FPIN_LINK_INTEGRITY_EVENT_TYPE_* */
+static const char *fpin_policy_type_names[] = {
+	"unknown", "link-failure", "loss-of-sync", "loss-of-signal",
+	"primitive-error", "invalid-tx-word", "crc", "device-specific",
+};
+
+#define FPIN_POLICY_NR_NAMED_TYPES	\
+	((int)(sizeof(fpin_policy_type_names) / sizeof(fpin_policy_type_names[0])))
+
+const char *
+fpin_policy_action_name(enum fpin_policy_action action) {
+	return fpin_policy_action_names[action];
+}
+
+/* Event types beyond the named ones share the last slot of the index */
+static int
+fpin_policy_type_slot(uint32_t event_type) {
+	return (event_type < FPIN_POLICY_NR_TYPES - 1) ?
+		event_type : FPIN_POLICY_NR_TYPES - 1;
+}
+
+static void
+fpin_policy_free(struct fpin_policy *policy) {
+	int i = 0;
+
+	if (policy == NULL)
+		return;
+	for (i = 0; i < policy->nr_rules; i++)
+		free(policy->rules[i].track);
+	for (i = 0; i < FPIN_POLICY_NR_TYPES; i++)
+		free(policy->by_type[i]);
+	free(policy->rules);
+	free(policy);
+}
+
+static int
+fpin_policy_parse_action(const char *str, enum fpin_policy_action *action) {
+	int i = 0;
+
+	for (i = 0; i < FPIN_ACT_MAX; i++) {
+		if (strcmp(str, fpin_policy_action_names[i]) == 0) {
+			*action = i;
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int
+fpin_policy_parse_type(const char *str, uint32_t *event_type) {
+	char *end = NULL;
+	int i = 0;
+
+	if (strcmp(str, "*") == 0) {
+		*event_type = FPIN_POLICY_ANY;
+		return 0;
+	}
+	for (i = 0; i < FPIN_POLICY_NR_NAMED_TYPES; i++) {
+		if (strcmp(str, fpin_policy_type_names[i]) == 0) {
+			*event_type = i;
+			return 0;
+		}
+	}
+	*event_type = strtoul(str, &end, 0);
+	if ((end == str) || (*end != '\0') || (*event_type > UINT16_MAX))
+		return -EINVAL;
+	return 0;
+}
+
+/* Parses a WWN prefix such as 0x500604, 16 hex digits make a full WWN */
+static int
+fpin_policy_parse_wwn(const char *str, uint64_t *prefix, uint64_t *mask) {
+	char *end = NULL;
+	size_t digits = 0;
+
+	if (strcmp(str, "*") == 0) {
+		*prefix = 0;
+		*mask = 0;
+		return 0;
+	}
+	if (strncasecmp(str, "0x", 2) == 0)
+		str += 2;
+	digits = strlen(str);
+	if ((digits == 0) || (digits > 16))
+		return -EINVAL;
+	*prefix = strtoull(str, &end, 16);
+	if (*end != '\0')
+		return -EINVAL;
+
+	*mask = ~0ULL << (64 - 4 * digits);
+	*prefix <<= (64 - 4 * digits);
+	return 0;
+}
+
+static int
+fpin_policy_parse_rule(struct fpin_policy_rule *rule, char **tok, int ntok) {
+	char *end = NULL;
+	int i = 0;
+
+	if (ntok < 4)
+		return -EINVAL;
+	if (fpin_policy_parse_type(tok[0], &rule->event_type) < 0)
+		return -EINVAL;
+	if (strcmp(tok[1], "*") == 0) {
+		rule->host_num = FPIN_POLICY_ANY;
+	} else {
+		if (strncmp(tok[1], "host", 4) == 0)
+			tok[1] += 4;
+		rule->host_num = strtoul(tok[1], &end, 0);
+		if ((end == tok[1]) || (*end != '\0'))
+			return -EINVAL;
+	}
+	if (fpin_policy_parse_wwn(tok[2], &rule->wwn_prefix, &rule->wwn_mask) < 0)
+		return -EINVAL;
+	if (fpin_policy_parse_action(tok[3], &rule->action) < 0)
+		return -EINVAL;
+
+	rule->after = 1;
+	rule->confirm.errors = 1;
+	for (i = 4; i < ntok; i++) {
+		if (strncmp(tok[i], "after=", 6) == 0)
+			rule->after = strtoul(tok[i] + 6, &end, 0);
+		else if (strncmp(tok[i], "window=", 7) == 0)
+			rule->window_s = strtoul(tok[i] + 7, &end, 0);
+		else if (strncmp(tok[i], "confirm=", 8) == 0)
+			rule->confirm.window_s = strtoul(tok[i] + 8, &end, 0);
+		else if (strncmp(tok[i], "errors=", 7) == 0)
+			rule->confirm.errors = strtoul(tok[i] + 7, &end, 0);
+		else
+			return -EINVAL;
+		if (*end != '\0')
+			return -EINVAL;
+	}
+	if ((rule->after == 0) || (rule->confirm.errors == 0))
+		return -EINVAL;
+	if (rule->after > 1) {
+		rule->track = calloc(FPIN_POLICY_TRACK_SLOTS,
+					sizeof(struct fpin_policy_track));
+		if (rule->track == NULL)
+			return -ENOMEM;
+	}
+	return 0;
+}
+
+/* Builds the per event type rule indexes */
+static int
+fpin_policy_compile(struct fpin_policy *policy) {
+	int slot = 0, i = 0, n = 0;
+
+	for (slot = 0; slot < FPIN_POLICY_NR_TYPES; slot++) {
+		policy->by_type[slot] = malloc((policy->nr_rules + 1) * sizeof(int));
+		if (policy->by_type[slot] == NULL)
+			return -ENOMEM;
+		n = 0;
+		for (i = 0; i < policy->nr_rules; i++) {
+			if ((policy->rules[i].event_type == FPIN_POLICY_ANY) ||
+				(fpin_policy_type_slot(policy->rules[i].event_type) == slot))
+				policy->by_type[slot][n++] = i;
+		}
+		policy->by_type[slot][n] = -1;
+	}
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_policy_parse
+ *
+ * Inputs:
+ *	Path of the policy file.
+ *
+ * Description:
+ *	Reads and compiles the policy file. A missing file yields an empty
+ *	policy, i.e. every LI event marks the impacted paths marginal. Any
+ *	syntax error fails the whole file.
+ */
+static struct fpin_policy *
+fpin_policy_parse(const char *path, int *err) {
+	char line[FPIN_POLICY_LINE_LEN], *tok[8], *save = NULL, *p = NULL;
+	struct fpin_policy *policy = NULL;
+	struct fpin_policy_rule *rules = NULL;
+	int ntok = 0, lineno = 0, max_rules = 0;
+	FILE *fp = NULL;
+
+	*err = 0;
+	policy = calloc(1, sizeof(struct fpin_policy));
+	if (policy == NULL) {
+		*err = -ENOMEM;
+		return NULL;
+	}
+	policy->refcnt = 1;
+	policy->def_action = FPIN_ACT_MARGINAL;
+	snprintf(policy->path, sizeof(policy->path), "%s", path);
+
+	fp = fopen(path, "re");
+	if (fp == NULL) {
+		if (errno != ENOENT) {
+			*err = -errno;
+			goto error;
+		}
+		FPIN_DLOG("No policy file %s, using the default policy\n", path);
+		goto compile;
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		p = strchr(line, '#');
+		if (p != NULL)
+			*p = '\0';
+		ntok = 0;
+		for (p = strtok_r(line, " \t\r\n", &save); (p != NULL) && (ntok < 8);
+				p = strtok_r(NULL, " \t\r\n", &save))
+			tok[ntok++] = p;
+		if (ntok == 0)
+			continue;
+
+		if (strcmp(tok[0], "default") == 0) {
+			if ((ntok != 2) ||
+				(fpin_policy_parse_action(tok[1], &policy->def_action) < 0))
+				goto syntax;
+			continue;
+		}
+
+		if (policy->nr_rules == max_rules) {
+			max_rules = max_rules ? max_rules * 2 : 16;
+			rules = realloc(policy->rules,
+					max_rules * sizeof(struct fpin_policy_rule));
+			if (rules == NULL) {
+				*err = -ENOMEM;
+				goto error;
+			}
+			policy->rules = rules;
+		}
+		memset(&policy->rules[policy->nr_rules], 0,
+				sizeof(struct fpin_policy_rule));
+		policy->rules[policy->nr_rules].line = lineno;
+		/* Counted first, so fpin_policy_free releases a partial rule */
+		policy->nr_rules++;
+		if (fpin_policy_parse_rule(&policy->rules[policy->nr_rules - 1],
+					tok, ntok) < 0)
+			goto syntax;
+	}
+	fclose(fp);
+	fp = NULL;
+
+compile:
+	*err = fpin_policy_compile(policy);
+	if (*err < 0)
+		goto error;
+	return policy;
+
+syntax:
+	FPIN_ELOG("%s:%d: invalid policy rule\n", path, lineno);
+	*err = -EINVAL;
+error:
+	if (fp != NULL)
+		fclose(fp);
+	fpin_policy_free(policy);
+	return NULL;
+}
+
+/*
+ * Loads the policy file and makes it the current policy. On failure the
+ * current policy stays in effect.
+ */
+int
+fpin_policy_load(const char *path) {
+	struct fpin_policy *policy = NULL, *old = NULL;
+	int err = 0;
+
+	policy = fpin_policy_parse(path, &err);
+	if (policy == NULL) {
+		FPIN_ELOG("Failed to load policy %s, err %d, keeping the current"
+			" policy\n", path, err);
+		return err;
+	}
+
+	pthread_mutex_lock(&fpin_policy_mutex);
+	old = fpin_policy_cur;
+	fpin_policy_cur = policy;
+	fpin_policy_reloads++;
+	pthread_mutex_unlock(&fpin_policy_mutex);
+	fpin_policy_put(old);
+
+	FPIN_ILOG("Loaded policy %s, %d rules, default %s\n", path,
+		policy->nr_rules, fpin_policy_action_names[policy->def_action]);
+	return 0;
+}
+
+/* Takes a reference on the current policy, held for one event */
+struct fpin_policy *
+fpin_policy_get(void) {
+	struct fpin_policy *policy = NULL;
+
+	pthread_mutex_lock(&fpin_policy_mutex);
+	policy = fpin_policy_cur;
+	if (policy != NULL)
+		__atomic_add_fetch(&policy->refcnt, 1, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&fpin_policy_mutex);
+	return policy;
+}
+
+void
+fpin_policy_put(struct fpin_policy *policy) {
+	if ((policy != NULL) &&
+		(__atomic_sub_fetch(&policy->refcnt, 1, __ATOMIC_ACQ_REL) == 0))
+		fpin_policy_free(policy);
+}
+
+/* Returns 1 once an after=N rule has seen N events for the host and WWN */
+static int
+fpin_policy_track(struct fpin_policy_rule *rule, uint32_t host_num,
+			uint64_t wwn) {
+	struct fpin_policy_track *track = NULL;
+	time_t now = time(NULL);
+
+	track = &rule->track[(wwn ^ (wwn >> 29) ^ host_num) %
+				FPIN_POLICY_TRACK_SLOTS];
+	if ((track->count == 0) || (track->wwn != wwn) ||
+		(track->host_num != host_num) ||
+		(rule->window_s && (now - track->first > rule->window_s))) {
+		track->wwn = wwn;
+		track->host_num = host_num;
+		track->count = 0;
+		track->first = now;
+	}
+
+	if (++track->count < rule->after)
+		return 0;
+	track->count = 0;
+	return 1;
+}
+
+/*
+ * Function:
+ *	fpin_policy_lookup
+ *
+ * Inputs:
+ *	1. The policy of the event.
+ *	2. Event type of the Link Integrity descriptor.
+ *	3. Host number the FPIN was received on.
+ *	4. The impacted port WWN.
+ *	5. Filled in with the corroboration the action waits for, a window of
+ *	   0 if none.
+ *
+ * Description:
+ *	Returns the action for the impacted port. Only called from the LI
+ *	consumer, so the after=N state needs no locking.
+ */
+enum fpin_policy_action
+fpin_policy_lookup(struct fpin_policy *policy, uint32_t event_type,
+			uint32_t host_num, uint64_t wwn, struct fpin_confirm *confirm) {
+	struct fpin_policy_rule *rule = NULL;
+	enum fpin_policy_action action;
+	int *idx = NULL;
+
+	memset(confirm, 0, sizeof(*confirm));
+	if (policy == NULL)
+		return FPIN_ACT_MARGINAL;
+
+	action = policy->def_action;
+	for (idx = policy->by_type[fpin_policy_type_slot(event_type)]; *idx >= 0;
+			idx++) {
+		rule = &policy->rules[*idx];
+		if ((rule->event_type != FPIN_POLICY_ANY) &&
+			(rule->event_type != event_type))
+			continue;
+		if ((rule->host_num != FPIN_POLICY_ANY) &&
+			(rule->host_num != host_num))
+			continue;
+		if ((wwn & rule->wwn_mask) != rule->wwn_prefix)
+			continue;
+
+		__atomic_add_fetch(&rule->hits, 1, __ATOMIC_RELAXED);
+		action = rule->action;
+		if ((rule->track != NULL) && (action > FPIN_ACT_COUNT) &&
+			!fpin_policy_track(rule, host_num, wwn))
+			action = FPIN_ACT_COUNT;
+		if (action > FPIN_ACT_COUNT)
+			*confirm = rule->confirm;
+		break;
+	}
+	if (*idx < 0)
+		__atomic_add_fetch(&policy->def_hits, 1, __ATOMIC_RELAXED);
+
+	__atomic_add_fetch(&fpin_policy_actions[action], 1, __ATOMIC_RELAXED);
+	return action;
+}
+
+void
+fpin_policy_dump_stats(void) {
+	struct fpin_policy *policy = fpin_policy_get();
+	int i = 0;
+
+	FPIN_TLOG("policy: reloads %llu ignored %llu counted %llu marginal %llu"
+		" failed %llu\n", (unsigned long long)fpin_policy_reloads,
+		(unsigned long long)fpin_policy_actions[FPIN_ACT_IGNORE],
+		(unsigned long long)fpin_policy_actions[FPIN_ACT_COUNT],
+		(unsigned long long)fpin_policy_actions[FPIN_ACT_MARGINAL],
+		(unsigned long long)fpin_policy_actions[FPIN_ACT_FAIL]);
+	if (policy == NULL)
+		return;
+
+	FPIN_TLOG("policy: %s default %s hits %llu\n", policy->path,
+		fpin_policy_action_names[policy->def_action],
+		(unsigned long long)policy->def_hits);
+	for (i = 0; i < policy->nr_rules; i++) {
+		FPIN_TLOG("policy: line %d %s hits %llu\n", policy->rules[i].line,
+			fpin_policy_action_names[policy->rules[i].action],
+			(unsigned long long)policy->rules[i].hits);
+	}
+	fpin_policy_put(policy);
+}
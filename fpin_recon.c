@@ -0,0 +1,276 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_DM
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * Reconciliation of the marginal device list.
+ *
+ * The list is what LINKUP/RSCN recover, so it must not hold paths that are
+ * gone or that were recovered behind the daemon's back, e.g. by a manual
+ * multipathd unsetmarginal. The monitor thread follows the udev events of
+ * the block and nvme subsystems instead of rescanning:
+ *
+ *	remove of an sd or nvme controller:
+ *		the device is dropped from the list.
+ *	change of a multipath dm map:
+ *		multipathd reloads a map whenever the marginal state of one of its
+ *		paths changes, so the paths of the map are read back from
+ *		multipathd, and the listed paths it reports normal are dropped.
+ *		Only paths whose setmarginal multipathd took are compared, the
+ *		ones still queued to an actuation worker are left alone.
+ *
+ * Every entry dropped is a divergence and counted. If the kernel drops
+ * uevents because the monitor fell behind, the whole list is checked once
+ * against sysfs and multipathd.
+ */
+
+#define FPIN_RECON_RCVBUF		(4 << 20)	/* bytes of uevents buffered */
+#define FPIN_RECON_FORMAT		"show paths raw format \"%d %M %m\""
+
+static pthread_mutex_t fpin_recon_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct fpin_recon_stats {
+	uint64_t events;
+	uint64_t maps_checked;
+	uint64_t mpath_errors;
+	uint64_t resyncs;
+	uint64_t gone;				/* Divergences: device removed */
+	uint64_t unset_outside;		/* Divergences: no longer marginal */
+} fpin_recon_stats;
+
+/* Sends a show command to multipathd, returns its reply to free or NULL */
+static char *
+fpin_recon_mpath_query(const char *cmd) {
+	char *reply = NULL;
+	int fd = -1, ret = 0;
+
+	fd = mpath_connect();
+	if (fd < 0)
+		return NULL;
+	ret = send_packet(fd, cmd);
+	if (ret == 0)
+		ret = recv_packet(fd, &reply, DEFAULT_REPLY_TIMEOUT);
+	mpath_disconnect(fd);
+	if (ret < 0) {
+		free(reply);
+		return NULL;
+	}
+	return reply;
+}
+
+/*
+ * Function:
+ *	fpin_recon_map
+ *
+ * Inputs:
+ *	The name of the multipath map, e.g. mpatha, NULL for every map.
+ *
+ * Description:
+ *	Reads the marginal state of the paths of the map from multipathd and
+ *	drops the paths it reports normal from the marginal device list.
+ *	Returns the number of paths dropped, or -EIO if multipathd did not
+ *	answer.
+ */
+static int
+fpin_recon_map(const char *map_name) {
+	char dev[DEV_NAME_LEN], state[16], map[NAME_MAX + 1];
+	char *reply = NULL, *line = NULL, *save = NULL;
+	int dropped = 0, n = 0;
+
+	/* Nothing of ours multipathd could have changed */
+	if (fpin_marginal_dev_nr_applied() == 0)
+		return 0;
+
+	reply = fpin_recon_mpath_query(FPIN_RECON_FORMAT);
+	pthread_mutex_lock(&fpin_recon_mutex);
+	fpin_recon_stats.maps_checked++;
+	if (reply == NULL)
+		fpin_recon_stats.mpath_errors++;
+	pthread_mutex_unlock(&fpin_recon_mutex);
+	if (reply == NULL) {
+		FPIN_ELOG("multipathd did not list the paths of %s\n",
+			map_name ? map_name : "the maps");
+		return -EIO;
+	}
+
+	for (line = strtok_r(reply, "\n", &save); line != NULL;
+			line = strtok_r(NULL, "\n", &save)) {
+		if (sscanf(line, "%127s %15s %255s", dev, state, map) != 3)
+			continue;
+		if (((map_name != NULL) && (strcmp(map, map_name) != 0)) ||
+			(strcmp(state, "normal") != 0))
+			continue;
+		n = fpin_marginal_dev_reconcile(dev, FPIN_DEV_SCSI, 1);
+		if (n == 0)
+			continue;
+		FPIN_ILOG("%s of %s was unset marginal outside of the daemon,"
+			" dropped from the marginal list\n", dev, map);
+		dropped += n;
+	}
+	free(reply);
+
+	pthread_mutex_lock(&fpin_recon_mutex);
+	fpin_recon_stats.unset_outside += dropped;
+	pthread_mutex_unlock(&fpin_recon_mutex);
+	return dropped;
+}
+
+/* Tells if the device of a marginal list entry is gone from sysfs */
+static int
+fpin_recon_dev_gone(const struct marginal_dev_list *marg) {
+	const char *fmt = "block/%s";
+	char path[FILE_PATH_LEN];
+
+	if (marg->dev_type == FPIN_DEV_NVME)
+		fmt = "class/nvme/%s";
+	if (fpin_sysfs_path(path, sizeof(path), fmt, marg->dev_name) < 0)
+		return 0;
+	return (access(path, F_OK) < 0) && (errno == ENOENT);
+}
+
+/* Checks the whole list once, after uevents were lost */
+static void
+fpin_recon_resync(void) {
+	int gone = 0;
+
+	FPIN_ELOG("uevents were lost, checking the whole marginal list\n");
+	gone = fpin_marginal_dev_prune(fpin_recon_dev_gone);
+	pthread_mutex_lock(&fpin_recon_mutex);
+	fpin_recon_stats.resyncs++;
+	fpin_recon_stats.gone += gone;
+	pthread_mutex_unlock(&fpin_recon_mutex);
+	fpin_recon_map(NULL);
+}
+
+/* Reconciles the marginal device list with one uevent */
+static void
+fpin_recon_event(struct udev_device *dev) {
+	const char *action = udev_device_get_action(dev);
+	const char *sysname = udev_device_get_sysname(dev);
+	const char *subsystem = udev_device_get_subsystem(dev);
+	const char *dm_name = NULL, *dm_uuid = NULL;
+	enum fpin_dev_type dev_type = FPIN_DEV_SCSI;
+	int n = 0;
+
+	if ((action == NULL) || (sysname == NULL) || (subsystem == NULL))
+		return;
+
+	if (strcmp(action, "remove") == 0) {
+		if (strcmp(subsystem, "nvme") == 0)
+			dev_type = FPIN_DEV_NVME;
+		else if (strncmp(sysname, "sd", 2) != 0)
+			return;
+		n = fpin_marginal_dev_reconcile(sysname, dev_type, 0);
+		if (n == 0)
+			return;
+		FPIN_ILOG("%s was removed, dropped from the marginal list\n",
+			sysname);
+		pthread_mutex_lock(&fpin_recon_mutex);
+		fpin_recon_stats.gone += n;
+		pthread_mutex_unlock(&fpin_recon_mutex);
+		return;
+	}
+
+	if ((strcmp(action, "change") != 0) || (strncmp(sysname, "dm-", 3) != 0))
+		return;
+	dm_name = udev_device_get_property_value(dev, "DM_NAME");
+	dm_uuid = udev_device_get_property_value(dev, "DM_UUID");
+	if ((dm_name == NULL) || (dm_uuid == NULL) ||
+		(strncmp(dm_uuid, "mpath-", 6) != 0))
+		return;
+	fpin_recon_map(dm_name);
+}
+
+/*
+ * This is the reconciliation thread. It sleeps on the udev monitor socket,
+ * which only passes the events of block disks, i.e. sd and dm, and of nvme
+ * controllers.
+ */
+void *fpin_recon_monitor() {
+	struct udev_monitor *mon = NULL;
+	struct udev_device *dev = NULL;
+	struct udev *udev = NULL;
+	struct pollfd pfd;
+
+	udev = udev_new();
+	if (udev == NULL) {
+		FPIN_ELOG("Can't create udev, the marginal list is not"
+			" reconciled\n");
+		return NULL;
+	}
+	mon = udev_monitor_new_from_netlink(udev, "udev");
+	if ((mon == NULL) ||
+		(udev_monitor_filter_add_match_subsystem_devtype(mon, "block",
+				"disk") < 0) ||
+		(udev_monitor_filter_add_match_subsystem_devtype(mon, "nvme",
+				NULL) < 0) ||
+		(udev_monitor_enable_receiving(mon) < 0)) {
+		FPIN_ELOG("Can't monitor uevents, the marginal list is not"
+			" reconciled\n");
+		if (mon != NULL)
+			udev_monitor_unref(mon);
+		udev_unref(udev);
+		return NULL;
+	}
+	udev_monitor_set_receive_buffer_size(mon, FPIN_RECON_RCVBUF);
+
+	pfd.fd = udev_monitor_get_fd(mon);
+	pfd.events = POLLIN;
+	for ( ; ; ) {
+		if (poll(&pfd, 1, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			FPIN_ELOG("poll on the udev monitor failed, err %d\n", -errno);
+			break;
+		}
+		errno = 0;
+		dev = udev_monitor_receive_device(mon);
+		if (dev == NULL) {
+			if (errno == ENOBUFS)
+				fpin_recon_resync();
+			continue;
+		}
+		pthread_mutex_lock(&fpin_recon_mutex);
+		fpin_recon_stats.events++;
+		pthread_mutex_unlock(&fpin_recon_mutex);
+		fpin_recon_event(dev);
+		udev_device_unref(dev);
+	}
+
+	udev_monitor_unref(mon);
+	udev_unref(udev);
+	return NULL;
+}
+
+void
+fpin_recon_dump_stats(void) {
+	struct fpin_recon_stats stats;
+
+	pthread_mutex_lock(&fpin_recon_mutex);
+	stats = fpin_recon_stats;
+	pthread_mutex_unlock(&fpin_recon_mutex);
+
+	FPIN_TLOG("recon: uevents %llu maps checked %llu multipathd errors %llu"
+		" resyncs %llu\n", (unsigned long long)stats.events,
+		(unsigned long long)stats.maps_checked,
+		(unsigned long long)stats.mpath_errors,
+		(unsigned long long)stats.resyncs);
+	FPIN_TLOG("recon: divergences gone %llu unset outside %llu\n",
+		(unsigned long long)stats.gone,
+		(unsigned long long)stats.unset_outside);
+}
@@ -0,0 +1,293 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <sched.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "fpin.h"
+
+/*
+ * Real-time failover mode (-R).
+ *
+ * A fabric incident often comes with memory pressure on the host, which is
+ * when the daemon must not wait on page faults or the allocator. In
+ * real-time mode the objects of the FPIN path, i.e. frames, event traces,
+ * actuation jobs, marginal list and damping entries, recovery jobs and
+ * I/O error watches, come from pools reserved at startup, the LI arena
+ * gets its chunk up front and all memory is locked. The receiver, the LI
+ * consumer and the actuation workers run SCHED_FIFO, the receiver one
+ * priority above the others so it always drains the socket, optionally
+ * bound to the -A CPUs.
+ *
+ * A pool that runs dry falls back to the heap and counts it; the counts
+ * are logged on SIGUSR1 so the pool sizes can be checked against a storm.
+ * Only the bookkeeping of the daemon is pool-backed, see
+ * tests/test_rt_alloc.c. The resolution and actuation still allocate in
+ * libudev, libdevmapper, the multipathd client and libc's opendir, their
+ * memory is locked but not reserved.
+ */
+
+int fpin_rt_prio;
+static cpu_set_t fpin_rt_cpus;
+static int fpin_rt_nr_cpus;
+
+static struct {
+	struct fpin_pool *pool;
+	uint32_t nr;
+} fpin_rt_pools[] = {
+	{ &fpin_frame_pool,		0 },	/* Sized to the LI queue */
+	{ &fpin_trace_pool,		FPIN_RT_TRACES },
+	{ &fpin_job_pool,		0 },	/* Sized to the act queues */
+	{ &fpin_marginal_pool,	FPIN_RT_MARGINAL },
+	{ &fpin_damp_pool,		FPIN_RT_DAMP },
+	{ &fpin_recovery_pool,	FPIN_RT_RECOVERY },
+	{ &fpin_ioerr_pool,		FPIN_RT_IOERR },
+};
+
+static const char *fpin_rt_roles[] = {
+	[FPIN_RT_RECEIVER]	= "receiver",
+	[FPIN_RT_CONSUMER]	= "consumer",
+	[FPIN_RT_WORKER]	= "worker",
+};
+
+/* Reserves nr objects, touching them so they are resident */
+static int
+fpin_pool_reserve(struct fpin_pool *pool, uint32_t nr) {
+	size_t stride = (pool->obj_size + 15) & ~(size_t)15;
+	char *base = NULL;
+	uint32_t i = 0;
+
+	base = malloc((size_t)nr * stride);
+	if (base == NULL)
+		return -ENOMEM;
+	memset(base, 0, (size_t)nr * stride);
+
+	pthread_mutex_lock(&pool->mutex);
+	for (i = nr; i-- > 0; ) {
+		*(void **)(base + i * stride) = pool->free_list;
+		pool->free_list = base + i * stride;
+	}
+	pool->stride = stride;
+	pool->nr = nr;
+	pool->base = base;
+	pthread_mutex_unlock(&pool->mutex);
+	return 0;
+}
+
+/*
+ * Returns a zeroed object of the pool. Outside of real-time mode, or once
+ * the reserved objects are used up, it comes from the heap.
+ */
+void *
+fpin_pool_get(struct fpin_pool *pool) {
+	void *obj = NULL;
+
+	if (pool->base == NULL)
+		return calloc(1, pool->obj_size);
+
+	pthread_mutex_lock(&pool->mutex);
+	obj = pool->free_list;
+	if (obj != NULL) {
+		pool->free_list = *(void **)obj;
+		if (++pool->in_use > pool->max_in_use)
+			pool->max_in_use = pool->in_use;
+	} else {
+		pool->exhausted++;
+	}
+	pthread_mutex_unlock(&pool->mutex);
+
+	if (obj == NULL)
+		return calloc(1, pool->obj_size);
+	memset(obj, 0, pool->obj_size);
+	return obj;
+}
+
+/* Returns an object to the pool it came from, or to the heap */
+void
+fpin_pool_put(struct fpin_pool *pool, void *obj) {
+	char *ptr = obj;
+
+	if (obj == NULL)
+		return;
+	if ((pool->base == NULL) || (ptr < pool->base) ||
+		(ptr >= pool->base + (size_t)pool->nr * pool->stride)) {
+		free(obj);
+		return;
+	}
+
+	pthread_mutex_lock(&pool->mutex);
+	*(void **)obj = pool->free_list;
+	pool->free_list = obj;
+	pool->in_use--;
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/* Parses the -A CPU list, e.g. 2,3 or 0,4-7 */
+int
+fpin_rt_parse_cpus(const char *arg) {
+	unsigned long first = 0, last = 0, cpu = 0;
+	char *end = NULL;
+
+	CPU_ZERO(&fpin_rt_cpus);
+	while (*arg != '\0') {
+		first = strtoul(arg, &end, 10);
+		if (end == arg)
+			return -EINVAL;
+		last = first;
+		if (*end == '-') {
+			arg = end + 1;
+			last = strtoul(arg, &end, 10);
+			if ((end == arg) || (last < first))
+				return -EINVAL;
+		}
+		if (last >= CPU_SETSIZE)
+			return -EINVAL;
+		for (cpu = first; cpu <= last; cpu++)
+			CPU_SET(cpu, &fpin_rt_cpus);
+		if (*end == ',')
+			end++;
+		else if (*end != '\0')
+			return -EINVAL;
+		arg = end;
+	}
+	fpin_rt_nr_cpus = CPU_COUNT(&fpin_rt_cpus);
+	return fpin_rt_nr_cpus ? 0 : -EINVAL;
+}
+
+/*
+ * Function:
+ *	fpin_rt_init
+ *
+ * Description:
+ *	In real-time mode reserves the object pools and locks the memory of
+ *	the daemon, present and future. Called before the threads are started.
+ *	Returns 0 or -errno.
+ */
+int
+fpin_rt_init(void) {
+	int flags = MCL_CURRENT | MCL_FUTURE;
+	size_t i = 0;
+	int ret = 0;
+
+	if (fpin_rt_prio == 0)
+		return 0;
+
+	/* One frame more than the queue holds, the one being copied out */
+	fpin_rt_pools[0].nr = fpin_li_queue_capacity + 1;
+	/*
+	 * The queued and running planned actions, and the unsets, which are
+	 * bounded by the marginal list instead
+	 */
+	fpin_rt_pools[2].nr = fpin_act_workers * (fpin_act_queue_capacity + 1) +
+		FPIN_RT_MARGINAL;
+	for (i = 0; i < sizeof(fpin_rt_pools) / sizeof(fpin_rt_pools[0]); i++) {
+		ret = fpin_pool_reserve(fpin_rt_pools[i].pool, fpin_rt_pools[i].nr);
+		if (ret < 0) {
+			FPIN_CLOG("No memory to reserve the %s pool\n",
+				fpin_rt_pools[i].pool->name);
+			return ret;
+		}
+	}
+
+#ifdef MCL_ONFAULT
+	/* Thread stacks are locked as they are touched, not all 8MB of them */
+	flags |= MCL_ONFAULT;
+#endif
+	ret = mlockall(flags);
+	if ((ret < 0) && (errno == EINVAL) && (flags != (MCL_CURRENT | MCL_FUTURE)))
+		ret = mlockall(MCL_CURRENT | MCL_FUTURE);
+	if (ret < 0) {
+		ret = -errno;
+		FPIN_CLOG("Could not lock the daemon memory, err %d\n", ret);
+		return ret;
+	}
+
+	FPIN_TLOG("Real-time mode, SCHED_FIFO priority %d, memory locked,"
+		" %d CPUs\n", fpin_rt_prio, fpin_rt_nr_cpus);
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_rt_thread
+ *
+ * Inputs:
+ *	What the calling thread does on the FPIN path.
+ *
+ * Description:
+ *	Called by the receiver, the LI consumer and the actuation workers when
+ *	they start. In real-time mode sets the scheduling policy and CPU
+ *	affinity of the thread, and faults in its stack, log ring and sysfs
+ *	I/O context, so the FPIN path does not fault on them later.
+ */
+void
+fpin_rt_thread(enum fpin_rt_role role) {
+	volatile char stack[FPIN_RT_STACK_PREFAULT];
+	struct sched_param param;
+	size_t i = 0;
+	int ret = 0;
+
+	if (fpin_rt_prio == 0)
+		return;
+
+	for (i = 0; i < sizeof(stack); i += 4096)
+		stack[i] = 0;
+	fpin_log_thread_init();
+	fpin_sio_thread_init();
+
+	memset(&param, 0, sizeof(param));
+	param.sched_priority = fpin_rt_prio;
+	if ((role != FPIN_RT_RECEIVER) && (fpin_rt_prio > 1))
+		param.sched_priority--;
+	ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+	if (ret != 0)
+		FPIN_ELOG("Could not run the %s thread SCHED_FIFO %d, err %d\n",
+			fpin_rt_roles[role], param.sched_priority, ret);
+
+	if (fpin_rt_nr_cpus) {
+		ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t),
+				&fpin_rt_cpus);
+		if (ret != 0)
+			FPIN_ELOG("Could not bind the %s thread to the -A CPUs, err %d\n",
+				fpin_rt_roles[role], ret);
+	}
+}
+
+void
+fpin_rt_dump_stats(void) {
+	struct fpin_pool *pool = NULL;
+	uint32_t in_use = 0, max_in_use = 0;
+	uint64_t exhausted = 0;
+	size_t i = 0;
+
+	if (fpin_rt_prio == 0)
+		return;
+
+	for (i = 0; i < sizeof(fpin_rt_pools) / sizeof(fpin_rt_pools[0]); i++) {
+		pool = fpin_rt_pools[i].pool;
+		pthread_mutex_lock(&pool->mutex);
+		in_use = pool->in_use;
+		max_in_use = pool->max_in_use;
+		exhausted = pool->exhausted;
+		pthread_mutex_unlock(&pool->mutex);
+		FPIN_TLOG("rt: pool %s size %u in use %u max %u heap fallbacks %llu\n",
+			pool->name, pool->nr, in_use, max_in_use,
+			(unsigned long long)exhausted);
+	}
+}
@@ -0,0 +1,549 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <stdlib.h>
+#ifdef FPIN_HAVE_LIBURING
+#include <liburing.h>
+#endif
+#include "fpin.h"
+
+/*
+ * Batched sysfs attribute I/O.
+ *
+ * Resolution and actuation access long runs of small attributes: the
+ * port_name of every remote port and target of a host, the state of every
+ * LUN of a target, the port_state of an rport. Opening an attribute costs
+ * more than reading it, so every thread keeps the attributes it used open
+ * in a direct mapped cache and reads them again with pread at offset 0,
+ * which makes sysfs generate the value anew. A cached fd whose device went
+ * away fails with ENODEV and is reopened once.
+ *
+ * Only attributes read again and again are cached, e.g. the I/O error
+ * counters, host statistics and port_state. The directory scans of the
+ * resolution read every remote port, target or LUN once per event; on a
+ * large fabric they would only evict each other from the cache, paying a
+ * close on top of every open, so their requests are marked once and
+ * opened, read and closed.
+ *
+ * With the io_uring backend (make LIBURING=1) the cached fds are also
+ * registered with a ring of the thread, and a batch is submitted and
+ * reaped with one system call. Where io_uring is not available, e.g.
+ * disabled by sysctl or seccomp, the thread falls back to pread/pwrite.
+ * The threads of the daemon live as long as the process, so their
+ * contexts are never freed.
+ */
+
+struct fpin_sio_slot
+{
+	char path[FILE_PATH_LEN];
+	uint32_t hash;
+	int fd;
+	int write;
+	int busy;				/* An operation on fd is in flight */
+};
+
+struct fpin_sio_ctx
+{
+	struct fpin_sio_slot slots[FPIN_SIO_CACHE_SLOTS];
+#ifdef FPIN_HAVE_LIBURING
+	struct io_uring ring;
+	int uring;
+#endif
+};
+
+struct fpin_sio_stats
+{
+	uint64_t batches;
+	uint64_t ops;
+	uint64_t failed;
+	uint64_t ns;
+	uint64_t max_ns;
+};
+
+#ifdef FPIN_HAVE_LIBURING
+int fpin_sio_backend = FPIN_SIO_IO_URING;
+#else
+int fpin_sio_backend = FPIN_SIO_PSYNC;
+#endif
+
+static const char *fpin_sio_names[FPIN_SIO_MAX] = {
+	[FPIN_SIO_PSYNC]	= "psync",
+	[FPIN_SIO_IO_URING]	= "io_uring",
+};
+
+static __thread struct fpin_sio_ctx *fpin_sio_self;
+static struct fpin_sio_stats fpin_sio_stats[FPIN_SIO_MAX];
+static uint64_t fpin_sio_opens;
+static uint64_t fpin_sio_uncached;
+#ifdef FPIN_HAVE_LIBURING
+static int fpin_sio_uring_failed;
+#endif
+
+/* Selects the backend by name, before any thread does I/O */
+int
+fpin_sio_parse_backend(const char *name) {
+	if (strcmp(name, fpin_sio_names[FPIN_SIO_PSYNC]) == 0) {
+		fpin_sio_backend = FPIN_SIO_PSYNC;
+		return 0;
+	}
+#ifdef FPIN_HAVE_LIBURING
+	if (strcmp(name, fpin_sio_names[FPIN_SIO_IO_URING]) == 0) {
+		fpin_sio_backend = FPIN_SIO_IO_URING;
+		return 0;
+	}
+#endif
+	return -EINVAL;
+}
+
+/* FNV-1a of the attribute path */
+static uint32_t
+fpin_sio_hash(const char *path) {
+	uint32_t hash = 2166136261U;
+
+	while (*path != '\0') {
+		hash ^= (unsigned char)*path++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+#ifdef FPIN_HAVE_LIBURING
+/* Sets up the ring of the thread with an empty registered file table */
+static void
+fpin_sio_uring_init(struct fpin_sio_ctx *ctx) {
+	int fds[FPIN_SIO_CACHE_SLOTS];
+	int i = 0, ret = 0;
+
+	ret = io_uring_queue_init(FPIN_SIO_BATCH, &ctx->ring, 0);
+	if (ret == 0) {
+		for (i = 0; i < FPIN_SIO_CACHE_SLOTS; i++)
+			fds[i] = -1;
+		ret = io_uring_register_files(&ctx->ring, fds, FPIN_SIO_CACHE_SLOTS);
+		if (ret < 0)
+			io_uring_queue_exit(&ctx->ring);
+	}
+	if (ret < 0) {
+		if (!__atomic_exchange_n(&fpin_sio_uring_failed, 1, __ATOMIC_RELAXED))
+			FPIN_ELOG("io_uring not available, err %d, using pread/pwrite\n",
+					ret);
+		return;
+	}
+	ctx->uring = 1;
+}
+#endif
+
+static struct fpin_sio_ctx *
+fpin_sio_get_ctx(void) {
+	struct fpin_sio_ctx *ctx = fpin_sio_self;
+	int i = 0;
+
+	if (ctx != NULL)
+		return ctx;
+
+	ctx = calloc(1, sizeof(struct fpin_sio_ctx));
+	if (ctx == NULL)
+		return NULL;
+	for (i = 0; i < FPIN_SIO_CACHE_SLOTS; i++)
+		ctx->slots[i].fd = -1;
+#ifdef FPIN_HAVE_LIBURING
+	if (fpin_sio_backend == FPIN_SIO_IO_URING)
+		fpin_sio_uring_init(ctx);
+#endif
+	fpin_sio_self = ctx;
+	return ctx;
+}
+
+/* Closes the cached fd of a slot */
+static void
+fpin_sio_evict(struct fpin_sio_ctx *ctx, int idx) {
+	struct fpin_sio_slot *slot = &ctx->slots[idx];
+#ifdef FPIN_HAVE_LIBURING
+	int fd = -1;
+#endif
+
+	if (slot->fd < 0)
+		return;
+#ifdef FPIN_HAVE_LIBURING
+	if (ctx->uring)
+		io_uring_register_files_update(&ctx->ring, idx, &fd, 1);
+#endif
+	close(slot->fd);
+	slot->path[0] = '\0';
+	slot->fd = -1;
+}
+
+/*
+ * Function:
+ *	fpin_sio_lookup
+ *
+ * Inputs:
+ *	1. The I/O context of the thread.
+ *	2. Full path of the attribute.
+ *	3. Whether it is opened for writing.
+ *	4. Set if the fd was opened by this lookup.
+ *
+ * Description:
+ *	Returns the index of the cache slot holding the attribute open,
+ *	opening it and evicting the previous attribute of the slot if needed.
+ *	Returns -EBUSY if the slot is used by an operation in flight, or
+ *	-errno.
+ */
+static int
+fpin_sio_lookup(struct fpin_sio_ctx *ctx, const char *path, int write,
+			int *opened) {
+	uint32_t hash = fpin_sio_hash(path) + write;
+	int idx = hash & (FPIN_SIO_CACHE_SLOTS - 1);
+	struct fpin_sio_slot *slot = &ctx->slots[idx];
+	int fd = -1;
+#ifdef FPIN_HAVE_LIBURING
+	int ret = 0;
+#endif
+
+	*opened = 0;
+	if ((slot->fd >= 0) && (slot->hash == hash) && (slot->write == write) &&
+		(strcmp(slot->path, path) == 0))
+		return idx;
+	if (slot->busy)
+		return -EBUSY;
+
+	fpin_sio_evict(ctx, idx);
+	if (strlen(path) >= sizeof(slot->path))
+		return -ENAMETOOLONG;
+	fd = open(path, (write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+#ifdef FPIN_HAVE_LIBURING
+	if (ctx->uring) {
+		ret = io_uring_register_files_update(&ctx->ring, idx, &fd, 1);
+		if (ret < 0) {
+			close(fd);
+			return ret;
+		}
+	}
+#endif
+	strcpy(slot->path, path);
+	slot->hash = hash;
+	slot->fd = fd;
+	slot->write = write;
+	*opened = 1;
+	__atomic_add_fetch(&fpin_sio_opens, 1, __ATOMIC_RELAXED);
+	return idx;
+}
+
+/* Stores the result of a completed read or write in the request */
+static void
+fpin_sio_complete(struct fpin_sio_req *req, ssize_t res) {
+	if (res < 0)
+		req->ret = res;
+	else if (req->write)
+		req->ret = 0;
+	else
+		req->ret = fpin_sysfs_strip(req->buf, res);
+}
+
+static ssize_t
+fpin_sio_psync_op(int fd, struct fpin_sio_req *req) {
+	ssize_t ret = 0;
+
+	if (req->write)
+		ret = pwrite(fd, req->buf, strlen(req->buf), 0);
+	else
+		ret = pread(fd, req->buf, req->len - 1, 0);
+	return (ret < 0) ? -errno : ret;
+}
+
+/* Opens the attribute of a request that is not cached */
+static int
+fpin_sio_open_once(struct fpin_sio_req *req) {
+	int fd = -1;
+
+	fd = open(req->path, (req->write ? O_WRONLY : O_RDONLY) | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+	__atomic_add_fetch(&fpin_sio_uncached, 1, __ATOMIC_RELAXED);
+	return fd;
+}
+
+/* Carries out one request with pread/pwrite, reopening a stale cached fd */
+static void
+fpin_sio_psync(struct fpin_sio_ctx *ctx, struct fpin_sio_req *req) {
+	ssize_t res = 0;
+	int idx = 0, opened = 0, fd = -1;
+
+	if (req->once) {
+		fd = fpin_sio_open_once(req);
+		if (fd < 0) {
+			req->ret = fd;
+			return;
+		}
+		res = fpin_sio_psync_op(fd, req);
+		close(fd);
+		fpin_sio_complete(req, res);
+		return;
+	}
+
+	idx = fpin_sio_lookup(ctx, req->path, req->write, &opened);
+	if (idx < 0) {
+		req->ret = idx;
+		return;
+	}
+	res = fpin_sio_psync_op(ctx->slots[idx].fd, req);
+	if ((res == -ENODEV) && !opened) {
+		fpin_sio_evict(ctx, idx);
+		idx = fpin_sio_lookup(ctx, req->path, req->write, &opened);
+		if (idx < 0) {
+			req->ret = idx;
+			return;
+		}
+		res = fpin_sio_psync_op(ctx->slots[idx].fd, req);
+	}
+	fpin_sio_complete(req, res);
+}
+
+#ifdef FPIN_HAVE_LIBURING
+/*
+ * Carries out the requests through the ring, up to FPIN_SIO_BATCH at a
+ * time. A chunk ends early when a request needs the cache slot of one
+ * already queued, the slot is reused once the chunk completed. Requests
+ * read once are queued on a plain fd, closed once the chunk completed.
+ * Requests that failed on a stale cached fd are retried with pread/pwrite.
+ * If the ring fails the thread continues with pread/pwrite.
+ */
+static void
+fpin_sio_uring(struct fpin_sio_ctx *ctx, struct fpin_sio_req *reqs, int nr) {
+	int slot_of[FPIN_SIO_BATCH], opened[FPIN_SIO_BATCH];
+	int req_of[FPIN_SIO_BATCH], res[FPIN_SIO_BATCH];
+	struct io_uring_sqe *sqe = NULL;
+	struct io_uring_cqe *cqe = NULL;
+	struct fpin_sio_req *req = NULL;
+	int i = 0, n = 0, k = 0, idx = 0, fd = 0, ret = 0;
+
+	while ((i < nr) && ctx->uring) {
+		n = 0;
+		while ((i < nr) && (n < FPIN_SIO_BATCH)) {
+			req = &reqs[i];
+			if (req->once) {
+				/* slot_of holds the plain fd, as -fd - 1 */
+				fd = fpin_sio_open_once(req);
+				i++;
+				if (fd < 0) {
+					req->ret = fd;
+					continue;
+				}
+				sqe = io_uring_get_sqe(&ctx->ring);
+				if (req->write)
+					io_uring_prep_write(sqe, fd, req->buf, strlen(req->buf),
+						0);
+				else
+					io_uring_prep_read(sqe, fd, req->buf, req->len - 1, 0);
+				io_uring_sqe_set_data(sqe, (void *)(uintptr_t)n);
+				opened[n] = 1;
+				slot_of[n] = -fd - 1;
+				req_of[n] = i - 1;
+				res[n] = -EIO;
+				n++;
+				continue;
+			}
+			idx = fpin_sio_lookup(ctx, req->path, req->write, &opened[n]);
+			if (idx == -EBUSY)
+				break;
+			i++;
+			if (idx < 0) {
+				req->ret = idx;
+				continue;
+			}
+			sqe = io_uring_get_sqe(&ctx->ring);
+			if (req->write)
+				io_uring_prep_write(sqe, idx, req->buf, strlen(req->buf), 0);
+			else
+				io_uring_prep_read(sqe, idx, req->buf, req->len - 1, 0);
+			sqe->flags |= IOSQE_FIXED_FILE;
+			io_uring_sqe_set_data(sqe, (void *)(uintptr_t)n);
+			ctx->slots[idx].busy = 1;
+			slot_of[n] = idx;
+			req_of[n] = i - 1;
+			res[n] = -EIO;
+			n++;
+		}
+		if (n == 0)
+			continue;
+
+		ret = io_uring_submit_and_wait(&ctx->ring, n);
+		for (k = 0; (ret >= 0) && (k < n); k++) {
+			do {
+				ret = io_uring_wait_cqe(&ctx->ring, &cqe);
+			} while (ret == -EINTR);
+			if (ret < 0)
+				break;
+			res[(uintptr_t)io_uring_cqe_get_data(cqe)] = cqe->res;
+			io_uring_cqe_seen(&ctx->ring, cqe);
+		}
+		if (ret < 0) {
+			FPIN_ELOG("io_uring failed, err %d, using pread/pwrite\n", ret);
+			ctx->uring = 0;
+		}
+
+		for (k = 0; k < n; k++) {
+			if (slot_of[k] >= 0)
+				ctx->slots[slot_of[k]].busy = 0;
+			else
+				close(-slot_of[k] - 1);
+		}
+		for (k = 0; k < n; k++) {
+			req = &reqs[req_of[k]];
+			if ((ret < 0) && (slot_of[k] < 0)) {
+				fpin_sio_psync(ctx, req);
+			} else if ((ret < 0) || ((res[k] == -ENODEV) && !opened[k])) {
+				fpin_sio_evict(ctx, slot_of[k]);
+				fpin_sio_psync(ctx, req);
+			} else {
+				fpin_sio_complete(req, res[k]);
+			}
+		}
+	}
+
+	for ( ; i < nr; i++)
+		fpin_sio_psync(ctx, &reqs[i]);
+}
+#endif
+
+/*
+ * Function:
+ *	fpin_sio_batch
+ *
+ * Inputs:
+ *	1. Array of attribute reads and writes.
+ *	2. Number of requests.
+ *
+ * Description:
+ *	Carries out the requests, through the io_uring of the calling thread
+ *	if it has one, and stores the result of each in its ret: the length of
+ *	the value read, NULL terminated and with the trailing newline
+ *	stripped, 0 for a write, or -errno. Requests are independent of each
+ *	other and may complete in any order.
+ */
+void
+fpin_sio_batch(struct fpin_sio_req *reqs, int nr) {
+	struct fpin_sio_stats *stats = NULL;
+	struct fpin_sio_ctx *ctx = NULL;
+	struct timespec start, end;
+	uint64_t ns = 0, max_ns = 0;
+	int backend = FPIN_SIO_PSYNC;
+	int i = 0, failed = 0;
+
+	if (nr <= 0)
+		return;
+
+	ctx = fpin_sio_get_ctx();
+	fpin_trace_now(&start);
+	if (ctx == NULL) {
+		/* No memory for a cache, open every attribute */
+		for (i = 0; i < nr; i++) {
+			if (reqs[i].write)
+				reqs[i].ret = fpin_sysfs_write_attr(reqs[i].path, reqs[i].buf);
+			else
+				reqs[i].ret = fpin_sysfs_read_attr(reqs[i].path, reqs[i].buf,
+								reqs[i].len);
+		}
+#ifdef FPIN_HAVE_LIBURING
+	} else if (ctx->uring) {
+		backend = FPIN_SIO_IO_URING;
+		fpin_sio_uring(ctx, reqs, nr);
+#endif
+	} else {
+		for (i = 0; i < nr; i++)
+			fpin_sio_psync(ctx, &reqs[i]);
+	}
+	fpin_trace_now(&end);
+
+	for (i = 0; i < nr; i++)
+		if (reqs[i].ret < 0)
+			failed++;
+	ns = fpin_trace_elapsed_ns(&start, &end);
+	stats = &fpin_sio_stats[backend];
+	__atomic_add_fetch(&stats->batches, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->ops, nr, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->failed, failed, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&stats->ns, ns, __ATOMIC_RELAXED);
+	max_ns = __atomic_load_n(&stats->max_ns, __ATOMIC_RELAXED);
+	while ((ns > max_ns) &&
+		!__atomic_compare_exchange_n(&stats->max_ns, &max_ns, ns, 0,
+					__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Sets up the I/O context of the calling thread ahead of its first batch */
+void
+fpin_sio_thread_init(void) {
+	fpin_sio_get_ctx();
+}
+
+/* Reads one attribute through the fd cache, see fpin_sysfs_read_attr */
+int
+fpin_sio_read_attr(const char *path, char *buf, size_t len) {
+	struct fpin_sio_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.path = path;
+	req.buf = buf;
+	req.len = len;
+	fpin_sio_batch(&req, 1);
+	return req.ret;
+}
+
+/* Writes one attribute through the fd cache. Returns 0 or -errno. */
+int
+fpin_sio_write_attr(const char *path, const char *value) {
+	struct fpin_sio_req req;
+
+	memset(&req, 0, sizeof(req));
+	req.path = path;
+	req.buf = (char *)value;
+	req.write = 1;
+	fpin_sio_batch(&req, 1);
+	return req.ret;
+}
+
+void
+fpin_sio_dump_stats(void) {
+	struct fpin_sio_stats *stats = NULL;
+	uint64_t batches = 0, ops = 0, ns = 0;
+	int backend = 0;
+
+	FPIN_TLOG("sio: backend %s attribute opens %llu uncached %llu\n",
+		fpin_sio_names[fpin_sio_backend],
+		(unsigned long long)__atomic_load_n(&fpin_sio_opens,
+						__ATOMIC_RELAXED),
+		(unsigned long long)__atomic_load_n(&fpin_sio_uncached,
+						__ATOMIC_RELAXED));
+	for (backend = 0; backend < FPIN_SIO_MAX; backend++) {
+		stats = &fpin_sio_stats[backend];
+		batches = __atomic_load_n(&stats->batches, __ATOMIC_RELAXED);
+		if (batches == 0)
+			continue;
+		ops = __atomic_load_n(&stats->ops, __ATOMIC_RELAXED);
+		ns = __atomic_load_n(&stats->ns, __ATOMIC_RELAXED);
+		FPIN_TLOG("sio: %s batches %llu ops %llu failed %llu avg %lluus"
+			" max %lluus %lluns/op\n", fpin_sio_names[backend],
+			(unsigned long long)batches, (unsigned long long)ops,
+			(unsigned long long)__atomic_load_n(&stats->failed,
+							__ATOMIC_RELAXED),
+			(unsigned long long)(ns / batches / 1000),
+			(unsigned long long)(__atomic_load_n(&stats->max_ns,
+							__ATOMIC_RELAXED) / 1000),
+			(unsigned long long)(ns / ops));
+	}
+}
@@ -0,0 +1,310 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define FPIN_LOG_SUBSYS	FPIN_LOG_SLO
+#include <stdarg.h>
+#include <stdlib.h>
+#include "fpin.h"
+
+#define NSEC_PER_SEC	1000000000ULL
+#define NSEC_PER_MSEC	1000000ULL
+#define NSEC_PER_USEC	1000ULL
+
+/* End-to-end budget from kernel receive to the last completed action */
+uint32_t fpin_slo_budget_ms = FPIN_DEF_SLO_MS;
+
+/* Shadow mode, actions are recorded into the event plan instead of taken */
+int fpin_shadow_mode;
+static uint64_t fpin_shadow_actions;
+
+static const char *fpin_stage_names[FPIN_STAGE_MAX] = {
+	[FPIN_STAGE_QUEUE]			= "queue",
+	[FPIN_STAGE_RESOLVE]		= "resolve",
+	[FPIN_STAGE_SETMARGINAL]	= "setmarginal",
+	[FPIN_STAGE_RPORT]			= "rport",
+};
+
+/* Latency statistics, updated by the consumer and read on SIGUSR1 */
+static struct fpin_slo_stats {
+	uint64_t events;
+	uint64_t violations;
+	uint64_t stage_violations[FPIN_STAGE_MAX];
+	uint64_t stage_max_ns[FPIN_STAGE_MAX];
+	uint64_t e2e_sum_ns;
+	uint64_t e2e_max_ns;
+	uint64_t actioned;			/* Events with at least one path actioned */
+	uint64_t first_sum_ns;
+	uint64_t first_max_ns;
+	uint64_t last_sum_ns;
+	uint64_t last_max_ns;
+} fpin_slo_stats;
+static pthread_mutex_t fpin_slo_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct fpin_pool fpin_trace_pool =
+	FPIN_POOL_INITIALIZER("trace", struct fpin_event_trace);
+
+/*
+ * The kernel receive time comes from SO_TIMESTAMPNS, which is CLOCK_REALTIME.
+ * All the stage timestamps use the same clock so they can be subtracted.
+ */
+void
+fpin_trace_now(struct timespec *ts) {
+	clock_gettime(CLOCK_REALTIME, ts);
+}
+
+uint64_t
+fpin_trace_elapsed_ns(const struct timespec *from, const struct timespec *to) {
+	int64_t ns;
+
+	ns = (int64_t)(to->tv_sec - from->tv_sec) * (int64_t)NSEC_PER_SEC +
+		(to->tv_nsec - from->tv_nsec);
+	/* Clock steps may move realtime backwards, never report negative time */
+	return (ns < 0) ? 0 : (uint64_t)ns;
+}
+
+/*
+ * Function:
+ *	fpin_trace_stage
+ *
+ * Inputs:
+ *	1. The event trace being accumulated.
+ *	2. The stage the elapsed time is charged to.
+ *	3. The start time of the stage. Updated to the current time on return, so
+ *	   consecutive stages can be chained with one clock read each.
+ *
+ * Description:
+ *	Adds the time elapsed since start to the given stage of the event, and
+ *	marks the current time as the completion of the last action. Actions
+ *	outside of an event, recoveries and held actions, have a NULL trace.
+ */
+void
+fpin_trace_stage(struct fpin_event_trace *trace, enum fpin_stage stage,
+			struct timespec *start) {
+	struct timespec now;
+
+	fpin_trace_now(&now);
+	if (trace == NULL) {
+		*start = now;
+		return;
+	}
+	pthread_mutex_lock(&trace->lock);
+	trace->stage_ns[stage] += fpin_trace_elapsed_ns(start, &now);
+	/* Actions of the event complete out of order on the workers */
+	if (fpin_trace_elapsed_ns(&trace->done_ts, &now) > 0)
+		trace->done_ts = now;
+	pthread_mutex_unlock(&trace->lock);
+	*start = now;
+}
+
+/* Accounts a path set marginal or failed for the event */
+void
+fpin_trace_action(struct fpin_event_trace *trace) {
+	struct timespec now;
+
+	if (trace == NULL)
+		return;
+	fpin_trace_now(&now);
+	pthread_mutex_lock(&trace->lock);
+	trace->last_action_ts = now;
+	if (trace->paths_marginal++ == 0)
+		trace->first_action_ts = now;
+	pthread_mutex_unlock(&trace->lock);
+}
+
+/*
+ * Starts the trace of an event at its dequeue by the LI consumer, which
+ * holds the first reference. Returns NULL if out of memory.
+ */
+struct fpin_event_trace *
+fpin_trace_new(uint32_t host_num, uint32_t event_num,
+			const struct timespec *rx_ts) {
+	struct fpin_event_trace *trace = NULL;
+	struct timespec dequeue_ts;
+
+	trace = fpin_pool_get(&fpin_trace_pool);
+	if (trace == NULL)
+		return NULL;
+	pthread_mutex_init(&trace->lock, NULL);
+	trace->refs = 1;
+	trace->host_num = host_num;
+	trace->event_num = event_num;
+	trace->rx_ts = *rx_ts;
+
+	/* The queue stage runs from kernel receive to this dequeue */
+	fpin_trace_now(&dequeue_ts);
+	trace->stage_ns[FPIN_STAGE_QUEUE] =
+		fpin_trace_elapsed_ns(&trace->rx_ts, &dequeue_ts);
+	trace->done_ts = dequeue_ts;
+	return trace;
+}
+
+void
+fpin_trace_get(struct fpin_event_trace *trace) {
+	if (trace == NULL)
+		return;
+	__atomic_add_fetch(&trace->refs, 1, __ATOMIC_RELAXED);
+}
+
+/* Drops a reference, the last one records the completed event */
+void
+fpin_trace_put(struct fpin_event_trace *trace) {
+	if (trace == NULL)
+		return;
+	if (__atomic_sub_fetch(&trace->refs, 1, __ATOMIC_ACQ_REL) != 0)
+		return;
+	fpin_slo_record(trace);
+	pthread_mutex_destroy(&trace->lock);
+	fpin_pool_put(&fpin_trace_pool, trace);
+}
+
+/*
+ * Function:
+ *	fpin_slo_record
+ *
+ * Inputs:
+ *	The completed event trace.
+ *
+ * Description:
+ *	Computes the end-to-end latency of the event against the configured SLO
+ *	and emits one trace record per event. A violation is charged to the stage
+ *	that consumed the largest share of the end-to-end time.
+ */
+void
+fpin_slo_record(struct fpin_event_trace *trace) {
+	uint64_t e2e_ns = 0, worst_ns = 0, first_ns = 0, last_ns = 0;
+	int stage = 0, worst = FPIN_STAGE_QUEUE, violated = 0;
+
+	e2e_ns = fpin_trace_elapsed_ns(&trace->rx_ts, &trace->done_ts);
+	if (trace->paths_marginal) {
+		first_ns = fpin_trace_elapsed_ns(&trace->rx_ts,
+					&trace->first_action_ts);
+		last_ns = fpin_trace_elapsed_ns(&trace->rx_ts,
+					&trace->last_action_ts);
+	}
+	violated = (e2e_ns > (uint64_t)fpin_slo_budget_ms * NSEC_PER_MSEC);
+
+	for (stage = 0; stage < FPIN_STAGE_MAX; stage++) {
+		if (trace->stage_ns[stage] > worst_ns) {
+			worst_ns = trace->stage_ns[stage];
+			worst = stage;
+		}
+	}
+
+	pthread_mutex_lock(&fpin_slo_mutex);
+	fpin_slo_stats.events++;
+	fpin_slo_stats.e2e_sum_ns += e2e_ns;
+	if (e2e_ns > fpin_slo_stats.e2e_max_ns)
+		fpin_slo_stats.e2e_max_ns = e2e_ns;
+	for (stage = 0; stage < FPIN_STAGE_MAX; stage++) {
+		if (trace->stage_ns[stage] > fpin_slo_stats.stage_max_ns[stage])
+			fpin_slo_stats.stage_max_ns[stage] = trace->stage_ns[stage];
+	}
+	if (violated) {
+		fpin_slo_stats.violations++;
+		fpin_slo_stats.stage_violations[worst]++;
+	}
+	if (trace->paths_marginal) {
+		fpin_slo_stats.actioned++;
+		fpin_slo_stats.first_sum_ns += first_ns;
+		fpin_slo_stats.last_sum_ns += last_ns;
+		if (first_ns > fpin_slo_stats.first_max_ns)
+			fpin_slo_stats.first_max_ns = first_ns;
+		if (last_ns > fpin_slo_stats.last_max_ns)
+			fpin_slo_stats.last_max_ns = last_ns;
+	}
+	pthread_mutex_unlock(&fpin_slo_mutex);
+
+	FPIN_TLOG("trace: host %u event %u rx %ld.%09ld paths %d "
+		"queue %lluus resolve %lluus setmarginal %lluus rport %lluus "
+		"first %lluus last %lluus e2e %lluus slo %ums %s%s%s\n",
+		trace->host_num, trace->event_num,
+		(long)trace->rx_ts.tv_sec, trace->rx_ts.tv_nsec,
+		trace->paths_marginal,
+		(unsigned long long)(trace->stage_ns[FPIN_STAGE_QUEUE] / NSEC_PER_USEC),
+		(unsigned long long)(trace->stage_ns[FPIN_STAGE_RESOLVE] / NSEC_PER_USEC),
+		(unsigned long long)(trace->stage_ns[FPIN_STAGE_SETMARGINAL] / NSEC_PER_USEC),
+		(unsigned long long)(trace->stage_ns[FPIN_STAGE_RPORT] / NSEC_PER_USEC),
+		(unsigned long long)(first_ns / NSEC_PER_USEC),
+		(unsigned long long)(last_ns / NSEC_PER_USEC),
+		(unsigned long long)(e2e_ns / NSEC_PER_USEC), fpin_slo_budget_ms,
+		violated ? "VIOLATED by " : "met",
+		violated ? fpin_stage_names[worst] : "",
+		fpin_shadow_mode ? " shadow" : "");
+}
+
+/*
+ * Function:
+ *	fpin_shadow_record
+ *
+ * Inputs:
+ *	1. Host number the action is for.
+ *	2. Event number the action is taken for, 0 for a recovery.
+ *	3. printf style description of the action.
+ *
+ * Description:
+ *	Stands in for a multipathd command or sysfs write in shadow mode. The
+ *	action is logged as a plan record, which precede the trace record of
+ *	the event, so two daemon versions run on the same host can be compared
+ *	by their plan and trace records.
+ */
+void
+fpin_shadow_record(uint32_t host_num, uint32_t event_num, const char *fmt, ...) {
+	char action[FPIN_LOG_MSG_LEN];
+	va_list args;
+
+	va_start(args, fmt);
+	vsnprintf(action, sizeof(action), fmt, args);
+	va_end(args);
+
+	__atomic_add_fetch(&fpin_shadow_actions, 1, __ATOMIC_RELAXED);
+	FPIN_TLOG("plan: host %u event %u %s\n", host_num, event_num, action);
+}
+
+void
+fpin_slo_dump_stats(void) {
+	struct fpin_slo_stats stats;
+	int stage = 0;
+
+	pthread_mutex_lock(&fpin_slo_mutex);
+	stats = fpin_slo_stats;
+	pthread_mutex_unlock(&fpin_slo_mutex);
+
+	FPIN_TLOG("slo: budget %ums events %llu violations %llu e2e avg %lluus "
+		"max %lluus\n", fpin_slo_budget_ms,
+		(unsigned long long)stats.events,
+		(unsigned long long)stats.violations,
+		(unsigned long long)(stats.events ?
+			stats.e2e_sum_ns / stats.events / NSEC_PER_USEC : 0),
+		(unsigned long long)(stats.e2e_max_ns / NSEC_PER_USEC));
+	FPIN_TLOG("slo: actioned events %llu first action avg %lluus max %lluus"
+		" last action avg %lluus max %lluus\n",
+		(unsigned long long)stats.actioned,
+		(unsigned long long)(stats.actioned ?
+			stats.first_sum_ns / stats.actioned / NSEC_PER_USEC : 0),
+		(unsigned long long)(stats.first_max_ns / NSEC_PER_USEC),
+		(unsigned long long)(stats.actioned ?
+			stats.last_sum_ns / stats.actioned / NSEC_PER_USEC : 0),
+		(unsigned long long)(stats.last_max_ns / NSEC_PER_USEC));
+	if (fpin_shadow_mode)
+		FPIN_TLOG("slo: shadow mode, %llu actions recorded\n",
+			(unsigned long long)__atomic_load_n(&fpin_shadow_actions,
+				__ATOMIC_RELAXED));
+	for (stage = 0; stage < FPIN_STAGE_MAX; stage++) {
+		FPIN_TLOG("slo: stage %s violations %llu max %lluus\n",
+			fpin_stage_names[stage],
+			(unsigned long long)stats.stage_violations[stage],
+			(unsigned long long)(stats.stage_max_ns[stage] / NSEC_PER_USEC));
+	}
+}
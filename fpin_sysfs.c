@@ -0,0 +1,396 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * Root of the sysfs tree used by the plain file accessors below. Pointing
+ * it at a synthetic tree (-S) allows the resolution to be exercised without
+ * FC hardware.
+ */
+const char *fpin_sysfs_root = FPIN_DEF_SYSFS_ROOT;
+
+/*
+ * Builds <sysfs root>/<fmt> into buf. Returns the length, or -ENAMETOOLONG
+ * if the path does not fit.
+ */
+int
+fpin_sysfs_path(char *buf, size_t len, const char *fmt, ...) {
+	va_list ap;
+	int root_len = 0, ret = 0;
+
+	root_len = snprintf(buf, len, "%s/", fpin_sysfs_root);
+	if ((root_len < 0) || ((size_t)root_len >= len))
+		return -ENAMETOOLONG;
+
+	va_start(ap, fmt);
+	ret = vsnprintf(buf + root_len, len - root_len, fmt, ap);
+	va_end(ap);
+	if ((ret < 0) || ((size_t)ret >= len - root_len))
+		return -ENAMETOOLONG;
+
+	return root_len + ret;
+}
+
+/*
+ * Function:
+ *	fpin_sysfs_read_attr
+ *
+ * Inputs:
+ *	1. Full path of the sysfs attribute.
+ *	2. Buffer for the value and its size.
+ *
+ * Description:
+ *	Reads a sysfs attribute into buf, NULL terminated and with the trailing
+ *	newline stripped. Returns the length of the value or -errno.
+ */
+int
+fpin_sysfs_read_attr(const char *path, char *buf, size_t len) {
+	ssize_t ret = 0;
+	int fd = -1;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = read(fd, buf, len - 1);
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	close(fd);
+
+	return fpin_sysfs_strip(buf, ret);
+}
+
+/*
+ * NULL terminates a value of len bytes read into buf and strips its
+ * trailing newline. Returns the resulting length.
+ */
+int
+fpin_sysfs_strip(char *buf, ssize_t len) {
+	buf[len] = '\0';
+	while ((len > 0) && ((buf[len - 1] == '\n') || (buf[len - 1] == ' ')))
+		buf[--len] = '\0';
+	return len;
+}
+
+/* Writes value to a sysfs attribute. Returns 0 or -errno. */
+int
+fpin_sysfs_write_attr(const char *path, const char *value) {
+	ssize_t ret = 0;
+	int fd = -1;
+
+	fd = open(path, O_WRONLY | O_TRUNC | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = write(fd, value, strlen(value));
+	if (ret < 0) {
+		ret = -errno;
+		close(fd);
+		return ret;
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_sysfs_parse_wwn
+ *
+ * Inputs:
+ *	1. A port name as sysfs shows it, 0x followed by up to 16 hex digits.
+ *	2. Length of the string.
+ *	3. Returns the WWN.
+ *
+ * Description:
+ *	Converts the digits without branching on them: '0'-'9' have bit 6
+ *	clear and their value in the low nibble, 'a'-'f' and 'A'-'F' have bit 6
+ *	set and their value less 9 in it. Invalid characters are collected and
+ *	checked once at the end. Returns 0 or -EINVAL.
+ */
+int
+fpin_sysfs_parse_wwn(const char *str, size_t len, uint64_t *wwn) {
+	uint64_t val = 0;
+	uint32_t c = 0, letter = 0, bad = 0;
+	size_t i = 0;
+
+	if ((len > 2) && (str[0] == '0') && ((str[1] | 0x20) == 'x')) {
+		str += 2;
+		len -= 2;
+	}
+	if ((len == 0) || (len > 16))
+		return -EINVAL;
+
+	for (i = 0; i < len; i++) {
+		c = (unsigned char)str[i];
+		letter = (c >> 6) & 1;
+		val = (val << 4) | (((c & 0xf) + 9 * letter) & 0xf);
+		bad |= ((c - '0') >= 10) & (((c | 0x20) - 'a') >= 6);
+	}
+	if (bad)
+		return -EINVAL;
+
+	*wwn = val;
+	return 0;
+}
+
+/* Reads a port_name attribute as a 64 bit WWN. Returns 0 or -errno. */
+int
+fpin_sysfs_read_wwn(const char *path, uint64_t *wwn) {
+	char buf[WWN_LEN];
+	int ret = 0;
+
+	ret = fpin_sysfs_read_attr(path, buf, sizeof(buf));
+	if (ret <= 0)
+		return ret ? ret : -ENODATA;
+	return fpin_sysfs_parse_wwn(buf, ret, wwn);
+}
+
+/* Buffers of one batch of fpin_sysfs_scan_attrs, per thread */
+struct fpin_sysfs_scan
+{
+	char names[FPIN_SIO_BATCH][NAME_MAX + 1];
+	char paths[FPIN_SIO_BATCH][FILE_PATH_LEN];
+	char values[FPIN_SIO_BATCH][DEV_STATUS_LEN];
+	struct fpin_sio_req reqs[FPIN_SIO_BATCH];
+};
+
+static __thread struct fpin_sysfs_scan fpin_sysfs_scan_buf;
+
+static int
+fpin_sysfs_scan_flush(struct fpin_sysfs_scan *scan, int nr, int nr_attrs,
+			fpin_sysfs_scan_fn fn, void *arg) {
+	int i = 0, ret = 0;
+
+	fpin_sio_batch(scan->reqs, nr * nr_attrs);
+	for (i = 0; i < nr; i++) {
+		ret = fn(scan->names[i], &scan->reqs[i * nr_attrs], arg);
+		if (ret != 0)
+			return ret;
+	}
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_sysfs_scan_attrs
+ *
+ * Inputs:
+ *	1. Directory relative to the sysfs root, e.g. class/fc_remote_ports.
+ *	2. Name prefix of the entries to read, e.g. rport-3:.
+ *	3. Names of the attributes to read of every entry, and their number.
+ *	4. Set if the attributes are read once, i.e. not kept in the fd cache.
+ *	5. Called with every entry and its requests, in attribute order.
+ *	6. Argument of the callback.
+ *
+ * Description:
+ *	Reads the attributes of the matching entries of a directory in
+ *	batches of FPIN_SIO_BATCH requests, see fpin_sio_batch. The walks of
+ *	the resolution read once, the periodic sampling of a few entries keeps
+ *	its attributes cached. Returns the
+ *	nonzero value the callback stopped the scan with, 0 once every entry
+ *	was passed to it, or -errno.
+ */
+int
+fpin_sysfs_scan_attrs(const char *dir_name, const char *prefix,
+			const char *const *attrs, int nr_attrs, int once,
+			fpin_sysfs_scan_fn fn, void *arg) {
+	char path[FILE_PATH_LEN];
+	struct fpin_sysfs_scan *scan = &fpin_sysfs_scan_buf;
+	struct fpin_sio_req *req = NULL;
+	struct dirent *entry = NULL;
+	size_t prefix_len = strlen(prefix);
+	int nr = 0, i = 0, ret = 0;
+	DIR *dir = NULL;
+
+	if ((nr_attrs < 1) || (nr_attrs > FPIN_SIO_BATCH))
+		return -EINVAL;
+	if (fpin_sysfs_path(path, sizeof(path), "%s", dir_name) < 0)
+		return -ENAMETOOLONG;
+	dir = opendir(path);
+	if (dir == NULL)
+		return -errno;
+
+	while ((entry = readdir(dir)) != NULL) {
+		if ((entry->d_name[0] == '.') ||
+			(strncmp(entry->d_name, prefix, prefix_len) != 0))
+			continue;
+
+		for (i = 0; i < nr_attrs; i++) {
+			req = &scan->reqs[nr * nr_attrs + i];
+			memset(req, 0, sizeof(*req));
+			req->path = scan->paths[nr * nr_attrs + i];
+			req->buf = scan->values[nr * nr_attrs + i];
+			req->len = DEV_STATUS_LEN;
+			req->once = once;
+			if (fpin_sysfs_path(scan->paths[nr * nr_attrs + i],
+					FILE_PATH_LEN, "%s/%s/%s", dir_name, entry->d_name,
+					attrs[i]) < 0)
+				break;
+		}
+		if (i < nr_attrs)
+			continue;
+		strcpy(scan->names[nr], entry->d_name);
+
+		if (++nr == FPIN_SIO_BATCH / nr_attrs) {
+			ret = fpin_sysfs_scan_flush(scan, nr, nr_attrs, fn, arg);
+			nr = 0;
+			if (ret != 0)
+				break;
+		}
+	}
+	if ((ret == 0) && (nr > 0))
+		ret = fpin_sysfs_scan_flush(scan, nr, nr_attrs, fn, arg);
+
+	closedir(dir);
+	return ret;
+}
+
+struct fpin_sysfs_rport_scan
+{
+	struct fpin_rport *rports;
+	int max;
+	int count;
+};
+
+static int
+fpin_sysfs_rport_cb(const char *name, struct fpin_sio_req *reqs, void *arg) {
+	struct fpin_sysfs_rport_scan *scan = arg;
+	struct fpin_rport *rport = NULL;
+
+	if (scan->count == scan->max)
+		return -E2BIG;
+	rport = &scan->rports[scan->count];
+	if ((reqs[0].ret <= 0) ||
+		(fpin_sysfs_parse_wwn(reqs[0].buf, reqs[0].ret,
+					&rport->port_name) < 0))
+		return 0;
+	if (reqs[1].ret <= 0)
+		return 0;
+	rport->port_id = strtoul(reqs[1].buf, NULL, 16);
+	scan->count++;
+	return 0;
+}
+
+/*
+ * Function:
+ *	fpin_sysfs_read_rports
+ *
+ * Inputs:
+ *	1. Host number of the HBA port.
+ *	2. Array for the remote ports and its size.
+ *
+ * Description:
+ *	Reads the port_name and port_id of every rport-<host>:* remote port in
+ *	one directory pass. Returns the number of ports read, -E2BIG if the
+ *	host has more than max of them, or -errno.
+ */
+int
+fpin_sysfs_read_rports(uint32_t host_num, struct fpin_rport *rports, int max) {
+	static const char *const attrs[] = { "port_name", "port_id" };
+	struct fpin_sysfs_rport_scan scan = { rports, max, 0 };
+	char prefix[DEV_NODE_LEN];
+	int ret = 0;
+
+	snprintf(prefix, sizeof(prefix), "rport-%u:", host_num);
+	ret = fpin_sysfs_scan_attrs("class/fc_remote_ports", prefix, attrs, 2, 1,
+			fpin_sysfs_rport_cb, &scan);
+	return (ret < 0) ? ret : scan.count;
+}
+
+struct fpin_sysfs_rport_find
+{
+	uint64_t p_wwn;
+	char *name;
+	size_t len;
+};
+
+static int
+fpin_sysfs_rport_find_cb(const char *name, struct fpin_sio_req *reqs,
+			void *arg) {
+	struct fpin_sysfs_rport_find *find = arg;
+	uint64_t port_name = 0;
+
+	if ((reqs[0].ret <= 0) ||
+		(fpin_sysfs_parse_wwn(reqs[0].buf, reqs[0].ret, &port_name) < 0) ||
+		(port_name != find->p_wwn))
+		return 0;
+	snprintf(find->name, find->len, "%s", name);
+	return 1;
+}
+
+/*
+ * Function:
+ *	fpin_sysfs_set_rport_state
+ *
+ * Inputs:
+ *	1. Host number of the HBA port.
+ *	2. Event the state is set for, 0 for a recovery.
+ *	3. Port WWN of the remote port.
+ *	4. The port_state to set, Marginal or Online.
+ *
+ * Returns:
+ *	1 if the state was changed, 0 if the rport already was in that state,
+ *	-errno on failure.
+ *
+ * Description:
+ *	Finds the rport-<host>:* remote port with the given port_name and
+ *	writes its port_state. In shadow mode the write is only recorded.
+ */
+int
+fpin_sysfs_set_rport_state(uint32_t host_num, uint32_t event_num,
+			uint64_t p_wwn, const char *state) {
+	static const char *const attrs[] = { "port_name" };
+	char path[FILE_PATH_LEN], prefix[DEV_NODE_LEN], rport[NAME_MAX + 1];
+	char port_state[DEV_STATUS_LEN];
+	struct fpin_sysfs_rport_find find = { p_wwn, rport, sizeof(rport) };
+	int ret = 0;
+
+	snprintf(prefix, sizeof(prefix), "rport-%u:", host_num);
+	ret = fpin_sysfs_scan_attrs("class/fc_remote_ports", prefix, attrs, 1, 1,
+			fpin_sysfs_rport_find_cb, &find);
+	if (ret <= 0)
+		return ret ? ret : -ENODEV;
+
+	if (fpin_sysfs_path(path, sizeof(path),
+			"class/fc_remote_ports/%s/port_state", rport) < 0)
+		return -ENAMETOOLONG;
+	if (fpin_sio_read_attr(path, port_state, sizeof(port_state)) < 0)
+		return -EIO;
+	/* The transport rejects a write of the state the rport is in */
+	if (strcmp(port_state, state) == 0)
+		return 0;
+	if (fpin_shadow_mode) {
+		fpin_shadow_record(host_num, event_num,
+				"%s 0x%016llx port_state %s -> %s", rport,
+				(unsigned long long)p_wwn, port_state, state);
+		return 1;
+	}
+	ret = fpin_sio_write_attr(path, state);
+	if (ret < 0) {
+		FPIN_ELOG("failed to set %s port_state %s, err %d\n", rport, state,
+			ret);
+		return ret;
+	}
+	FPIN_ILOG("%s 0x%016llx port_state %s -> %s\n", rport,
+		(unsigned long long)p_wwn, port_state, state);
+	return 1;
+}
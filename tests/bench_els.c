@@ -0,0 +1,122 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include "fpin_test.h"
+
+/*
+ * Decode microbenchmark. Times fpin_els_decode_frame on LI and congestion
+ * frames with 1 to FPIN_TEST_MAX_LI_PORTS port names and reports the
+ * nanoseconds and heap allocations per frame. The decode includes the
+ * fault classification, which reads the local port name from a synthetic
+ * sysfs tree, and the default policy, which sets every port marginal.
+ *
+ *	tests/bench_els [iterations]
+ */
+
+#define FPIN_BENCH_DEF_ITER		20000
+
+static struct fpin_arena fpin_bench_arena;
+
+static uint64_t
+fpin_bench_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void
+fpin_bench_decode(const char *name, char *frame, size_t len,
+			uint32_t nr_ports, int iterations) {
+	struct wwn_list list;
+	uint64_t start = 0, ns = 0, allocs = 0;
+	int i = 0, count = 0;
+
+	/* Warm the arena chunks, health slots and page cache up first */
+	for (i = 0; i < iterations / 10 + 1; i++) {
+		memset(&list, 0, sizeof(list));
+		list.arena = &fpin_bench_arena;
+		count = fpin_els_decode_frame(1, frame, len, &list, NULL);
+		fpin_arena_reset(&fpin_bench_arena);
+	}
+	FPIN_TEST_ASSERT(count >= 0);
+
+	allocs = fpin_test_allocs();
+	fpin_test_count_allocs = 1;
+	start = fpin_bench_ns();
+	for (i = 0; i < iterations; i++) {
+		memset(&list, 0, sizeof(list));
+		list.arena = &fpin_bench_arena;
+		fpin_els_decode_frame(1, frame, len, &list, NULL);
+		fpin_arena_reset(&fpin_bench_arena);
+	}
+	ns = fpin_bench_ns() - start;
+	fpin_test_count_allocs = 0;
+	allocs = fpin_test_allocs() - allocs;
+
+	printf("%-4s %6u %8zu %12.1f %14.3f\n", name, nr_ports, len,
+		(double)ns / iterations, (double)allocs / iterations);
+}
+
+int
+main(int argc, char *argv[]) {
+	char frame[FC_PAYLOAD_MAXLEN];
+	int iterations = FPIN_BENCH_DEF_ITER;
+	uint32_t nr_ports = 0;
+	size_t len = 0;
+
+	if (argc > 1)
+		iterations = atoi(argv[1]);
+	if (iterations <= 0) {
+		fprintf(stderr, "usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	fpin_log_level = LOG_EMERG;
+	fpin_arena_init(&fpin_bench_arena);
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+	fpin_test_sysfs_file("0x10000090fa000001",
+		"class/fc_host/host1/port_name");
+
+	printf("%-4s %6s %8s %12s %14s\n", "desc", "ports", "bytes",
+		"ns/frame", "allocs/frame");
+	for (nr_ports = 1; ; nr_ports *= 2) {
+		if (nr_ports > FPIN_TEST_MAX_LI_PORTS)
+			nr_ports = FPIN_TEST_MAX_LI_PORTS;
+		len = fpin_test_li_frame(frame, sizeof(frame),
+				FPIN_LINK_INTEGRITY_EVENT_TYPE_LINK_FAILURE,
+				0x2000000000000001ULL, 0x2000000000000002ULL,
+				0x5006016000000001ULL, nr_ports);
+		fpin_bench_decode("li", frame, len, nr_ports, iterations);
+		if (nr_ports == FPIN_TEST_MAX_LI_PORTS)
+			break;
+	}
+	for (nr_ports = 1; ; nr_ports *= 2) {
+		if (nr_ports > FPIN_TEST_MAX_LI_PORTS)
+			nr_ports = FPIN_TEST_MAX_LI_PORTS;
+		len = fpin_test_cn_frame(frame, sizeof(frame),
+				eFPIN_CONGESTION_NOTIFICATION_EVENT_TYPE_CREDIT_STALL,
+				0x2000000000000001ULL, 0x2000000000000002ULL,
+				0x5006016100000001ULL, nr_ports);
+		fpin_bench_decode("cn", frame, len, nr_ports, iterations);
+		if (nr_ports == FPIN_TEST_MAX_LI_PORTS)
+			break;
+	}
+
+	fpin_arena_destroy(&fpin_bench_arena);
+	fpin_test_sysfs_cleanup();
+	return 0;
+}
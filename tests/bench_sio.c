@@ -0,0 +1,185 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <pthread.h>
+#include "fpin_test.h"
+
+/*
+ * sysfs attribute I/O microbenchmark. Reads the port_name and port_state
+ * of every remote port of a synthetic tree, as the resolution does, with
+ * an open/read/close per attribute and with the batched backends of
+ * fpin_sio.c, read once as the resolution scans do and through the fd
+ * cache as the samplers do, and reports the nanoseconds per attribute.
+ * The trees range from one that fits in the fd cache to one many times
+ * its size.
+ *
+ *	tests/bench_sio [passes]
+ */
+
+#define FPIN_BENCH_DEF_PASSES	50
+
+static const char *const fpin_bench_attrs[] = { "port_name", "port_state" };
+#define FPIN_BENCH_NR_ATTRS	2
+
+struct fpin_bench_run {
+	const char *name;
+	int backend;				/* fpin_sio backend, -1 for open/read/close */
+	int once;					/* Scan requests bypass the fd cache */
+	int passes;
+	uint64_t attrs;				/* Attributes read per pass */
+	uint64_t ns;
+};
+
+static uint64_t
+fpin_bench_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int
+fpin_bench_scan_cb(const char *name, struct fpin_sio_req *reqs, void *arg) {
+	uint64_t *attrs = arg;
+	int i = 0;
+
+	for (i = 0; i < FPIN_BENCH_NR_ATTRS; i++)
+		FPIN_TEST_ASSERT(reqs[i].ret > 0);
+	*attrs += FPIN_BENCH_NR_ATTRS;
+	return 0;
+}
+
+/* One pass the way every attribute was read before fpin_sio.c */
+static uint64_t
+fpin_bench_plain_pass(void) {
+	char path[FILE_PATH_LEN], value[DEV_STATUS_LEN];
+	struct dirent *entry = NULL;
+	uint64_t attrs = 0;
+	DIR *dir = NULL;
+	int i = 0;
+
+	fpin_sysfs_path(path, sizeof(path), "class/fc_remote_ports");
+	dir = opendir(path);
+	FPIN_TEST_ASSERT(dir != NULL);
+	while ((entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] == '.')
+			continue;
+		for (i = 0; i < FPIN_BENCH_NR_ATTRS; i++) {
+			fpin_sysfs_path(path, sizeof(path),
+				"class/fc_remote_ports/%s/%s", entry->d_name,
+				fpin_bench_attrs[i]);
+			FPIN_TEST_ASSERT(fpin_sysfs_read_attr(path, value,
+						sizeof(value)) > 0);
+			attrs++;
+		}
+	}
+	closedir(dir);
+	return attrs;
+}
+
+static uint64_t
+fpin_bench_sio_pass(int once) {
+	uint64_t attrs = 0;
+
+	FPIN_TEST_ASSERT(fpin_sysfs_scan_attrs("class/fc_remote_ports", "rport-",
+				fpin_bench_attrs, FPIN_BENCH_NR_ATTRS, once,
+				fpin_bench_scan_cb, &attrs) == 0);
+	return attrs;
+}
+
+/* Runs in a thread of its own, the fd cache and ring are per thread */
+static void *
+fpin_bench_thread(void *arg) {
+	struct fpin_bench_run *run = arg;
+	uint64_t start = 0;
+	int i = 0;
+
+	if (run->backend >= 0) {
+		fpin_sio_backend = run->backend;
+		fpin_sio_thread_init();
+	}
+	/* The first pass opens the attributes and fills the page cache */
+	run->attrs = (run->backend < 0) ? fpin_bench_plain_pass() :
+			fpin_bench_sio_pass(run->once);
+	start = fpin_bench_ns();
+	for (i = 0; i < run->passes; i++) {
+		if (run->backend < 0)
+			fpin_bench_plain_pass();
+		else
+			fpin_bench_sio_pass(run->once);
+	}
+	run->ns = fpin_bench_ns() - start;
+	return NULL;
+}
+
+/* Adds the remote ports first to last - 1 to the tree */
+static void
+fpin_bench_tree(int first, int last) {
+	char port_name[WWN_LEN];
+	int i = 0;
+
+	for (i = first; i < last; i++) {
+		snprintf(port_name, sizeof(port_name), "0x50060160%08x", i);
+		FPIN_TEST_ASSERT(fpin_test_sysfs_file(port_name,
+			"class/fc_remote_ports/rport-1:0-%d/port_name", i) == 0);
+		FPIN_TEST_ASSERT(fpin_test_sysfs_file("Online",
+			"class/fc_remote_ports/rport-1:0-%d/port_state", i) == 0);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	static const int sizes[] = { 64, 512, 4096 };
+	struct fpin_bench_run runs[] = {
+		{ "open/read/close", -1 },
+		{ "psync once", FPIN_SIO_PSYNC, 1 },
+		{ "psync cached", FPIN_SIO_PSYNC, 0 },
+#ifdef FPIN_HAVE_LIBURING
+		{ "io_uring once", FPIN_SIO_IO_URING, 1 },
+		{ "io_uring cached", FPIN_SIO_IO_URING, 0 },
+#endif
+	};
+	int passes = FPIN_BENCH_DEF_PASSES, nr_rports = 0, s = 0, r = 0;
+	pthread_t thread;
+
+	if (argc > 1)
+		passes = atoi(argv[1]);
+	if (passes <= 0) {
+		fprintf(stderr, "usage: %s [passes]\n", argv[0]);
+		return 1;
+	}
+
+	fpin_log_level = LOG_EMERG;
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+
+	printf("%-16s %8s %8s %12s\n", "backend", "rports", "attrs", "ns/attr");
+	for (s = 0; s < (int)(sizeof(sizes) / sizeof(sizes[0])); s++) {
+		fpin_bench_tree(nr_rports, sizes[s]);
+		nr_rports = sizes[s];
+		for (r = 0; r < (int)(sizeof(runs) / sizeof(runs[0])); r++) {
+			runs[r].passes = passes;
+			FPIN_TEST_ASSERT(pthread_create(&thread, NULL,
+						fpin_bench_thread, &runs[r]) == 0);
+			pthread_join(thread, NULL);
+			printf("%-16s %8d %8llu %12.1f\n", runs[r].name, nr_rports,
+				(unsigned long long)runs[r].attrs,
+				(double)runs[r].ns / passes / runs[r].attrs);
+		}
+	}
+
+	fpin_test_sysfs_cleanup();
+	return 0;
+}
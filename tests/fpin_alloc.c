@@ -0,0 +1,80 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include "fpin_test.h"
+
+/*
+ * Heap allocation counting. glibc lets a program replace malloc, and its
+ * own callers, e.g. fopen or strdup, then come here too. The harness turns
+ * fpin_test_count_allocs on around the code it measures. Not linked into
+ * the fuzzer, whose sanitizers replace malloc themselves.
+ */
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+extern void *__libc_memalign(size_t alignment, size_t size);
+extern void __libc_free(void *ptr);
+
+volatile int fpin_test_count_allocs;
+static uint64_t fpin_test_nr_allocs;
+
+static inline void
+fpin_test_alloc_count(void) {
+	if (fpin_test_count_allocs)
+		__atomic_add_fetch(&fpin_test_nr_allocs, 1, __ATOMIC_RELAXED);
+}
+
+uint64_t
+fpin_test_allocs(void) {
+	return __atomic_load_n(&fpin_test_nr_allocs, __ATOMIC_RELAXED);
+}
+
+void *
+malloc(size_t size) {
+	fpin_test_alloc_count();
+	return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size) {
+	fpin_test_alloc_count();
+	return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size) {
+	fpin_test_alloc_count();
+	return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **memptr, size_t alignment, size_t size) {
+	fpin_test_alloc_count();
+	*memptr = __libc_memalign(alignment, size);
+	return (*memptr == NULL) ? ENOMEM : 0;
+}
+
+void *
+aligned_alloc(size_t alignment, size_t size) {
+	fpin_test_alloc_count();
+	return __libc_memalign(alignment, size);
+}
+
+void
+free(void *ptr) {
+	__libc_free(ptr);
+}
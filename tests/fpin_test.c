@@ -0,0 +1,204 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#define _GNU_SOURCE
+#include <stdarg.h>
+#include <ftw.h>
+#include <sys/mman.h>
+#include "fpin_test.h"
+
+/* Globals of fpin_main.c */
+struct list_head els_marginal_list_head =
+	LIST_HEAD_INIT(els_marginal_list_head);
+struct list_head fpin_li_marginal_dev_list_head =
+	LIST_HEAD_INIT(fpin_li_marginal_dev_list_head);
+
+int
+fpin_rx_host_wanted(uint32_t host_num) {
+	return 1;
+}
+
+/* The ELS header and the descriptor header common to every frame */
+static size_t
+fpin_test_frame(char *buf, size_t size, uint32_t tag, size_t desc_len) {
+	fpin_els_header_t *els = (fpin_els_header_t *)buf;
+	fpin_descriptor_header_t *desc =
+		(fpin_descriptor_header_t *)(buf + sizeof(*els));
+	size_t len = sizeof(*els) + desc_len;
+
+	if (len > size)
+		return 0;
+	memset(buf, 0, len);
+	/* The command word is compared as is, see fpin_handle_els_frame */
+	els->cmd = ELS_CMD_FPIN;
+	els->length = htonl(desc_len);
+	desc->tag = htonl(tag);
+	desc->length = htonl(desc_len - sizeof(*desc));
+	return len;
+}
+
+static void
+fpin_test_port_list(fpin_notification_port_list_t *port_list,
+			uint64_t first_wwn, uint32_t nr_ports) {
+	uint32_t i = 0;
+
+	port_list->count = htonl(nr_ports);
+	for (i = 0; i < nr_ports; i++)
+		fpin_u64_to_wwn(first_wwn + i, &port_list->port_name_list[i]);
+}
+
+size_t
+fpin_test_li_frame(char *buf, size_t size, uint16_t event_type,
+			uint64_t detecting_wwn, uint64_t attached_wwn,
+			uint64_t first_wwn, uint32_t nr_ports) {
+	fpin_link_integrity_notification_t *li = NULL;
+	size_t len = 0;
+
+	len = fpin_test_frame(buf, size,
+			eFPIN_NOTIFICATION_DESCRIPTOR_LINK_INTEGRITY_TAG,
+			sizeof(*li) + nr_ports * sizeof(wwn_t));
+	if (len == 0)
+		return 0;
+	li = &((fpin_link_integrity_request_els_t *)buf)->linkIntegrityDesc;
+	fpin_u64_to_wwn(detecting_wwn, &li->detecting_port_wwn);
+	fpin_u64_to_wwn(attached_wwn, &li->attached_port_wwn);
+	li->event_type = htons(event_type);
+	li->event_threshold = htonl(2000);
+	li->event_count = htonl(5);
+	fpin_test_port_list(&li->port_list, first_wwn, nr_ports);
+	return len;
+}
+
+size_t
+fpin_test_cn_frame(char *buf, size_t size, uint16_t event_type,
+			uint64_t detecting_wwn, uint64_t attached_wwn,
+			uint64_t first_wwn, uint32_t nr_ports) {
+	fpin_congestion_notification_t *cn = NULL;
+	size_t len = 0;
+
+	len = fpin_test_frame(buf, size,
+			eFPIN_NOTIFICATION_DESCRIPTOR_CONGESTION_TAG,
+			sizeof(*cn) + nr_ports * sizeof(wwn_t));
+	if (len == 0)
+		return 0;
+	cn = &((fpin_congestion_request_els_t *)buf)->congestionDesc;
+	fpin_u64_to_wwn(detecting_wwn, &cn->detecting_port_wwn);
+	fpin_u64_to_wwn(attached_wwn, &cn->attached_port_wwn);
+	cn->event_type = htons(event_type);
+	cn->event_period = htonl(100);
+	fpin_test_port_list(&cn->port_list, first_wwn, nr_ports);
+	return len;
+}
+
+/*
+ * Delivery notification: the port names, a reason code and the 24 byte
+ * header of the discarded frame.
+ */
+size_t
+fpin_test_delivery_frame(char *buf, size_t size,
+			uint64_t detecting_wwn, uint64_t attached_wwn) {
+	fpin_descriptor_header_t *desc = NULL;
+	wwn_t *port_name = NULL;
+	uint32_t *reason = NULL;
+	size_t len = 0;
+
+	len = fpin_test_frame(buf, size,
+			eFPIN_NOTIFICATION_DESCRIPTOR_DELIVERY_TAG,
+			sizeof(*desc) + 2 * sizeof(wwn_t) + sizeof(*reason) + 24);
+	if (len == 0)
+		return 0;
+	desc = (fpin_descriptor_header_t *)(buf + sizeof(fpin_els_header_t));
+	port_name = (wwn_t *)(desc + 1);
+	fpin_u64_to_wwn(detecting_wwn, &port_name[0]);
+	fpin_u64_to_wwn(attached_wwn, &port_name[1]);
+	reason = (uint32_t *)&port_name[2];
+	*reason = htonl(1);				/* Timeout */
+	return len;
+}
+
+static char fpin_test_root[] = "/tmp/fctxpd_test.XXXXXX";
+
+const char *
+fpin_test_sysfs_init(void) {
+	if (mkdtemp(fpin_test_root) == NULL)
+		return NULL;
+	fpin_sysfs_root = fpin_test_root;
+	return fpin_test_root;
+}
+
+int
+fpin_test_sysfs_file(const char *value, const char *fmt, ...) {
+	char path[FILE_PATH_LEN], *slash = NULL;
+	int root_len = strlen(fpin_test_root), ret = 0;
+	FILE *fp = NULL;
+	va_list ap;
+
+	snprintf(path, sizeof(path), "%s/", fpin_test_root);
+	va_start(ap, fmt);
+	ret = vsnprintf(path + root_len + 1, sizeof(path) - root_len - 1, fmt, ap);
+	va_end(ap);
+	if ((ret < 0) || ((size_t)ret >= sizeof(path) - root_len - 1))
+		return -ENAMETOOLONG;
+
+	for (slash = strchr(path + root_len + 1, '/'); slash != NULL;
+			slash = strchr(slash + 1, '/')) {
+		*slash = '\0';
+		if ((mkdir(path, 0755) < 0) && (errno != EEXIST))
+			return -errno;
+		*slash = '/';
+	}
+	/* A NULL value makes a directory */
+	if (value == NULL)
+		return ((mkdir(path, 0755) < 0) && (errno != EEXIST)) ? -errno : 0;
+	fp = fopen(path, "w");
+	if (fp == NULL)
+		return -errno;
+	fprintf(fp, "%s\n", value);
+	fclose(fp);
+	return 0;
+}
+
+static int
+fpin_test_rm(const char *path, const struct stat *st, int flag,
+			struct FTW *ftw) {
+	return remove(path);
+}
+
+void
+fpin_test_sysfs_cleanup(void) {
+	nftw(fpin_test_root, fpin_test_rm, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+static char fpin_test_feed[32];
+
+static void
+fpin_test_feed_cleanup(void) {
+	shm_unlink(fpin_test_feed);
+}
+
+int
+fpin_test_feed_init(struct fpin_feed_reader *reader) {
+	int ret = 0;
+
+	snprintf(fpin_test_feed, sizeof(fpin_test_feed), "/fctxpd_test_%d",
+		(int)getpid());
+	fpin_feed_name = fpin_test_feed;
+	ret = fpin_feed_init();
+	if (ret < 0)
+		return ret;
+	atexit(fpin_test_feed_cleanup);
+	return fpin_feed_open(reader, fpin_test_feed);
+}
@@ -0,0 +1,60 @@
+#ifndef __FPIN_TEST_H__
+#define __FPIN_TEST_H__
+
+#include <stdlib.h>
+#include "fpin.h"
+
+/*
+ * Support for the test and benchmark harnesses. They link every module of
+ * the daemon except fpin_main.c, whose globals fpin_test.c stands in for.
+ */
+
+/* The LI queue, defined in fpin_main.c and fpin_test.c */
+extern struct list_head els_marginal_list_head;
+
+/* FPIN frames as the HBA driver delivers them, return the length or 0 */
+size_t fpin_test_li_frame(char *buf, size_t size, uint16_t event_type,
+			uint64_t detecting_wwn, uint64_t attached_wwn,
+			uint64_t first_wwn, uint32_t nr_ports);
+size_t fpin_test_cn_frame(char *buf, size_t size, uint16_t event_type,
+			uint64_t detecting_wwn, uint64_t attached_wwn,
+			uint64_t first_wwn, uint32_t nr_ports);
+size_t fpin_test_delivery_frame(char *buf, size_t size,
+			uint64_t detecting_wwn, uint64_t attached_wwn);
+
+/* Link ends and first remote port of the frames of the tests */
+#define FPIN_TEST_DETECTING	0x2001000dec000001ULL
+#define FPIN_TEST_ATTACHED	0x2002000dec000002ULL
+#define FPIN_TEST_PORT		0x5006016000000000ULL
+
+/* Most port names an LI frame can carry */
+#define FPIN_TEST_MAX_LI_PORTS	\
+	((FC_PAYLOAD_MAXLEN - sizeof(fpin_link_integrity_request_els_t)) / \
+	 sizeof(wwn_t))
+
+/*
+ * Synthetic sysfs tree the daemon is pointed at, see fpin_sysfs_root.
+ * fpin_test_sysfs_file creates a file relative to it, with its parents.
+ */
+const char *fpin_test_sysfs_init(void);
+int fpin_test_sysfs_file(const char *value, const char *fmt, ...);
+void fpin_test_sysfs_cleanup(void);
+
+/*
+ * Event feed of the test process, unlinked at exit, and a reader at its
+ * head. Returns 0 or -errno.
+ */
+int fpin_test_feed_init(struct fpin_feed_reader *reader);
+
+/* Heap allocation counting, see fpin_alloc.c */
+extern volatile int fpin_test_count_allocs;
+uint64_t fpin_test_allocs(void);
+
+#define FPIN_TEST_ASSERT(cond) do { \
+	if (!(cond)) { \
+		fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, #cond); \
+		exit(1); \
+	} \
+} while (0)
+
+#endif
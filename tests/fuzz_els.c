@@ -0,0 +1,100 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include "fpin_test.h"
+
+/*
+ * Fuzz target of the FPIN frame decode, fpin_els_decode_frame, which is
+ * where everything the fabric sends is first trusted. Built for libFuzzer
+ * by make fuzz. Built with -DFPIN_FUZZ_MAIN it reads one frame from each
+ * file argument or from stdin instead, for afl-fuzz and for replaying a
+ * crash. The seed corpus is in tests/corpus.
+ */
+
+static struct fpin_arena fpin_fuzz_arena;
+
+static void
+fpin_fuzz_init(void) {
+	static int done;
+
+	if (done)
+		return;
+	done = 1;
+	fpin_log_level = LOG_EMERG;
+	fpin_arena_init(&fpin_fuzz_arena);
+	/* The local port, so that host link faults are classified too */
+	if (fpin_test_sysfs_init() != NULL) {
+		fpin_test_sysfs_file("0x10000090fa000001",
+			"class/fc_host/host1/port_name");
+		atexit(fpin_test_sysfs_cleanup);
+	}
+}
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+	struct wwn_list list;
+	char *frame = NULL;
+
+	fpin_fuzz_init();
+	/* The receiver never passes on more than this */
+	if (size > FC_PAYLOAD_MAXLEN)
+		return 0;
+	/* A copy of the exact size, so an overread is caught */
+	frame = malloc(size ? size : 1);
+	if (frame == NULL)
+		return 0;
+	memcpy(frame, data, size);
+
+	memset(&list, 0, sizeof(list));
+	list.arena = &fpin_fuzz_arena;
+	fpin_els_decode_frame(1, frame, size, &list, NULL);
+
+	fpin_arena_reset(&fpin_fuzz_arena);
+	free(frame);
+	return 0;
+}
+
+#ifdef FPIN_FUZZ_MAIN
+static int
+fpin_fuzz_file(FILE *fp) {
+	uint8_t data[FC_PAYLOAD_MAXLEN + 1];
+	size_t size = 0;
+
+	size = fread(data, 1, sizeof(data), fp);
+	if (ferror(fp))
+		return -EIO;
+	return LLVMFuzzerTestOneInput(data, size);
+}
+
+int
+main(int argc, char *argv[]) {
+	FILE *fp = NULL;
+	int i = 0;
+
+	if (argc < 2)
+		return fpin_fuzz_file(stdin);
+	for (i = 1; i < argc; i++) {
+		fp = fopen(argv[i], "r");
+		if (fp == NULL) {
+			perror(argv[i]);
+			return 1;
+		}
+		fpin_fuzz_file(fp);
+		fclose(fp);
+	}
+	return 0;
+}
+#endif
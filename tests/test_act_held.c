@@ -0,0 +1,96 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+
+#include <pthread.h>
+#include "fpin_test.h"
+
+/*
+ * A held action through the actuation worker: the setmarginal of a path
+ * whose policy rule wants I/O errors is planned by the sampler once the
+ * errors show up, after the event and its trace are gone, so the job has
+ * no trace. Runs in shadow mode, the paths actioned are read back from
+ * the event feed.
+ */
+
+#define FPIN_TEST_EVENT		7
+#define FPIN_TEST_TIMEOUT_MS	10000
+
+/* Waits for the path record of the given type, returns 0 or -ETIMEDOUT */
+static int
+fpin_test_wait(struct fpin_feed_reader *reader, uint16_t type,
+			uint32_t *ioerr_cnt) {
+	struct timespec delay = { 0, 50000000 };
+	struct fpin_feed_rec rec;
+	char value[16];
+	int ms = 0;
+
+	for (ms = 0; ms < FPIN_TEST_TIMEOUT_MS; ms += 50) {
+		while (fpin_feed_read(reader, &rec) > 0) {
+			if ((rec.type == type) && (strcmp(rec.dev_name, "sdb") == 0)) {
+				FPIN_TEST_ASSERT(rec.event_num == FPIN_TEST_EVENT);
+				FPIN_TEST_ASSERT(rec.wwn == FPIN_TEST_PORT);
+				return 0;
+			}
+		}
+		/*
+		 * The errors keep coming, whenever the sampler reads its
+		 * baseline they reach the threshold a sample or two later
+		 */
+		if (ioerr_cnt != NULL) {
+			snprintf(value, sizeof(value), "0x%x", ++(*ioerr_cnt));
+			fpin_test_sysfs_file(value, "block/sdb/device/ioerr_cnt");
+		}
+		nanosleep(&delay, NULL);
+	}
+	return -ETIMEDOUT;
+}
+
+int
+main(int argc, char *argv[]) {
+	struct fpin_confirm confirm = { 60, 2 };
+	struct fpin_feed_reader reader;
+	pthread_t sampler;
+	uint32_t ioerr_cnt = 0;
+
+	fpin_log_level = LOG_EMERG;
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+	fpin_test_sysfs_file("0x0", "block/sdb/device/ioerr_cnt");
+	fpin_test_sysfs_file("0x0", "block/sdb/device/iotmo_cnt");
+	fpin_test_sysfs_file("0x0", "block/sdb/device/iodone_cnt");
+
+	FPIN_TEST_ASSERT(fpin_test_feed_init(&reader) == 0);
+
+	fpin_shadow_mode = 1;
+	fpin_act_workers = 1;
+	FPIN_TEST_ASSERT(fpin_act_init() == 0);
+	FPIN_TEST_ASSERT(pthread_create(&sampler, NULL, fpin_ioerr_sampler,
+				NULL) == 0);
+
+	FPIN_TEST_ASSERT(fpin_ioerr_watch(FPIN_JOB_MARGINAL, 1, FPIN_TEST_EVENT,
+				"sdb", FPIN_TEST_PORT, &confirm) == 0);
+	FPIN_TEST_ASSERT(fpin_test_wait(&reader, FPIN_FEED_MARGINAL,
+				&ioerr_cnt) == 0);
+
+	/* The worker is done with the held job once it takes the next one */
+	FPIN_TEST_ASSERT(fpin_dm_plan_path(FPIN_JOB_FAIL, 1, FPIN_TEST_EVENT,
+				"sdb", FPIN_TEST_PORT, NULL) == 0);
+	FPIN_TEST_ASSERT(fpin_test_wait(&reader, FPIN_FEED_FAIL, NULL) == 0);
+
+	fpin_feed_close(&reader);
+	fpin_test_sysfs_cleanup();
+	return 0;
+}
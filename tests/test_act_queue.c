@@ -0,0 +1,116 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+
+#include <pthread.h>
+#include "fpin_test.h"
+
+/*
+ * The actuation queue with multipathd hung: the worker is stuck on its
+ * first action, repeats of a pending action are coalesced and the
+ * submitter waits once the queue is full, instead of queueing a job per
+ * event. Runs in shadow mode, the worker is held on the trace of its job.
+ */
+
+#define FPIN_TEST_CAPACITY	2
+#define FPIN_TEST_PATHS		(FPIN_TEST_CAPACITY + 2)
+#define FPIN_TEST_SETTLE_MS	200
+#define FPIN_TEST_TIMEOUT_MS	10000
+
+static volatile int fpin_test_submitted;
+
+/* Queues a fail of more paths than the queue holds */
+static void *
+fpin_test_submitter(void *arg) {
+	char dev_name[DEV_NAME_LEN];
+	int i = 0;
+
+	for (i = 0; i < FPIN_TEST_PATHS; i++) {
+		snprintf(dev_name, sizeof(dev_name), "sd%c", 'c' + i);
+		FPIN_TEST_ASSERT(fpin_act_submit(FPIN_JOB_FAIL, FPIN_DEV_SCSI, 1,
+					1, dev_name, FPIN_TEST_PORT, NULL) == 0);
+	}
+	__atomic_store_n(&fpin_test_submitted, 1, __ATOMIC_RELEASE);
+	return NULL;
+}
+
+static void
+fpin_test_sleep_ms(int ms) {
+	struct timespec delay = { ms / 1000, (ms % 1000) * 1000000L };
+
+	nanosleep(&delay, NULL);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct fpin_event_trace *trace = NULL;
+	struct timespec now;
+	pthread_t submitter;
+	int ms = 0;
+
+	fpin_log_level = LOG_EMERG;
+	fpin_shadow_mode = 1;
+	FPIN_TEST_ASSERT(fpin_act_parse_config("0") == -EINVAL);
+	FPIN_TEST_ASSERT(fpin_act_parse_config("1:0") == -EINVAL);
+	FPIN_TEST_ASSERT(fpin_act_parse_config("1:2x") == -EINVAL);
+	FPIN_TEST_ASSERT(fpin_act_parse_config("1:2") == 0);
+	FPIN_TEST_ASSERT(fpin_act_workers == 1);
+	FPIN_TEST_ASSERT(fpin_act_queue_capacity == FPIN_TEST_CAPACITY);
+	/* The job pool, sized to the queues, counts the jobs */
+	fpin_rt_prio = 1;
+	fpin_rt_init();
+	FPIN_TEST_ASSERT(fpin_job_pool.base != NULL);
+	FPIN_TEST_ASSERT(fpin_job_pool.nr >= FPIN_TEST_CAPACITY + 1);
+	FPIN_TEST_ASSERT(fpin_act_init() == 0);
+
+	fpin_trace_now(&now);
+	trace = fpin_trace_new(1, 1, &now);
+	FPIN_TEST_ASSERT(trace != NULL);
+	pthread_mutex_lock(&trace->lock);
+	FPIN_TEST_ASSERT(fpin_act_submit(FPIN_JOB_FAIL, FPIN_DEV_SCSI, 1, 1,
+				"sdb", FPIN_TEST_PORT, trace) == 0);
+
+	/* Whether or not the worker took the fail, the second is a repeat */
+	FPIN_TEST_ASSERT(fpin_act_submit(FPIN_JOB_MARGINAL, FPIN_DEV_SCSI, 1, 1,
+				"sdb", FPIN_TEST_PORT, NULL) == 0);
+	FPIN_TEST_ASSERT(fpin_act_submit(FPIN_JOB_MARGINAL, FPIN_DEV_SCSI, 1, 1,
+				"sdb", FPIN_TEST_PORT, NULL) == 0);
+	FPIN_TEST_ASSERT(fpin_job_pool.in_use == 2);
+
+	/* The queue plus the job being run, the submitter waits for the rest */
+	FPIN_TEST_ASSERT(pthread_create(&submitter, NULL, fpin_test_submitter,
+				NULL) == 0);
+	fpin_test_sleep_ms(FPIN_TEST_SETTLE_MS);
+	FPIN_TEST_ASSERT(fpin_job_pool.in_use <= FPIN_TEST_CAPACITY + 1);
+	FPIN_TEST_ASSERT(!__atomic_load_n(&fpin_test_submitted,
+				__ATOMIC_ACQUIRE));
+
+	/* Unsets never wait, their callers hold a lock the workers take */
+	FPIN_TEST_ASSERT(fpin_act_submit(FPIN_JOB_UNSET, FPIN_DEV_SCSI, 1, 0,
+				"sdb", FPIN_TEST_PORT, NULL) == 0);
+
+	pthread_mutex_unlock(&trace->lock);
+	fpin_trace_put(trace);
+	FPIN_TEST_ASSERT(pthread_join(submitter, NULL) == 0);
+	for (ms = 0; ms < FPIN_TEST_TIMEOUT_MS; ms += 50) {
+		if (fpin_job_pool.in_use == 0)
+			break;
+		fpin_test_sleep_ms(50);
+	}
+	FPIN_TEST_ASSERT(fpin_job_pool.in_use == 0);
+	FPIN_TEST_ASSERT(fpin_job_pool.max_in_use <= FPIN_TEST_CAPACITY + 2);
+	return 0;
+}
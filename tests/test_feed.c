@@ -0,0 +1,120 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+
+#include "fpin_test.h"
+
+/*
+ * Decoded LI and congestion notifications are published to the event
+ * feed with their link ends, event type and port count, read back through
+ * the reader library. A reader that falls a lap behind counts the records
+ * it lost, and one left on the feed of a restarted daemon is told to
+ * reopen it.
+ */
+
+#define FPIN_TEST_OVERRUN	5
+
+static struct fpin_arena fpin_test_arena;
+
+static void
+fpin_test_decode(char *frame, size_t len, uint32_t event_num) {
+	struct wwn_list list;
+
+	FPIN_TEST_ASSERT(len != 0);
+	memset(&list, 0, sizeof(list));
+	list.arena = &fpin_test_arena;
+	list.event_num = event_num;
+	FPIN_TEST_ASSERT(fpin_els_decode_frame(1, frame, len, &list, NULL) >= 0);
+	fpin_arena_reset(&fpin_test_arena);
+}
+
+static void
+fpin_test_event(struct fpin_feed_reader *reader, uint16_t type,
+			uint16_t event_type, uint32_t event_num, uint32_t nr_ports) {
+	struct fpin_feed_rec rec;
+
+	FPIN_TEST_ASSERT(fpin_feed_read(reader, &rec) == 1);
+	FPIN_TEST_ASSERT(rec.type == type);
+	FPIN_TEST_ASSERT(rec.event_type == event_type);
+	FPIN_TEST_ASSERT(rec.host_num == 1);
+	FPIN_TEST_ASSERT(rec.event_num == event_num);
+	FPIN_TEST_ASSERT(rec.detecting_wwn == FPIN_TEST_DETECTING);
+	FPIN_TEST_ASSERT(rec.attached_wwn == FPIN_TEST_ATTACHED);
+	FPIN_TEST_ASSERT(rec.count == nr_ports);
+}
+
+int
+main(int argc, char *argv[]) {
+	char frame[FC_PAYLOAD_MAXLEN];
+	struct fpin_feed_reader reader;
+	struct fpin_feed_rec rec;
+	uint32_t i = 0;
+
+	fpin_log_level = LOG_EMERG;
+	fpin_arena_init(&fpin_test_arena);
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+	fpin_test_sysfs_file("0x10000090fa000001",
+		"class/fc_host/host1/port_name");
+
+	FPIN_TEST_ASSERT(fpin_test_feed_init(&reader) == 0);
+
+	fpin_test_decode(frame, fpin_test_li_frame(frame, sizeof(frame),
+				FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC, FPIN_TEST_DETECTING,
+				FPIN_TEST_ATTACHED, FPIN_TEST_PORT, 3), 1);
+	fpin_test_event(&reader, FPIN_FEED_LI_EVENT,
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC, 1, 3);
+
+	fpin_test_decode(frame, fpin_test_cn_frame(frame, sizeof(frame),
+				eFPIN_CONGESTION_NOTIFICATION_EVENT_TYPE_CREDIT_STALL,
+				FPIN_TEST_DETECTING, FPIN_TEST_ATTACHED,
+				FPIN_TEST_PORT, 5), 2);
+	fpin_test_event(&reader, FPIN_FEED_CN_EVENT,
+		eFPIN_CONGESTION_NOTIFICATION_EVENT_TYPE_CREDIT_STALL, 2, 5);
+
+	FPIN_TEST_ASSERT(fpin_feed_read(&reader, &rec) == 0);
+
+	/* Overrun, the oldest records are overwritten before being read */
+	for (i = 0; i < FPIN_FEED_RECORDS + FPIN_TEST_OVERRUN; i++)
+		fpin_feed_path_action(FPIN_FEED_MARGINAL, 1, i, "sdb",
+			FPIN_TEST_PORT);
+	for (i = FPIN_TEST_OVERRUN; fpin_feed_read(&reader, &rec) == 1; i++) {
+		FPIN_TEST_ASSERT(rec.type == FPIN_FEED_MARGINAL);
+		FPIN_TEST_ASSERT(rec.event_num == i);
+	}
+	FPIN_TEST_ASSERT(i == FPIN_FEED_RECORDS + FPIN_TEST_OVERRUN);
+	FPIN_TEST_ASSERT(reader.lost == FPIN_TEST_OVERRUN);
+
+	/* Restart, the old feed is replaced under the reader */
+	FPIN_TEST_ASSERT(fpin_feed_init() == 0);
+	fpin_feed_path_action(FPIN_FEED_RECOVERED, 1, 0, "sdb", FPIN_TEST_PORT);
+	FPIN_TEST_ASSERT(fpin_feed_read(&reader, &rec) == -ESTALE);
+	fpin_feed_close(&reader);
+	FPIN_TEST_ASSERT(fpin_feed_open(&reader, fpin_feed_name) == 0);
+	FPIN_TEST_ASSERT(fpin_feed_read(&reader, &rec) == 0);
+	fpin_feed_path_action(FPIN_FEED_RECOVERED, 1, 0, "sdb", FPIN_TEST_PORT);
+	FPIN_TEST_ASSERT(fpin_feed_read(&reader, &rec) == 1);
+	FPIN_TEST_ASSERT(rec.type == FPIN_FEED_RECOVERED);
+	FPIN_TEST_ASSERT(rec.index == 1);
+	fpin_feed_close(&reader);
+
+	/* A failed open leaves no descriptor for close to release */
+	FPIN_TEST_ASSERT(fpin_feed_open(&reader, "/fctxpd_test_none") == -ENOENT);
+	FPIN_TEST_ASSERT(reader.fd == -1);
+	fpin_feed_close(&reader);
+	fpin_arena_destroy(&fpin_test_arena);
+	fpin_test_sysfs_cleanup();
+	return 0;
+}
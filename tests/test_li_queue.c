@@ -0,0 +1,97 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include "fpin_test.h"
+
+/*
+ * Coalescing in the full LI queue: the queued frame of the same
+ * notification keeps the ports of both frames, and a union that does not
+ * fit in a frame is not coalesced. No consumer runs, so the queue is
+ * inspected as the receiver left it.
+ */
+
+static int
+fpin_test_send(uint32_t event_num, uint64_t attached_wwn, uint64_t first_wwn,
+			uint32_t nr_ports) {
+	char buf[sizeof(fpin_payload_t) + FC_PAYLOAD_MAXLEN];
+	fpin_payload_t *fpin_payload = (fpin_payload_t *)buf;
+
+	memset(fpin_payload, 0, sizeof(*fpin_payload));
+	fpin_payload->host_num = 1;
+	fpin_payload->event_num = event_num;
+	fpin_payload->length = fpin_test_li_frame(fpin_payload->payload,
+				FC_PAYLOAD_MAXLEN, FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC,
+				FPIN_TEST_DETECTING, attached_wwn, first_wwn, nr_ports);
+	FPIN_TEST_ASSERT(fpin_payload->length != 0);
+	return fpin_handle_els_frame(fpin_payload);
+}
+
+/* Checks a queued frame holds the ports first to first + nr - 1, any order */
+static void
+fpin_test_ports(struct els_marginal_list *els_mrg, uint64_t first_wwn,
+			uint32_t nr_ports) {
+	fpin_link_integrity_request_els_t *fpin_req =
+		(fpin_link_integrity_request_els_t *)els_mrg->payload;
+	fpin_link_integrity_notification_t *li = &fpin_req->linkIntegrityDesc;
+	uint64_t seen = 0, wwn = 0;
+	uint32_t i = 0;
+
+	FPIN_TEST_ASSERT(ntohl(li->port_list.count) == nr_ports);
+	FPIN_TEST_ASSERT(els_mrg->length ==
+		sizeof(*fpin_req) + nr_ports * sizeof(wwn_t));
+	FPIN_TEST_ASSERT(ntohl(li->header.length) == els_mrg->length -
+		sizeof(fpin_els_header_t) - sizeof(fpin_descriptor_header_t));
+	for (i = 0; i < nr_ports; i++) {
+		wwn = fpin_wwn_to_u64(&li->port_list.port_name_list[i]);
+		FPIN_TEST_ASSERT((wwn >= first_wwn) && (wwn < first_wwn + nr_ports));
+		FPIN_TEST_ASSERT(!(seen & (1ULL << (wwn - first_wwn))));
+		seen |= 1ULL << (wwn - first_wwn);
+	}
+}
+
+int
+main(int argc, char *argv[]) {
+	struct els_marginal_list *first = NULL, *last = NULL;
+
+	fpin_log_level = LOG_EMERG;
+	FPIN_TEST_ASSERT(fpin_els_parse_queue("2:coalesce") == 0);
+
+	/* Ports 0-3, then another link, then ports 2-5 of the first link */
+	FPIN_TEST_ASSERT(fpin_test_send(1, FPIN_TEST_ATTACHED,
+				FPIN_TEST_PORT, 4) == 0);
+	FPIN_TEST_ASSERT(fpin_test_send(2, FPIN_TEST_ATTACHED + 1,
+				FPIN_TEST_PORT, 1) == 0);
+	FPIN_TEST_ASSERT(fpin_test_send(3, FPIN_TEST_ATTACHED,
+				FPIN_TEST_PORT + 2, 4) == 0);
+
+	first = list_first_entry(&els_marginal_list_head,
+				struct els_marginal_list, els_frame);
+	last = list_entry(els_marginal_list_head.prev,
+				struct els_marginal_list, els_frame);
+	FPIN_TEST_ASSERT(first->els_frame.next == &last->els_frame);
+	FPIN_TEST_ASSERT(first->event_num == 3);
+	fpin_test_ports(first, FPIN_TEST_PORT, 6);
+	FPIN_TEST_ASSERT(last->event_num == 2);
+
+	/* A union beyond the frame size is not coalesced, and then dropped */
+	FPIN_TEST_ASSERT(fpin_test_send(4, FPIN_TEST_ATTACHED,
+				FPIN_TEST_PORT + 0x1000,
+				FPIN_TEST_MAX_LI_PORTS) == -ENOBUFS);
+	FPIN_TEST_ASSERT(first->event_num == 3);
+	fpin_test_ports(first, FPIN_TEST_PORT, 6);
+
+	return 0;
+}
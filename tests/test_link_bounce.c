@@ -0,0 +1,133 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include "fpin_test.h"
+
+/*
+ * The fc_host statistics sampler on a link bounce: the LINKDOWN and LINKUP
+ * of a switch reboot move the link failure, loss of sync and CRC counters,
+ * and no LI frame may stand in for them nor may they score the link. CRC
+ * errors on a link that stays up still do both. fpin_link_sample is called
+ * directly, no consumer runs, so the stood in frames stay queued.
+ */
+
+static uint64_t fpin_test_crc;
+
+static void
+fpin_test_counter(const char *name, uint64_t value) {
+	char buf[32];
+
+	snprintf(buf, sizeof(buf), "0x%llx", (unsigned long long)value);
+	FPIN_TEST_ASSERT(fpin_test_sysfs_file(buf,
+				"class/fc_host/host1/statistics/%s", name) == 0);
+}
+
+/* What the HBA counts while its link goes down and comes back */
+static void
+fpin_test_bounce(uint64_t n) {
+	fpin_test_counter("link_failure_count", n);
+	fpin_test_counter("loss_of_signal_count", n);
+	fpin_test_counter("loss_of_sync_count", 4 * n);
+	fpin_test_crc += 20;
+	fpin_test_counter("invalid_crc_count", fpin_test_crc);
+}
+
+static int
+fpin_test_queued(void) {
+	struct els_marginal_list *els_mrg = NULL;
+	int n = 0;
+
+	list_for_each_entry(els_mrg, &els_marginal_list_head, els_frame)
+		n++;
+	return n;
+}
+
+int
+main(int argc, char *argv[]) {
+	static const char *const counters[] = {
+		"link_failure_count", "loss_of_signal_count", "loss_of_sync_count",
+		"prim_seq_protocol_err_count", "invalid_crc_count",
+		"invalid_tx_word_count", "error_frames", "fpin_li", "fpin_cn",
+	};
+	fpin_link_integrity_request_els_t *fpin_req = NULL;
+	struct els_marginal_list *els_mrg = NULL;
+	char port_name[WWN_LEN];
+	int i = 0;
+
+	fpin_log_level = LOG_EMERG;
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+	fpin_test_sysfs_file("0x10000090fa000001",
+		"class/fc_host/host1/port_name");
+	for (i = 0; i < (int)(sizeof(counters) / sizeof(counters[0])); i++)
+		fpin_test_counter(counters[i], 0);
+	for (i = 0; i < 4; i++) {
+		snprintf(port_name, sizeof(port_name), "0x%016llx",
+			(unsigned long long)(FPIN_TEST_PORT + i));
+		fpin_test_sysfs_file(port_name,
+			"class/fc_remote_ports/rport-1:0-%d/port_name", i);
+		fpin_test_sysfs_file("0x010100",
+			"class/fc_remote_ports/rport-1:0-%d/port_id", i);
+	}
+	fpin_link_interval = 5;
+	/* A CRC LI event alone stays below, with 20 link CRC errors above */
+	fpin_health_cfg.early_score = 80;
+	fpin_link_sample();
+
+	/* LINKDOWN, counters, a sample while down, LINKUP, two more samples */
+	fpin_link_event(1, FCH_EVT_LINKDOWN);
+	fpin_test_bounce(1);
+	fpin_link_sample();
+	fpin_link_event(1, FCH_EVT_LINKUP);
+	fpin_link_sample();
+	fpin_link_sample();
+	FPIN_TEST_ASSERT(fpin_test_queued() == 0);
+
+	/* The counters move, the LINKUP comes before the frame is sent */
+	fpin_test_bounce(2);
+	fpin_link_sample();
+	fpin_link_event(1, FCH_EVT_LINKUP);
+	fpin_link_sample();
+	fpin_link_sample();
+	FPIN_TEST_ASSERT(fpin_test_queued() == 0);
+
+	/* A link failure without the events stands in for nothing either */
+	fpin_test_counter("link_failure_count", 3);
+	fpin_link_sample();
+	fpin_link_sample();
+	FPIN_TEST_ASSERT(fpin_test_queued() == 0);
+	FPIN_TEST_ASSERT(fpin_health_li_event(1, FPIN_TEST_PORT + 0x10,
+				FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC) == 0);
+
+	/* CRC errors on a stable link are held for a sample, then sent */
+	fpin_test_crc += 20;
+	fpin_test_counter("invalid_crc_count", fpin_test_crc);
+	fpin_link_sample();
+	FPIN_TEST_ASSERT(fpin_test_queued() == 0);
+	fpin_link_sample();
+	FPIN_TEST_ASSERT(fpin_test_queued() == 1);
+	els_mrg = list_first_entry(&els_marginal_list_head,
+				struct els_marginal_list, els_frame);
+	fpin_req = (fpin_link_integrity_request_els_t *)els_mrg->payload;
+	FPIN_TEST_ASSERT(ntohs(fpin_req->linkIntegrityDesc.event_type) ==
+			FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC);
+	FPIN_TEST_ASSERT(ntohl(fpin_req->linkIntegrityDesc.port_list.count) == 4);
+	/* and weigh on the health of every remote port of the host */
+	FPIN_TEST_ASSERT(fpin_health_li_event(1, FPIN_TEST_PORT + 0x11,
+				FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC) == 1);
+
+	fpin_test_sysfs_cleanup();
+	return 0;
+}
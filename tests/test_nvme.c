@@ -0,0 +1,134 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+
+#include "fpin_test.h"
+
+/*
+ * Resolution of an LI event to nvme-fc controllers: a controller is set
+ * marginal only if its traddr is an impacted port and its host_traddr is
+ * the HBA port that received the FPIN. Runs in shadow mode against a
+ * synthetic sysfs tree, the controllers actioned are read back from the
+ * event feed.
+ */
+
+#define FPIN_TEST_HOST_PN	0x10000090fa000001ULL
+#define FPIN_TEST_OTHER_PN	0x10000090fa000002ULL
+#define FPIN_TEST_STRAY		0x5006016000000099ULL
+#define FPIN_TEST_TIMEOUT_MS	10000
+
+static struct fpin_arena fpin_test_arena;
+
+/* An nvme controller with its transport and, for fc, its address */
+static void
+fpin_test_ctrl(const char *ctrl, const char *transport, uint64_t traddr,
+			uint64_t host_traddr) {
+	char addr[NVME_ADDR_LEN];
+
+	FPIN_TEST_ASSERT(fpin_test_sysfs_file(transport, "class/nvme/%s/transport",
+				ctrl) == 0);
+	if (strcmp(transport, "fc") == 0)
+		snprintf(addr, sizeof(addr), "traddr=nn-0x%016llx:pn-0x%016llx,"
+			"host_traddr=nn-0x%016llx:pn-0x%016llx",
+			(unsigned long long)(traddr ^ (1ULL << 60)),
+			(unsigned long long)traddr,
+			(unsigned long long)(host_traddr ^ (1ULL << 60)),
+			(unsigned long long)host_traddr);
+	else
+		snprintf(addr, sizeof(addr), "traddr=192.168.1.10,trsvcid=4420");
+	FPIN_TEST_ASSERT(fpin_test_sysfs_file(addr, "class/nvme/%s/address",
+				ctrl) == 0);
+}
+
+/* A remote port of host1, for the port_state write */
+static void
+fpin_test_rport(int id, uint64_t port_name) {
+	char value[WWN_LEN];
+
+	snprintf(value, sizeof(value), "0x%016llx", (unsigned long long)port_name);
+	FPIN_TEST_ASSERT(fpin_test_sysfs_file(value,
+				"class/fc_remote_ports/rport-1:0-%d/port_name", id) == 0);
+	FPIN_TEST_ASSERT(fpin_test_sysfs_file("Online",
+				"class/fc_remote_ports/rport-1:0-%d/port_state", id) == 0);
+}
+
+int
+main(int argc, char *argv[]) {
+	struct timespec delay = { 0, 50000000 };
+	char frame[FC_PAYLOAD_MAXLEN];
+	struct fpin_feed_reader reader;
+	struct fpin_feed_rec rec;
+	struct wwn_list list;
+	int nvme0 = 0, nvme4 = 0, ms = 0;
+	size_t len = 0;
+
+	fpin_log_level = LOG_EMERG;
+	fpin_arena_init(&fpin_test_arena);
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+	fpin_test_sysfs_file("0x10000090fa000001",
+		"class/fc_host/host1/port_name");
+	fpin_test_rport(0, FPIN_TEST_PORT);
+	fpin_test_rport(1, FPIN_TEST_PORT + 1);
+
+	/* Impacted and through host1, the ones to set marginal */
+	fpin_test_ctrl("nvme0", "fc", FPIN_TEST_PORT, FPIN_TEST_HOST_PN);
+	fpin_test_ctrl("nvme4", "fc", FPIN_TEST_PORT + 1, FPIN_TEST_HOST_PN);
+	/* Impacted port, but reached through another HBA port */
+	fpin_test_ctrl("nvme1", "fc", FPIN_TEST_PORT, FPIN_TEST_OTHER_PN);
+	/* Not an nvme-fc controller */
+	fpin_test_ctrl("nvme2", "tcp", 0, 0);
+	/* Through host1, to a port the event does not list */
+	fpin_test_ctrl("nvme3", "fc", FPIN_TEST_STRAY, FPIN_TEST_HOST_PN);
+
+	FPIN_TEST_ASSERT(fpin_test_feed_init(&reader) == 0);
+	fpin_shadow_mode = 1;
+	fpin_act_workers = 1;
+	FPIN_TEST_ASSERT(fpin_act_init() == 0);
+
+	len = fpin_test_li_frame(frame, sizeof(frame),
+			FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC, FPIN_TEST_DETECTING,
+			FPIN_TEST_ATTACHED, FPIN_TEST_PORT, 2);
+	FPIN_TEST_ASSERT(len != 0);
+	memset(&list, 0, sizeof(list));
+	list.arena = &fpin_test_arena;
+	list.event_num = 1;
+	FPIN_TEST_ASSERT(fpin_els_decode_frame(1, frame, len, &list, NULL) >= 0);
+	FPIN_TEST_ASSERT(list.host_num == 1);
+	FPIN_TEST_ASSERT(fpin_nvme_marginal_path(&list, NULL) == 2);
+
+	for (ms = 0; (ms < FPIN_TEST_TIMEOUT_MS) && !(nvme0 && nvme4); ms += 50) {
+		while (fpin_feed_read(&reader, &rec) > 0) {
+			if (rec.type != FPIN_FEED_MARGINAL)
+				continue;
+			if (strcmp(rec.dev_name, "nvme0") == 0) {
+				FPIN_TEST_ASSERT(rec.wwn == FPIN_TEST_PORT);
+				nvme0 = 1;
+			} else if (strcmp(rec.dev_name, "nvme4") == 0) {
+				FPIN_TEST_ASSERT(rec.wwn == FPIN_TEST_PORT + 1);
+				nvme4 = 1;
+			} else {
+				FPIN_TEST_ASSERT(0);
+			}
+		}
+		nanosleep(&delay, NULL);
+	}
+	FPIN_TEST_ASSERT(nvme0 && nvme4);
+
+	fpin_feed_close(&reader);
+	fpin_arena_destroy(&fpin_test_arena);
+	fpin_test_sysfs_cleanup();
+	return 0;
+}
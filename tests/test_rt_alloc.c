@@ -0,0 +1,214 @@
+/*
+ * Copyright 2019 Broadcom. All rights reserved.
+ * The term “Broadcom” refers to Broadcom Inc. and/or its subsidiaries.
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see https://www.gnu.org/licenses/gpl-2.0.en.html.
+ */
+
+#include <pthread.h>
+#include "fpin_test.h"
+
+/*
+ * Replays an LI storm in real-time mode and checks that the bookkeeping of
+ * the FPIN path makes no heap allocations: the receiver queueing with its
+ * overflow policies, the LI consumer, the event traces, the decode, fault
+ * classification, health scoring and policy lookup. The policy ignores
+ * every event, so the resolution, which calls into libudev, libdevmapper
+ * and multipathd, is not reached.
+ *
+ * A second storm covers the actuation half in shadow mode with a marginal
+ * policy: every decoded port is planned as the resolution does for its
+ * paths, the workers carry out the setmarginal, the marginal list and
+ * flap damping follow, and the host is recovered every few events, which
+ * queues the unsets. The tree has no remote ports, so the rport writes
+ * stop before the directory scan, which allocates in opendir.
+ */
+
+#define FPIN_TEST_STORM		20000
+#define FPIN_TEST_WARMUP	64
+#define FPIN_TEST_RECOVER	64		/* Events between recoveries */
+#define FPIN_TEST_PATHS		32
+
+static void
+fpin_test_send(fpin_payload_t *fpin_payload, uint32_t i) {
+	static const uint16_t types[] = {
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_LINK_FAILURE,
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC,
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_ITW,
+		FPIN_LINK_INTEGRITY_EVENT_TYPE_LOSS_OF_SYNC,
+	};
+	fpin_link_integrity_request_els_t *fpin_req = NULL;
+	size_t len = 0;
+
+	/* 16 links with up to 32 ports behind them */
+	len = fpin_test_li_frame(fpin_payload->payload, FC_PAYLOAD_MAXLEN,
+			types[i % 4], 0x2001000dec000000ULL + (i % 16),
+			0x2002000dec000000ULL + (i % 16),
+			0x5006016000000000ULL + (i % 64), 1 + i % 32);
+	/* Every 101st frame announces more ports than it carries */
+	if (i % 101 == 100) {
+		fpin_req = (fpin_link_integrity_request_els_t *)fpin_payload->payload;
+		fpin_req->linkIntegrityDesc.port_list.count = htonl(4096);
+	}
+	fpin_payload->host_num = 1;
+	fpin_payload->length = len;
+	fpin_payload->event_num = i;
+	fpin_trace_now(&fpin_payload->rx_ts);
+	fpin_handle_els_frame(fpin_payload);
+}
+
+/* Decodes an LI frame with the policy and plans the paths of its ports */
+static void
+fpin_test_plan(struct fpin_arena *arena, uint32_t i) {
+	char frame[FC_PAYLOAD_MAXLEN], dev_name[DEV_NAME_LEN];
+	struct fpin_event_trace *trace = NULL;
+	struct fpin_policy *policy = NULL;
+	struct wwn_list list;
+	struct timespec now;
+	size_t len = 0;
+	uint32_t k = 0;
+	int skipped = 0;
+
+	len = fpin_test_li_frame(frame, sizeof(frame),
+			FPIN_LINK_INTEGRITY_EVENT_TYPE_CRC, 0x2001000dec000000ULL + (i % 16),
+			0x2002000dec000000ULL + (i % 16),
+			0x5006016000000000ULL + (i % 64), 1 + i % 32);
+	memset(&list, 0, sizeof(list));
+	list.arena = arena;
+	list.event_num = i;
+	fpin_trace_now(&now);
+	trace = fpin_trace_new(1, i, &now);
+	FPIN_TEST_ASSERT(trace != NULL);
+	policy = fpin_policy_get();
+	FPIN_TEST_ASSERT(fpin_els_decode_frame(1, frame, len, &list, policy) > 0);
+	fpin_policy_put(policy);
+
+	for (k = 0; k < list.nr_ports; k++) {
+		FPIN_TEST_ASSERT(list.ports[k].action == FPIN_ACT_MARGINAL);
+		snprintf(dev_name, sizeof(dev_name), "sd%u",
+			(uint32_t)(list.ports[k].wwn % FPIN_TEST_PATHS));
+		FPIN_TEST_ASSERT(fpin_dm_plan_path(FPIN_JOB_MARGINAL, 1, i, dev_name,
+					list.ports[k].wwn, trace) == 0);
+	}
+	fpin_trace_put(trace);
+	fpin_arena_reset(arena);
+
+	if (i % FPIN_TEST_RECOVER == FPIN_TEST_RECOVER - 1)
+		fpin_unset_marginal_dev(1, &fpin_li_marginal_dev_list_head, NULL,
+			&skipped);
+}
+
+static uint32_t
+fpin_test_in_use(struct fpin_pool *pool) {
+	uint32_t in_use = 0;
+
+	pthread_mutex_lock(&pool->mutex);
+	in_use = pool->in_use;
+	pthread_mutex_unlock(&pool->mutex);
+	return in_use;
+}
+
+/* The consumer takes the trace before it returns the frame */
+static void
+fpin_test_drain(void) {
+	struct timespec delay = { 0, 1000000 };
+
+	while (fpin_test_in_use(&fpin_frame_pool) ||
+		fpin_test_in_use(&fpin_trace_pool) ||
+		fpin_test_in_use(&fpin_job_pool))
+		nanosleep(&delay, NULL);
+}
+
+int
+main(int argc, char *argv[]) {
+	char buf[sizeof(fpin_payload_t) + FC_PAYLOAD_MAXLEN];
+	fpin_payload_t *fpin_payload = (fpin_payload_t *)buf;
+	char policy[FILE_PATH_LEN];
+	struct fpin_arena arena;
+	pthread_t consumer;
+	uint64_t allocs = 0;
+	uint32_t i = 0;
+	int ret = 0;
+
+	fpin_log_level = LOG_EMERG;
+	FPIN_TEST_ASSERT(fpin_test_sysfs_init() != NULL);
+	fpin_test_sysfs_file("0x10000090fa000001",
+		"class/fc_host/host1/port_name");
+	fpin_test_sysfs_file("default ignore", "policy");
+	fpin_sysfs_path(policy, sizeof(policy), "policy");
+	FPIN_TEST_ASSERT(fpin_policy_load(policy) == 0);
+
+	fpin_rt_prio = 1;
+	ret = fpin_rt_init();
+	/* The pools are reserved before the memory is locked */
+	if (ret < 0)
+		fprintf(stderr, "memory not locked, err %d, continuing\n", ret);
+	FPIN_TEST_ASSERT(fpin_frame_pool.base != NULL);
+
+	FPIN_TEST_ASSERT(pthread_create(&consumer, NULL, fpin_els_li_consumer,
+				NULL) == 0);
+	for (i = 0; i < FPIN_TEST_WARMUP; i++)
+		fpin_test_send(fpin_payload, i);
+	fpin_test_drain();
+
+	allocs = fpin_test_allocs();
+	fpin_test_count_allocs = 1;
+	for (i = 0; i < FPIN_TEST_STORM; i++)
+		fpin_test_send(fpin_payload, i);
+	fpin_test_drain();
+	fpin_test_count_allocs = 0;
+	allocs = fpin_test_allocs() - allocs;
+
+	printf("%u frames, %llu heap allocations, pool fallbacks frame %llu"
+		" trace %llu\n", FPIN_TEST_STORM, (unsigned long long)allocs,
+		(unsigned long long)fpin_frame_pool.exhausted,
+		(unsigned long long)fpin_trace_pool.exhausted);
+	FPIN_TEST_ASSERT(allocs == 0);
+	FPIN_TEST_ASSERT(fpin_frame_pool.exhausted == 0);
+	FPIN_TEST_ASSERT(fpin_trace_pool.exhausted == 0);
+
+	fpin_test_sysfs_file("default marginal", "policy");
+	FPIN_TEST_ASSERT(fpin_policy_load(policy) == 0);
+	fpin_shadow_mode = 1;
+	FPIN_TEST_ASSERT(fpin_act_init() == 0);
+	fpin_arena_init(&arena);
+	for (i = 0; i < FPIN_TEST_WARMUP; i++)
+		fpin_test_plan(&arena, i);
+	fpin_test_drain();
+
+	allocs = fpin_test_allocs();
+	fpin_test_count_allocs = 1;
+	for (i = 0; i < FPIN_TEST_STORM; i++)
+		fpin_test_plan(&arena, i);
+	fpin_test_drain();
+	fpin_test_count_allocs = 0;
+	allocs = fpin_test_allocs() - allocs;
+
+	printf("%u planned events, %llu heap allocations, pool fallbacks job %llu"
+		" marginal %llu damp %llu trace %llu\n", FPIN_TEST_STORM,
+		(unsigned long long)allocs,
+		(unsigned long long)fpin_job_pool.exhausted,
+		(unsigned long long)fpin_marginal_pool.exhausted,
+		(unsigned long long)fpin_damp_pool.exhausted,
+		(unsigned long long)fpin_trace_pool.exhausted);
+	FPIN_TEST_ASSERT(fpin_job_pool.max_in_use > 0);
+	FPIN_TEST_ASSERT(fpin_damp_pool.max_in_use > 0);
+	FPIN_TEST_ASSERT(allocs == 0);
+	FPIN_TEST_ASSERT(fpin_job_pool.exhausted == 0);
+	FPIN_TEST_ASSERT(fpin_marginal_pool.exhausted == 0);
+	FPIN_TEST_ASSERT(fpin_damp_pool.exhausted == 0);
+	FPIN_TEST_ASSERT(fpin_trace_pool.exhausted == 0);
+
+	fpin_arena_destroy(&arena);
+	fpin_test_sysfs_cleanup();
+	return 0;
+}